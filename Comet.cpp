@@ -98,6 +98,8 @@ void Usage(char *pszCmd)
    logout("                 -L<num>    to specify the last/end scan to search, overriding entry in parameters file\n");
    logout("                            (-L option is required if -F option is used)\n");
    logout("                 -i         create peptide index file only (specify .idx file as database for index search)\n");
+   logout("                            (with an .idx file as database, folds in peptides appended with -a)\n");
+   logout("                 -a<index>  append the database's peptides to an existing .idx file instead (implies -i)\n");
    logout("\n");
    sprintf(szTmp, "       example:  %s file1.mzXML file2.mzXML\n", pszCmd);
    logout(szTmp);
@@ -196,6 +198,15 @@ void SetOptions(char *arg,
          sprintf(szParamStringVal, "1");
          pSearchMgr->SetParam("create_index", szParamStringVal, 1);
          break;
+      case 'a':   // Append to an existing index file.
+         strncpy(szTmp, arg+2, 511);
+         szTmp[511]='\0';
+
+         if (strlen(szTmp) == 0 )
+            logerr("Missing text for parameter option -a<index>.  Ignored.\n");
+         else
+            pSearchMgr->SetParam("index_append", szTmp, szTmp);
+         break;
       default:
          break;
    }
@@ -1088,6 +1099,62 @@ void LoadParameters(char *pszParamsFile,
                sprintf(szParamStringVal, "%d", iIntParam);
                pSearchMgr->SetParam("spectrum_batch_size", szParamStringVal, iIntParam);
             }
+            else if (!strcmp(szParamName, "spectrum_batch_pipeline"))
+            {
+               sscanf(szParamVal, "%d", &iIntParam);
+               szParamStringVal[0] = '\0';
+               sprintf(szParamStringVal, "%d", iIntParam);
+               pSearchMgr->SetParam("spectrum_batch_pipeline", szParamStringVal, iIntParam);
+            }
+            else if (!strcmp(szParamName, "database_cache_size"))
+            {
+               sscanf(szParamVal, "%d", &iIntParam);
+               szParamStringVal[0] = '\0';
+               sprintf(szParamStringVal, "%d", iIntParam);
+               pSearchMgr->SetParam("database_cache_size", szParamStringVal, iIntParam);
+            }
+            else if (!strcmp(szParamName, "preload_protein_names"))
+            {
+               sscanf(szParamVal, "%d", &iIntParam);
+               szParamStringVal[0] = '\0';
+               sprintf(szParamStringVal, "%d", iIntParam);
+               pSearchMgr->SetParam("preload_protein_names", szParamStringVal, iIntParam);
+            }
+            else if (!strcmp(szParamName, "index_build_memory"))
+            {
+               sscanf(szParamVal, "%d", &iIntParam);
+               szParamStringVal[0] = '\0';
+               sprintf(szParamStringVal, "%d", iIntParam);
+               pSearchMgr->SetParam("index_build_memory", szParamStringVal, iIntParam);
+            }
+            else if (!strcmp(szParamName, "index_fragment_bins"))
+            {
+               sscanf(szParamVal, "%d", &iIntParam);
+               szParamStringVal[0] = '\0';
+               sprintf(szParamStringVal, "%d", iIntParam);
+               pSearchMgr->SetParam("index_fragment_bins", szParamStringVal, iIntParam);
+            }
+            else if (!strcmp(szParamName, "index_compress"))
+            {
+               sscanf(szParamVal, "%d", &iIntParam);
+               szParamStringVal[0] = '\0';
+               sprintf(szParamStringVal, "%d", iIntParam);
+               pSearchMgr->SetParam("index_compress", szParamStringVal, iIntParam);
+            }
+            else if (!strcmp(szParamName, "thread_local_scoring"))
+            {
+               sscanf(szParamVal, "%d", &iIntParam);
+               szParamStringVal[0] = '\0';
+               sprintf(szParamStringVal, "%d", iIntParam);
+               pSearchMgr->SetParam("thread_local_scoring", szParamStringVal, iIntParam);
+            }
+            else if (!strcmp(szParamName, "flat_xcorr"))
+            {
+               sscanf(szParamVal, "%d", &iIntParam);
+               szParamStringVal[0] = '\0';
+               sprintf(szParamStringVal, "%d", iIntParam);
+               pSearchMgr->SetParam("flat_xcorr", szParamStringVal, iIntParam);
+            }
             else if (!strcmp(szParamName, "minimum_peaks"))
             {
                iIntParam = 0;
@@ -1205,6 +1272,41 @@ void LoadParameters(char *pszParamsFile,
                sprintf(szParamStringVal, "%d", iIntParam);
                pSearchMgr->SetParam("mango_search", szParamStringVal, iIntParam);
             }
+            else if (!strcmp(szParamName, "fragindex_search"))
+            {
+               sscanf(szParamVal, "%d", &iIntParam);
+               szParamStringVal[0] = '\0';
+               sprintf(szParamStringVal, "%d", iIntParam);
+               pSearchMgr->SetParam("fragindex_search", szParamStringVal, iIntParam);
+            }
+            else if (!strcmp(szParamName, "fragindex_min_ions_score"))
+            {
+               sscanf(szParamVal, "%d", &iIntParam);
+               szParamStringVal[0] = '\0';
+               sprintf(szParamStringVal, "%d", iIntParam);
+               pSearchMgr->SetParam("fragindex_min_ions_score", szParamStringVal, iIntParam);
+            }
+            else if (!strcmp(szParamName, "fragindex_num_spectrumpeaks"))
+            {
+               sscanf(szParamVal, "%d", &iIntParam);
+               szParamStringVal[0] = '\0';
+               sprintf(szParamStringVal, "%d", iIntParam);
+               pSearchMgr->SetParam("fragindex_num_spectrumpeaks", szParamStringVal, iIntParam);
+            }
+            else if (!strcmp(szParamName, "fragindex_min_fragmentmass"))
+            {
+               sscanf(szParamVal, "%lf", &dDoubleParam);
+               szParamStringVal[0] = '\0';
+               sprintf(szParamStringVal, "%lf", dDoubleParam);
+               pSearchMgr->SetParam("fragindex_min_fragmentmass", szParamStringVal, dDoubleParam);
+            }
+            else if (!strcmp(szParamName, "fragindex_max_fragmentmass"))
+            {
+               sscanf(szParamVal, "%lf", &dDoubleParam);
+               szParamStringVal[0] = '\0';
+               sprintf(szParamStringVal, "%lf", dDoubleParam);
+               pSearchMgr->SetParam("fragindex_max_fragmentmass", szParamStringVal, dDoubleParam);
+            }
             else if (!strcmp(szParamName, "max_iterations"))
             {
                sscanf(szParamVal, "%ld", &lLongParam);
@@ -1613,6 +1715,14 @@ fprintf(fp,
 "nucleotide_reading_frame = 0           # 0=proteinDB, 1-6, 7=forward three, 8=reverse three, 9=all six\n\
 clip_nterm_methionine = 0              # 0=leave protein sequences as-is; 1=also consider sequence w/o N-term methionine\n\
 spectrum_batch_size = 15000            # max. # of spectra to search at a time; 0 to search the entire scan range in one loop\n\
+spectrum_batch_pipeline = 0            # 0=load each batch after the previous one is written; 1=read the next batch while the current one is searched (2 batches in memory)\n\
+database_cache_size = 0                # MB of memory to keep the parsed database for later spectrum batches; 0 to re-read the database every batch\n\
+preload_protein_names = 0              # 0=read protein names for output as they are needed (then cached); 1=read every protein name before writing output\n\
+index_build_memory = 0                 # MB of peptides held in memory while creating an .idx file (-i); larger indices sort through temporary files; 0=no limit\n\
+index_fragment_bins = 0                # 0=no; 1=also store each peptide's binned fragment ions in a created .idx file (-i) for faster index searches\n\
+index_compress = 0                     # 0=no; 1=compress the peptide columns of a created .idx file (-i); smaller file, decoded when it is loaded\n\
+thread_local_scoring = 0               # 0=update score histograms under a per-spectrum lock; 1=per-thread histograms merged after search (more memory)\n\
+flat_xcorr = 0                         # 0=sparse xcorr lookups; 1=flat per-spectrum xcorr arrays scored with AVX2/AVX-512 when available (more memory)\n\
 decoy_prefix = DECOY_                  # decoy entries are denoted by this string which is pre-pended to each protein accession\n\
 equal_I_and_L = 1                      # 0=treat I and L as different; 1=treat I and L as same\n\
 output_suffix =                        # add a suffix to output base names i.e. suffix \"-C\" generates base-C.pep.xml from base.mzXML input\n\
@@ -1620,6 +1730,15 @@ mass_offsets =                         # one or more mass offsets to search (val
 precursor_NL_ions =                    # one or more precursor neutral loss masses, will be added to xcorr analysis\n\
 \n\
 #\n\
+# fragment ion index; shortlists candidate peptides by shared fragment ions before xcorr scoring\n\
+#\n\
+fragindex_search = 0                   # 0=score all candidates; 1=score only candidates passing fragment ion index\n\
+fragindex_min_ions_score = 3           # minimum number of shared fragment ions for a candidate to be scored; 0 scores all\n\
+fragindex_num_spectrumpeaks = 100      # number of most intense peaks per spectrum placed in fragment ion index\n\
+fragindex_min_fragmentmass = 200.0     # low fragment ion mass placed in fragment ion index\n\
+fragindex_max_fragmentmass = 2000.0    # high fragment ion mass placed in fragment ion index\n\
+\n\
+#\n\
 # spectral processing\n\
 #\n\
 minimum_peaks = 10                     # required minimum number of peaks in spectrum to search (default 10)\n");
@@ -20,6 +20,7 @@
 #include "CometData.h"
 #include "Threading.h"
 #include <chrono>
+#include <atomic>
 
 class CometSearchManager;
 
@@ -43,6 +44,16 @@ class CometSearchManager;
 
 #define HISTO_SIZE                  152      // some number greater than 150; chose 152 for byte alignment?
 
+#define FLAT_XCORR_SCALAR_BIN_SIZE  0.5      // "flat_xcorr" uses the scalar kernel for fragment bins at least this wide
+
+#define SEARCH_JOB_RESIDUES         65536    // database entries are grouped into search thread jobs of about this many residues
+#define SEARCH_JOBS_PER_THREAD      4        // max # of queued search thread jobs per thread before the database reader helps out
+#define INDEX_PEPTIDE_BATCH         4096     // # of peptides a search thread buffers before handing them to the index builder
+#define DATABASE_PARSE_CHUNK        262144   // bytes of a memory mapped database parsed as one search thread job
+#define PENDING_PEPTIDE_BATCH       4096     // # of candidates a "thread_local_scoring" search thread buffers before storing them
+
+#define SINGLE_SEARCH_LATENCY_WINDOW 10000   // # of recent DoSingleSpectrumSearch() calls kept for latency percentiles
+
 #define NO_PEFF_VARIANT             -127
 
 #define VMODS                       9
@@ -89,6 +100,12 @@ struct Options             // output parameters
    int iNumStored;               // # of search results to store for xcorr analysis
    int iMaxDuplicateProteins;    // maximum number of duplicate proteins to report or store in idx file
    int iSpectrumBatchSize;       // # of spectra to search at a time within the scan range
+   int bSpectrumBatchPipeline;   // 0=load each spectrum batch after the previous one is written; 1=load the next batch during the search
+   int iDatabaseCacheSize;       // MB of parsed database entries kept in memory for reuse across spectrum batches
+   int iIndexBuildMemory;        // MB of peptides held in memory while creating an .idx file; 0 = no limit
+   int bPreloadProteinNames;     // 0=cache protein names as output reads them; 1=read every protein name before output
+   int bThreadLocalScoring;      // 0=update query score histograms under lock; 1=per thread histograms merged after search
+   int bFlatXcorr;               // 0=sparse fast xcorr lookups; 1=flat aligned fast xcorr arrays scored with SIMD gathers
    int iStartCharge;
    int iEndCharge;
    int iMaxFragmentCharge;
@@ -112,6 +129,8 @@ struct Options             // output parameters
 // int bSkipUpdateCheck;         // 0=do not check for updates; 1=check for updates
    int bMango;                   // 0=normal; 1=Mango x-link ms2 input
    int bCreateIndex;             // 0=normal search; 1=create peptide index file
+   int bIndexFragmentBins;       // 0=no; 1=store binned fragment ions in created peptide index file
+   int bIndexCompress;           // 0=no; 1=store the peptide columns of a created index file compressed
    int bVerboseOutput;
    int bShowFragmentIons;
    int bExplicitDeltaCn;         // if set to 1, do not use sequence similarity logic 
@@ -120,12 +139,17 @@ struct Options             // output parameters
    int bCorrectMass;             // use selectionMZ instead of monoMZ if monoMZ is outside selection window
    int bTreatSameIL;
    int iMaxIndexRunTime;         // max run time of index search in milliseconds
+   int bFragIndexSearch;         // 0=score every candidate; 1=shortlist candidates using fragment ion index
+   int iFragIndexMinIonsScore;   // minimum # of shared fragment ions for a candidate to be scored
+   int iFragIndexNumSpectrumPeaks;  // # of most intense peaks of each spectrum to place in fragment ion index
    long lMaxIterations;          // max # of modification permutations for each iStart position
    double dMinIntensity;
    double dRemovePrecursorTol;
    double dPeptideMassLow;       // MH+ mass
    double dPeptideMassHigh;      // MH+ mass
    double dMinimumXcorr;         // set the minimum xcorr to report (default is 1e-8)
+   double dFragIndexMinMass;     // lowest fragment ion mass placed in fragment ion index
+   double dFragIndexMaxMass;     // highest fragment ion mass placed in fragment ion index
    IntRange scanRange;
    IntRange peptideLengthRange;
    DoubleRange clearMzRange;
@@ -139,6 +163,12 @@ struct Options             // output parameters
       iNumStored = a.iNumStored;
       iMaxDuplicateProteins = a.iMaxDuplicateProteins;
       iSpectrumBatchSize = a.iSpectrumBatchSize;
+      bSpectrumBatchPipeline = a.bSpectrumBatchPipeline;
+      iDatabaseCacheSize = a.iDatabaseCacheSize;
+      iIndexBuildMemory = a.iIndexBuildMemory;
+      bPreloadProteinNames = a.bPreloadProteinNames;
+      bThreadLocalScoring = a.bThreadLocalScoring;
+      bFlatXcorr = a.bFlatXcorr;
       iStartCharge = a.iStartCharge;
       iEndCharge = a.iEndCharge;
       iMaxFragmentCharge = a.iMaxFragmentCharge;
@@ -162,6 +192,8 @@ struct Options             // output parameters
 //    bSkipUpdateCheck = a.bSkipUpdateCheck;
       bMango = a.bMango;
       bCreateIndex = a.bCreateIndex;
+      bIndexFragmentBins = a.bIndexFragmentBins;
+      bIndexCompress = a.bIndexCompress;
       bVerboseOutput = a.bVerboseOutput;
       bShowFragmentIons = a.bShowFragmentIons;
       bExplicitDeltaCn = a.bExplicitDeltaCn;
@@ -170,12 +202,17 @@ struct Options             // output parameters
       bCorrectMass = a.bCorrectMass;
       bTreatSameIL = a.bTreatSameIL;
       iMaxIndexRunTime = a.iMaxIndexRunTime;
+      bFragIndexSearch = a.bFragIndexSearch;
+      iFragIndexMinIonsScore = a.iFragIndexMinIonsScore;
+      iFragIndexNumSpectrumPeaks = a.iFragIndexNumSpectrumPeaks;
       lMaxIterations = a.lMaxIterations;
       dMinIntensity = a.dMinIntensity;
       dRemovePrecursorTol = a.dRemovePrecursorTol;
       dPeptideMassLow = a.dPeptideMassLow;
       dPeptideMassHigh = a.dPeptideMassHigh;
       dMinimumXcorr = a.dMinimumXcorr;
+      dFragIndexMinMass = a.dFragIndexMinMass;
+      dFragIndexMaxMass = a.dFragIndexMaxMass;
       scanRange = a.scanRange;
       peptideLengthRange = a.peptideLengthRange;
       clearMzRange = a.clearMzRange;
@@ -185,6 +222,13 @@ struct Options             // output parameters
    }
 };
 
+struct ResultsPeffMod        // PEFF mod at one position of a stored peptide
+{
+   int    iPosition;           // index into piVarModSites
+   double dMassDiffMono;
+   char   szMod[MAX_PEFFMOD_LEN];
+};
+
 struct Results
 {
    double dPepMass;
@@ -197,8 +241,7 @@ struct Results
    int    iTotalIons;
    comet_fileoffset_t   lProteinFilePosition;
    int    piVarModSites[MAX_PEPTIDE_LEN_P2];   // store variable mods encoding, +2 to accomodate N/C-term
-   double pdVarModSites[MAX_PEPTIDE_LEN_P2];   // store variable mods mass diffs, +2 to accomodate N/C-term
-   char   pszMod[MAX_PEPTIDE_LEN][MAX_PEFFMOD_LEN];    // store PEFF mod string
+   vector<struct ResultsPeffMod> vPeffMods;   // PEFF mods, i.e. negative piVarModSites entries, in position order
    char   szPeptide[MAX_PEPTIDE_LEN];
    char   szPrevNextAA[2];                    // [0] stores prev AA, [1] stores next AA
    bool   bClippedM;                          // true if new N-term protein due to clipped methionine
@@ -208,6 +251,9 @@ struct Results
    int    iPeffNewResidueCount;               // more than 0 new residues is a substitution (if iPeffOrigResidueCount=1) or insertion (if iPeffOrigResidueCount>1)
    vector<struct ProteinEntryStruct> pWhichProtein;       // file positions of matched protein entries
    vector<struct ProteinEntryStruct> pWhichDecoyProtein;  // keep separate decoy list (used for separate decoy matches and combined results)
+
+   double VarModMass(int iPos) const;          // mod mass diff at piVarModSites[iPos]
+   const char *PeffModName(int iPos) const;    // PEFF mod string at piVarModSites[iPos]
 };
 
 struct PepMassInfo
@@ -413,6 +459,97 @@ struct IndexProteinStruct  // for indexed database
    int  iWhichProtein;
 };
 
+// Version 4 .idx file:  an IndexFileHeader followed by the sections below, each
+// starting on an 8 byte boundary so that the numeric columns can be used in place
+// from a mapping of the file.  Peptides are stored in ascending mass order and a
+// peptide's number is its row in each of the per peptide columns.  Peptides appended
+// later (comet -a) follow as delta segments:  each is laid out the same way from the
+// next 8 byte boundary after the end of the previous segment's sections, with file
+// positions still relative to the start of the file and a zero checksum; the first
+// header's checksum covers the whole file.  A version 5 segment is a version 4 one
+// with its per peptide columns compressed, see IndexBlock; the segments of one file
+// can differ in version.  Version 3 files have no delta segments.
+// Version 2 files also lack INDEX_SECTION_FRAGMENT_BINS, so their header is one
+// section shorter.  Version 1 files start with the text line "Comet indexed
+// database." instead of INDEX_FILE_MAGIC.
+#define INDEX_FILE_MAGIC            "CometIDX"
+#define INDEX_FILE_VERSION          4
+#define INDEX_FILE_VERSION_PACKED   5
+#define INDEX_BLOCK_PEPTIDES        256     // peptides per IndexBlock of a version 5 segment
+#define INDEX_CHECKSUM_SEED         14695981039346656037ULL  // FNV-1a 64 bit offset basis
+
+enum IndexFileSectionType
+{
+   INDEX_SECTION_PARAMS = 0,        // text lines:  input db, mass range, mass type, enzymes, static and variable mods
+   INDEX_SECTION_PROTEIN_NAMES,     // WIDTH_REFERENCE wide protein names
+   INDEX_SECTION_PROTEIN_LISTS,     // per peptide sequence:  long count then the file positions of its protein names
+   INDEX_SECTION_MASSES,            // double MH+ mass of each peptide
+   INDEX_SECTION_SEQUENCE_OFFSETS,  // uint64_t bit offset of each peptide in INDEX_SECTION_SEQUENCES, plus the end
+   INDEX_SECTION_SEQUENCES,         // residues packed 5 bits each, 'A' to 'Z' stored as 1 to 26
+   INDEX_SECTION_MOD_OFFSETS,       // uint64_t start of each peptide in INDEX_SECTION_MOD_SITES, plus the end
+   INDEX_SECTION_MOD_SITES,         // (position, variable mod number) byte pairs
+   INDEX_SECTION_PROTEIN_REFS,      // comet_fileoffset_t file position of each peptide's protein list
+   INDEX_SECTION_MASS_INDEX,        // int64_t first peptide of each 0.1 Da mass bin, -1 if none
+   INDEX_SECTION_FRAGMENT_BINS,     // optional, IndexFragmentBinsHeader then each peptide's binned fragment ions
+   INDEX_SECTION_COUNT
+};
+
+struct IndexFileSection
+{
+   uint64_t tOffset;                // file position
+   uint64_t tSize;                  // in bytes
+};
+
+struct IndexFileHeader
+{
+   char     szMagic[8];             // INDEX_FILE_MAGIC, not null terminated
+   uint32_t uiVersion;
+   uint32_t uiHeaderSize;           // sizeof(IndexFileHeader)
+   uint64_t tChecksum;              // CometSearch::IndexFileChecksum() of everything after the header
+   uint64_t tNumPeptides;
+   int      iMinMass;
+   int      iMaxMass;
+   IndexFileSection sections[INDEX_SECTION_COUNT];
+};
+
+// Version 5 segments store the per peptide columns in blocks of INDEX_BLOCK_PEPTIDES
+// peptides, decoded when the index is loaded:
+//    INDEX_SECTION_MASSES            each block's first mass as a double, then the
+//                                    zigzag varint differences of the following
+//                                    masses' bit patterns
+//    INDEX_SECTION_SEQUENCE_OFFSETS  one byte residue count per peptide
+//    INDEX_SECTION_MOD_OFFSETS       one byte mod site count per peptide
+//    INDEX_SECTION_PROTEIN_REFS      varint position of each peptide's protein list
+//                                    from the start of INDEX_SECTION_PROTEIN_LISTS
+// INDEX_SECTION_MASS_INDEX is followed by an IndexBlock per block, so that a 0.1 Da
+// mass bin leads to the block holding its first peptide.  Identical protein lists
+// are written once.
+struct IndexBlock
+{
+   uint64_t tMassByte;              // block start within INDEX_SECTION_MASSES
+   uint64_t tProteinRefByte;        // and within INDEX_SECTION_PROTEIN_REFS
+   uint64_t tSequenceBit;           // bit offset of the block's first peptide in INDEX_SECTION_SEQUENCES
+   uint64_t tModSite;               // its first (position, mod) pair in INDEX_SECTION_MOD_SITES
+};
+
+// Start of INDEX_SECTION_FRAGMENT_BINS.  The binned fragment ions are only valid
+// for a search that uses the same binning, fragment mass type, enzyme offset (which
+// sets how decoys are reversed) and ion series.  Each peptide has iNumLadders *
+// iMaxFragmentCharge * iNumIonSeries * (length-1) unsigned int bins ordered by
+// ladder (target then decoy), fragment charge, ion series then ion number, and a
+// peptide's bins start at that count per residue times the residues before it.
+struct IndexFragmentBinsHeader
+{
+   double   dInverseBinWidth;
+   double   dOneMinusBinOffset;
+   int      iMonoMassesFragment;
+   int      iSearchEnzymeOffSet;
+   int      iMaxFragmentCharge;
+   int      iNumIonSeries;
+   int      piIonSeries[NUM_ION_SERIES];
+   int      iNumLadders;            // 1=target, 2=target and decoy
+};
+
 struct PEFFInfo
 {
    char   szPeffOBO[SIZE_FILE];
@@ -625,6 +762,7 @@ struct StaticParams
    int             iPrecursorNLSize;
    int             iOldModsEncoding;
    char            szDIAWindowsFile[SIZE_FILE];
+   char            szIndexAppend[SIZE_FILE];   // .idx file that a created index is appended to as a delta segment
    bool            bSkipToStartScan;
    std::chrono::high_resolution_clock::time_point tRealTimeStart;     // track run time of real-time index search
 
@@ -688,6 +826,7 @@ struct StaticParams
       peffInfo.iPeffSearch = 0;
 
       szDIAWindowsFile[0]='\0';
+      szIndexAppend[0]='\0';
       iPrecursorNLSize = 0;
 
       for (i=0; i<SIZE_MASS; i++)
@@ -765,6 +904,11 @@ struct StaticParams
       options.bCorrectMass = 0;
       options.bTreatSameIL = 1;
       options.iMaxIndexRunTime = 0;                     // index run time limit in milliseconds; 0=no time limit
+      options.bFragIndexSearch = 0;
+      options.iFragIndexMinIonsScore = 3;
+      options.iFragIndexNumSpectrumPeaks = 100;
+      options.dFragIndexMinMass = 200.0;
+      options.dFragIndexMaxMass = 2000.0;
       options.iRemovePrecursor = 0;
       options.dRemovePrecursorTol = 1.5;
 
@@ -780,6 +924,8 @@ struct StaticParams
 //    options.bSkipUpdateCheck = 0;
       options.bMango = 0;
       options.bCreateIndex = 0;
+      options.bIndexFragmentBins = 0;
+      options.bIndexCompress = 0;
       options.bVerboseOutput = 0;
       options.iDecoySearch = 0;
       options.iNumThreads = 0;
@@ -793,6 +939,12 @@ struct StaticParams
       options.scanRange.iStart = 0;
       options.scanRange.iEnd = 0;
       options.iSpectrumBatchSize = 0;
+      options.bSpectrumBatchPipeline = 0;
+      options.iDatabaseCacheSize = 0;
+      options.iIndexBuildMemory = 0;
+      options.bPreloadProteinNames = 0;
+      options.bThreadLocalScoring = 0;
+      options.bFlatXcorr = 0;
       options.iMinPeaks = 10;
       options.iStartCharge = 0;
       options.iEndCharge = 0;
@@ -831,6 +983,35 @@ struct StaticParams
 
 extern StaticParams    g_staticParams;
 
+inline double Results::VarModMass(int iPos) const
+{
+   int iVal = piVarModSites[iPos];
+
+   if (iVal > 0)
+      return g_staticParams.variableModParameters.varModList[iVal-1].dVarModMass;
+   else if (iVal < 0)
+   {
+      for (auto it = vPeffMods.begin(); it != vPeffMods.end(); ++it)
+      {
+         if (it->iPosition == iPos)
+            return it->dMassDiffMono;
+      }
+   }
+
+   return 0.0;
+}
+
+inline const char *Results::PeffModName(int iPos) const
+{
+   for (auto it = vPeffMods.begin(); it != vPeffMods.end(); ++it)
+   {
+      if (it->iPosition == iPos)
+         return it->szMod;
+   }
+
+   return "";
+}
+
 extern vector<double>  g_pvDIAWindows;    // vector of start-end masses for DIA window; even number start mass, odd number end mass
 
 extern string g_psGITHUB_SHA;             // grab the GITHUB_SHA environment variable and trim to 7 chars; null if environment variable not present
@@ -841,6 +1022,74 @@ extern vector<DBIndex> g_pvDBIndex;
 
 extern vector<vector<comet_fileoffset_t>> g_pvProteinsList;
 
+// Sparse and flat scoring arrays built by CometPreprocess::Preprocess().  The Query
+// objects of one scan's charge states share a single copy when their binned spectra
+// are identical (see CometPreprocess::CanShareSpectrumData); each holds a reference
+// and the last one deleted frees the arrays.  References are taken by the thread
+// that preprocessed the scan and released when the queries are deleted after the
+// search, so the count itself needs no lock.
+struct QuerySpectrumData
+{
+   int iRefCount;
+   int iSpScoreData;          // rows in ppfSparseSpScoreData
+   int iFastXcorrDataSize;    // rows in ppfSparseFastXcorrData and ppfSparseFastXcorrDataNL
+   float **ppfSparseSpScoreData;
+   float **ppfSparseFastXcorrData;
+   float **ppfSparseFastXcorrDataNL;
+   float *pfFlatFastXcorrData;
+   float *pfFlatFastXcorrDataNL;
+
+   QuerySpectrumData()
+   {
+      iRefCount = 1;
+      iSpScoreData = 0;
+      iFastXcorrDataSize = 0;
+      ppfSparseSpScoreData = NULL;
+      ppfSparseFastXcorrData = NULL;
+      ppfSparseFastXcorrDataNL = NULL;
+      pfFlatFastXcorrData = NULL;
+      pfFlatFastXcorrDataNL = NULL;
+   }
+
+   ~QuerySpectrumData()
+   {
+      int i;
+
+      if (ppfSparseSpScoreData != NULL)
+      {
+         for (i=0;i<iSpScoreData;i++)
+         {
+            if (ppfSparseSpScoreData[i] != NULL)
+               delete[] ppfSparseSpScoreData[i];
+         }
+         delete[] ppfSparseSpScoreData;
+      }
+
+      if (ppfSparseFastXcorrData != NULL)
+      {
+         for (i=0;i<iFastXcorrDataSize;i++)
+         {
+            if (ppfSparseFastXcorrData[i] != NULL)
+               delete[] ppfSparseFastXcorrData[i];
+         }
+         delete[] ppfSparseFastXcorrData;
+      }
+
+      if (ppfSparseFastXcorrDataNL != NULL)
+      {
+         for (i=0;i<iFastXcorrDataSize;i++)
+         {
+            if (ppfSparseFastXcorrDataNL[i] != NULL)
+               delete[] ppfSparseFastXcorrDataNL[i];
+         }
+         delete[] ppfSparseFastXcorrDataNL;
+      }
+
+      comet_aligned_free(pfFlatFastXcorrData);
+      comet_aligned_free(pfFlatFastXcorrDataNL);
+   }
+};
+
 // Query stores information for peptide scoring and results
 // This struct is allocated for each spectrum/charge combination
 struct Query
@@ -860,8 +1109,9 @@ struct Query
    float fLowestSpScore;
    float fLowestDecoySpScore;
 
-   double dLowestXcorrScore;
-   double dLowestDecoyXcorrScore;
+   // Written under accessMutex; "thread_local_scoring" also reads them without it.
+   std::atomic<double> dLowestXcorrScore;
+   std::atomic<double> dLowestDecoyXcorrScore;
 
    double dMangoIndex;      // scan number decimal precursor value i.e. 2401.001 for scan 2401, first precursor/z pair
 
@@ -875,16 +1125,28 @@ struct Query
    float **ppfSparseFastXcorrData;
    float **ppfSparseFastXcorrDataNL;
 
+   // Flat representation of fast xcorr data, only used with "flat_xcorr".
+   // Padded to a multiple of 16 floats, 64 byte aligned, zero outside the spectrum.
+   int iFlatXcorrDataSize;
+   float *pfFlatFastXcorrData;
+   float *pfFlatFastXcorrDataNL;
+
    // Standard array representation of data
    float *pfSpScoreData;
    float *pfFastXcorrData;
    float *pfFastXcorrDataNL;  // pfFastXcorrData with NH3, H2O contributions
+   QuerySpectrumData *pSpectrumData;   // owns the sparse and flat arrays above; may be shared
 
    PepMassInfo          _pepMassInfo;
    SpectrumInfoInternal _spectrumInfoInternal;
    Results              *_pResults;
    Results              *_pDecoys;
 
+   vector<unsigned int> vuiResultsHash;   // CometSearch::PeptideHash() of each _pResults peptide, checked first by CheckDuplicate
+   vector<unsigned int> vuiDecoysHash;
+   vector<short>        vsiResultsHeap;   // _pResults indices as a min heap on xcorr once every entry is filled
+   vector<short>        vsiDecoysHeap;
+
    Mutex accessMutex;
 
    Query()
@@ -918,10 +1180,14 @@ struct Query
       ppfSparseSpScoreData = NULL;
       ppfSparseFastXcorrData = NULL;
       ppfSparseFastXcorrDataNL = NULL;          // ppfSparseFastXcorrData with NH3, H2O contributions
+      iFlatXcorrDataSize = 0;
+      pfFlatFastXcorrData = NULL;
+      pfFlatFastXcorrDataNL = NULL;
 
       pfSpScoreData = NULL;
       pfFastXcorrData = NULL;
       pfFastXcorrDataNL = NULL;                 // pfFastXcorrData with NH3, H2O contributions
+      pSpectrumData = NULL;
 
       _pepMassInfo.dCalcPepMass = 0.0;
       _pepMassInfo.dExpPepMass = 0.0;
@@ -943,40 +1209,15 @@ struct Query
 
    ~Query()
    {
-      int i;
-      for (i=0;i<iSpScoreData;i++)
-      {
-         if (ppfSparseSpScoreData[i] != NULL)
-            delete[] ppfSparseSpScoreData[i];
-      }
-      delete[] ppfSparseSpScoreData;
-      ppfSparseSpScoreData = NULL;
+      if (pSpectrumData != NULL && --pSpectrumData->iRefCount == 0)
+         delete pSpectrumData;
+      pSpectrumData = NULL;
 
-      if (g_staticParams.ionInformation.bUseWaterAmmoniaLoss
-            && (g_staticParams.ionInformation.iIonVal[ION_SERIES_A]
-               || g_staticParams.ionInformation.iIonVal[ION_SERIES_B]
-               || g_staticParams.ionInformation.iIonVal[ION_SERIES_Y]))
-      {
-         for (i=0;i<iFastXcorrDataSize;i++)
-         {
-            if (ppfSparseFastXcorrData[i] != NULL)
-               delete[] ppfSparseFastXcorrData[i];
-            if (ppfSparseFastXcorrDataNL[i]!=NULL)
-               delete[] ppfSparseFastXcorrDataNL[i];
-         }
-         delete[] ppfSparseFastXcorrDataNL;
-         ppfSparseFastXcorrDataNL = NULL;
-      }
-      else
-      {
-         for (i=0;i<iFastXcorrDataSize;i++)
-         {
-            if (ppfSparseFastXcorrData[i] != NULL)
-               delete[] ppfSparseFastXcorrData[i];
-         }
-      }
-      delete[] ppfSparseFastXcorrData;
+      ppfSparseSpScoreData = NULL;
       ppfSparseFastXcorrData = NULL;
+      ppfSparseFastXcorrDataNL = NULL;
+      pfFlatFastXcorrData = NULL;
+      pfFlatFastXcorrDataNL = NULL;
 
       _pResults->pWhichProtein.clear();
       if (g_staticParams.options.iDecoySearch == 1)
@@ -1001,6 +1242,7 @@ extern Mutex                   g_pvQueryMutex;
 extern Mutex                   g_preprocessMemoryPoolMutex;
 extern Mutex                   g_searchMemoryPoolMutex;
 extern Mutex                   g_dbIndexMutex;
+extern Mutex                   g_proteinCacheMutex;
 
 struct IonSeriesStruct         // defines which fragment ion series are considered
 {
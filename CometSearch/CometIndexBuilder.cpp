@@ -0,0 +1,1309 @@
+/*
+   Copyright 2012 University of Washington
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "Common.h"
+#include "CometDataInternal.h"
+#include "CometSearch.h"
+#include "CometStatus.h"
+#include "CometIndexBuilder.h"
+#include <queue>
+
+
+char CometIndexBuilder::_szIndexFile[SIZE_FILE+4];
+ThreadPool *CometIndexBuilder::_tp = NULL;
+int CometIndexBuilder::_iNumTempFiles = 0;
+size_t CometIndexBuilder::_tMaxEntries = 0;
+uint64_t CometIndexBuilder::_tNumPeptides = 0;
+uint64_t CometIndexBuilder::_tNumUnique = 0;
+bool CometIndexBuilder::_bSpillFailed = false;
+vector<FILE*> CometIndexBuilder::_vPeptideRuns;
+vector<FILE*> CometIndexBuilder::_vMassRuns;
+vector<FILE*> CometIndexBuilder::_vTempFiles;
+map<vector<comet_fileoffset_t>, comet_fileoffset_t> CometIndexBuilder::_mapProteinLists;
+
+
+// Run files hold one record per peptide:  length, number of variable mod sites,
+// residues, (position, mod) pairs, mass and protein file position.
+static bool WriteRunEntry(FILE *fp,
+                          const DBIndex &sEntry)
+{
+   char szBuf[2 + MAX_PEPTIDE_LEN + 2*MAX_PEPTIDE_LEN_P2 + sizeof(double) + sizeof(comet_fileoffset_t)];
+   int iLen = (int)strlen(sEntry.szPeptide);
+   int iNumMods = 0;
+   char *p = szBuf + 2;
+
+   memcpy(p, sEntry.szPeptide, iLen);
+   p += iLen;
+
+   for (int x = 0; x < iLen + 2; x++)
+   {
+      if (sEntry.pcVarModSites[x] != 0)
+      {
+         *p++ = (char)x;
+         *p++ = sEntry.pcVarModSites[x];
+         iNumMods++;
+      }
+   }
+
+   memcpy(p, &sEntry.dPepMass, sizeof(double));
+   p += sizeof(double);
+   memcpy(p, &sEntry.lIndexProteinFilePosition, sizeof(comet_fileoffset_t));
+   p += sizeof(comet_fileoffset_t);
+
+   szBuf[0] = (char)iLen;
+   szBuf[1] = (char)iNumMods;
+
+   return (fwrite(szBuf, sizeof(char), p - szBuf, fp) == (size_t)(p - szBuf));
+}
+
+
+static bool ReadRunEntry(FILE *fp,
+                         DBIndex &sEntry)
+{
+   unsigned char szHead[2];
+   char szBuf[MAX_PEPTIDE_LEN + 2*MAX_PEPTIDE_LEN_P2 + sizeof(double) + sizeof(comet_fileoffset_t)];
+
+   if (fread(szHead, sizeof(char), 2, fp) != 2)
+      return false;
+
+   int iLen = szHead[0];
+   int iNumMods = szHead[1];
+   size_t tSize = iLen + 2*iNumMods + sizeof(double) + sizeof(comet_fileoffset_t);
+
+   if (iLen >= MAX_PEPTIDE_LEN || iNumMods > MAX_PEPTIDE_LEN_P2
+         || fread(szBuf, sizeof(char), tSize, fp) != tSize)
+   {
+      return false;
+   }
+
+   const char *p = szBuf;
+
+   memcpy(sEntry.szPeptide, p, iLen);
+   sEntry.szPeptide[iLen] = '\0';
+   p += iLen;
+
+   memset(sEntry.pcVarModSites, 0, sizeof(sEntry.pcVarModSites));
+   for (int x = 0; x < iNumMods; x++, p += 2)
+      sEntry.pcVarModSites[(unsigned char)p[0]] = p[1];
+
+   memcpy(&sEntry.dPepMass, p, sizeof(double));
+   p += sizeof(double);
+   memcpy(&sEntry.lIndexProteinFilePosition, p, sizeof(comet_fileoffset_t));
+
+   return true;
+}
+
+
+// Start a section of a version 3 index file on the next 8 byte boundary.
+static void BeginIndexSection(FILE *fptr,
+                              IndexFileSection *pSection)
+{
+   while (comet_ftell(fptr) % 8 != 0)
+      fputc(0, fptr);
+
+   pSection->tOffset = (uint64_t)comet_ftell(fptr);
+}
+
+
+static void EndIndexSection(FILE *fptr,
+                            IndexFileSection *pSection)
+{
+   pSection->tSize = (uint64_t)comet_ftell(fptr) - pSection->tOffset;
+}
+
+
+// LEB128 varint of a version 5 column; returns the number of bytes written.
+static int WriteVarint(FILE *fp,
+                       uint64_t tValue)
+{
+   int iNumBytes = 1;
+
+   while (tValue >= 0x80)
+   {
+      fputc((int)(tValue & 0x7F) | 0x80, fp);
+      tValue >>= 7;
+      iNumBytes++;
+   }
+   fputc((int)tValue, fp);
+
+   return iNumBytes;
+}
+
+
+// Params section without the lines that differ between segments of one index.
+static string StripIndexParams(const string &strParams)
+{
+   istringstream issParams(strParams);
+   string strLine;
+   string strStripped;
+
+   while (getline(issParams, strLine))
+   {
+      if (strncmp(strLine.c_str(), "Comet indexed database.", 23)
+            && strncmp(strLine.c_str(), "InputDB:", 8)
+            && strncmp(strLine.c_str(), "NumPeptides:", 12))
+      {
+         strStripped += strLine + "\n";
+      }
+   }
+
+   return strStripped;
+}
+
+
+// Cut the index file back to lSize, dropping a partly written segment.
+static bool TruncateIndexFile(FILE *fptr,
+                              comet_fileoffset_t lSize)
+{
+   fflush(fptr);
+#ifdef _WIN32
+   return (_chsize_s(_fileno(fptr), lSize) == 0);
+#else
+   return (ftruncate(fileno(fptr), (off_t)lSize) == 0);
+#endif
+}
+
+
+// One input of a k-way merge:  a spilled run file, or the sorted entries still held
+// in g_pvDBIndex when fp is NULL.
+struct IndexRunSource
+{
+   FILE *fp;
+   size_t tNext;
+   size_t tEnd;
+   DBIndex sEntry;      // current, not yet merged entry
+};
+
+
+// Merges sorted runs into a single sorted stream.
+class IndexRunMerger
+{
+public:
+   IndexRunMerger(vector<FILE*> &vRuns,
+                  bool (*pfnCompare)(const DBIndex&, const DBIndex&)) :
+      _heap(SourceGreater(&_vSources, pfnCompare))
+   {
+      IndexRunSource source;
+
+      for (size_t i = 0; i < vRuns.size(); i++)
+      {
+         rewind(vRuns.at(i));
+         source.fp = vRuns.at(i);
+         _vSources.push_back(source);
+      }
+
+      if (g_pvDBIndex.size() > 0)
+      {
+         source.fp = NULL;
+         source.tNext = 0;
+         source.tEnd = g_pvDBIndex.size();
+         _vSources.push_back(source);
+      }
+
+      for (size_t i = 0; i < _vSources.size(); i++)
+      {
+         if (Advance(_vSources.at(i)))
+            _heap.push(i);
+      }
+   }
+
+   bool Next(DBIndex &sEntry)
+   {
+      if (_heap.empty())
+         return false;
+
+      size_t iWhich = _heap.top();
+      _heap.pop();
+
+      sEntry = _vSources.at(iWhich).sEntry;
+
+      if (Advance(_vSources.at(iWhich)))
+         _heap.push(iWhich);
+
+      return true;
+   }
+
+private:
+   struct SourceGreater
+   {
+      vector<IndexRunSource> *pvSources;
+      bool (*pfnCompare)(const DBIndex&, const DBIndex&);
+
+      SourceGreater(vector<IndexRunSource> *pv,
+                    bool (*pfn)(const DBIndex&, const DBIndex&)) : pvSources(pv), pfnCompare(pfn) {}
+
+      bool operator()(size_t a, size_t b) const
+      {
+         return pfnCompare(pvSources->at(b).sEntry, pvSources->at(a).sEntry);
+      }
+   };
+
+   bool Advance(IndexRunSource &source)
+   {
+      if (source.fp != NULL)
+         return ReadRunEntry(source.fp, source.sEntry);
+
+      if (source.tNext >= source.tEnd)
+         return false;
+
+      source.sEntry = g_pvDBIndex.at(source.tNext++);
+      return true;
+   }
+
+   vector<IndexRunSource> _vSources;
+   priority_queue<size_t, vector<size_t>, SourceGreater> _heap;
+};
+
+
+CometIndexBuilder::CometIndexBuilder()
+{
+}
+
+
+CometIndexBuilder::~CometIndexBuilder()
+{
+}
+
+
+void CometIndexBuilder::Initialize(const char *szIndexFile,
+                                   ThreadPool *tp)
+{
+   Cleanup();
+
+   strcpy(_szIndexFile, szIndexFile);
+   _tp = tp;
+   _iNumTempFiles = 0;
+   _tNumPeptides = 0;
+   _tNumUnique = 0;
+   _bSpillFailed = false;
+   _tMaxEntries = (size_t)g_staticParams.options.iIndexBuildMemory * 1048576 / sizeof(DBIndex);
+
+   if (_tMaxEntries > 0)
+      g_pvDBIndex.reserve(_tMaxEntries);
+}
+
+
+// Called by the search threads with their buffered peptides.  A full buffer is
+// spilled by the calling thread; the other threads keep buffering meanwhile.
+void CometIndexBuilder::AddPeptides(vector<DBIndex> &vEntries)
+{
+   for (std::vector<DBIndex>::iterator it = vEntries.begin(); it != vEntries.end() && !_bSpillFailed; ++it)
+   {
+      g_pvDBIndex.push_back(*it);
+      _tNumPeptides++;
+
+      if (_tMaxEntries > 0 && g_pvDBIndex.size() >= _tMaxEntries)
+         SpillRun(_vPeptideRuns, CompareByPeptide, false);
+   }
+}
+
+
+uint64_t CometIndexBuilder::NumPeptides(void)
+{
+   return _tNumPeptides;
+}
+
+
+void CometIndexBuilder::Cleanup(void)
+{
+   for (size_t i = 0; i < _vTempFiles.size(); i++)
+      fclose(_vTempFiles.at(i));
+
+   _vTempFiles.clear();
+   _vPeptideRuns.clear();
+   _vMassRuns.clear();
+   _mapProteinLists.clear();
+
+   vector<DBIndex>().swap(g_pvDBIndex);
+}
+
+
+// Temporary files sit next to the index file and are removed once closed.
+FILE *CometIndexBuilder::OpenTempFile(void)
+{
+   char szTempFile[SIZE_FILE+24];
+   FILE *fp;
+
+   sprintf(szTempFile, "%s.tmp%d", _szIndexFile, _iNumTempFiles++);
+
+#ifdef _WIN32
+   fp = fopen(szTempFile, "w+bD");
+#else
+   if ((fp = fopen(szTempFile, "w+b")) != NULL)
+      unlink(szTempFile);
+#endif
+
+   if (fp == NULL)
+   {
+      char szErrorMsg[SIZE_ERROR];
+      sprintf(szErrorMsg, " Error - cannot create temporary file %s.\n", szTempFile);
+      string strErrorMsg(szErrorMsg);
+      g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+      logerr(szErrorMsg);
+      return NULL;
+   }
+
+   _vTempFiles.push_back(fp);
+
+   return fp;
+}
+
+
+// Sort the buffered peptides and move them to a new run file.  bParallel sorts on
+// the thread pool, which only the main thread may do.
+bool CometIndexBuilder::SpillRun(vector<FILE*> &vRuns,
+                                 bool (*pfnCompare)(const DBIndex&, const DBIndex&),
+                                 bool bParallel)
+{
+   if (g_pvDBIndex.size() == 0)
+      return true;
+
+   if (bParallel)
+      ParallelSort(pfnCompare);
+   else
+      sort(g_pvDBIndex.begin(), g_pvDBIndex.end(), pfnCompare);
+
+   FILE *fp = OpenTempFile();
+   bool bSucceeded = (fp != NULL);
+
+   for (std::vector<DBIndex>::iterator it = g_pvDBIndex.begin(); bSucceeded && it != g_pvDBIndex.end(); ++it)
+      bSucceeded = WriteRunEntry(fp, *it);
+
+   if (bSucceeded && fflush(fp) != 0)
+      bSucceeded = false;
+
+   g_pvDBIndex.clear();  // capacity is kept for the next run
+
+   if (!bSucceeded)
+   {
+      if (fp != NULL)
+      {
+         char szErrorMsg[SIZE_ERROR];
+         sprintf(szErrorMsg, " Error - cannot write temporary index run for %s; check free disk space.\n", _szIndexFile);
+         string strErrorMsg(szErrorMsg);
+         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+         logerr(szErrorMsg);
+      }
+      _bSpillFailed = true;
+      return false;
+   }
+
+   vRuns.push_back(fp);
+
+   return true;
+}
+
+
+// Write a new index file:  a single segment at the start of fptr.  pstrParams gives
+// the params section text of an index being compacted; NULL formats this search's.
+bool CometIndexBuilder::WriteIndex(FILE *fptr,
+                                   const string *pstrParams)
+{
+   IndexFileHeader header;
+
+   if (!WriteSegment(fptr, 0, &header, pstrParams))
+      return false;
+
+   // read back everything after the header for the checksum, then write final header
+   header.tChecksum = ChecksumIndexFile(INDEX_CHECKSUM_SEED, sizeof(IndexFileHeader));
+
+   comet_fseek(fptr, 0, SEEK_SET);
+   fwrite(&header, sizeof(IndexFileHeader), 1, fptr);
+
+   return true;
+}
+
+
+// Check before digesting the database that the index in fptr can take a delta
+// segment:  a version 3 or later header and the same search params.
+bool CometIndexBuilder::CheckAppendIndex(FILE *fptr)
+{
+   IndexFileHeader header;
+   string strParams;
+   string strIndexParams;
+
+   if (!ReadIndexHeader(fptr, &header, &strIndexParams))
+      return false;
+
+   FormatIndexParams(strParams, NULL);
+
+   if (StripIndexParams(strParams) != StripIndexParams(strIndexParams))
+   {
+      char szErrorMsg[SIZE_ERROR];
+      sprintf(szErrorMsg, " Error - search parameters differ from those of index file %s; appended peptides need the same mass range, enzyme and modifications.\n", _szIndexFile);
+      string strErrorMsg(szErrorMsg);
+      g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+      logerr(szErrorMsg);
+      return false;
+   }
+
+   return true;
+}
+
+
+// Append the collected peptides to the index in fptr as a delta segment, see
+// IndexFileHeader.  The base header's checksum is continued over the new bytes so
+// that the file validates as a whole.  A failed append is cut back off the file.
+bool CometIndexBuilder::AppendIndex(FILE *fptr)
+{
+   IndexFileHeader baseHeader;
+   IndexFileHeader header;
+   string strIndexParams;
+
+   if (!ReadIndexHeader(fptr, &baseHeader, &strIndexParams))
+      return false;
+
+   comet_fseek(fptr, 0, SEEK_END);
+   comet_fileoffset_t lBaseEnd = comet_ftell(fptr);
+
+   while (comet_ftell(fptr) % 8 != 0)
+      fputc(0, fptr);
+
+   if (!WriteSegment(fptr, comet_ftell(fptr), &header, NULL))
+   {
+      TruncateIndexFile(fptr, lBaseEnd);
+      return false;
+   }
+
+   if (baseHeader.uiVersion < INDEX_FILE_VERSION)
+      baseHeader.uiVersion = INDEX_FILE_VERSION;  // has delta segments
+   baseHeader.tChecksum = ChecksumIndexFile(baseHeader.tChecksum, lBaseEnd);
+
+   comet_fseek(fptr, 0, SEEK_SET);
+   fwrite(&baseHeader, sizeof(IndexFileHeader), 1, fptr);
+
+   if (fflush(fptr) != 0 || ferror(fptr))
+   {
+      char szErrorMsg[SIZE_ERROR];
+      sprintf(szErrorMsg, " Error - cannot write index file %s.\n", _szIndexFile);
+      string strErrorMsg(szErrorMsg);
+      g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+      logerr(szErrorMsg);
+      return false;
+   }
+
+   return true;
+}
+
+
+// Read the header and params section of an existing index that a delta segment is
+// to be appended to.  Version 1 and 2 files have to be rebuilt first.
+bool CometIndexBuilder::ReadIndexHeader(FILE *fptr,
+                                        IndexFileHeader *pHeader,
+                                        string *pstrParams)
+{
+   char szErrorMsg[SIZE_ERROR];
+
+   memset(pHeader, 0, sizeof(IndexFileHeader));
+   comet_fseek(fptr, 0, SEEK_SET);
+
+   if (fread(pHeader, sizeof(IndexFileHeader), 1, fptr) != 1 || memcmp(pHeader->szMagic, INDEX_FILE_MAGIC, 8)
+         || pHeader->uiVersion < 3 || pHeader->uiVersion > INDEX_FILE_VERSION_PACKED
+         || pHeader->uiHeaderSize != sizeof(IndexFileHeader))
+   {
+      sprintf(szErrorMsg, " Error - cannot append to index file %s; rebuild it with this version of Comet first.\n", _szIndexFile);
+      string strErrorMsg(szErrorMsg);
+      g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+      logerr(szErrorMsg);
+      return false;
+   }
+
+   IndexFileSection *pSection = &(pHeader->sections[INDEX_SECTION_PARAMS]);
+   vector<char> vParams((size_t)pSection->tSize);
+
+   comet_fseek(fptr, (comet_fileoffset_t)pSection->tOffset, SEEK_SET);
+   if (fread(vParams.data(), sizeof(char), vParams.size(), fptr) != vParams.size())
+   {
+      sprintf(szErrorMsg, " Error - cannot read back index file %s.\n", _szIndexFile);
+      string strErrorMsg(szErrorMsg);
+      g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+      logerr(szErrorMsg);
+      return false;
+   }
+
+   pstrParams->assign(vParams.data(), vParams.size());
+
+   return true;
+}
+
+
+// Write the collected peptides as one index segment starting at lStart, which is
+// where fptr is positioned.  pHeader gets the segment's header, which is written
+// at lStart with a zero checksum that is left to the caller.
+bool CometIndexBuilder::WriteSegment(FILE *fptr,
+                                     comet_fileoffset_t lStart,
+                                     IndexFileHeader *pHeader,
+                                     const string *pstrParams)
+{
+   char szOut[256];
+
+   if (_bSpillFailed)
+      return false;
+
+   sprintf(szOut, " - removing duplicates\n");
+   logout(szOut);
+   fflush(stdout);
+
+   // Protein lists are written before the protein names so they first reference
+   // each name by its ordinal; the ordinals are replaced by file positions below.
+   int ctProteinNames = 0;
+   for (auto it = g_pvProteinNames.begin(); it != g_pvProteinNames.end(); ++it)
+      it->second.iWhichProtein = ctProteinNames++;
+
+   FILE *fpLists = OpenTempFile();
+
+   if (fpLists == NULL || !MergePeptides(fpLists))
+      return false;
+
+   sprintf(szOut, " - writing file\n");
+   logout(szOut);
+   fflush(stdout);
+
+   // The header is written again at the end once the section positions are known.
+   memset(pHeader, 0, sizeof(IndexFileHeader));
+   memcpy(pHeader->szMagic, INDEX_FILE_MAGIC, 8);
+   pHeader->uiVersion = (g_staticParams.options.bIndexCompress ? INDEX_FILE_VERSION_PACKED : INDEX_FILE_VERSION);
+   pHeader->uiHeaderSize = sizeof(IndexFileHeader);
+   pHeader->tNumPeptides = _tNumUnique;
+   pHeader->iMinMass = (int)(g_staticParams.options.dPeptideMassLow);
+   pHeader->iMaxMass = (int)(g_staticParams.options.dPeptideMassHigh);
+   fwrite(pHeader, sizeof(IndexFileHeader), 1, fptr);
+
+   // write out index params
+   string strParams;
+   FormatIndexParams(strParams, pstrParams);
+
+   BeginIndexSection(fptr, &pHeader->sections[INDEX_SECTION_PARAMS]);
+   fwrite(strParams.c_str(), sizeof(char), strParams.size(), fptr);
+   EndIndexSection(fptr, &pHeader->sections[INDEX_SECTION_PARAMS]);
+
+   IndexFragmentBinsHeader fragmentBins;
+   IndexFragmentBinsHeader *pFragmentBins = NULL;
+
+   if (g_staticParams.options.bIndexFragmentBins)
+   {
+      if (!ApplyIndexParams(fptr, &pHeader->sections[INDEX_SECTION_PARAMS]))
+         return false;
+
+      if (g_staticParams.variableModParameters.bUseFragmentNeutralLoss)
+      {
+         sprintf(szOut, " - not storing fragment ions; variable mods have fragment neutral losses\n");
+         logout(szOut);
+         fflush(stdout);
+      }
+      else
+      {
+         memset(&fragmentBins, 0, sizeof(IndexFragmentBinsHeader));
+         fragmentBins.dInverseBinWidth = g_staticParams.dInverseBinWidth;
+         fragmentBins.dOneMinusBinOffset = g_staticParams.dOneMinusBinOffset;
+         fragmentBins.iMonoMassesFragment = g_staticParams.massUtility.bMonoMassesFragment;
+         fragmentBins.iSearchEnzymeOffSet = g_staticParams.enzymeInformation.iSearchEnzymeOffSet;
+         fragmentBins.iMaxFragmentCharge = g_staticParams.options.iMaxFragmentCharge;
+         fragmentBins.iNumIonSeries = g_staticParams.ionInformation.iNumIonSeriesUsed;
+         for (int i = 0; i < fragmentBins.iNumIonSeries; i++)
+            fragmentBins.piIonSeries[i] = g_staticParams.ionInformation.piSelectedIonSeries[i];
+         fragmentBins.iNumLadders = (g_staticParams.options.iDecoySearch ? 2 : 1);
+         pFragmentBins = &fragmentBins;
+      }
+   }
+
+   comet_fileoffset_t *lProteinIndex = new comet_fileoffset_t[ctProteinNames];
+
+   // write out protein names. Track file position of each protein name
+   BeginIndexSection(fptr, &pHeader->sections[INDEX_SECTION_PROTEIN_NAMES]);
+   for (auto it = g_pvProteinNames.begin(); it != g_pvProteinNames.end(); ++it)
+   {
+      lProteinIndex[it->second.iWhichProtein] = comet_ftell(fptr);
+      fwrite(it->second.szProt, sizeof(char)*WIDTH_REFERENCE, 1, fptr);
+   }
+   EndIndexSection(fptr, &pHeader->sections[INDEX_SECTION_PROTEIN_NAMES]);
+
+   // copy the protein lists, which keep their size so their relative positions hold
+   BeginIndexSection(fptr, &pHeader->sections[INDEX_SECTION_PROTEIN_LISTS]);
+   comet_fileoffset_t lListsOffset = (comet_fileoffset_t)pHeader->sections[INDEX_SECTION_PROTEIN_LISTS].tOffset;
+   long lNumMatchedProteins;
+   comet_fileoffset_t lWhichProtein;
+
+   rewind(fpLists);
+   while (fread(&lNumMatchedProteins, sizeof(long), 1, fpLists) == 1)
+   {
+      fwrite(&lNumMatchedProteins, sizeof(long), 1, fptr);
+
+      for (long x = 0; x < lNumMatchedProteins; x++)
+      {
+         if (fread(&lWhichProtein, sizeof(comet_fileoffset_t), 1, fpLists) == 1)
+            fwrite(&(lProteinIndex[lWhichProtein]), sizeof(comet_fileoffset_t), 1, fptr);
+      }
+   }
+   EndIndexSection(fptr, &pHeader->sections[INDEX_SECTION_PROTEIN_LISTS]);
+
+   delete[] lProteinIndex;
+
+   if (!WriteColumns(fptr, pHeader, lListsOffset, pFragmentBins))
+      return false;
+
+   if (fflush(fptr) != 0 || ferror(fptr))
+   {
+      char szErrorMsg[SIZE_ERROR];
+      sprintf(szErrorMsg, " Error - cannot write index file %s; check free disk space.\n", _szIndexFile);
+      string strErrorMsg(szErrorMsg);
+      g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+      logerr(szErrorMsg);
+      return false;
+   }
+
+   comet_fseek(fptr, lStart, SEEK_SET);
+   fwrite(pHeader, sizeof(IndexFileHeader), 1, fptr);
+   fflush(fptr);
+
+   return true;
+}
+
+
+// Text of the params section.  The params of an index being compacted are kept
+// apart from the peptide count.
+void CometIndexBuilder::FormatIndexParams(string &strParams,
+                                          const string *pstrParams)
+{
+   char szBuf[SIZE_BUF];
+
+   strParams.clear();
+
+   if (pstrParams != NULL)
+   {
+      istringstream issParams(*pstrParams);
+      string strLine;
+
+      while (getline(issParams, strLine))
+      {
+         if (!strncmp(strLine.c_str(), "NumPeptides:", 12))
+         {
+            sprintf(szBuf, "NumPeptides: %ld", (long)_tNumUnique);
+            strLine = szBuf;
+         }
+         strParams += strLine + "\n";
+      }
+      return;
+   }
+
+   sprintf(szBuf, "Comet indexed database.  Comet version %s\n", g_sCometVersion.c_str());
+   strParams += szBuf;
+   sprintf(szBuf, "InputDB:  %s\n", g_staticParams.databaseInfo.szDatabase);
+   strParams += szBuf;
+   sprintf(szBuf, "MassRange: %lf %lf\n", g_staticParams.options.dPeptideMassLow, g_staticParams.options.dPeptideMassHigh);
+   strParams += szBuf;
+   sprintf(szBuf, "MassType: %d %d\n", g_staticParams.massUtility.bMonoMassesParent, g_staticParams.massUtility.bMonoMassesFragment);
+   strParams += szBuf;
+   sprintf(szBuf, "Enzyme: %s [%d %s %s]\n", g_staticParams.enzymeInformation.szSearchEnzymeName,
+      g_staticParams.enzymeInformation.iSearchEnzymeOffSet,
+      g_staticParams.enzymeInformation.szSearchEnzymeBreakAA,
+      g_staticParams.enzymeInformation.szSearchEnzymeNoBreakAA);
+   strParams += szBuf;
+   sprintf(szBuf, "Enzyme2: %s [%d %s %s]\n", g_staticParams.enzymeInformation.szSearchEnzyme2Name,
+      g_staticParams.enzymeInformation.iSearchEnzyme2OffSet,
+      g_staticParams.enzymeInformation.szSearchEnzyme2BreakAA,
+      g_staticParams.enzymeInformation.szSearchEnzyme2NoBreakAA);
+   strParams += szBuf;
+   sprintf(szBuf, "NumPeptides: %ld\n", (long)_tNumUnique);
+   strParams += szBuf;
+
+   // write out static mod params A to Z is ascii 65 to 90 then terminal mods
+   strParams += "StaticMod:";
+   for (int x = 65; x <= 90; x++)
+   {
+      sprintf(szBuf, " %lf", g_staticParams.staticModifications.pdStaticMods[x]);
+      strParams += szBuf;
+   }
+   sprintf(szBuf, " %lf %lf %lf %lf\n", g_staticParams.staticModifications.dAddNterminusPeptide,
+      g_staticParams.staticModifications.dAddCterminusPeptide,
+      g_staticParams.staticModifications.dAddNterminusProtein,
+      g_staticParams.staticModifications.dAddCterminusProtein);
+   strParams += szBuf;
+
+   // write out variable mod params
+   strParams += "VariableMod:";
+   for (int x = 0; x < VMODS; x++)
+   {
+      sprintf(szBuf, " %s %lf:%lf", g_staticParams.variableModParameters.varModList[x].szVarModChar,
+            g_staticParams.variableModParameters.varModList[x].dVarModMass,
+            g_staticParams.variableModParameters.varModList[x].dNeutralLoss);
+      strParams += szBuf;
+   }
+   strParams += "\n\n";
+}
+
+
+// Checksum continued from tChecksum over the index file from lStart to its end.
+uint64_t CometIndexBuilder::ChecksumIndexFile(uint64_t tChecksum,
+                                              comet_fileoffset_t lStart)
+{
+   FILE *fpCheck;
+
+   if ((fpCheck = fopen(_szIndexFile, "rb")) != NULL)
+   {
+      vector<char> vBuf(1048576);
+      size_t tRead;
+
+      comet_fseek(fpCheck, lStart, SEEK_SET);
+      while ((tRead = fread(vBuf.data(), sizeof(char), vBuf.size(), fpCheck)) > 0)
+         tChecksum = CometSearch::IndexFileChecksum(tChecksum, vBuf.data(), tRead);
+      fclose(fpCheck);
+   }
+
+   return tChecksum;
+}
+
+
+// Merge the peptide sorted runs.  Consecutive entries of the same peptide sequence
+// share one protein list; entries that are also the same mass and mod state are
+// duplicates and only the first is kept.
+bool CometIndexBuilder::MergePeptides(FILE *fpLists)
+{
+   char szOut[256];
+
+   if (_tMaxEntries > 0)
+   {
+      if (!SpillRun(_vPeptideRuns, CompareByPeptide, true))
+         return false;
+
+      vector<DBIndex>().swap(g_pvDBIndex);  // unique peptides are buffered again below
+      g_pvDBIndex.reserve(_tMaxEntries);
+
+      sprintf(szOut, " - merging %d sorted runs\n", (int)_vPeptideRuns.size());
+      logout(szOut);
+      fflush(stdout);
+   }
+   else
+      ParallelSort(CompareByPeptide);
+
+   IndexRunMerger merger(_vPeptideRuns, CompareByPeptide);
+   _mapProteinLists.clear();
+   vector<DBIndex> vGroup;                    // unique mod forms of one peptide
+   vector<comet_fileoffset_t> vProteins;      // proteins of one peptide
+   DBIndex sEntry;
+   bool bMore = merger.Next(sEntry);
+
+   _tNumUnique = 0;
+
+   while (bMore)
+   {
+      vGroup.clear();
+      vProteins.clear();
+
+      vGroup.push_back(sEntry);
+      vProteins.push_back(sEntry.lIndexProteinFilePosition);
+
+      // each unique peptide, irregardless of mod state, will have the same list
+      // of matched proteins
+      while ((bMore = merger.Next(sEntry)) && !strcmp(sEntry.szPeptide, vGroup.at(0).szPeptide))
+      {
+         vProteins.push_back(sEntry.lIndexProteinFilePosition);
+
+         if (!(sEntry == vGroup.back()))
+            vGroup.push_back(sEntry);
+      }
+
+      comet_fileoffset_t lListPos;
+
+      if (!WriteProteinList(fpLists, vProteins, &lListPos))
+      {
+         char szErrorMsg[SIZE_ERROR];
+         sprintf(szErrorMsg, " Error - cannot write temporary protein lists for %s; check free disk space.\n", _szIndexFile);
+         string strErrorMsg(szErrorMsg);
+         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+         logerr(szErrorMsg);
+         return false;
+      }
+
+      for (std::vector<DBIndex>::iterator it = vGroup.begin(); it != vGroup.end(); ++it)
+      {
+         (*it).lIndexProteinFilePosition = lListPos;
+         AddUniquePeptide(*it);
+      }
+   }
+
+   if (_bSpillFailed)
+      return false;
+
+   if (_tMaxEntries > 0)
+      return SpillRun(_vMassRuns, CompareByMass, true);
+
+   g_pvDBIndex.resize(_tNumUnique);
+   ParallelSort(CompareByMass);
+
+   return true;
+}
+
+
+// Write a peptide's protein list, referencing each protein by its ordinal in
+// g_pvProteinNames.  plListPos is relative to the start of the lists.  A compressed
+// index shares one copy of identical lists.
+bool CometIndexBuilder::WriteProteinList(FILE *fpLists,
+                                         vector<comet_fileoffset_t> &vProteins,
+                                         comet_fileoffset_t *plListPos)
+{
+   // proteins can repeat due to mod forms of peptide so make unique here
+   sort(vProteins.begin(), vProteins.end());
+   vProteins.erase(unique(vProteins.begin(), vProteins.end()), vProteins.end());
+
+   long lNumMatchedProteins = (long)vProteins.size();
+
+   if (lNumMatchedProteins > g_staticParams.options.iMaxDuplicateProteins)
+      lNumMatchedProteins = g_staticParams.options.iMaxDuplicateProteins;
+
+   vector<comet_fileoffset_t> vWhichProteins((size_t)lNumMatchedProteins);
+
+   comet_fileoffset_t lWhichProtein = 0;
+   for (long x = 0; x < lNumMatchedProteins; x++)
+   {
+      auto result = g_pvProteinNames.find(vProteins.at(x));
+      if (result != g_pvProteinNames.end())
+         lWhichProtein = result->second.iWhichProtein;
+
+      vWhichProteins.at(x) = lWhichProtein;
+   }
+
+   if (g_staticParams.options.bIndexCompress)
+   {
+      auto result = _mapProteinLists.find(vWhichProteins);
+      if (result != _mapProteinLists.end())
+      {
+         *plListPos = result->second;
+         return true;
+      }
+   }
+
+   *plListPos = comet_ftell(fpLists);
+
+   fwrite(&lNumMatchedProteins, sizeof(long), 1, fpLists);
+   if (lNumMatchedProteins > 0)
+      fwrite(vWhichProteins.data(), sizeof(comet_fileoffset_t), vWhichProteins.size(), fpLists);
+
+   if (g_staticParams.options.bIndexCompress)
+      _mapProteinLists[vWhichProteins] = *plListPos;
+
+   return !ferror(fpLists);
+}
+
+
+void CometIndexBuilder::AddUniquePeptide(DBIndex &sEntry)
+{
+   if (_tMaxEntries == 0)
+   {
+      // compact in place; the merge has already read past this slot
+      g_pvDBIndex.at(_tNumUnique) = sEntry;
+   }
+   else if (!_bSpillFailed)
+   {
+      g_pvDBIndex.push_back(sEntry);
+
+      if (g_pvDBIndex.size() >= _tMaxEntries)
+         SpillRun(_vMassRuns, CompareByMass, true);
+   }
+
+   _tNumUnique++;
+}
+
+
+// Sort g_pvDBIndex on the thread pool:  each thread sorts one slice, then neighbouring
+// slices are merged pairwise until a single sorted range is left.
+void CometIndexBuilder::ParallelSort(bool (*pfnCompare)(const DBIndex&, const DBIndex&))
+{
+   size_t tSize = g_pvDBIndex.size();
+   size_t tNumSlices = (g_staticParams.options.iNumThreads > 1 ? (size_t)g_staticParams.options.iNumThreads : 1);
+
+   if (_tp == NULL || tNumSlices == 1 || tSize < tNumSlices * INDEX_PEPTIDE_BATCH)
+   {
+      sort(g_pvDBIndex.begin(), g_pvDBIndex.end(), pfnCompare);
+      return;
+   }
+
+   vector<size_t> vBounds(tNumSlices + 1);
+   for (size_t i = 0; i <= tNumSlices; i++)
+      vBounds[i] = tSize * i / tNumSlices;
+
+   for (size_t i = 0; i < tNumSlices; i++)
+      _tp->doJob(std::bind(SortThreadProc, vBounds[i], vBounds[i+1], pfnCompare));
+   _tp->wait_on_threads();
+
+   for (size_t tWidth = 1; tWidth < tNumSlices; tWidth *= 2)
+   {
+      for (size_t i = 0; i + tWidth < tNumSlices; i += 2*tWidth)
+      {
+         size_t tEnd = vBounds[(i + 2*tWidth < tNumSlices ? i + 2*tWidth : tNumSlices)];
+         _tp->doJob(std::bind(MergeThreadProc, vBounds[i], vBounds[i + tWidth], tEnd, pfnCompare));
+      }
+      _tp->wait_on_threads();
+   }
+}
+
+
+void CometIndexBuilder::SortThreadProc(size_t tBegin,
+                                       size_t tEnd,
+                                       bool (*pfnCompare)(const DBIndex&, const DBIndex&))
+{
+   sort(g_pvDBIndex.begin() + tBegin, g_pvDBIndex.begin() + tEnd, pfnCompare);
+}
+
+
+void CometIndexBuilder::MergeThreadProc(size_t tBegin,
+                                        size_t tMiddle,
+                                        size_t tEnd,
+                                        bool (*pfnCompare)(const DBIndex&, const DBIndex&))
+{
+   inplace_merge(g_pvDBIndex.begin() + tBegin, g_pvDBIndex.begin() + tMiddle, g_pvDBIndex.begin() + tEnd, pfnCompare);
+}
+
+
+// Merge the mass sorted runs into the index columns.  The masses follow the protein
+// lists directly; the other columns go through temporary files and are appended.
+// A version 5 segment gets the compressed columns and block list of IndexBlock.
+bool CometIndexBuilder::WriteColumns(FILE *fptr,
+                                     IndexFileHeader *pHeader,
+                                     comet_fileoffset_t lListsOffset,
+                                     const IndexFragmentBinsHeader *pFragmentBins)
+{
+   FILE *fpSequenceOffsets = OpenTempFile();
+   FILE *fpSequences = OpenTempFile();
+   FILE *fpModOffsets = OpenTempFile();
+   FILE *fpModSites = OpenTempFile();
+   FILE *fpProteinRefs = OpenTempFile();
+   FILE *fpFragmentBins = NULL;
+
+   if (fpSequenceOffsets == NULL || fpSequences == NULL || fpModOffsets == NULL
+         || fpModSites == NULL || fpProteinRefs == NULL)
+   {
+      return false;
+   }
+
+   vector<unsigned int> vBins;
+   if (pFragmentBins != NULL)
+   {
+      if ((fpFragmentBins = OpenTempFile()) == NULL)
+         return false;
+
+      fwrite(pFragmentBins, sizeof(IndexFragmentBinsHeader), 1, fpFragmentBins);
+      vBins.resize((size_t)pFragmentBins->iNumLadders * pFragmentBins->iMaxFragmentCharge
+            * pFragmentBins->iNumIonSeries * MAX_PEPTIDE_LEN);
+   }
+
+   int iMaxPeptideMass = (int)(g_staticParams.options.dPeptideMassHigh);
+   int iMaxPeptideMass10 = iMaxPeptideMass * 10;  // make mass index at resolution of 0.1 Da
+   comet_fileoffset_t *lIndex = new comet_fileoffset_t[iMaxPeptideMass10 + 1];
+   for (int x = 0; x <= iMaxPeptideMass10; x++)
+      lIndex[x] = -1;
+
+   IndexRunMerger merger(_vMassRuns, CompareByMass);
+   DBIndex sEntry;
+   int iPrevMass10 = 0;
+   uint64_t tPeptide = 0;
+   uint64_t tBit = 0;         // bit offset of the next peptide sequence
+   uint64_t tBits = 0;        // packed residue bits not yet written
+   int iNumBits = 0;
+   uint64_t tNumModSites = 0;
+
+   bool bPacked = (pHeader->uiVersion == INDEX_FILE_VERSION_PACKED);
+   vector<IndexBlock> vBlocks;
+   uint64_t tMassBytes = 0;
+   uint64_t tProteinRefBytes = 0;
+   uint64_t tPrevMassBits = 0;
+
+   BeginIndexSection(fptr, &pHeader->sections[INDEX_SECTION_MASSES]);
+   while (merger.Next(sEntry))
+   {
+      if ((int)(sEntry.dPepMass * 10.0) > iPrevMass10)
+      {
+         iPrevMass10 = (int)(sEntry.dPepMass * 10.0);
+         if (iPrevMass10 < iMaxPeptideMass10)
+            lIndex[iPrevMass10] = (comet_fileoffset_t)tPeptide;
+      }
+
+      if (bPacked)
+      {
+         uint64_t tMassBits;
+         memcpy(&tMassBits, &(sEntry.dPepMass), sizeof(double));
+
+         if (tPeptide % INDEX_BLOCK_PEPTIDES == 0)
+         {
+            IndexBlock block;
+            block.tMassByte = tMassBytes;
+            block.tProteinRefByte = tProteinRefBytes;
+            block.tSequenceBit = tBit;
+            block.tModSite = tNumModSites;
+            vBlocks.push_back(block);
+
+            fwrite(&(sEntry.dPepMass), sizeof(double), 1, fptr);
+            tMassBytes += sizeof(double);
+         }
+         else
+         {
+            // masses are sorted only to within FLOAT_ZERO so the difference is zigzag coded
+            int64_t lDiff = (int64_t)(tMassBits - tPrevMassBits);
+            tMassBytes += WriteVarint(fptr, ((uint64_t)lDiff << 1) ^ (uint64_t)(lDiff >> 63));
+         }
+
+         tPrevMassBits = tMassBits;
+      }
+      else
+         fwrite(&(sEntry.dPepMass), sizeof(double), 1, fptr);
+
+      // peptide sequences, packed 5 bits per residue
+      if (bPacked)
+         fputc((int)strlen(sEntry.szPeptide), fpSequenceOffsets);
+      else
+         fwrite(&tBit, sizeof(uint64_t), 1, fpSequenceOffsets);
+      tBit += 5 * strlen(sEntry.szPeptide);
+
+      for (char *pszResidue = sEntry.szPeptide; *pszResidue; pszResidue++)
+      {
+         if (*pszResidue < 'A' || *pszResidue > 'Z')
+         {
+            char szErrorMsg[SIZE_ERROR];
+            sprintf(szErrorMsg, " Error - cannot store residue '%c' of peptide %s in index.\n", *pszResidue, sEntry.szPeptide);
+            logerr(szErrorMsg);
+            delete[] lIndex;
+            return false;
+         }
+
+         tBits |= (uint64_t)(*pszResidue - 'A' + 1) << iNumBits;
+         iNumBits += 5;
+
+         while (iNumBits >= 8)
+         {
+            fputc((int)(tBits & 0xFF), fpSequences);
+            tBits >>= 8;
+            iNumBits -= 8;
+         }
+      }
+
+      // variable mod sites as (position, mod) pairs; most peptides have none
+      if (!bPacked)
+         fwrite(&tNumModSites, sizeof(uint64_t), 1, fpModOffsets);
+
+      int iLen2 = (int)strlen(sEntry.szPeptide) + 2;
+      int iNumSites = 0;
+      for (int x = 0; x < iLen2; x++)
+      {
+         if (sEntry.pcVarModSites[x] != 0)
+         {
+            fputc(x, fpModSites);
+            fputc(sEntry.pcVarModSites[x], fpModSites);
+            iNumSites++;
+         }
+      }
+      tNumModSites += iNumSites;
+
+      if (bPacked)
+         fputc(iNumSites, fpModOffsets);
+
+      // file position of the peptide's protein list
+      if (bPacked)
+         tProteinRefBytes += WriteVarint(fpProteinRefs, (uint64_t)sEntry.lIndexProteinFilePosition);
+      else
+      {
+         comet_fileoffset_t lProteinList = lListsOffset + sEntry.lIndexProteinFilePosition;
+         fwrite(&lProteinList, sizeof(comet_fileoffset_t), 1, fpProteinRefs);
+      }
+
+      // binned fragment ions, a run per residue after the first
+      if (fpFragmentBins != NULL && iLen2 > 3)
+      {
+         CometSearch::CalcIndexFragmentBins(sEntry, pFragmentBins, vBins.data());
+         fwrite(vBins.data(), sizeof(unsigned int), (size_t)pFragmentBins->iNumLadders * pFragmentBins->iMaxFragmentCharge
+               * pFragmentBins->iNumIonSeries * (iLen2 - 3), fpFragmentBins);
+      }
+
+      tPeptide++;
+   }
+   EndIndexSection(fptr, &pHeader->sections[INDEX_SECTION_MASSES]);
+
+   if (!bPacked)
+      fwrite(&tBit, sizeof(uint64_t), 1, fpSequenceOffsets);
+   if (iNumBits > 0)
+      fputc((int)(tBits & 0xFF), fpSequences);
+   fputc(0, fpSequences);  // readers always load the byte after a residue's first byte
+   if (!bPacked)
+      fwrite(&tNumModSites, sizeof(uint64_t), 1, fpModOffsets);
+
+   bool bSucceeded = AppendTempFile(fptr, fpSequenceOffsets, &pHeader->sections[INDEX_SECTION_SEQUENCE_OFFSETS])
+      && AppendTempFile(fptr, fpSequences, &pHeader->sections[INDEX_SECTION_SEQUENCES])
+      && AppendTempFile(fptr, fpModOffsets, &pHeader->sections[INDEX_SECTION_MOD_OFFSETS])
+      && AppendTempFile(fptr, fpModSites, &pHeader->sections[INDEX_SECTION_MOD_SITES])
+      && AppendTempFile(fptr, fpProteinRefs, &pHeader->sections[INDEX_SECTION_PROTEIN_REFS]);
+
+   BeginIndexSection(fptr, &pHeader->sections[INDEX_SECTION_MASS_INDEX]);
+   fwrite(lIndex, sizeof(comet_fileoffset_t), iMaxPeptideMass10, fptr); // write index
+   if (bPacked && !vBlocks.empty())
+      fwrite(vBlocks.data(), sizeof(IndexBlock), vBlocks.size(), fptr);
+   EndIndexSection(fptr, &pHeader->sections[INDEX_SECTION_MASS_INDEX]);
+
+   if (bSucceeded && fpFragmentBins != NULL)
+      bSucceeded = AppendTempFile(fptr, fpFragmentBins, &pHeader->sections[INDEX_SECTION_FRAGMENT_BINS]);
+
+   delete[] lIndex;
+
+   return bSucceeded;
+}
+
+
+// Apply the parameters just written to the index the way a search of it will, so
+// that stored fragment ions use the same (rounded) static and variable mod masses.
+bool CometIndexBuilder::ApplyIndexParams(FILE *fptr,
+                                         IndexFileSection *pSection)
+{
+   FILE *fpParams;
+   vector<char> vParams((size_t)pSection->tSize);
+   bool bRead = false;
+
+   fflush(fptr);
+   if ((fpParams = fopen(_szIndexFile, "rb")) != NULL)
+   {
+      comet_fseek(fpParams, (comet_fileoffset_t)pSection->tOffset, SEEK_SET);
+      bRead = (fread(vParams.data(), sizeof(char), vParams.size(), fpParams) == vParams.size());
+      fclose(fpParams);
+   }
+
+   if (!bRead)
+   {
+      char szErrorMsg[SIZE_ERROR];
+      sprintf(szErrorMsg, " Error - cannot read back index file %s.\n", _szIndexFile);
+      string strErrorMsg(szErrorMsg);
+      g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+      logerr(szErrorMsg);
+      return false;
+   }
+
+   memset(g_staticParams.staticModifications.pdStaticMods, 0, sizeof(g_staticParams.staticModifications.pdStaticMods));
+
+   return CometSearch::ParseIndexParams(vParams.data(), (comet_fileoffset_t)vParams.size());
+}
+
+
+bool CometIndexBuilder::AppendTempFile(FILE *fptr,
+                                       FILE *fpTemp,
+                                       IndexFileSection *pSection)
+{
+   vector<char> vBuf(1048576);
+   size_t tRead;
+
+   if (fflush(fpTemp) != 0 || ferror(fpTemp))
+   {
+      char szErrorMsg[SIZE_ERROR];
+      sprintf(szErrorMsg, " Error - cannot write temporary index columns for %s; check free disk space.\n", _szIndexFile);
+      string strErrorMsg(szErrorMsg);
+      g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+      logerr(szErrorMsg);
+      return false;
+   }
+
+   BeginIndexSection(fptr, pSection);
+   rewind(fpTemp);
+   while ((tRead = fread(vBuf.data(), sizeof(char), vBuf.size(), fpTemp)) > 0)
+      fwrite(vBuf.data(), sizeof(char), tRead, fptr);
+   EndIndexSection(fptr, pSection);
+
+   return true;
+}
+
+
+// this sort function needs to compare peptide, modification state, and protein file pointer
+bool CometIndexBuilder::CompareByPeptide(const DBIndex &lhs,
+                                         const DBIndex &rhs)
+{
+   if (!strcmp(lhs.szPeptide, rhs.szPeptide))
+   {
+      // peptides are same here so look at mass next
+      if (fabs(lhs.dPepMass - rhs.dPepMass) > FLOAT_ZERO)
+      {
+         // masses are different
+         if (lhs.dPepMass < rhs.dPepMass)
+            return true;
+         else
+            return false;
+      }
+
+      // same sequences and masses here so next look at mod state
+      int iLen = (int)strlen(lhs.szPeptide)+2;
+      for (int i=0; i<iLen; i++)
+      {
+         if (lhs.pcVarModSites[i] != rhs.pcVarModSites[i])
+         {
+            // different mod state
+            if (lhs.pcVarModSites[i] > rhs.pcVarModSites[i])
+               return true;
+            else
+               return false;
+         }
+      }
+
+      // at this point, same peptide, same mass, same mods so return first protein
+      if (lhs.lIndexProteinFilePosition < rhs.lIndexProteinFilePosition)
+         return true;
+      else
+         return false;
+   }
+
+   // peptides are different
+   if (strcmp(lhs.szPeptide, rhs.szPeptide)<0)
+      return true;
+   else
+      return false;
+};
+
+
+// sort by mass, then peptide, then modification state, then protein fp location
+bool CometIndexBuilder::CompareByMass(const DBIndex &lhs,
+                                      const DBIndex &rhs)
+{
+   if (fabs(lhs.dPepMass - rhs.dPepMass) > FLOAT_ZERO)
+   {
+      // masses are different
+      if (lhs.dPepMass < rhs.dPepMass)
+         return true;
+      else
+         return false;
+   }
+
+   // at this point, peptides are same mass so next need to compare sequences
+
+   if (!strcmp(lhs.szPeptide, rhs.szPeptide))
+   {
+      // same sequences and masses here so next look at mod state
+      for (unsigned int i=0; i<strlen(lhs.szPeptide)+2; i++)
+      {
+         if (lhs.pcVarModSites[i] != rhs.pcVarModSites[i])
+         {
+            if (lhs.pcVarModSites[i] > rhs.pcVarModSites[i])
+               return true;
+            else
+               return false;
+         }
+      }
+
+      // at this point, same peptide, same mass, same mods so return first protein
+      if (lhs.lIndexProteinFilePosition < rhs.lIndexProteinFilePosition)
+         return true;
+      else
+         return false;
+   }
+
+   // if here, peptide sequences are different (but w/same mass) so sort alphabetically
+   if (strcmp(lhs.szPeptide, rhs.szPeptide) < 0)
+      return true;
+   else
+      return false;
+
+}
@@ -0,0 +1,106 @@
+/*
+   Copyright 2012 University of Washington
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _COMETINDEXBUILDER_H_
+#define _COMETINDEXBUILDER_H_
+
+#include "Common.h"
+#include "CometDataInternal.h"
+
+
+// Builds the .idx peptide index file.  Peptides collected from the database search
+// are buffered in g_pvDBIndex; with "index_build_memory" set, a full buffer is sorted
+// and spilled to a temporary run file so memory use stays within that budget.  The
+// runs are then k-way merged twice: by peptide to remove duplicates and gather each
+// peptide's protein list, then by mass to write the index columns.  Sorts that run
+// on the main thread are split across the thread pool.  With "index_fragment_bins"
+// each peptide's binned fragment ions are also written, and with "index_compress"
+// the columns are compressed (a version 5 segment).  AppendIndex() adds the
+// peptides of another database to an existing index as a delta segment.
+class CometIndexBuilder
+{
+public:
+   CometIndexBuilder();
+   ~CometIndexBuilder();
+
+   static void Initialize(const char *szIndexFile,
+                          ThreadPool *tp);
+   static void AddPeptides(vector<DBIndex> &vEntries);    // caller holds g_dbIndexMutex
+   static uint64_t NumPeptides(void);
+   static bool WriteIndex(FILE *fptr,
+                          const string *pstrParams);
+   static bool CheckAppendIndex(FILE *fptr);
+   static bool AppendIndex(FILE *fptr);
+   static void Cleanup(void);
+
+   static bool CompareByPeptide(const DBIndex &lhs,
+                                const DBIndex &rhs);
+   static bool CompareByMass(const DBIndex &lhs,
+                             const DBIndex &rhs);
+
+private:
+   static FILE *OpenTempFile(void);
+   static bool SpillRun(vector<FILE*> &vRuns,
+                        bool (*pfnCompare)(const DBIndex&, const DBIndex&),
+                        bool bParallel);
+   static void ParallelSort(bool (*pfnCompare)(const DBIndex&, const DBIndex&));
+   static void SortThreadProc(size_t tBegin,
+                              size_t tEnd,
+                              bool (*pfnCompare)(const DBIndex&, const DBIndex&));
+   static void MergeThreadProc(size_t tBegin,
+                               size_t tMiddle,
+                               size_t tEnd,
+                               bool (*pfnCompare)(const DBIndex&, const DBIndex&));
+   static bool MergePeptides(FILE *fpLists);
+   static bool WriteProteinList(FILE *fpLists,
+                                vector<comet_fileoffset_t> &vProteins,
+                                comet_fileoffset_t *plListPos);
+   static void AddUniquePeptide(DBIndex &sEntry);
+   static bool ReadIndexHeader(FILE *fptr,
+                               IndexFileHeader *pHeader,
+                               string *pstrParams);
+   static bool WriteSegment(FILE *fptr,
+                            comet_fileoffset_t lStart,
+                            IndexFileHeader *pHeader,
+                            const string *pstrParams);
+   static void FormatIndexParams(string &strParams,
+                                 const string *pstrParams);
+   static uint64_t ChecksumIndexFile(uint64_t tChecksum,
+                                     comet_fileoffset_t lStart);
+   static bool ApplyIndexParams(FILE *fptr,
+                                IndexFileSection *pSection);
+   static bool WriteColumns(FILE *fptr,
+                            IndexFileHeader *pHeader,
+                            comet_fileoffset_t lListsOffset,
+                            const IndexFragmentBinsHeader *pFragmentBins);
+   static bool AppendTempFile(FILE *fptr,
+                              FILE *fpTemp,
+                              IndexFileSection *pSection);
+
+   static char _szIndexFile[SIZE_FILE+4];
+   static ThreadPool *_tp;
+   static int _iNumTempFiles;
+   static size_t _tMaxEntries;            // 0 = keep every peptide in memory
+   static uint64_t _tNumPeptides;         // peptides collected
+   static uint64_t _tNumUnique;           // peptides after removing duplicates
+   static bool _bSpillFailed;
+   static vector<FILE*> _vPeptideRuns;    // runs sorted by CompareByPeptide
+   static vector<FILE*> _vMassRuns;       // unique peptides sorted by CompareByMass
+   static vector<FILE*> _vTempFiles;      // every open temporary file
+   static map<vector<comet_fileoffset_t>, comet_fileoffset_t> _mapProteinLists;   // written lists, when compressing
+};
+
+#endif
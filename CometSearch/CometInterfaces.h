@@ -43,6 +43,8 @@ public:
                                           string& strReturnProtein,
                                           vector<Fragment> & matchedFragments,
                                           Scores & scores) = 0;
+      virtual int GetSingleSpectrumSearchLatency(double &dP50,
+                                                 double &dP99) = 0;
       virtual void AddInputFiles(vector<InputFileInfo*> &pvInputFiles) = 0;
       virtual void SetOutputFileBaseName(const char *pszBaseName) = 0;
       virtual void SetParam(const string &name, const string &strValue, const string &value) = 0;
@@ -128,39 +128,33 @@ void CometMassSpecUtils::AssignMass(double *pdAAMass,
 }
 
 
+map<comet_fileoffset_t, string> CometMassSpecUtils::_mapProteinNames;
+map<comet_fileoffset_t, string> CometMassSpecUtils::_mapProteinSequences;
+map<comet_fileoffset_t, vector<comet_fileoffset_t> > CometMassSpecUtils::_mapProteinLists;
+bool CometMassSpecUtils::_bProteinNamesPreloaded = false;
+
+
 // return a single protein name as a C char string
 void CometMassSpecUtils::GetProteinName(FILE *fpdb,
                                         comet_fileoffset_t lFilePosition,
                                         char *szProteinName)
 {
-   comet_fseek(fpdb, lFilePosition, SEEK_SET);
+   Threading::LockMutex(g_proteinCacheMutex);
 
    if (g_staticParams.bIndexDb)  //index database
    {
-      long lSize;
+      const vector<comet_fileoffset_t> &vOffsets = ReadProteinList(fpdb, lFilePosition);
 
-      fread(&lSize, sizeof(long), 1, fpdb);
-      vector<comet_fileoffset_t> vOffsets;
-      for (long x = 0; x < lSize; x++)
-      {
-         comet_fileoffset_t tmpoffset;
-         fread(&tmpoffset, sizeof(comet_fileoffset_t), 1, fpdb);
-         vOffsets.push_back(tmpoffset);
-      }
-      for (long x = 0; x < lSize; x++)
-      {
-         char szTmp[WIDTH_REFERENCE];
-         comet_fseek(fpdb, vOffsets.at(x), SEEK_SET);
-         fread(szTmp, sizeof(char)*WIDTH_REFERENCE, 1, fpdb);
-         sscanf(szTmp, "%511s", szProteinName);  // WIDTH_REFERENCE-1
-         break;  //break here to only get first protein reference (out of lSize)
-      }
+      // only get first protein reference
+      if (!vOffsets.empty())
+         strcpy(szProteinName, ReadProteinName(fpdb, vOffsets.at(0)).c_str());
    }
    else  //regular fasta database
    {
-      fscanf(fpdb, "%511s", szProteinName);  // WIDTH_REFERENCE-1
-      szProteinName[511] = '\0';
+      strcpy(szProteinName, ReadProteinName(fpdb, lFilePosition).c_str());
    }
+
+   Threading::UnlockMutex(g_proteinCacheMutex);
 }
 
 
@@ -173,6 +167,17 @@ void CometMassSpecUtils::GetProteinSequence(FILE *fpdb,
 
    if (!g_staticParams.bIndexDb)  // works only for regular FASTA
    {
+      Threading::LockMutex(g_proteinCacheMutex);
+
+      map<comet_fileoffset_t, string>::iterator itSeq = _mapProteinSequences.find(lFilePosition);
+
+      if (itSeq != _mapProteinSequences.end())
+      {
+         strSeq = itSeq->second;
+         Threading::UnlockMutex(g_proteinCacheMutex);
+         return;
+      }
+
       int iTmpCh;
 
       comet_fseek(fpdb, lFilePosition, SEEK_SET);
@@ -198,6 +203,10 @@ void CometMassSpecUtils::GetProteinSequence(FILE *fpdb,
             strSeq += iTmpCh;
          }
       }
+
+      _mapProteinSequences[lFilePosition] = strSeq;
+
+      Threading::UnlockMutex(g_proteinCacheMutex);
    }
 }
 
@@ -217,39 +226,44 @@ void CometMassSpecUtils::GetProteinNameString(FILE *fpdb,
 
    int iLenDecoyPrefix = strlen(g_staticParams.szDecoyPrefix);
 
+   Threading::LockMutex(g_proteinCacheMutex);
+
    if (g_staticParams.bIndexDb)  //index database
    {
       long lSize;
       bool bDecoy = false;
 
+      vector<ProteinEntryStruct> *pvProteins;
+
       if (g_pvQuery.at(iWhichQuery)->_pResults[iWhichResult].pWhichProtein.size() > 0)
-         it = g_pvQuery.at(iWhichQuery)->_pResults[iWhichResult].pWhichProtein.begin();
+         pvProteins = &(g_pvQuery.at(iWhichQuery)->_pResults[iWhichResult].pWhichProtein);
       else
       {
-         it = g_pvQuery.at(iWhichQuery)->_pResults[iWhichResult].pWhichDecoyProtein.begin();
+         pvProteins = &(g_pvQuery.at(iWhichQuery)->_pResults[iWhichResult].pWhichDecoyProtein);
          bDecoy = true;
       }
 
-      comet_fseek(fpdb, it->lWhichProtein, SEEK_SET);
-
-      fread(&lSize, sizeof(long), 1, fpdb);
+      // Each protein list is read; a peptide also in a delta segment of the index
+      // has one there too.  Sorted, the names keep their database order.
       vector<comet_fileoffset_t> vOffsets;
 
-      for (long x = 0; x < lSize; x++)
+      for (it = pvProteins->begin(); it != pvProteins->end(); ++it)
       {
-         comet_fileoffset_t tmpoffset;
-         fread(&tmpoffset, sizeof(comet_fileoffset_t), 1, fpdb);
-         vOffsets.push_back(tmpoffset);
+         const vector<comet_fileoffset_t> &vList = ReadProteinList(fpdb, it->lWhichProtein);
+
+         vOffsets.insert(vOffsets.end(), vList.begin(), vList.end());
       }
 
+      sort(vOffsets.begin(), vOffsets.end());
+      vOffsets.erase(unique(vOffsets.begin(), vOffsets.end()), vOffsets.end());
+      lSize = (long)vOffsets.size();
+
       for (long x = 0; x < lSize; x++)
       {
          if (x > g_staticParams.options.iMaxDuplicateProteins)
             break;
 
-         comet_fseek(fpdb, vOffsets.at(x), SEEK_SET);
-         fscanf(fpdb, "%511s", szProteinName);  // WIDTH_REFERENCE-1
-         szProteinName[511] = '\0';
+         strcpy(szProteinName, ReadProteinName(fpdb, vOffsets.at(x)).c_str());
    
          if (bDecoy)
          {
@@ -282,11 +296,7 @@ void CometMassSpecUtils::GetProteinNameString(FILE *fpdb,
          {
             for (it=pOutput[iWhichResult].pWhichProtein.begin(); it!=pOutput[iWhichResult].pWhichProtein.end(); ++it)
             {
-               comet_fseek(fpdb, (*it).lWhichProtein, SEEK_SET);
-               fscanf(fpdb, "%511s", szProteinName);  // WIDTH_REFERENCE-1
-               szProteinName[511] = '\0';
-
-               vProteinTargets.push_back(szProteinName);
+               vProteinTargets.push_back(ReadProteinName(fpdb, (*it).lWhichProtein));
                iPrintDuplicateProteinCt++;
                if (iPrintDuplicateProteinCt > g_staticParams.options.iMaxDuplicateProteins)
                   break;
@@ -305,9 +315,7 @@ void CometMassSpecUtils::GetProteinNameString(FILE *fpdb,
                if (iPrintDuplicateProteinCt > g_staticParams.options.iMaxDuplicateProteins)
                   break;
    
-               comet_fseek(fpdb, (*it).lWhichProtein, SEEK_SET);
-               fscanf(fpdb, "%511s", szProteinName);  // WIDTH_REFERENCE-1
-               szProteinName[511] = '\0';
+               strcpy(szProteinName, ReadProteinName(fpdb, (*it).lWhichProtein).c_str());
    
                if (strlen(szProteinName) + iLenDecoyPrefix >= WIDTH_REFERENCE)
                   szProteinName[strlen(szProteinName) - iLenDecoyPrefix] = '\0';
@@ -319,6 +327,223 @@ void CometMassSpecUtils::GetProteinNameString(FILE *fpdb,
          }
       }
    }
+
+   Threading::UnlockMutex(g_proteinCacheMutex);
+}
+
+
+// Read every protein name of the database into the cache so that output does
+// not seek for each one.  Version 1 .idx files have no protein name section;
+// their names are still cached as they are read.
+void CometMassSpecUtils::PreloadProteinNames(FILE *fpdb)
+{
+   Threading::LockMutex(g_proteinCacheMutex);
+
+   if (!_bProteinNamesPreloaded)
+   {
+      if (g_staticParams.bIndexDb)
+         PreloadIndexProteinNames(fpdb);
+      else
+         PreloadFastaProteinNames(fpdb);
+
+      _bProteinNamesPreloaded = true;
+   }
+
+   Threading::UnlockMutex(g_proteinCacheMutex);
+}
+
+
+void CometMassSpecUtils::ClearProteinCache(void)
+{
+   Threading::LockMutex(g_proteinCacheMutex);
+
+   map<comet_fileoffset_t, string>().swap(_mapProteinNames);
+   map<comet_fileoffset_t, string>().swap(_mapProteinSequences);
+   map<comet_fileoffset_t, vector<comet_fileoffset_t> >().swap(_mapProteinLists);
+   _bProteinNamesPreloaded = false;
+
+   Threading::UnlockMutex(g_proteinCacheMutex);
+}
+
+
+// return the protein name at a file position:  a FASTA description line after
+// its '>' or an .idx WIDTH_REFERENCE protein name; caller holds g_proteinCacheMutex
+const string& CometMassSpecUtils::ReadProteinName(FILE *fpdb,
+                                                  comet_fileoffset_t lFilePosition)
+{
+   map<comet_fileoffset_t, string>::iterator itName = _mapProteinNames.find(lFilePosition);
+
+   if (itName != _mapProteinNames.end())
+      return itName->second;
+
+   char szProteinName[WIDTH_REFERENCE];
+
+   szProteinName[0] = '\0';
+   comet_fseek(fpdb, lFilePosition, SEEK_SET);
+
+   if (g_staticParams.bIndexDb)
+   {
+      char szTmp[WIDTH_REFERENCE];
+
+      if (fread(szTmp, sizeof(char)*WIDTH_REFERENCE, 1, fpdb) == 1)
+      {
+         szTmp[WIDTH_REFERENCE-1] = '\0';
+         sscanf(szTmp, "%511s", szProteinName);  // WIDTH_REFERENCE-1
+      }
+   }
+   else
+   {
+      fscanf(fpdb, "%511s", szProteinName);  // WIDTH_REFERENCE-1
+      szProteinName[511] = '\0';
+   }
+
+   return _mapProteinNames[lFilePosition] = szProteinName;
+}
+
+
+// return the file positions of the protein names in an .idx protein list;
+// caller holds g_proteinCacheMutex
+const vector<comet_fileoffset_t>& CometMassSpecUtils::ReadProteinList(FILE *fpdb,
+                                                                      comet_fileoffset_t lFilePosition)
+{
+   map<comet_fileoffset_t, vector<comet_fileoffset_t> >::iterator itList = _mapProteinLists.find(lFilePosition);
+
+   if (itList != _mapProteinLists.end())
+      return itList->second;
+
+   vector<comet_fileoffset_t> &vOffsets = _mapProteinLists[lFilePosition];
+   long lSize = 0;
+
+   comet_fseek(fpdb, lFilePosition, SEEK_SET);
+
+   if (fread(&lSize, sizeof(long), 1, fpdb) == 1 && lSize > 0)
+   {
+      vOffsets.resize(lSize);
+      if (fread(&vOffsets[0], sizeof(comet_fileoffset_t), lSize, fpdb) != (size_t)lSize)
+         vOffsets.clear();
+   }
+
+   return vOffsets;
+}
+
+
+// Cache the WIDTH_REFERENCE names of INDEX_SECTION_PROTEIN_NAMES in the base
+// segment and in each delta segment of a version 2 to 4 .idx file.
+void CometMassSpecUtils::PreloadIndexProteinNames(FILE *fpdb)
+{
+   comet_fseek(fpdb, 0, SEEK_END);
+   comet_fileoffset_t lFileSize = comet_ftell(fpdb);
+   comet_fileoffset_t lStart = 0;
+   vector<char> vNames;
+
+   while (lStart + 16 <= lFileSize)
+   {
+      IndexFileHeader header;
+
+      memset(&header, 0, sizeof(IndexFileHeader));
+      comet_fseek(fpdb, lStart, SEEK_SET);
+      if (fread(&header, 16, 1, fpdb) != 1
+            || memcmp(header.szMagic, INDEX_FILE_MAGIC, 8)
+            || header.uiHeaderSize > sizeof(IndexFileHeader)
+            || header.uiHeaderSize < 16)
+      {
+         break;
+      }
+
+      comet_fseek(fpdb, lStart, SEEK_SET);
+      if (fread(&header, header.uiHeaderSize, 1, fpdb) != 1)
+         break;
+
+      IndexFileSection &names = header.sections[INDEX_SECTION_PROTEIN_NAMES];
+      size_t tNumNames = (size_t)(names.tSize / WIDTH_REFERENCE);
+
+      if (tNumNames > 0 && (comet_fileoffset_t)(names.tOffset + names.tSize) <= lFileSize)
+      {
+         vNames.resize(tNumNames * WIDTH_REFERENCE);
+         comet_fseek(fpdb, names.tOffset, SEEK_SET);
+         if (fread(&vNames[0], WIDTH_REFERENCE, tNumNames, fpdb) != tNumNames)
+            break;
+
+         for (size_t i = 0; i < tNumNames; i++)
+         {
+            char *pName = &vNames[i * WIDTH_REFERENCE];
+            char szProteinName[WIDTH_REFERENCE];
+
+            pName[WIDTH_REFERENCE-1] = '\0';
+            szProteinName[0] = '\0';
+            sscanf(pName, "%511s", szProteinName);  // WIDTH_REFERENCE-1
+            _mapProteinNames[names.tOffset + i * WIDTH_REFERENCE] = szProteinName;
+         }
+      }
+
+      if (header.uiVersion < 4)
+         break;
+
+      // the next delta segment starts on the 8 byte boundary after this one's sections
+      comet_fileoffset_t lEnd = lStart + header.uiHeaderSize;
+      for (int i = 0; i < INDEX_SECTION_COUNT; i++)
+      {
+         if ((comet_fileoffset_t)(header.sections[i].tOffset + header.sections[i].tSize) > lEnd)
+            lEnd = (comet_fileoffset_t)(header.sections[i].tOffset + header.sections[i].tSize);
+      }
+      lStart = (lEnd + 7) / 8 * 8;
+   }
+}
+
+
+// Cache the name of every FASTA entry, keyed by the file position after its '>'
+// as stored in lProteinFilePosition.  The file is read in blocks.
+void CometMassSpecUtils::PreloadFastaProteinNames(FILE *fpdb)
+{
+   const size_t tBlockSize = 1048576;
+   vector<char> vBlock(tBlockSize);
+   comet_fileoffset_t lBlockStart = 0;
+   comet_fileoffset_t lNamePosition = 0;
+   bool bLineStart = true;
+   int iNameState = 0;     // 0 = not in a description line, 1 = before the name, 2 = in the name
+   string strName;
+   size_t tRead;
+
+   comet_fseek(fpdb, 0, SEEK_SET);
+
+   while ((tRead = fread(&vBlock[0], 1, tBlockSize, fpdb)) > 0)
+   {
+      for (size_t i = 0; i < tRead; i++)
+      {
+         char c = vBlock[i];
+
+         if (iNameState == 1)
+         {
+            if (!isspace((unsigned char)c))
+            {
+               strName = c;
+               iNameState = 2;
+            }
+         }
+         else if (iNameState == 2)
+         {
+            if (isspace((unsigned char)c))
+            {
+               _mapProteinNames[lNamePosition] = strName;
+               iNameState = 0;
+            }
+            else if (strName.size() < WIDTH_REFERENCE - 1)
+               strName += c;
+         }
+         else if (c == '>' && bLineStart)
+         {
+            lNamePosition = lBlockStart + (comet_fileoffset_t)i + 1;
+            iNameState = 1;
+         }
+
+         bLineStart = (c == '\n' || c == '\r');
+      }
+
+      lBlockStart += (comet_fileoffset_t)tRead;
+   }
+
+   if (iNameState == 2)
+      _mapProteinNames[lNamePosition] = strName;
 }
 
 
@@ -54,11 +54,30 @@ public:
                                     vector<string>& vProteinTargets,  // the target protein names
                                     vector<string>& vProteinDecoys);  // the decoy protein names if applicable
 
+   // Protein names, sequences and .idx protein lists read for output are cached by
+   // file position until ClearProteinCache(); the Get functions above lock
+   // g_proteinCacheMutex around the cache and fpdb.
+   static void PreloadProteinNames(FILE *fpdb);
+   static void ClearProteinCache(void);
+
    static string GetField(std::string *s,
                           unsigned int n,
                           char cDelimeter);
 
    static void EscapeString(std::string& data);
+
+private:
+   static const string& ReadProteinName(FILE *fpdb,
+                                        comet_fileoffset_t lFilePosition);
+   static const vector<comet_fileoffset_t>& ReadProteinList(FILE *fpdb,
+                                                            comet_fileoffset_t lFilePosition);
+   static void PreloadIndexProteinNames(FILE *fpdb);
+   static void PreloadFastaProteinNames(FILE *fpdb);
+
+   static map<comet_fileoffset_t, string> _mapProteinNames;       // name file position to name
+   static map<comet_fileoffset_t, string> _mapProteinSequences;   // FASTA entry file position to sequence
+   static map<comet_fileoffset_t, vector<comet_fileoffset_t> > _mapProteinLists;   // .idx protein list to name file positions
+   static bool _bProteinNamesPreloaded;
 };
 
 #endif // _COMETMASSSPECUTILS_H_
@@ -110,7 +110,7 @@ void CometPostAnalysis::AnalyzeSP(int i)
    // Target search
    CalculateSP(pQuery->_pResults, i, iSize);
 
-   std::sort(pQuery->_pResults, pQuery->_pResults + iSize, SortFnSp);
+   SortResults(pQuery->_pResults, iSize, SortFnSp);
 
    pQuery->_pResults[0].iRankSp = 1;
 
@@ -124,7 +124,7 @@ void CometPostAnalysis::AnalyzeSP(int i)
    }
 
    // Then sort each entry by xcorr
-   std::sort(pQuery->_pResults, pQuery->_pResults + iSize, SortFnXcorr);
+   SortResults(pQuery->_pResults, iSize, SortFnXcorr);
 
    // if mod search, now sort peptides with same score but different mod locations
    if (g_staticParams.variableModParameters.bVarModSearch)
@@ -143,7 +143,7 @@ void CometPostAnalysis::AnalyzeSP(int i)
 
          if (j>ii+1)
          {
-            std::sort(pQuery->_pResults + ii, pQuery->_pResults + j, SortFnMod);
+            SortResults(pQuery->_pResults + ii, j - ii, SortFnMod);
          }
 
          ii=j-1;
@@ -160,7 +160,7 @@ void CometPostAnalysis::AnalyzeSP(int i)
 
       CalculateSP(pQuery->_pDecoys, i, iSize);
 
-      std::sort(pQuery->_pDecoys, pQuery->_pDecoys + iSize, SortFnSp);
+      SortResults(pQuery->_pDecoys, iSize, SortFnSp);
       pQuery->_pDecoys[0].iRankSp = 1;
 
       for (int ii=1; ii<iSize; ii++)
@@ -173,7 +173,7 @@ void CometPostAnalysis::AnalyzeSP(int i)
       }
 
       // Then sort each entry by xcorr
-      std::sort(pQuery->_pDecoys, pQuery->_pDecoys + iSize, SortFnXcorr);
+      SortResults(pQuery->_pDecoys, iSize, SortFnXcorr);
 
       // if mod search, now sort peptides with same score but different mod locations
       if (g_staticParams.variableModParameters.bVarModSearch)
@@ -190,7 +190,7 @@ void CometPostAnalysis::AnalyzeSP(int i)
 
             if (j>ii+1)
             {
-               std::sort(pQuery->_pDecoys + ii, pQuery->_pDecoys + j, SortFnMod);
+               SortResults(pQuery->_pDecoys + ii, j - ii, SortFnMod);
             }
 
             ii=j-1;
@@ -309,10 +309,10 @@ void CometPostAnalysis::CalculateSP(Results *pOutput,
             if (g_staticParams.variableModParameters.bVarModSearch)
             {
                if (pOutput[i].piVarModSites[ii] != 0)
-                  dBion += pOutput[i].pdVarModSites[ii];
+                  dBion += pOutput[i].VarModMass(ii);
 
                if (pOutput[i].piVarModSites[iPos] != 0)
-                  dYion += pOutput[i].pdVarModSites[iPos];
+                  dYion += pOutput[i].VarModMass(iPos);
             }
 
             pdAAforward[ii] = dBion;
@@ -382,6 +382,48 @@ bool CometPostAnalysis::ProteinEntryCmp(const struct ProteinEntryStruct &a,
 }
 
 
+// Sorts an array of Results by sorting an index vector and then applying the
+// resulting permutation once, so each (large) Results entry is moved at most
+// once instead of being swapped repeatedly inside std::sort.
+void CometPostAnalysis::SortResults(Results *pResults,
+                                    int iSize,
+                                    bool (*SortFn)(const Results &, const Results &))
+{
+   if (iSize < 2)
+      return;
+
+   vector<int> vIndex(iSize);
+   for (int i=0; i<iSize; i++)
+      vIndex[i] = i;
+
+   std::sort(vIndex.begin(), vIndex.end(),
+         [pResults, SortFn](int a, int b) { return SortFn(pResults[a], pResults[b]); });
+
+   // vIndex[i] is the original position of the entry that belongs at i;
+   // walk each permutation cycle once
+   for (int i=0; i<iSize; i++)
+   {
+      if (vIndex[i] == i || vIndex[i] < 0)
+         continue;
+
+      Results tmp = std::move(pResults[i]);
+      int iDest = i;
+      int iSrc = vIndex[i];
+
+      while (iSrc != i)
+      {
+         pResults[iDest] = std::move(pResults[iSrc]);
+         vIndex[iDest] = -1;
+         iDest = iSrc;
+         iSrc = vIndex[iSrc];
+      }
+
+      pResults[iDest] = std::move(tmp);
+      vIndex[iDest] = -1;
+   }
+}
+
+
 bool CometPostAnalysis::SortFnSp(const Results &a,
                                  const Results &b)
 {
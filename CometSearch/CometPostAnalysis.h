@@ -49,6 +49,9 @@ private:
    static void CalculateSP(Results *pOutput,
                            int iWhichQuery,
                            int iSize);
+   static void SortResults(Results *pResults,
+                           int iSize,
+                           bool (*SortFn)(const Results &, const Results &));
    static bool SortFnSp(const Results &a,
                         const Results &b);
 
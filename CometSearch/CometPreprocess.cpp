@@ -20,12 +20,15 @@
 #include "CometStatus.h"
 
 Mutex CometPreprocess::_maxChargeMutex;
-bool CometPreprocess::_bDoneProcessingAllSpectra;
+std::atomic<bool> CometPreprocess::_bDoneProcessingAllSpectra;
 bool CometPreprocess::_bFirstScan;
 bool *CometPreprocess::pbMemoryPool;
-double **CometPreprocess::ppdTmpRawDataArr;
-double **CometPreprocess::ppdTmpFastXcorrDataArr;
-double **CometPreprocess::ppdTmpCorrelationDataArr;
+PreprocessScratch *CometPreprocess::pScratchArr;
+vector<Query*> *CometPreprocess::_pvLoadQuery = &g_pvQuery;
+int CometPreprocess::_iLoadMaxFragmentCharge;
+vector<Query*> CometPreprocess::_vPrefetchQuery;
+std::thread CometPreprocess::_prefetchThread;
+bool CometPreprocess::_bPrefetchSucceeded;
 
 // Generate data for both sp scoring (pfSpScoreData) and xcorr analysis (FastXcorr).
 CometPreprocess::CometPreprocess()
@@ -48,6 +51,89 @@ bool CometPreprocess::LoadAndPreprocessSpectra(MSReader &mstReader,
                                                int iLastScan,
                                                int iAnalysisType,
                                                ThreadPool* tp)
+{
+   g_staticParams.precalcMasses.iMinus17 = BIN(g_staticParams.massUtility.dH2O);
+   g_staticParams.precalcMasses.iMinus18 = BIN(g_staticParams.massUtility.dNH3);
+
+   _pvLoadQuery = &g_pvQuery;
+
+   bool bSucceeded = LoadSpectra(mstReader, iFirstScan, iLastScan, iAnalysisType, tp);
+
+   g_massRange.iMaxFragmentCharge = _iLoadMaxFragmentCharge;
+
+   return bSucceeded;
+}
+
+
+// Reads and preprocesses the next spectrum batch on a reader thread so that it
+// overlaps the search, post analysis and output of the batch in g_pvQuery.
+// Only one batch is prefetched at a time; FinishPrefetch() must be called
+// before the next StartPrefetch().  The reader thread preprocesses inline so
+// it does not compete with the search for the thread pool.
+void CometPreprocess::StartPrefetch(MSReader &mstReader,
+                                    int iFirstScan,
+                                    int iLastScan,
+                                    int iAnalysisType)
+{
+   _pvLoadQuery = &_vPrefetchQuery;
+   _bPrefetchSucceeded = false;
+
+   _prefetchThread = std::thread(PrefetchThreadProc, &mstReader, iFirstScan, iLastScan, iAnalysisType);
+}
+
+
+void CometPreprocess::PrefetchThreadProc(MSReader *pReader,
+                                         int iFirstScan,
+                                         int iLastScan,
+                                         int iAnalysisType)
+{
+   _bPrefetchSucceeded = LoadSpectra(*pReader, iFirstScan, iLastScan, iAnalysisType, NULL);
+}
+
+
+bool CometPreprocess::PrefetchPending()
+{
+   return _prefetchThread.joinable();
+}
+
+
+// Waits for the prefetched batch and moves it into the (empty) g_pvQuery.
+bool CometPreprocess::FinishPrefetch()
+{
+   _prefetchThread.join();
+
+   g_pvQuery.swap(_vPrefetchQuery);
+   g_massRange.iMaxFragmentCharge = _iLoadMaxFragmentCharge;
+   _pvLoadQuery = &g_pvQuery;
+
+   return _bPrefetchSucceeded;
+}
+
+
+// Waits for a pending prefetch and frees its spectra; used when the search
+// stops before the prefetched batch is searched.
+void CometPreprocess::DiscardPrefetch()
+{
+   if (!PrefetchPending())
+      return;
+
+   _prefetchThread.join();
+
+   for (std::vector<Query*>::iterator it = _vPrefetchQuery.begin(); it != _vPrefetchQuery.end(); ++it)
+      delete *it;
+
+   _vPrefetchQuery.clear();
+   _pvLoadQuery = &g_pvQuery;
+}
+
+
+// Reads spectra into *_pvLoadQuery until the batch is full.  Spectra are
+// preprocessed on tp, or inline on the calling thread if tp is NULL.
+bool CometPreprocess::LoadSpectra(MSReader &mstReader,
+                                  int iFirstScan,
+                                  int iLastScan,
+                                  int iAnalysisType,
+                                  ThreadPool* tp)
 {
    int iFileLastScan = -1;         // The actual last scan in the file.
    int iScanNumber = 0;
@@ -56,11 +142,9 @@ bool CometPreprocess::LoadAndPreprocessSpectra(MSReader &mstReader,
    int iTmpCount = 0;
    Spectrum mstSpectrum;           // For holding spectrum.
 
-   g_massRange.iMaxFragmentCharge = 0;
-   g_staticParams.precalcMasses.iMinus17 = BIN(g_staticParams.massUtility.dH2O);
-   g_staticParams.precalcMasses.iMinus18 = BIN(g_staticParams.massUtility.dNH3);
+   _iLoadMaxFragmentCharge = 0;
 
-   // Create the mutex we will use to protect g_massRange.iMaxFragmentCharge.
+   // Create the mutex we will use to protect _iLoadMaxFragmentCharge.
    Threading::CreateMutex(&_maxChargeMutex);
 
    // Get the thread pool of threads that will preprocess the data.
@@ -136,6 +220,9 @@ bool CometPreprocess::LoadAndPreprocessSpectra(MSReader &mstReader,
          {
             int i=0;
 
+            // The cleared peak count is needed here so these peaks cannot wait for PreprocessThreadProc.
+            mstSpectrum.decodePeaks();
+
             while (true)
             {
                 if (i >= mstSpectrum.size() || mstSpectrum.at(i).mz > g_staticParams.options.clearMzRange.dEnd)
@@ -152,7 +239,8 @@ bool CometPreprocess::LoadAndPreprocessSpectra(MSReader &mstReader,
             }
          }
 
-         if (mstSpectrum.size()-iNumClearedPeaks >= g_staticParams.options.iMinPeaks)
+         // Peaks of mzML/mzXML spectra are still encoded (sizeEncoded) until PreprocessThreadProc.
+         if (mstSpectrum.size() + mstSpectrum.sizeEncoded() - iNumClearedPeaks >= g_staticParams.options.iMinPeaks)
          {
             if (iAnalysisType == AnalysisType_SpecificScanRange && iLastScan > 0 && iScanNumber > iLastScan)
             {
@@ -163,17 +251,15 @@ bool CometPreprocess::LoadAndPreprocessSpectra(MSReader &mstReader,
             if (CheckActivationMethodFilter(mstSpectrum.getActivationMethod()))
             {
                // add this hack when 1 thread is specified otherwise g_pvQuery.size() returns 0
-               if (g_staticParams.options.iNumThreads == 1)
+               if (g_staticParams.options.iNumThreads == 1 && pPreprocessThreadPool != NULL)
                   pPreprocessThreadPool->wait_on_threads();
 
                Threading::LockMutex(g_pvQueryMutex);
                // this needed because processing can add multiple spectra at a time
-               iNumSpectraLoaded = (int)g_pvQuery.size();
+               iNumSpectraLoaded = (int)_pvLoadQuery->size();
                iNumSpectraLoaded++;
                Threading::UnlockMutex(g_pvQueryMutex);
 
-               pPreprocessThreadPool->wait_for_available_thread();
-
                //-->MH
                //If there are no Z-lines, filter the spectrum for charge state
                //run filter here.
@@ -181,7 +267,15 @@ bool CometPreprocess::LoadAndPreprocessSpectra(MSReader &mstReader,
                PreprocessThreadData *pPreprocessThreadData =
                   new PreprocessThreadData(mstSpectrum, iAnalysisType, iFileLastScan);
 
-               pPreprocessThreadPool->doJob(std::bind(PreprocessThreadProc, pPreprocessThreadData, pPreprocessThreadPool));
+               if (pPreprocessThreadPool == NULL)
+               {
+                  PreprocessThreadProc(pPreprocessThreadData, NULL);
+               }
+               else
+               {
+                  pPreprocessThreadPool->wait_for_available_thread();
+                  pPreprocessThreadPool->doJob(std::bind(PreprocessThreadProc, pPreprocessThreadData, pPreprocessThreadPool));
+               }
             }
          }
 
@@ -226,7 +320,8 @@ bool CometPreprocess::LoadAndPreprocessSpectra(MSReader &mstReader,
 
    // Wait for active preprocess threads to complete processing.
 
-   pPreprocessThreadPool->wait_on_threads();
+   if (pPreprocessThreadPool != NULL)
+      pPreprocessThreadPool->wait_on_threads();
 
    Threading::DestroyMutex(_maxChargeMutex);
 
@@ -267,10 +362,10 @@ void CometPreprocess::PreprocessThreadProc(PreprocessThreadData *pPreprocessThre
    //MH: Give memory manager access to the thread.
    pPreprocessThreadData->SetMemory(&pbMemoryPool[i]);
 
-   PreprocessSpectrum(pPreprocessThreadData->mstSpectrum,
-         ppdTmpRawDataArr[i],
-         ppdTmpFastXcorrDataArr[i],
-         ppdTmpCorrelationDataArr[i]);
+   // Decode the peaks MSReader left encoded; this is the bulk of reading an mzML/mzXML spectrum.
+   pPreprocessThreadData->mstSpectrum.decodePeaks();
+
+   PreprocessSpectrum(pPreprocessThreadData->mstSpectrum, &pScratchArr[i]);
 
    delete pPreprocessThreadData;
    pPreprocessThreadData = NULL;
@@ -284,54 +379,16 @@ bool CometPreprocess::DoneProcessingAllSpectra()
 
 
 bool CometPreprocess::Preprocess(struct Query *pScoring,
-                                 Spectrum mstSpectrum,
-                                 double *pdTmpRawData,
-                                 double *pdTmpFastXcorrData,
-                                 double *pdTmpCorrelationData)
+                                 Spectrum &mstSpectrum,
+                                 PreprocessScratch *pScratch)
 {
-   int i;
-   int x;
-   int y;
-   struct msdata pTmpSpData[NUM_SP_IONS];
    struct PreprocessStruct pPre;
 
    pPre.iHighestIon = 0;
    pPre.dHighestIntensity = 0;
 
-   //MH: Find appropriately sized array cushion based on user parameters. Fixes error found by Patrick Pedrioli for
-   // very wide mass tolerance searches (i.e. 500 Da).
-   double dCushion = 0.0;
-   if (g_staticParams.tolerances.iMassToleranceUnits == 0) // amu
-   {
-      dCushion = g_staticParams.tolerances.dInputTolerance;
-
-      if (g_staticParams.tolerances.iMassToleranceType == 1)  // precursor m/z tolerance
-      {
-        dCushion *= 8; //MH: hope +8 is large enough charge because g_staticParams.options.iEndCharge can be overridden.
-      }
-   }
-   else if (g_staticParams.tolerances.iMassToleranceUnits == 1) // mmu
-   {
-      dCushion = g_staticParams.tolerances.dInputTolerance * 0.001;
-
-      if (g_staticParams.tolerances.iMassToleranceType == 1)  // precursor m/z tolerance
-      {
-         dCushion *= 8; //MH: hope +8 is large enough charge because g_staticParams.options.iEndCharge can be overridden.
-      }
-   }
-   else // ppm
-   {
-      dCushion = g_staticParams.tolerances.dInputTolerance * g_staticParams.options.dPeptideMassHigh / 1000000.0;
-   }
-
-   // initialize these temporary arrays before re-using
-   size_t iTmp= (size_t)((g_staticParams.options.dPeptideMassHigh + dCushion + 2.0) * g_staticParams.dInverseBinWidth)*sizeof(double);
-   memset(pdTmpRawData, 0, iTmp);
-   memset(pdTmpFastXcorrData, 0, iTmp);
-   memset(pdTmpCorrelationData, 0, iTmp);
-
-   // pdTmpRawData is a binned array holding raw data
-   if (!LoadIons(pScoring, pdTmpRawData, mstSpectrum, &pPre))
+   // pScratch->vRawPeaks holds the binned raw data
+   if (!LoadIons(pScoring, pScratch, mstSpectrum, &pPre))
    {
       return false;
    }
@@ -343,14 +400,48 @@ bool CometPreprocess::Preprocess(struct Query *pScoring,
    else
       pScoring->_spectrumInfoInternal.szNativeID[0]='\0';
 
+   return PreprocessPeaks(pScoring, pScratch, &pPre);
+}
+
+
+// Builds the sparse xcorr, neutral loss and sp matrices (and their flat copies with
+// "flat_xcorr") from the binned peaks in pScratch->vRawPeaks.  Only the bins around
+// the peaks are visited, so the work scales with the peak count, not iArraySize.
+bool CometPreprocess::PreprocessPeaks(struct Query *pScoring,
+                                      PreprocessScratch *pScratch,
+                                      struct PreprocessStruct *pPre)
+{
+   int i;
+   int iArraySize = pScoring->_spectrumInfoInternal.iArraySize;
+   struct msdata pTmpSpData[NUM_SP_IONS];
+   bool bUseNL = g_staticParams.ionInformation.bUseWaterAmmoniaLoss
+         && (g_staticParams.ionInformation.iIonVal[ION_SERIES_A]
+            || g_staticParams.ionInformation.iIonVal[ION_SERIES_B]
+            || g_staticParams.ionInformation.iIonVal[ION_SERIES_Y]);
+
+   // Create data for correlation analysis.
+   // vRawPeaks intensities are normalized to 100; vCorrPeaks is windowed
+   MakeCorrData(pScratch, pScoring, pPre);
+
+   // Make fast xcorr spectrum; corr - fast xcorr is kept for the runs of bins around the peaks.
+   MakeFastXcorrRuns(pScratch, iArraySize);
+
+   pScoring->iFastXcorrDataSize = (iArraySize / SPARSE_MATRIX_SIZE) + 1;
+
+   if (g_staticParams.options.bFlatXcorr)
+      pScoring->iFlatXcorrDataSize = ((iArraySize + 15) / 16) * 16;
+
    try
    {
-      pScoring->pfFastXcorrData = new float[pScoring->_spectrumInfoInternal.iArraySize]();
+      pScoring->ppfSparseFastXcorrData = new float*[pScoring->iFastXcorrDataSize]();
+
+      if (bUseNL)
+         pScoring->ppfSparseFastXcorrDataNL = new float*[pScoring->iFastXcorrDataSize]();
    }
    catch (std::bad_alloc& ba)
    {
       char szErrorMsg[256];
-      sprintf(szErrorMsg,  " Error - new(pfFastXcorrData[%d]). bad_alloc: %s.\n", pScoring->_spectrumInfoInternal.iArraySize, ba.what());
+      sprintf(szErrorMsg,  " Error - new(pScoring->ppfSparseFastXcorrData[%d]). bad_alloc: %s.\n", pScoring->iFastXcorrDataSize, ba.what());
       sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
       sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to address mitigate memory use.\n");
       string strErrorMsg(szErrorMsg);
@@ -359,164 +450,114 @@ bool CometPreprocess::Preprocess(struct Query *pScoring,
       return false;
    }
 
-   if (g_staticParams.ionInformation.bUseWaterAmmoniaLoss
-         && (g_staticParams.ionInformation.iIonVal[ION_SERIES_A]
-            || g_staticParams.ionInformation.iIonVal[ION_SERIES_B]
-            || g_staticParams.ionInformation.iIonVal[ION_SERIES_Y]))
+   // Outside the runs the xcorr data is only rounding residue and is dropped by the
+   // FLOAT_ZERO test; the neutral loss data also picks up the runs 17 and 18 Da lower.
+   vector<pair<int, int> > &vOutputBins = pScratch->vOutputBins;
+   vOutputBins.clear();
+
+   for (size_t t=0; t<pScratch->vRuns.size(); t++)
    {
-      try
+      vOutputBins.push_back(make_pair(pScratch->vRuns[t].iStart, pScratch->vRuns[t].iEnd));
+
+      if (bUseNL)
       {
-         pScoring->pfFastXcorrDataNL = new float[pScoring->_spectrumInfoInternal.iArraySize]();
-      }
-      catch (std::bad_alloc& ba)
-      {
-         char szErrorMsg[256];
-         sprintf(szErrorMsg,  " Error - new(pfFastXcorrDataNL[%d]). bad_alloc: %s.\n", pScoring->_spectrumInfoInternal.iArraySize, ba.what());
-         sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
-         sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to address mitigate memory use.\n");
-         string strErrorMsg(szErrorMsg);
-         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-         logerr(szErrorMsg);
-         return false;
+         vOutputBins.push_back(make_pair(pScratch->vRuns[t].iStart + g_staticParams.precalcMasses.iMinus17,
+                  pScratch->vRuns[t].iEnd + g_staticParams.precalcMasses.iMinus17));
+         vOutputBins.push_back(make_pair(pScratch->vRuns[t].iStart + g_staticParams.precalcMasses.iMinus18,
+                  pScratch->vRuns[t].iEnd + g_staticParams.precalcMasses.iMinus18));
       }
    }
 
-   // Create data for correlation analysis.
-   // pdTmpRawData intensities are normalized to 100; pdTmpCorrelationData is windowed
-   MakeCorrData(pdTmpRawData, pdTmpCorrelationData, pScoring, &pPre);
+   sort(vOutputBins.begin(), vOutputBins.end());
 
-   // Make fast xcorr spectrum.
-   double dSum=0.0;
-   int iTmpRange = 2*g_staticParams.iXcorrProcessingOffset + 1;
-   double dTmp = 1.0 / (double)(iTmpRange - 1);
+   size_t ptRun[5] = {0, 0, 0, 0, 0};  // GetRunValue() cursors for bins i, i-1, i+1, i-17 Da, i-18 Da
+   int iLastBin = 0;
 
-   dSum=0.0;
-   for (i=0; i<g_staticParams.iXcorrProcessingOffset; i++)
-      dSum += pdTmpCorrelationData[i];
-   for (i=g_staticParams.iXcorrProcessingOffset; i < pScoring->_spectrumInfoInternal.iArraySize + g_staticParams.iXcorrProcessingOffset; i++)
+   for (size_t t=0; t<vOutputBins.size(); t++)
    {
-      if (i<pScoring->_spectrumInfoInternal.iArraySize)
-         dSum += pdTmpCorrelationData[i];
-      if (i>=iTmpRange)
-         dSum -= pdTmpCorrelationData[i-iTmpRange];
-      pdTmpFastXcorrData[i-g_staticParams.iXcorrProcessingOffset] = (dSum - pdTmpCorrelationData[i-g_staticParams.iXcorrProcessingOffset])* dTmp;
-   }
+      int iEnd = min(vOutputBins[t].second, iArraySize - 1);
 
-   pScoring->pfFastXcorrData[0] = 0.0;
-   for (i=1; i<pScoring->_spectrumInfoInternal.iArraySize; i++)
-   {
-      double dTmp = pdTmpCorrelationData[i] - pdTmpFastXcorrData[i];
-
-      pScoring->pfFastXcorrData[i] = (float)dTmp;
-
-      // Add flanking peaks if used
-      if (g_staticParams.ionInformation.iTheoreticalFragmentIons == 0)
+      for (i=max(vOutputBins[t].first, iLastBin + 1); i<=iEnd; i++)
       {
-         int iTmp;
+         float fXcorr = (float)GetRunValue(pScratch, i, &ptRun[0]);
+
+         // Add flanking peaks if used
+         if (g_staticParams.ionInformation.iTheoreticalFragmentIons == 0)
+         {
+            fXcorr += (float)(GetRunValue(pScratch, i-1, &ptRun[1]) * 0.5);
 
-         iTmp = i-1;
-         pScoring->pfFastXcorrData[i] += (float) ((pdTmpCorrelationData[iTmp] - pdTmpFastXcorrData[iTmp])*0.5);
+            if (i+1 < iArraySize)
+               fXcorr += (float)(GetRunValue(pScratch, i+1, &ptRun[2]) * 0.5);
+         }
 
-         iTmp = i+1;
-         if (iTmp < pScoring->_spectrumInfoInternal.iArraySize)
-            pScoring->pfFastXcorrData[i] += (float) ((pdTmpCorrelationData[iTmp] - pdTmpFastXcorrData[iTmp])*0.5);
-      }
+         // If A, B or Y ions and their neutral loss selected, roll in -17/-18 contributions to the NL data
+         if (bUseNL)
+         {
+            float fXcorrNL = fXcorr;
+            int iTmp;
 
-      // If A, B or Y ions and their neutral loss selected, roll in -17/-18 contributions to pfFastXcorrDataNL
-      if (g_staticParams.ionInformation.bUseWaterAmmoniaLoss
-            && (g_staticParams.ionInformation.iIonVal[ION_SERIES_A]
-               || g_staticParams.ionInformation.iIonVal[ION_SERIES_B]
-               || g_staticParams.ionInformation.iIonVal[ION_SERIES_Y]))
-      {
-         int iTmp;
+            iTmp = i-g_staticParams.precalcMasses.iMinus17;
+            if (iTmp>= 0)
+               fXcorrNL += (float)(GetRunValue(pScratch, iTmp, &ptRun[3]) * 0.2);
 
-         pScoring->pfFastXcorrDataNL[i] = pScoring->pfFastXcorrData[i];
+            iTmp = i-g_staticParams.precalcMasses.iMinus18;
+            if (iTmp>= 0)
+               fXcorrNL += (float)(GetRunValue(pScratch, iTmp, &ptRun[4]) * 0.2);
 
-         iTmp = i-g_staticParams.precalcMasses.iMinus17;
-         if (iTmp>= 0)
-         {
-            pScoring->pfFastXcorrDataNL[i] += (float)((pdTmpCorrelationData[iTmp] - pdTmpFastXcorrData[iTmp]) * 0.2);
+            if ((fXcorrNL>FLOAT_ZERO || fXcorrNL<-FLOAT_ZERO)
+                  && !SetSparseValue(pScoring->ppfSparseFastXcorrDataNL, i, fXcorrNL, "ppfSparseFastXcorrDataNL"))
+            {
+               return false;
+            }
          }
 
-         iTmp = i-g_staticParams.precalcMasses.iMinus18;
-         if (iTmp>= 0)
+         if ((fXcorr>FLOAT_ZERO || fXcorr<-FLOAT_ZERO)
+               && !SetSparseValue(pScoring->ppfSparseFastXcorrData, i, fXcorr, "ppfSparseFastXcorrData"))
          {
-            pScoring->pfFastXcorrDataNL[i] += (float)((pdTmpCorrelationData[iTmp] - pdTmpFastXcorrData[iTmp]) * 0.2);
+            return false;
          }
 
+         iLastBin = i;
       }
    }
 
-   pScoring->iFastXcorrDataSize = (pScoring->_spectrumInfoInternal.iArraySize / SPARSE_MATRIX_SIZE) + 1;
-
-   // Using sparse matrix which means we free pScoring->pfFastXcorrData, ->pfFastXcorrDataNL here
-   // If A, B or Y ions and their neutral loss selected, roll in -17/-18 contributions to pfFastXcorrDataNL.
-   if (g_staticParams.ionInformation.bUseWaterAmmoniaLoss
-         && (g_staticParams.ionInformation.iIonVal[ION_SERIES_A]
-            || g_staticParams.ionInformation.iIonVal[ION_SERIES_B]
-            || g_staticParams.ionInformation.iIonVal[ION_SERIES_Y]))
+   if (g_staticParams.options.bFlatXcorr)
    {
-
-      try
+      if (!CreateFlatXcorrData(pScoring->ppfSparseFastXcorrData, pScoring->iFastXcorrDataSize,
+               pScoring->iFlatXcorrDataSize, &(pScoring->pfFlatFastXcorrData)))
       {
-         pScoring->ppfSparseFastXcorrDataNL = new float*[pScoring->iFastXcorrDataSize]();
-      }
-      catch (std::bad_alloc& ba)
-      {
-         char szErrorMsg[256];
-         sprintf(szErrorMsg,  " Error - new(pScoring->ppfSparseFastXcorrDataNL[%d]). bad_alloc: %s.", pScoring->iFastXcorrDataSize, ba.what());
-         sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
-         sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to address mitigate memory use.\n");
-         string strErrorMsg(szErrorMsg);
-         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-         logerr( szErrorMsg);
          return false;
       }
 
-      for (i=1; i<pScoring->_spectrumInfoInternal.iArraySize; i++)
+      if (bUseNL
+            && !CreateFlatXcorrData(pScoring->ppfSparseFastXcorrDataNL, pScoring->iFastXcorrDataSize,
+               pScoring->iFlatXcorrDataSize, &(pScoring->pfFlatFastXcorrDataNL)))
       {
-         if (pScoring->pfFastXcorrDataNL[i]>FLOAT_ZERO || pScoring->pfFastXcorrDataNL[i]<-FLOAT_ZERO)
-         {
-            x=i/SPARSE_MATRIX_SIZE;
-            if (pScoring->ppfSparseFastXcorrDataNL[x]==NULL)
-            {
-               try
-               {
-                  pScoring->ppfSparseFastXcorrDataNL[x] = new float[SPARSE_MATRIX_SIZE]();
-               }
-               catch (std::bad_alloc& ba)
-               {
-                  char szErrorMsg[256];
-                  sprintf(szErrorMsg,  " Error - new(pScoring->ppfSparseFastXcorrDataNL[%d][%d]). bad_alloc: %s.\n", x, SPARSE_MATRIX_SIZE, ba.what());
-                  sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
-                  sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to address mitigate memory use.\n");
-                  string strErrorMsg(szErrorMsg);
-                  g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-                  logerr(szErrorMsg);
-                  return false;
-               }
-               for (y=0; y<SPARSE_MATRIX_SIZE; y++)
-                  pScoring->ppfSparseFastXcorrDataNL[x][y]=0;
-            }
-            y=i-(x*SPARSE_MATRIX_SIZE);
-            pScoring->ppfSparseFastXcorrDataNL[x][y] = pScoring->pfFastXcorrDataNL[i];
-         }
+         return false;
       }
+   }
 
-      delete[] pScoring->pfFastXcorrDataNL;
-      pScoring->pfFastXcorrDataNL = NULL;
+   // Create data for sp scoring.
 
+   for (i=0; i<NUM_SP_IONS; i++)
+   {
+      pTmpSpData[i].dIon = 0.0;
+      pTmpSpData[i].dIntensity = 0.0;
    }
 
-   //MH: Fill sparse matrix
+   GetTopIons(pScratch, &(pTmpSpData[0]));
+
+   // MH: Fill sparse matrix for SpScore
+   pScoring->iSpScoreData = iArraySize / SPARSE_MATRIX_SIZE + 1;
+
    try
    {
-      pScoring->ppfSparseFastXcorrData = new float*[pScoring->iFastXcorrDataSize]();
+      pScoring->ppfSparseSpScoreData = new float*[pScoring->iSpScoreData]();
    }
    catch (std::bad_alloc& ba)
    {
       char szErrorMsg[256];
-      sprintf(szErrorMsg,  " Error - new(pScoring->ppfSparseFastXcorrData[%d]). bad_alloc: %s.\n", pScoring->iFastXcorrDataSize, ba.what());
+      sprintf(szErrorMsg,  " Error - new(pScoring->ppfSparseSpScoreData[%d]). bad_alloc: %s.\n", pScoring->iSpScoreData, ba.what());
       sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
       sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to address mitigate memory use.\n");
       string strErrorMsg(szErrorMsg);
@@ -525,120 +566,273 @@ bool CometPreprocess::Preprocess(struct Query *pScoring,
       return false;
    }
 
-   for (i=1; i<pScoring->_spectrumInfoInternal.iArraySize; i++)
+   // note that pTmpSpData[].dIon values are already BIN'd; when two entries share a bin
+   // the later one wins, so keep the last of each bin after a stable sort
+   std::stable_sort(pTmpSpData, pTmpSpData + NUM_SP_IONS, SortByIon);
+
+   for (i=0; i<NUM_SP_IONS; i++)
    {
-      if (pScoring->pfFastXcorrData[i]>FLOAT_ZERO || pScoring->pfFastXcorrData[i]<-FLOAT_ZERO)
+      if (i+1 < NUM_SP_IONS && (int)(pTmpSpData[i+1].dIon) == (int)(pTmpSpData[i].dIon))
+         continue;
+
+      float fIntensity = (float) pTmpSpData[i].dIntensity;
+
+      if (fIntensity > FLOAT_ZERO
+            && !SetSparseValue(pScoring->ppfSparseSpScoreData, (int)(pTmpSpData[i].dIon), fIntensity, "ppfSparseSpScoreData"))
       {
-         x=i/SPARSE_MATRIX_SIZE;
-         if (pScoring->ppfSparseFastXcorrData[x]==NULL)
-         {
-            try
-            {
-               pScoring->ppfSparseFastXcorrData[x] = new float[SPARSE_MATRIX_SIZE]();
-            }
-            catch (std::bad_alloc& ba)
-            {
-               char szErrorMsg[256];
-               sprintf(szErrorMsg,  " Error - new(pScoring->ppfSparseFastXcorrData[%d][%d]). bad_alloc: %s.\n", x, SPARSE_MATRIX_SIZE, ba.what());
-               sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
-               sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to address mitigate memory use.\n");
-               string strErrorMsg(szErrorMsg);
-               g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-               logerr(szErrorMsg);
-               return false;
-            }
-            for (y=0; y<SPARSE_MATRIX_SIZE; y++)
-               pScoring->ppfSparseFastXcorrData[x][y]=0;
-         }
-         y=i-(x*SPARSE_MATRIX_SIZE);
-         pScoring->ppfSparseFastXcorrData[x][y] = pScoring->pfFastXcorrData[i];
+         return false;
       }
    }
 
-   delete[] pScoring->pfFastXcorrData;
-   pScoring->pfFastXcorrData = NULL;
+   AttachSpectrumData(pScoring);
 
-   // Create data for sp scoring.
+   return true;
+}
 
-   for (i=0; i<NUM_SP_IONS; i++)
+
+// Sets one bin of a sparse matrix, allocating its row on first use.
+bool CometPreprocess::SetSparseValue(float **ppfSparseData,
+                                     int iBin,
+                                     float fValue,
+                                     const char *szName)
+{
+   int x = iBin / SPARSE_MATRIX_SIZE;
+
+   if (ppfSparseData[x] == NULL)
    {
-      pTmpSpData[i].dIon = 0.0;
-      pTmpSpData[i].dIntensity = 0.0;
+      try
+      {
+         ppfSparseData[x] = new float[SPARSE_MATRIX_SIZE]();
+      }
+      catch (std::bad_alloc& ba)
+      {
+         char szErrorMsg[256];
+         sprintf(szErrorMsg,  " Error - new(pScoring->%s[%d][%d]). bad_alloc: %s.\n", szName, x, SPARSE_MATRIX_SIZE, ba.what());
+         sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
+         sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to address mitigate memory use.\n");
+         string strErrorMsg(szErrorMsg);
+         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+         logerr(szErrorMsg);
+         return false;
+      }
    }
 
-   GetTopIons(pdTmpRawData, &(pTmpSpData[0]), pScoring->_spectrumInfoInternal.iArraySize);
+   ppfSparseData[x][iBin - x*SPARSE_MATRIX_SIZE] = fValue;
 
-   try
+   return true;
+}
+
+
+// Computes corr - fast xcorr (what used to be pdTmpCorrelationData - pdTmpFastXcorrData
+// in dense scratch arrays) for the runs of bins within iXcorrProcessingOffset+2 of a
+// correlation peak.  The sliding window sum is carried from run to run and updated in
+// the same order as the dense loop did (the empty bins it skips only added 0.0), so
+// the values are bit for bit the same.  Between two runs the window holds no peak and
+// the value is the constant dGapValue.
+void CometPreprocess::MakeFastXcorrRuns(PreprocessScratch *pScratch,
+                                        int iArraySize)
+{
+   vector<pair<int, double> > &vCorrPeaks = pScratch->vCorrPeaks;
+   size_t tNumPeaks = vCorrPeaks.size();
+   int iOffset = g_staticParams.iXcorrProcessingOffset;
+   int iTmpRange = 2*iOffset + 1;
+   int iRadius = iOffset + 2;
+   double dTmp = 1.0 / (double)(iTmpRange - 1);
+   double dSum = 0.0;
+   size_t tAdd = 0;         // next peak to enter the window
+   size_t tSubtract = 0;    // next peak to leave it
+   size_t tCorr = 0;
+   size_t t = 0;
+
+   pScratch->vRuns.clear();
+   pScratch->vdRunValues.clear();
+
+   while (t < tNumPeaks)
    {
-      pScoring->pfSpScoreData = new float[pScoring->_spectrumInfoInternal.iArraySize]();
+      PreprocessRun sRun;
+
+      sRun.iStart = max(vCorrPeaks[t].first - iRadius, 0);
+      sRun.iEnd = vCorrPeaks[t].first + iRadius;
+      t++;
+
+      while (t < tNumPeaks && vCorrPeaks[t].first - iRadius <= sRun.iEnd + 1)
+      {
+         sRun.iEnd = vCorrPeaks[t].first + iRadius;
+         t++;
+      }
+
+      if (sRun.iEnd > iArraySize - 1)
+         sRun.iEnd = iArraySize - 1;
+
+      sRun.tOffset = pScratch->vdRunValues.size();
+
+      for (int i=sRun.iStart; i<=sRun.iEnd; i++)
+      {
+         int iStep = i + iOffset;   // the dense loop index that produced bin i
+
+         // A peak enters the window at its own bin and leaves iTmpRange bins later;
+         // on the same step the dense loop added before it subtracted.
+         while (true)
+         {
+            bool bAdd = (tAdd < tNumPeaks && vCorrPeaks[tAdd].first <= iStep);
+            bool bSubtract = (tSubtract < tNumPeaks && vCorrPeaks[tSubtract].first + iTmpRange <= iStep);
+
+            if (bAdd && (!bSubtract || vCorrPeaks[tAdd].first <= vCorrPeaks[tSubtract].first + iTmpRange))
+               dSum += vCorrPeaks[tAdd++].second;
+            else if (bSubtract)
+               dSum -= vCorrPeaks[tSubtract++].second;
+            else
+               break;
+         }
+
+         while (tCorr < tNumPeaks && vCorrPeaks[tCorr].first < i)
+            tCorr++;
+
+         double dCorr = 0.0;
+         if (tCorr < tNumPeaks && vCorrPeaks[tCorr].first == i)
+            dCorr = vCorrPeaks[tCorr].second;
+
+         double dFastXcorr = (dSum - dCorr) * dTmp;
+
+         pScratch->vdRunValues.push_back(dCorr - dFastXcorr);
+      }
+
+      sRun.dGapValue = 0.0 - (dSum - 0.0) * dTmp;
+
+      pScratch->vRuns.push_back(sRun);
    }
-   catch (std::bad_alloc& ba)
+}
+
+
+// Returns corr - fast xcorr at iBin from MakeFastXcorrRuns().  *ptRun is a cursor into
+// vRuns; the bins looked up through one cursor must not decrease.
+double CometPreprocess::GetRunValue(PreprocessScratch *pScratch,
+                                    int iBin,
+                                    size_t *ptRun)
+{
+   vector<PreprocessRun> &vRuns = pScratch->vRuns;
+
+   while (*ptRun < vRuns.size() && vRuns[*ptRun].iEnd < iBin)
+      (*ptRun)++;
+
+   if (*ptRun < vRuns.size() && vRuns[*ptRun].iStart <= iBin)
+      return pScratch->vdRunValues[vRuns[*ptRun].tOffset + (iBin - vRuns[*ptRun].iStart)];
+
+   if (*ptRun == 0)
+      return 0.0;
+
+   return vRuns[*ptRun - 1].dGapValue;
+}
+
+
+// Hands the sparse and flat arrays just built for pScoring to a QuerySpectrumData so
+// they can be shared with the scan's other charge states.
+void CometPreprocess::AttachSpectrumData(struct Query *pScoring)
+{
+   QuerySpectrumData *pData = new QuerySpectrumData();
+
+   pData->iSpScoreData = pScoring->iSpScoreData;
+   pData->iFastXcorrDataSize = pScoring->iFastXcorrDataSize;
+   pData->ppfSparseSpScoreData = pScoring->ppfSparseSpScoreData;
+   pData->ppfSparseFastXcorrData = pScoring->ppfSparseFastXcorrData;
+   pData->ppfSparseFastXcorrDataNL = pScoring->ppfSparseFastXcorrDataNL;
+   pData->pfFlatFastXcorrData = pScoring->pfFlatFastXcorrData;
+   pData->pfFlatFastXcorrDataNL = pScoring->pfFlatFastXcorrDataNL;
+
+   pScoring->pSpectrumData = pData;
+}
+
+
+// Returns true when Preprocess() would build exactly pSource's arrays, truncated to
+// pScoring's smaller iArraySize, for pScoring.  That holds when no precursor peaks are
+// removed (removal depends on the charge), every peak passes LoadIons()' precursor
+// mass cutoff for both, and all non-zero xcorr data (which spreads past the highest
+// peak by the xcorr processing offset, a flanking bin and the neutral loss offsets)
+// lies below pScoring's array size.
+bool CometPreprocess::CanShareSpectrumData(struct Query *pSource,
+                                           struct Query *pScoring,
+                                           double dHighestPeakMZ)
+{
+   if (g_staticParams.options.iRemovePrecursor != 0)
+      return false;
+
+   if (pScoring->_spectrumInfoInternal.iArraySize > pSource->_spectrumInfoInternal.iArraySize)
+      return false;
+
+   if (dHighestPeakMZ >= pSource->_pepMassInfo.dExpPepMass + 50.0
+         || dHighestPeakMZ >= pScoring->_pepMassInfo.dExpPepMass + 50.0)
    {
-      char szErrorMsg[256];
-      sprintf(szErrorMsg,  " Error - new(pfSpScoreData[%d]). bad_alloc: %s.\n", pScoring->_spectrumInfoInternal.iArraySize, ba.what());
-      sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
-      sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to address mitigate memory use.\n");
-      string strErrorMsg(szErrorMsg);
-      g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-      logerr(szErrorMsg);
       return false;
    }
 
-   // note that pTmpSpData[].dIon values are already BIN'd
-   for (i=0; i<NUM_SP_IONS; i++)
-      pScoring->pfSpScoreData[(int)(pTmpSpData[i].dIon)] = (float) pTmpSpData[i].dIntensity;
-
-   // MH: Fill sparse matrix for SpScore
-   pScoring->iSpScoreData = pScoring->_spectrumInfoInternal.iArraySize / SPARSE_MATRIX_SIZE + 1;
+   int iLastBin = BIN(dHighestPeakMZ) + g_staticParams.iXcorrProcessingOffset + 2;
 
-   try
+   if (g_staticParams.ionInformation.bUseWaterAmmoniaLoss
+         && (g_staticParams.ionInformation.iIonVal[ION_SERIES_A]
+            || g_staticParams.ionInformation.iIonVal[ION_SERIES_B]
+            || g_staticParams.ionInformation.iIonVal[ION_SERIES_Y]))
    {
-      pScoring->ppfSparseSpScoreData = new float*[pScoring->iSpScoreData]();
+      iLastBin += max(g_staticParams.precalcMasses.iMinus17, g_staticParams.precalcMasses.iMinus18);
    }
-   catch (std::bad_alloc& ba)
+
+   return iLastBin < pScoring->_spectrumInfoInternal.iArraySize;
+}
+
+
+// Points pScoring at pSource's preprocessed arrays; the sizes stay pScoring's own.
+void CometPreprocess::ShareSpectrumData(struct Query *pSource,
+                                        struct Query *pScoring)
+{
+   pScoring->_spectrumInfoInternal.dTotalIntensity = pSource->_spectrumInfoInternal.dTotalIntensity;
+   strcpy(pScoring->_spectrumInfoInternal.szNativeID, pSource->_spectrumInfoInternal.szNativeID);
+
+   pScoring->iFastXcorrDataSize = (pScoring->_spectrumInfoInternal.iArraySize / SPARSE_MATRIX_SIZE) + 1;
+   pScoring->iSpScoreData = pScoring->_spectrumInfoInternal.iArraySize / SPARSE_MATRIX_SIZE + 1;
+   if (g_staticParams.options.bFlatXcorr)
+      pScoring->iFlatXcorrDataSize = ((pScoring->_spectrumInfoInternal.iArraySize + 15) / 16) * 16;
+
+   pScoring->ppfSparseSpScoreData = pSource->ppfSparseSpScoreData;
+   pScoring->ppfSparseFastXcorrData = pSource->ppfSparseFastXcorrData;
+   pScoring->ppfSparseFastXcorrDataNL = pSource->ppfSparseFastXcorrDataNL;
+   pScoring->pfFlatFastXcorrData = pSource->pfFlatFastXcorrData;
+   pScoring->pfFlatFastXcorrDataNL = pSource->pfFlatFastXcorrDataNL;
+
+   pScoring->pSpectrumData = pSource->pSpectrumData;
+   pScoring->pSpectrumData->iRefCount++;
+}
+
+
+// Copies a sparse fast xcorr matrix into a flat, zero padded, 64 byte aligned array
+// for the "flat_xcorr" scoring kernel.  The sparse matrix only holds bins that passed
+// the FLOAT_ZERO test (never bin 0), so both paths score the same.
+bool CometPreprocess::CreateFlatXcorrData(float **ppfSparseData,
+                                          int iSparseSize,
+                                          int iFlatSize,
+                                          float **ppfFlatData)
+{
+   *ppfFlatData = (float *)comet_aligned_malloc(sizeof(float) * iFlatSize);
+
+   if (*ppfFlatData == NULL)
    {
       char szErrorMsg[256];
-      sprintf(szErrorMsg,  " Error - new(pScoring->ppfSparseSpScoreData[%d]). bad_alloc: %s.\n", pScoring->iSpScoreData, ba.what());
+      sprintf(szErrorMsg,  " Error - comet_aligned_malloc(pfFlatFastXcorrData[%d]).\n", iFlatSize);
       sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
-      sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to address mitigate memory use.\n");
+      sprintf(szErrorMsg+strlen(szErrorMsg), "and \"flat_xcorr\" parameters to mitigate memory use.\n");
       string strErrorMsg(szErrorMsg);
       g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
       logerr(szErrorMsg);
       return false;
    }
 
-   for (i=0; i<pScoring->_spectrumInfoInternal.iArraySize; i++)
+   memset(*ppfFlatData, 0, sizeof(float) * iFlatSize);
+
+   for (int x=0; x<iSparseSize; x++)
    {
-      if (pScoring->pfSpScoreData[i] > FLOAT_ZERO)
-      {
-         x=i/SPARSE_MATRIX_SIZE;
-         if (pScoring->ppfSparseSpScoreData[x]==NULL)
-         {
-            try
-            {
-               pScoring->ppfSparseSpScoreData[x] = new float[SPARSE_MATRIX_SIZE]();
-            }
-            catch (std::bad_alloc& ba)
-            {
-               char szErrorMsg[256];
-               sprintf(szErrorMsg,  " Error - new(pScoring->ppfSparseSpScoreData[%d][%d]). bad_alloc: %s.\n", x, SPARSE_MATRIX_SIZE, ba.what());
-               sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
-               sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to address mitigate memory use.\n");
-               string strErrorMsg(szErrorMsg);
-               g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-               logerr(szErrorMsg);
-               return false;
-            }
-            for (y=0; y<SPARSE_MATRIX_SIZE; y++)
-               pScoring->ppfSparseSpScoreData[x][y]=0;
-         }
-         y=i-(x*SPARSE_MATRIX_SIZE);
-         pScoring->ppfSparseSpScoreData[x][y] = pScoring->pfSpScoreData[i];
-      }
-   }
+      int iCount = min(SPARSE_MATRIX_SIZE, iFlatSize - x*SPARSE_MATRIX_SIZE);
 
-   delete[] pScoring->pfSpScoreData;
-   pScoring->pfSpScoreData = NULL;
+      if (ppfSparseData[x] != NULL && iCount > 0)
+         memcpy(*ppfFlatData + x*SPARSE_MATRIX_SIZE, ppfSparseData[x], sizeof(float) * iCount);
+   }
 
    return true;
 }
@@ -771,9 +965,7 @@ bool CometPreprocess::CheckExit(int iAnalysisType,
 
 
 bool CometPreprocess::PreprocessSpectrum(Spectrum &spec,
-                                         double *pdTmpRawData,
-                                         double *pdTmpFastXcorrData,
-                                         double *pdTmpCorrelationData)
+                                         PreprocessScratch *pScratch)
 {
    int z;
    int zStop;
@@ -905,6 +1097,7 @@ bool CometPreprocess::PreprocessSpectrum(Spectrum &spec,
    double dSelectionLower = 0.0;
    double dSelectedMZ = 0.0;
    double dMonoMZ = 0.0;
+   vector<Query*> vScanQueries;   // this scan's queries, one per precursor charge
 
    if (g_staticParams.options.bCorrectMass)
    {
@@ -994,10 +1187,11 @@ bool CometPreprocess::PreprocessSpectrum(Spectrum &spec,
 
             Threading::LockMutex(_maxChargeMutex);
 
-            // g_massRange.iMaxFragmentCharge is global maximum fragment ion charge across all spectra.
-            if (pScoring->_spectrumInfoInternal.iMaxFragCharge > g_massRange.iMaxFragmentCharge)
+            // _iLoadMaxFragmentCharge is maximum fragment ion charge across all spectra in the batch;
+            // it becomes g_massRange.iMaxFragmentCharge when the batch is searched.
+            if (pScoring->_spectrumInfoInternal.iMaxFragCharge > _iLoadMaxFragmentCharge)
             {
-               g_massRange.iMaxFragmentCharge = pScoring->_spectrumInfoInternal.iMaxFragCharge;
+               _iLoadMaxFragmentCharge = pScoring->_spectrumInfoInternal.iMaxFragCharge;
             }
 
             Threading::UnlockMutex(_maxChargeMutex);
@@ -1007,21 +1201,61 @@ bool CometPreprocess::PreprocessSpectrum(Spectrum &spec,
                return false;
             }
 
-            // Populate pdCorrelation data.
-            // NOTE: there must be a good way of doing this just once per spectrum instead
-            //       of repeating for each charge state.
-            if (!Preprocess(pScoring, spec, pdTmpRawData, pdTmpFastXcorrData, pdTmpCorrelationData))
-            {
-               return false;
-            }
-
-            Threading::LockMutex(g_pvQueryMutex);
-            g_pvQuery.push_back(pScoring);
-            Threading::UnlockMutex(g_pvQueryMutex);
+            vScanQueries.push_back(pScoring);
          }
       }
    }
 
+   if (vScanQueries.empty())
+      return true;
+
+   // Populate pdCorrelation data once for the charge state with the largest array.
+   // The other charge states reference its arrays when Preprocess() would build the
+   // same data for them and are only preprocessed separately otherwise.
+   size_t tSource = 0;
+   size_t i;
+
+   for (i=1; i<vScanQueries.size(); i++)
+   {
+      if (vScanQueries.at(i)->_spectrumInfoInternal.iArraySize > vScanQueries.at(tSource)->_spectrumInfoInternal.iArraySize)
+         tSource = i;
+   }
+
+   Query *pSource = vScanQueries.at(tSource);
+
+   if (!Preprocess(pSource, spec, pScratch))
+   {
+      return false;
+   }
+
+   double dHighestPeakMZ = 0.0;
+
+   for (int ii=0; ii<spec.size(); ii++)
+   {
+      if (spec.at(ii).intensity >= g_staticParams.options.dMinIntensity
+            && spec.at(ii).intensity > 0.0
+            && spec.at(ii).mz > dHighestPeakMZ)
+      {
+         dHighestPeakMZ = spec.at(ii).mz;
+      }
+   }
+
+   for (i=0; i<vScanQueries.size(); i++)
+   {
+      if (i == tSource)
+         continue;
+
+      if (CanShareSpectrumData(pSource, vScanQueries.at(i), dHighestPeakMZ))
+         ShareSpectrumData(pSource, vScanQueries.at(i));
+      else if (!Preprocess(vScanQueries.at(i), spec, pScratch))
+         return false;
+   }
+
+   Threading::LockMutex(g_pvQueryMutex);
+   for (i=0; i<vScanQueries.size(); i++)
+      _pvLoadQuery->push_back(vScanQueries.at(i));
+   Threading::UnlockMutex(g_pvQueryMutex);
+
    return true;
 }
 
@@ -1239,14 +1473,16 @@ bool CometPreprocess::AdjustMassTol(struct Query *pScoring)
 
 //  Reads MSMS data file as ASCII mass/intensity pairs.
 bool CometPreprocess::LoadIons(struct Query *pScoring,
-                               double *pdTmpRawData,
-                               Spectrum mstSpectrum,
+                               PreprocessScratch *pScratch,
+                               Spectrum &mstSpectrum,
                                struct PreprocessStruct *pPre)
 {
    int  i;
    double dIon,
           dIntensity;
 
+   pScratch->vRawPeaks.clear();
+
    i = 0;
    while(true)
    {
@@ -1270,8 +1506,7 @@ bool CometPreprocess::LoadIons(struct Query *pScoring,
             if (iBinIon > pPre->iHighestIon)
                pPre->iHighestIon = iBinIon;
 
-            if ((iBinIon < pScoring->_spectrumInfoInternal.iArraySize)
-                  && (dIntensity > pdTmpRawData[iBinIon]))
+            if (iBinIon < pScoring->_spectrumInfoInternal.iArraySize)
             {
                if (g_staticParams.options.iRemovePrecursor == 1)
                {
@@ -1281,11 +1516,10 @@ bool CometPreprocess::LoadIons(struct Query *pScoring,
 
                   if (fabs(dIon - dMZ) > g_staticParams.options.dRemovePrecursorTol)
                   {
-                     if (dIntensity > pdTmpRawData[iBinIon])
-                        pdTmpRawData[iBinIon] = dIntensity;
+                     pScratch->vRawPeaks.push_back(make_pair(iBinIon, dIntensity));
 
-                     if (pdTmpRawData[iBinIon] > pPre->dHighestIntensity)
-                        pPre->dHighestIntensity = pdTmpRawData[iBinIon];
+                     if (dIntensity > pPre->dHighestIntensity)
+                        pPre->dHighestIntensity = dIntensity;
                   }
                }
                else if (g_staticParams.options.iRemovePrecursor == 2)
@@ -1306,11 +1540,10 @@ bool CometPreprocess::LoadIons(struct Query *pScoring,
                   }
                   if (bNotPrec)
                   {
-                     if (dIntensity > pdTmpRawData[iBinIon])
-                        pdTmpRawData[iBinIon] = dIntensity;
+                     pScratch->vRawPeaks.push_back(make_pair(iBinIon, dIntensity));
 
-                     if (pdTmpRawData[iBinIon] > pPre->dHighestIntensity)
-                        pPre->dHighestIntensity = pdTmpRawData[iBinIon];
+                     if (dIntensity > pPre->dHighestIntensity)
+                        pPre->dHighestIntensity = dIntensity;
                   }
                }
                else if (g_staticParams.options.iRemovePrecursor == 3)  //phosphate neutral loss
@@ -1325,11 +1558,10 @@ bool CometPreprocess::LoadIons(struct Query *pScoring,
                   if (fabs(dIon - dMZ1) > g_staticParams.options.dRemovePrecursorTol
                         && fabs(dIon - dMZ2) > g_staticParams.options.dRemovePrecursorTol)
                   {
-                     if (dIntensity > pdTmpRawData[iBinIon])
-                        pdTmpRawData[iBinIon] = dIntensity;
+                     pScratch->vRawPeaks.push_back(make_pair(iBinIon, dIntensity));
 
-                     if (pdTmpRawData[iBinIon] > pPre->dHighestIntensity)
-                        pPre->dHighestIntensity = pdTmpRawData[iBinIon];
+                     if (dIntensity > pPre->dHighestIntensity)
+                        pPre->dHighestIntensity = dIntensity;
                   }
                }
                else if (g_staticParams.options.iRemovePrecursor == 4)  //undocumented TMT
@@ -1350,44 +1582,66 @@ bool CometPreprocess::LoadIons(struct Query *pScoring,
                         && fabs(dIon - dMZ2) > g_staticParams.options.dRemovePrecursorTol
                         && fabs(dIon - dMZ3) > g_staticParams.options.dRemovePrecursorTol)
                   {
-                     if (dIntensity > pdTmpRawData[iBinIon])
-                        pdTmpRawData[iBinIon] = dIntensity;
+                     pScratch->vRawPeaks.push_back(make_pair(iBinIon, dIntensity));
 
-                     if (pdTmpRawData[iBinIon] > pPre->dHighestIntensity)
-                        pPre->dHighestIntensity = pdTmpRawData[iBinIon];
+                     if (dIntensity > pPre->dHighestIntensity)
+                        pPre->dHighestIntensity = dIntensity;
                   }
                }
                else // iRemovePrecursor==0
                {
-                  if (dIntensity > pdTmpRawData[iBinIon])
-                     pdTmpRawData[iBinIon] = dIntensity;
+                  pScratch->vRawPeaks.push_back(make_pair(iBinIon, dIntensity));
 
-                  if (pdTmpRawData[iBinIon] > pPre->dHighestIntensity)
-                     pPre->dHighestIntensity = pdTmpRawData[iBinIon];
+                  if (dIntensity > pPre->dHighestIntensity)
+                     pPre->dHighestIntensity = dIntensity;
                }
             }
          }
       }
    }
 
+   CollapseRawPeaks(pScratch->vRawPeaks);
+
    return true;
 }
 
 
-// pdTmpRawData now holds raw data, pdTmpCorrelationData is windowed data after this function
-void CometPreprocess::MakeCorrData(double *pdTmpRawData,
-                                   double *pdTmpCorrelationData,
+// Sorts the binned peaks by bin and keeps the most intense peak of each bin.
+void CometPreprocess::CollapseRawPeaks(vector<pair<int, double> > &vRawPeaks)
+{
+   size_t tNumPeaks = 0;
+
+   sort(vRawPeaks.begin(), vRawPeaks.end());
+
+   for (size_t t=0; t<vRawPeaks.size(); t++)
+   {
+      if (tNumPeaks > 0 && vRawPeaks[tNumPeaks-1].first == vRawPeaks[t].first)
+         vRawPeaks[tNumPeaks-1].second = vRawPeaks[t].second;    // sorted, so never less intense
+      else
+         vRawPeaks[tNumPeaks++] = vRawPeaks[t];
+   }
+
+   vRawPeaks.resize(tNumPeaks);
+}
+
+
+// vRawPeaks holds raw data, vCorrPeaks is windowed data after this function
+void CometPreprocess::MakeCorrData(PreprocessScratch *pScratch,
                                    struct Query *pScoring,
                                    struct PreprocessStruct *pPre)
 {
    int  i,
-        ii,
-        iBin,
         iWindowSize,
         iNumWindows=10;
    double dMaxWindowInten,
           dTmp1,
           dTmp2;
+   vector<pair<int, double> > &vRawPeaks = pScratch->vRawPeaks;
+   size_t tWindowStart = 0;
+   size_t tWindowEnd;
+   size_t t;
+
+   pScratch->vCorrPeaks.clear();
 
    iWindowSize = (int)((pPre->iHighestIon)/iNumWindows) + 1;
 
@@ -1395,13 +1649,13 @@ void CometPreprocess::MakeCorrData(double *pdTmpRawData,
    {
       dMaxWindowInten = 0.0;
 
-      for (ii=0; ii<iWindowSize; ii++)    // Find max inten. in window.
+      // Find max inten. in window.
+      for (tWindowEnd=tWindowStart; tWindowEnd<vRawPeaks.size() && vRawPeaks[tWindowEnd].first < (i+1)*iWindowSize; tWindowEnd++)
       {
-         iBin = i*iWindowSize+ii;
-         if (iBin < pScoring->_spectrumInfoInternal.iArraySize)
+         if (vRawPeaks[tWindowEnd].first < pScoring->_spectrumInfoInternal.iArraySize
+               && vRawPeaks[tWindowEnd].second > dMaxWindowInten)
          {
-            if (pdTmpRawData[iBin] > dMaxWindowInten)
-               dMaxWindowInten = pdTmpRawData[iBin];
+            dMaxWindowInten = vRawPeaks[tWindowEnd].second;
          }
       }
 
@@ -1410,37 +1664,38 @@ void CometPreprocess::MakeCorrData(double *pdTmpRawData,
          dTmp1 = 50.0 / dMaxWindowInten;
          dTmp2 = 0.05 * pPre->dHighestIntensity;
 
-         for (ii=0; ii<iWindowSize; ii++)    // Normalize to max inten. in window.
+         // Normalize to max inten. in window.
+         for (t=tWindowStart; t<tWindowEnd; t++)
          {
-            iBin = i*iWindowSize+ii;
-            if (iBin < pScoring->_spectrumInfoInternal.iArraySize)
+            if (vRawPeaks[t].first < pScoring->_spectrumInfoInternal.iArraySize
+                  && vRawPeaks[t].second > dTmp2)
             {
-               if (pdTmpRawData[iBin] > dTmp2)
-                  pdTmpCorrelationData[iBin] = pdTmpRawData[iBin]*dTmp1;
+               pScratch->vCorrPeaks.push_back(make_pair(vRawPeaks[t].first, vRawPeaks[t].second*dTmp1));
             }
          }
       }
+
+      tWindowStart = tWindowEnd;
    }
 }
 
 
 // Pull out top # ions for intensity matching in search.
-void CometPreprocess::GetTopIons(double *pdTmpRawData,
-                                 struct msdata *pTmpSpData,
-                                 int iArraySize)
+void CometPreprocess::GetTopIons(PreprocessScratch *pScratch,
+                                 struct msdata *pTmpSpData)
 {
-   int  i,
-        ii,
+   int  ii,
         iLowestIntenIndex=0;
    double dLowestInten=0.0,
           dMaxInten=0.0;
+   vector<pair<int, double> > &vRawPeaks = pScratch->vRawPeaks;
 
-   for (i=0; i<iArraySize; i++)
+   for (size_t t=0; t<vRawPeaks.size(); t++)
    {
-      if (pdTmpRawData[i] > dLowestInten)
+      if (vRawPeaks[t].second > dLowestInten)
       {
-         (pTmpSpData+iLowestIntenIndex)->dIntensity = (double)pdTmpRawData[i];
-         (pTmpSpData+iLowestIntenIndex)->dIon = (double)i;
+         (pTmpSpData+iLowestIntenIndex)->dIntensity = vRawPeaks[t].second;
+         (pTmpSpData+iLowestIntenIndex)->dIon = (double)vRawPeaks[t].first;
 
          if ((pTmpSpData+iLowestIntenIndex)->dIntensity > dMaxInten)
             dMaxInten = (pTmpSpData+iLowestIntenIndex)->dIntensity;
@@ -1463,7 +1718,7 @@ void CometPreprocess::GetTopIons(double *pdTmpRawData,
 
    if (dMaxInten > FLOAT_ZERO)
    {
-      for (i=0; i<NUM_SP_IONS; i++)
+      for (int i=0; i<NUM_SP_IONS; i++)
          (pTmpSpData+i)->dIntensity = (((pTmpSpData+i)->dIntensity)/dMaxInten)*100.0;
    }
 }
@@ -1522,35 +1777,6 @@ bool CometPreprocess::AllocateMemory(int maxNumThreads)
 {
    int i;
 
-   //MH: Find appropriately sized array cushion based on user parameters. Fixes error found by Patrick Pedrioli for
-   // very wide mass tolerance searches (i.e. 500 Da).
-   double dCushion = 0.0;
-   if (g_staticParams.tolerances.iMassToleranceUnits == 0) // amu
-   {
-      dCushion = g_staticParams.tolerances.dInputTolerance;
-
-      if (g_staticParams.tolerances.iMassToleranceType == 1)  // precursor m/z tolerance
-      {
-        dCushion *= 8; //MH: hope +8 is large enough charge because g_staticParams.options.iEndCharge can be overridden.
-      }
-   }
-   else if (g_staticParams.tolerances.iMassToleranceUnits == 1) // mmu
-   {
-      dCushion = g_staticParams.tolerances.dInputTolerance * 0.001;
-
-      if (g_staticParams.tolerances.iMassToleranceType == 1)  // precursor m/z tolerance
-      {
-         dCushion *= 8; //MH: hope +8 is large enough charge because g_staticParams.options.iEndCharge can be overridden.
-      }
-   }
-   else // ppm
-   {
-      dCushion = g_staticParams.tolerances.dInputTolerance * g_staticParams.options.dPeptideMassHigh / 1000000.0;
-   }
-
-   //MH: Must be equal to largest possible array
-   int iArraySize = (int)((g_staticParams.options.dPeptideMassHigh + dCushion + 2.0) * g_staticParams.dInverseBinWidth);
-
    //MH: Initally mark all arrays as available (i.e. false=not inuse).
    pbMemoryPool = new bool[maxNumThreads];
    for (i=0; i<maxNumThreads; i++)
@@ -1558,67 +1784,21 @@ bool CometPreprocess::AllocateMemory(int maxNumThreads)
       pbMemoryPool[i] = false;
    }
 
-   //MH: Allocate arrays
-   ppdTmpRawDataArr = new double*[maxNumThreads]();
-   for (i=0; i<maxNumThreads; i++)
-   {
-      try
-      {
-         ppdTmpRawDataArr[i] = new double[iArraySize]();
-      }
-      catch (std::bad_alloc& ba)
-      {
-         char szErrorMsg[256];
-         sprintf(szErrorMsg,  " Error - new(pdTmpRawData[%d]). bad_alloc: %s.\n", iArraySize, ba.what());
-         sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
-         sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to address mitigate memory use.\n");
-         string strErrorMsg(szErrorMsg);
-         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-         logerr(szErrorMsg);
-         return false;
-      }
-   }
-
-   //MH: Allocate arrays
-   ppdTmpFastXcorrDataArr = new double*[maxNumThreads]();
-   for (i=0; i<maxNumThreads; i++)
+   // The peak lists grow with the spectra and are reused, so nothing is sized here.
+   try
    {
-      try
-      {
-         ppdTmpFastXcorrDataArr[i] = new double[iArraySize]();
-      }
-      catch (std::bad_alloc& ba)
-      {
-         char szErrorMsg[256];
-         sprintf(szErrorMsg,  " Error - new(pdTmpFastXcorrData[%d]). bad_alloc: %s.\n", iArraySize, ba.what());
-         sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
-         sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to address mitigate memory use.\n");
-         string strErrorMsg(szErrorMsg);
-         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-         logerr(szErrorMsg);
-         return false;
-      }
+      pScratchArr = new PreprocessScratch[maxNumThreads];
    }
-
-   //MH: Allocate arrays
-   ppdTmpCorrelationDataArr = new double*[maxNumThreads]();
-   for (i=0; i<maxNumThreads; i++)
+   catch (std::bad_alloc& ba)
    {
-      try
-      {
-         ppdTmpCorrelationDataArr[i] = new double[iArraySize]();
-      }
-      catch (std::bad_alloc& ba)
-      {
-         char szErrorMsg[256];
-         sprintf(szErrorMsg,  " Error - new(pdTmpCorrelationData[%d]). bad_alloc: %s.\n", iArraySize, ba.what());
-         sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
-         sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to address mitigate memory use.\n");
-         string strErrorMsg(szErrorMsg);
-         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-         logerr(szErrorMsg);
-         return false;
-      }
+      char szErrorMsg[256];
+      sprintf(szErrorMsg,  " Error - new(pScratchArr[%d]). bad_alloc: %s.\n", maxNumThreads, ba.what());
+      sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
+      sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to address mitigate memory use.\n");
+      string strErrorMsg(szErrorMsg);
+      g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+      logerr(szErrorMsg);
+      return false;
    }
 
    return true;
@@ -1626,22 +1806,12 @@ bool CometPreprocess::AllocateMemory(int maxNumThreads)
 
 
 //MH: Deallocates memory shared by threads during spectral processing.
-bool CometPreprocess::DeallocateMemory(int maxNumThreads)
+bool CometPreprocess::DeallocateMemory()
 {
-   int i;
-
    delete [] pbMemoryPool;
+   delete [] pScratchArr;
+   pScratchArr = NULL;
 
-   for (i=0; i<maxNumThreads; i++)
-   {
-      delete [] ppdTmpRawDataArr[i];
-      delete [] ppdTmpFastXcorrDataArr[i];
-      delete [] ppdTmpCorrelationDataArr[i];
-   }
-
-   delete [] ppdTmpRawDataArr;
-   delete [] ppdTmpFastXcorrDataArr;
-   delete [] ppdTmpCorrelationDataArr;
    return true;
 }
 
@@ -1685,9 +1855,6 @@ bool CometPreprocess::PreprocessSingleSpectrum(int iPrecursorCharge,
 
    //preprocess here
    int i;
-   int x;
-   int y;
-   struct msdata pTmpSpData[NUM_SP_IONS];
    struct PreprocessStruct pPre;
 
    pPre.iHighestIon = 0;
@@ -1723,18 +1890,11 @@ bool CometPreprocess::PreprocessSingleSpectrum(int iPrecursorCharge,
    pScoring->_spectrumInfoInternal.iArraySize = (int)((pScoring->_pepMassInfo.dExpPepMass + dCushion + 2.0) * g_staticParams.dInverseBinWidth);
    g_massRange.iMaxFragmentCharge = pScoring->_spectrumInfoInternal.iMaxFragCharge;
 
-   // initialize these temporary arrays before re-using
-   size_t iTmp= (size_t)(pScoring->_spectrumInfoInternal.iArraySize)*sizeof(double);
+   PreprocessScratch *pScratch = &pScratchArr[0];
 
-   double *pdTmpRawData = ppdTmpRawDataArr[0];
-   double *pdTmpFastXcorrData = ppdTmpFastXcorrDataArr[0];
-   double *pdTmpCorrelationData = ppdTmpCorrelationDataArr[0];
+   pScratch->vRawPeaks.clear();
 
-   memset(pdTmpRawData, 0, iTmp);
-   memset(pdTmpFastXcorrData, 0, iTmp);
-   memset(pdTmpCorrelationData, 0, iTmp);
- 
-   // Loop through single spectrum and store in pdTmpRawData array
+   // Loop through single spectrum and store in pScratch->vRawPeaks
    double dIon=0,
           dIntensity=0;
 
@@ -1760,230 +1920,24 @@ bool CometPreprocess::PreprocessSingleSpectrum(int iPrecursorCharge,
             if (iBinIon > pPre.iHighestIon)
                pPre.iHighestIon = iBinIon;
 
-            if ((iBinIon < pScoring->_spectrumInfoInternal.iArraySize)
-                  && (dIntensity > pdTmpRawData[iBinIon]))
+            if (iBinIon < pScoring->_spectrumInfoInternal.iArraySize)
             {
-               if (dIntensity > pdTmpRawData[iBinIon])
-                  pdTmpRawData[iBinIon] = dIntensity;
-
-               if (pdTmpRawData[iBinIon] > pPre.dHighestIntensity)
-                  pPre.dHighestIntensity = pdTmpRawData[iBinIon];
-            }
-         }
-      }
-   }
-
-   pScoring->pfFastXcorrData = new float[pScoring->_spectrumInfoInternal.iArraySize]();
-
-   if (g_staticParams.ionInformation.bUseWaterAmmoniaLoss
-         && (g_staticParams.ionInformation.iIonVal[ION_SERIES_A]
-            || g_staticParams.ionInformation.iIonVal[ION_SERIES_B]
-            || g_staticParams.ionInformation.iIonVal[ION_SERIES_Y]))
-   {
-      try
-      {
-         pScoring->pfFastXcorrDataNL = new float[pScoring->_spectrumInfoInternal.iArraySize]();
-      }
-      catch (std::bad_alloc& ba)
-      {
-         char szErrorMsg[256];
-         sprintf(szErrorMsg,  " Error - new(pfFastXcorrDataNL[%d]). bad_alloc: %s.\n", pScoring->_spectrumInfoInternal.iArraySize, ba.what());
-         sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
-         sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to address mitigate memory use.\n");
-         string strErrorMsg(szErrorMsg);
-         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-         logerr(szErrorMsg);
-         return false;
-      }
-   }
-
-   // Create data for correlation analysis.
-   // pdTmpRawData intensities are normalized to 100; pdTmpCorrelationData is windowed
-   MakeCorrData(pdTmpRawData, pdTmpCorrelationData, pScoring, &pPre);
-
-   // Make fast xcorr spectrum.
-   double dSum=0.0;
-   int iTmpRange = 2*g_staticParams.iXcorrProcessingOffset + 1;
-   double dTmp = 1.0 / (double)(iTmpRange - 1);
-
-   dSum=0.0;
-   for (i=0; i<g_staticParams.iXcorrProcessingOffset; i++)
-      dSum += pdTmpCorrelationData[i];
-   for (i=g_staticParams.iXcorrProcessingOffset; i < pScoring->_spectrumInfoInternal.iArraySize + g_staticParams.iXcorrProcessingOffset; i++)
-   {
-      if (i<pScoring->_spectrumInfoInternal.iArraySize)
-         dSum += pdTmpCorrelationData[i];
-      if (i>=iTmpRange)
-         dSum -= pdTmpCorrelationData[i-iTmpRange];
-      pdTmpFastXcorrData[i-g_staticParams.iXcorrProcessingOffset] = (dSum - pdTmpCorrelationData[i-g_staticParams.iXcorrProcessingOffset])* dTmp;
-   }
-
-   pScoring->pfFastXcorrData[0] = 0.0;
-   for (i=1; i<pScoring->_spectrumInfoInternal.iArraySize; i++)
-   {
-      double dTmp = pdTmpCorrelationData[i] - pdTmpFastXcorrData[i];
-
-      pScoring->pfFastXcorrData[i] = (float)dTmp;
-
-      // Add flanking peaks if used
-      if (g_staticParams.ionInformation.iTheoreticalFragmentIons == 0)
-      {
-         int iTmp;
-
-         iTmp = i-1;
-         pScoring->pfFastXcorrData[i] += (float) ((pdTmpCorrelationData[iTmp] - pdTmpFastXcorrData[iTmp])*0.5);
-
-         iTmp = i+1;
-         if (iTmp < pScoring->_spectrumInfoInternal.iArraySize)
-            pScoring->pfFastXcorrData[i] += (float) ((pdTmpCorrelationData[iTmp] - pdTmpFastXcorrData[iTmp])*0.5);
-      }
-
-      // If A, B or Y ions and their neutral loss selected, roll in -17/-18 contributions to pfFastXcorrDataNL
-      if (g_staticParams.ionInformation.bUseWaterAmmoniaLoss
-            && (g_staticParams.ionInformation.iIonVal[ION_SERIES_A]
-               || g_staticParams.ionInformation.iIonVal[ION_SERIES_B]
-               || g_staticParams.ionInformation.iIonVal[ION_SERIES_Y]))
-      {
-         int iTmp;
-
-         pScoring->pfFastXcorrDataNL[i] = pScoring->pfFastXcorrData[i];
-
-         iTmp = i-g_staticParams.precalcMasses.iMinus17;
-         if (iTmp>= 0)
-         {
-            pScoring->pfFastXcorrDataNL[i] += (float)((pdTmpCorrelationData[iTmp] - pdTmpFastXcorrData[iTmp]) * 0.2);
-         }
+               pScratch->vRawPeaks.push_back(make_pair(iBinIon, dIntensity));
 
-         iTmp = i-g_staticParams.precalcMasses.iMinus18;
-         if (iTmp>= 0)
-         {
-            pScoring->pfFastXcorrDataNL[i] += (float)((pdTmpCorrelationData[iTmp] - pdTmpFastXcorrData[iTmp]) * 0.2);
-         }
-      }
-   }
-
-   pScoring->iFastXcorrDataSize = pScoring->_spectrumInfoInternal.iArraySize/SPARSE_MATRIX_SIZE+1;
-
-   // Using sparse matrix which means we free pScoring->pfFastXcorrData, ->pfFastXcorrDataNL here
-   // If A, B or Y ions and their neutral loss selected, roll in -17/-18 contributions to pfFastXcorrDataNL.
-   if (g_staticParams.ionInformation.bUseWaterAmmoniaLoss
-         && (g_staticParams.ionInformation.iIonVal[ION_SERIES_A]
-            || g_staticParams.ionInformation.iIonVal[ION_SERIES_B]
-            || g_staticParams.ionInformation.iIonVal[ION_SERIES_Y]))
-   {
-      try
-      {
-         pScoring->ppfSparseFastXcorrDataNL = new float*[pScoring->iFastXcorrDataSize]();
-      }
-      catch (std::bad_alloc& ba)
-      {
-         char szErrorMsg[256];
-         sprintf(szErrorMsg,  " Error - new(pScoring->ppfSparseFastXcorrDataNL[%d]). bad_alloc: %s.", pScoring->iFastXcorrDataSize, ba.what());
-         sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
-         sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to address mitigate memory use.\n");
-         string strErrorMsg(szErrorMsg);
-         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-         logerr( szErrorMsg);
-         return false;
-      }
-
-      for (i=1; i<pScoring->_spectrumInfoInternal.iArraySize; i++)
-      {
-         if (pScoring->pfFastXcorrDataNL[i]>FLOAT_ZERO || pScoring->pfFastXcorrDataNL[i]<-FLOAT_ZERO)
-         {
-            x=i/SPARSE_MATRIX_SIZE;
-            if (pScoring->ppfSparseFastXcorrDataNL[x]==NULL)
-            {
-               try
-               {
-                  pScoring->ppfSparseFastXcorrDataNL[x] = new float[SPARSE_MATRIX_SIZE]();
-               }
-               catch (std::bad_alloc& ba)
-               {
-                  char szErrorMsg[256];
-                  sprintf(szErrorMsg,  " Error - new(pScoring->ppfSparseFastXcorrDataNL[%d][%d]). bad_alloc: %s.\n", x, SPARSE_MATRIX_SIZE, ba.what());
-                  sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
-                  sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to address mitigate memory use.\n");
-                  string strErrorMsg(szErrorMsg);
-                  g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-                  logerr(szErrorMsg);
-                  return false;
-               }
-               for (y=0; y<SPARSE_MATRIX_SIZE; y++)
-                  pScoring->ppfSparseFastXcorrDataNL[x][y]=0;
+               if (dIntensity > pPre.dHighestIntensity)
+                  pPre.dHighestIntensity = dIntensity;
             }
-            y=i-(x*SPARSE_MATRIX_SIZE);
-            pScoring->ppfSparseFastXcorrDataNL[x][y] = pScoring->pfFastXcorrDataNL[i];
          }
       }
-
-      delete[] pScoring->pfFastXcorrDataNL;
-      pScoring->pfFastXcorrDataNL = NULL;
-   }
-
-   //MH: Fill sparse matrix
-   pScoring->ppfSparseFastXcorrData = new float*[pScoring->iFastXcorrDataSize]();
-
-   for (i=1; i<pScoring->_spectrumInfoInternal.iArraySize; i++)
-   {
-      if (pScoring->pfFastXcorrData[i]>FLOAT_ZERO || pScoring->pfFastXcorrData[i]<-FLOAT_ZERO)
-      {
-         x=i/SPARSE_MATRIX_SIZE;
-         if (pScoring->ppfSparseFastXcorrData[x]==NULL)
-         {
-            pScoring->ppfSparseFastXcorrData[x] = new float[SPARSE_MATRIX_SIZE]();
-
-            for (y=0; y<SPARSE_MATRIX_SIZE; y++)
-               pScoring->ppfSparseFastXcorrData[x][y]=0;
-         }
-         y=i-(x*SPARSE_MATRIX_SIZE);
-         pScoring->ppfSparseFastXcorrData[x][y] = pScoring->pfFastXcorrData[i];
-      }
-   }
-
-   delete[] pScoring->pfFastXcorrData;
-   pScoring->pfFastXcorrData = NULL;
-
-   // Create data for sp scoring.
-
-   for (i=0; i<NUM_SP_IONS; i++)
-   {
-      pTmpSpData[i].dIon = 0.0;
-      pTmpSpData[i].dIntensity = 0.0;
    }
 
-   GetTopIons(pdTmpRawData, &(pTmpSpData[0]), pScoring->_spectrumInfoInternal.iArraySize);
-
-   pScoring->pfSpScoreData = new float[pScoring->_spectrumInfoInternal.iArraySize]();
-   memset(pScoring->pfSpScoreData, 0, sizeof(float) * pScoring->_spectrumInfoInternal.iArraySize);
-
-   // note that pTmpSpData[].dIon values are already BIN'd
-   for (i=0; i<NUM_SP_IONS; i++)
-      pScoring->pfSpScoreData[(int)(pTmpSpData[i].dIon)] = (float) pTmpSpData[i].dIntensity;
-
-   // MH: Fill sparse matrix for SpScore
-   pScoring->iSpScoreData = pScoring->_spectrumInfoInternal.iArraySize / SPARSE_MATRIX_SIZE + 1;
-
-   pScoring->ppfSparseSpScoreData = new float*[pScoring->iSpScoreData]();
+   CollapseRawPeaks(pScratch->vRawPeaks);
 
-   for (i=0; i<pScoring->_spectrumInfoInternal.iArraySize; i++)
+   if (!PreprocessPeaks(pScoring, pScratch, &pPre))
    {
-      if (pScoring->pfSpScoreData[i] > FLOAT_ZERO)
-      {
-         x=i/SPARSE_MATRIX_SIZE;
-         if (pScoring->ppfSparseSpScoreData[x]==NULL)
-         {
-            pScoring->ppfSparseSpScoreData[x] = new float[SPARSE_MATRIX_SIZE]();
-            memset(pScoring->ppfSparseSpScoreData[x], 0, sizeof(float) * SPARSE_MATRIX_SIZE);
-         }
-         y=i-(x*SPARSE_MATRIX_SIZE);
-         pScoring->ppfSparseSpScoreData[x][y] = pScoring->pfSpScoreData[i];
-      }
+      return false;
    }
 
-   delete[] pScoring->pfSpScoreData;
-   pScoring->pfSpScoreData = NULL;
-
    g_pvQuery.push_back(pScoring);
 
    return true;
@@ -19,6 +19,7 @@
 
 #include "Common.h"
 #include "ThreadPool.h"
+#include <atomic>
 
 struct PreprocessThreadData
 {
@@ -60,6 +61,28 @@ struct PreprocessThreadData
 };
 
 
+// A run of consecutive bins whose corr - fast xcorr values are kept in
+// PreprocessScratch::vdRunValues; see CometPreprocess::MakeFastXcorrRuns().
+struct PreprocessRun
+{
+   int iStart;
+   int iEnd;            // inclusive
+   size_t tOffset;      // index of iStart's value in vdRunValues
+   double dGapValue;    // value of every bin between iEnd and the next run
+};
+
+// Per thread working storage for preprocessing.  Spectra are processed as sorted
+// peak lists rather than dense arrays over the whole mass range; the vectors are
+// cleared and reused so their capacity carries over from spectrum to spectrum.
+struct PreprocessScratch
+{
+   vector<pair<int, double> > vRawPeaks;     // (bin, sqrt intensity), one per bin, sorted by bin
+   vector<pair<int, double> > vCorrPeaks;    // windowed correlation data, non-zero bins only
+   vector<PreprocessRun> vRuns;
+   vector<double> vdRunValues;
+   vector<pair<int, int> > vOutputBins;      // bin ranges the xcorr matrices are filled from
+};
+
 class CometPreprocess
 {
 public:
@@ -72,11 +95,18 @@ public:
                                         int iLastScan,
                                         int iAnalysisType,
                                         ThreadPool* tp);
+   static void StartPrefetch(MSReader &mstReader,
+                             int iFirstScan,
+                             int iLastScan,
+                             int iAnalysisType);
+   static bool PrefetchPending();
+   static bool FinishPrefetch();
+   static void DiscardPrefetch();
    static void PreprocessThreadProc(PreprocessThreadData *pPreprocessThreadData,
                                     ThreadPool* tp);
    static bool DoneProcessingAllSpectra();
    static bool AllocateMemory(int maxNumThreads);
-   static bool DeallocateMemory(int maxNumThreads);
+   static bool DeallocateMemory();
    static bool PreprocessSingleSpectrum(int iPrecursorCharge,
                                         double dMZ,
                                         double *pdMass,
@@ -87,10 +117,17 @@ public:
 private:
 
    // Private static methods
+   static bool LoadSpectra(MSReader &mstReader,
+                           int iFirstScan,
+                           int iLastScan,
+                           int iAnalysisType,
+                           ThreadPool* tp);
+   static void PrefetchThreadProc(MSReader *pReader,
+                                  int iFirstScan,
+                                  int iLastScan,
+                                  int iAnalysisType);
    static bool PreprocessSpectrum(Spectrum &spec,
-                                  double *pdTmpRawData,
-                                  double *pdTmpFastXcorrData,
-                                  double *pdTmpCorrelationData);
+                                  PreprocessScratch *pScratch);
    static bool CheckExistOutFile(int iCharge,
                                  int iScanNum);
    static bool AdjustMassTol(struct Query *pScoring);
@@ -106,21 +143,40 @@ private:
                          int iReaderLastScan,
                          int iNumSpectraLoaded);
    static bool Preprocess(struct Query *pScoring,
-                          Spectrum mstSpectrum,
-                          double *pdTmpRawData,
-                          double *pdTmpFastXcorrData,
-                          double *pdTmpCorrelationData);
+                          Spectrum &mstSpectrum,
+                          PreprocessScratch *pScratch);
+   static bool PreprocessPeaks(struct Query *pScoring,
+                               PreprocessScratch *pScratch,
+                               struct PreprocessStruct *pPre);
+   static bool SetSparseValue(float **ppfSparseData,
+                              int iBin,
+                              float fValue,
+                              const char *szName);
+   static void MakeFastXcorrRuns(PreprocessScratch *pScratch,
+                                 int iArraySize);
+   static double GetRunValue(PreprocessScratch *pScratch,
+                             int iBin,
+                             size_t *ptRun);
+   static void AttachSpectrumData(struct Query *pScoring);
+   static bool CanShareSpectrumData(struct Query *pSource,
+                                    struct Query *pScoring,
+                                    double dHighestPeakMZ);
+   static void ShareSpectrumData(struct Query *pSource,
+                                 struct Query *pScoring);
+   static bool CreateFlatXcorrData(float **ppfSparseData,
+                                   int iSparseSize,
+                                   int iFlatSize,
+                                   float **ppfFlatData);
    static bool LoadIons(struct Query *pScoring,
-                        double *pdTmpRawData,
-                        Spectrum mstSpectrum,
+                        PreprocessScratch *pScratch,
+                        Spectrum &mstSpectrum,
                         struct PreprocessStruct *pPre);
-   static void MakeCorrData(double *pdTmpRawData,
-                            double *pdTmpCorrelationData,
+   static void CollapseRawPeaks(vector<pair<int, double> > &vRawPeaks);
+   static void MakeCorrData(PreprocessScratch *pScratch,
                             struct Query *pScoring,
                             struct PreprocessStruct *pPre);
-   static void GetTopIons(double *pdTmpRawData,
-                          struct msdata *pTmpSpData,
-                          int iArraySize);
+   static void GetTopIons(PreprocessScratch *pScratch,
+                          struct msdata *pTmpSpData);
    static bool SortByIon(const struct msdata &a,
                          const struct msdata &b);
    static void StairStep(struct msdata *pTmpSpData);
@@ -130,13 +186,21 @@ private:
    // Private member variables
    static Mutex _maxChargeMutex;
    static bool _bFirstScan;
-   static bool _bDoneProcessingAllSpectra;
+   static std::atomic<bool> _bDoneProcessingAllSpectra;   // also set by _prefetchThread
+
+   // LoadSpectra() adds queries to *_pvLoadQuery and tracks their highest
+   // fragment charge in _iLoadMaxFragmentCharge.  A prefetched batch is
+   // loaded into _vPrefetchQuery by _prefetchThread while the previous
+   // batch in g_pvQuery is searched.
+   static vector<Query*> *_pvLoadQuery;
+   static int _iLoadMaxFragmentCharge;
+   static vector<Query*> _vPrefetchQuery;
+   static std::thread _prefetchThread;
+   static bool _bPrefetchSucceeded;
 
    //MH: Common memory to be shared by all threads during spectral processing
    static bool *pbMemoryPool;                 //MH: Regulator of memory use
-   static double **ppdTmpRawDataArr;          //MH: Number of arrays equals threads
-   static double **ppdTmpFastXcorrDataArr;    //MH: Ditto
-   static double **ppdTmpCorrelationDataArr;  //MH: Ditto
+   static PreprocessScratch *pScratchArr;     //MH: Number of entries equals threads
 };
 
 #endif // _COMETPREPROCESS_H_
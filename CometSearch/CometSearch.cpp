@@ -20,12 +20,50 @@
 #include "CometStatus.h"
 #include "CometPostAnalysis.h"
 #include "CometMassSpecUtils.h"
+#include "CometPreprocess.h"
+#include "CometIndexBuilder.h"
 
 #include <stdio.h>
 #include <sstream>
+#include <climits>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+// Runtime dispatched AVX2/AVX-512 kernels for "flat_xcorr"; other builds use the scalar kernel.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define COMET_FLAT_XCORR_X86
+#include <immintrin.h>
+#endif
 
 bool *CometSearch::_pbSearchMemoryPool;
 bool **CometSearch::_ppbDuplFragmentArr;
+CometSearch **CometSearch::_ppSearchContextArr = NULL;
+SearchThreadData *CometSearch::_pPendingSearchJob = NULL;
+IndexData CometSearch::_indexData;
+vector<IndexData> CometSearch::_vIndexDeltas;
+vector<pair<double, double> > CometSearch::_vIndexQueryWindows;
+uint64_t CometSearch::_tIndexChecksumVerified = 0;
+string CometSearch::_strIndexVerified;
+
+bool CometSearch::_bFragIndexActive = false;
+int CometSearch::_iFragIndexNumBins = 0;
+vector<unsigned int> CometSearch::_vuiFragIndexBinOffsets;
+vector<int> CometSearch::_viFragIndexQueries;
+vector<int> CometSearch::_viFragIndexMaxFragCharge;
+unsigned short **CometSearch::_ppusFragIndexCountArr = NULL;
+int **CometSearch::_ppiFragIndexTouchedArr = NULL;
+
+vector<sDBEntry> CometSearch::_vDatabaseCache;
+size_t CometSearch::_tDatabaseCacheBytes = 0;
+unsigned long int CometSearch::_uliDatabaseCacheAACount = 0;
+bool CometSearch::_bDatabaseCacheFilling = false;
+bool CometSearch::_bDatabaseCacheComplete = false;
+
+unsigned int **CometSearch::_ppuiThreadHistogramArr = NULL;
+unsigned long int **CometSearch::_ppuliThreadNumMatchedArr = NULL;
+
+double (*CometSearch::_pfnFlatXcorrSum)(const float *, const unsigned int *, int) = CometSearch::FlatXcorrSumScalar;
 
 CometSearch::CometSearch()
 {
@@ -34,7 +72,18 @@ CometSearch::CometSearch()
    // Allocate memory for protein sequence if necessary.
 
    _iSizepiVarModSites = sizeof(int)*MAX_PEPTIDE_LEN_P2;
-   _iSizepdVarModSites = sizeof(double)*MAX_PEPTIDE_LEN_P2;
+
+   _pusFragIndexCounts = NULL;
+   _piFragIndexTouched = NULL;
+   _iFragIndexNumTouched = 0;
+   _iFragIndexNumTouchedDecoy = 0;
+
+   _puiThreadHistogram = NULL;
+   _puliThreadNumMatched = NULL;
+
+   _pPendingSequenceSource = NULL;
+   _tPendingSequenceOffset = 0;
+   _bIndexPeptideRepeated = false;
 }
 
 
@@ -78,6 +127,31 @@ bool CometSearch::AllocateMemory(int maxNumThreads)
       }
    }
 
+   // Search objects hold the large binned ion arrays so keep one per thread
+   // slot for the whole run instead of constructing one per protein.
+   _ppSearchContextArr = new CometSearch*[maxNumThreads];
+   for (i=0; i < maxNumThreads; i++)
+   {
+      try
+      {
+         _ppSearchContextArr[i] = new CometSearch();
+      }
+      catch (std::bad_alloc& ba)
+      {
+         char szErrorMsg[SIZE_ERROR];
+         sprintf(szErrorMsg,  " Error - new(_ppSearchContextArr[%d]). bad_alloc: %s.\n", i, ba.what());
+         sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
+         sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to mitigate memory use.\n");
+         string strErrorMsg(szErrorMsg);
+         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+         logerr(szErrorMsg);
+         return false;
+      }
+   }
+
+   if (g_staticParams.options.bFlatXcorr)
+      SelectFlatXcorrKernel(g_staticParams.tolerances.dFragmentBinSize);
+
    return true;
 }
 
@@ -95,1281 +169,3048 @@ bool CometSearch::DeallocateMemory(int maxNumThreads)
 
    delete [] _ppbDuplFragmentArr;
 
-   return true;
-}
+   for (i=0; i<maxNumThreads; i++)
+   {
+      delete _ppSearchContextArr[i];
+   }
 
+   delete [] _ppSearchContextArr;
+   _ppSearchContextArr = NULL;
 
-bool CometSearch::RunSearch(void)
-{
+   DeleteFragmentIndex();
 
-   CometSearch sqSearch;
-   sqSearch.IndexSearch();
-   return true;
+   DeleteThreadScoring();
+
+   ClearDatabaseCache();
 
+   return true;
 }
 
 
-bool CometSearch::RunSearch(int iPercentStart,
-                            int iPercentEnd,
-                            ThreadPool *tp)
+// Build the fragment ion index for the current batch of queries.  For each query, the
+// most intense peaks of its preprocessed spectrum are posted under their fragment bin
+// so that a candidate peptide's binned fragment ions can be matched against all queries
+// within its precursor tolerance at once in FragmentIndexCountPeptide().  g_pvQuery
+// must already be sorted by mass.
+bool CometSearch::CreateFragmentIndex(void)
 {
-   bool bSucceeded = true;
+   int iNumQueries = (int)g_pvQuery.size();
+   int i;
 
-   if (g_staticParams.bIndexDb)
+   DeleteFragmentIndex();
+
+   if (!g_staticParams.options.bFragIndexSearch
+         || g_staticParams.bIndexDb
+         || g_staticParams.options.bCreateIndex
+         || iNumQueries == 0)
    {
-      CometSearch sqSearch;
-      sqSearch.IndexSearch();
+      return true;
    }
-   else
-   {
-      sDBEntry dbe;
-      FILE *fp;
-      int iTmpCh = 0;
-      comet_fileoffset_t lEndPos = 0;
-      comet_fileoffset_t lCurrPos = 0;
-      bool bTrimDescr = false;
-      string strPeffHeader;
-      char *szMods = 0;             // will store ModResPsi (or ModResUnimod) and VariantSimple text for parsing for all entries; resize as needed
-      char *szPeffLine = 0;         // store description line starting with first \ to parse above
-      comet_fileoffset_t iLenAllocMods = 0;
-      int iLenSzLine = 0;
-      comet_fileoffset_t iLen = 0;
-
-      vector<OBOStruct> vectorPeffOBO;
 
+   // same extent as the pbDuplFragment arrays which bound every binned fragment ion
+   _iFragIndexNumBins = (int)((g_staticParams.options.dPeptideMassHigh + 100.0) * g_staticParams.dInverseBinWidth);
 
-      //Reuse existing ThreadPool
-      ThreadPool *pSearchThreadPool = tp;
-      
-      g_staticParams.databaseInfo.uliTotAACount = 0;
-      g_staticParams.databaseInfo.iTotalNumProteins = 0;
+   int iMinBin = BIN(g_staticParams.options.dFragIndexMinMass);
+   int iMaxBin = BIN(g_staticParams.options.dFragIndexMaxMass);
 
-      if ((fp=fopen(g_staticParams.databaseInfo.szDatabase, "rb")) == NULL)
-      {
-         char szErrorMsg[SIZE_ERROR];
-         sprintf(szErrorMsg, " Error (1) - cannot read database file \"%s\".\n", g_staticParams.databaseInfo.szDatabase);
-         string strErrorMsg(szErrorMsg);
-         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-         logerr(szErrorMsg);
-         return false;
-      }
+   if (iMinBin < 1)
+      iMinBin = 1;
+   if (iMaxBin >= _iFragIndexNumBins)
+      iMaxBin = _iFragIndexNumBins - 1;
 
-      fseek(fp, 0, SEEK_END);
-      lEndPos=ftell(fp);
-      rewind(fp);
+   try
+   {
+      vector<pair<float, unsigned int>> vPeaks;
+      vector<unsigned int> vuiQueryOffsets(iNumQueries + 1);  // start of each query's entries in vuiQueryBins
+      vector<unsigned int> vuiQueryBins;                      // indexed peak bins of each query
 
-      // Load database entry header.
-      lCurrPos = ftell(fp);
-      iTmpCh = getc(fp);
+      vuiQueryBins.reserve((size_t)iNumQueries * g_staticParams.options.iFragIndexNumSpectrumPeaks);
+      _viFragIndexMaxFragCharge.resize(iNumQueries);
 
-      if (g_staticParams.peffInfo.iPeffSearch)
+      for (i=0; i<iNumQueries; i++)
       {
-         iLenSzLine = 2048;
-         szPeffLine = (char*)malloc( iLenSzLine* sizeof(char));
-         if (szPeffLine == NULL)
-         {
-            char szErrorMsg[SIZE_ERROR];
-            sprintf(szErrorMsg, " Error - malloc szPeffLine\n");
-            string strErrorMsg(szErrorMsg);
-            g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-            logerr(szErrorMsg);
-            return false;
-         }
+         Query *pQuery = g_pvQuery.at(i);
 
-         // allocate initial storage for mod strings that will be parsed from each def line
-         iLenAllocMods = 5000;
-         szMods = (char*)malloc( iLenAllocMods * sizeof(char));
-         if (szMods == NULL)
-         {
-            char szErrorMsg[SIZE_ERROR];
-            sprintf(szErrorMsg, " Error - malloc szMods\n");
-            string strErrorMsg(szErrorMsg);
-            g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-            logerr(szErrorMsg);
-            return false;
-         }
+         vuiQueryOffsets[i] = (unsigned int)vuiQueryBins.size();
+         _viFragIndexMaxFragCharge[i] = pQuery->_spectrumInfoInternal.iMaxFragCharge;
 
-         // if PEFF database, make sure OBO file is specified
-         if (strlen(g_staticParams.peffInfo.szPeffOBO)==0)
+         vPeaks.clear();
+         for (int x=0; x<pQuery->iFastXcorrDataSize; x++)
          {
-            char szErrorMsg[SIZE_ERROR];
-            sprintf(szErrorMsg,  " Error: \"peff_format\" is specified but \"peff_obo\" is not set\n");
-            string strErrorMsg(szErrorMsg);
-            g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-            logerr(szErrorMsg);
-            exit(1);
+            if (pQuery->ppfSparseFastXcorrData[x] == NULL)
+               continue;
+
+            for (int y=0; y<SPARSE_MATRIX_SIZE; y++)
+            {
+               int iBin = x*SPARSE_MATRIX_SIZE + y;
+
+               if (iBin >= iMinBin && iBin <= iMaxBin && pQuery->ppfSparseFastXcorrData[x][y] > FLOAT_ZERO)
+                  vPeaks.push_back(make_pair(pQuery->ppfSparseFastXcorrData[x][y], (unsigned int)iBin));
+            }
          }
 
-         // read in PSI or UniMod file and get a map of all mod codes and mod masses
-         CometSearch pOBO;
-         if (strlen(g_staticParams.peffInfo.szPeffOBO) > 0)
+         // keep the most intense peaks; ties resolved by bin so the index is deterministic
+         if ((int)vPeaks.size() > g_staticParams.options.iFragIndexNumSpectrumPeaks)
          {
-            pOBO.ReadOBO(g_staticParams.peffInfo.szPeffOBO, &vectorPeffOBO);
-            sort(vectorPeffOBO.begin(), vectorPeffOBO.end());  // sort by strMod for efficient binary search
+            nth_element(vPeaks.begin(), vPeaks.begin() + g_staticParams.options.iFragIndexNumSpectrumPeaks, vPeaks.end(),
+                  [](const pair<float, unsigned int> &a, const pair<float, unsigned int> &b)
+                  { return (a.first > b.first || (a.first == b.first && a.second < b.second)); });
+            vPeaks.resize(g_staticParams.options.iFragIndexNumSpectrumPeaks);
          }
-      }
 
-      if (!g_staticParams.options.bOutputSqtStream && !g_staticParams.options.bCreateIndex)
-      {
-         logout("     - Search progress: ");
-         fflush(stdout);
+         for (auto it = vPeaks.begin(); it != vPeaks.end(); ++it)
+            vuiQueryBins.push_back(it->second);
       }
-
-      char szBuf[8192];
-      char szPeffAttributeMod[16];                                // from ModRes
-      char szPeffAttributeVariant[16];
-      char szPeffAttributeVariantComplex[32];
-      char szPeffAttributeProcessed[16];
-
-      if (g_staticParams.peffInfo.iPeffSearch == 1 || g_staticParams.peffInfo.iPeffSearch == 3)
-         strcpy(szPeffAttributeMod, "\\ModResPsi=");
-      else if (g_staticParams.peffInfo.iPeffSearch == 2 || g_staticParams.peffInfo.iPeffSearch == 4)
-         strcpy(szPeffAttributeMod, "\\ModResUnimod=");
-      else
-         strcpy(szPeffAttributeMod, "");
-
-      if (g_staticParams.peffInfo.iPeffSearch == 1 || g_staticParams.peffInfo.iPeffSearch == 2
-            || g_staticParams.peffInfo.iPeffSearch == 5)
+      vuiQueryOffsets[iNumQueries] = (unsigned int)vuiQueryBins.size();
+
+      // Invert the query->bins lists into bin->queries.  Walking the queries in order
+      // leaves each bin's query list sorted.
+      _vuiFragIndexBinOffsets.assign(_iFragIndexNumBins + 1, 0);
+      for (auto it = vuiQueryBins.begin(); it != vuiQueryBins.end(); ++it)
+         _vuiFragIndexBinOffsets[*it + 1] += 1;
+      for (i=0; i<_iFragIndexNumBins; i++)
+         _vuiFragIndexBinOffsets[i+1] += _vuiFragIndexBinOffsets[i];
+
+      vector<unsigned int> vuiFill(_vuiFragIndexBinOffsets.begin(), _vuiFragIndexBinOffsets.end() - 1);
+      _viFragIndexQueries.resize(vuiQueryBins.size());
+      for (i=0; i<iNumQueries; i++)
       {
-         strcpy(szPeffAttributeVariant, "\\VariantSimple=");
-         strcpy(szPeffAttributeVariantComplex, "\\VariantComplex=");
+         for (unsigned int ui=vuiQueryOffsets[i]; ui<vuiQueryOffsets[i+1]; ui++)
+            _viFragIndexQueries[vuiFill[vuiQueryBins[ui]]++] = i;
       }
-      else
+
+      // per thread counts and touched lists; first half target, second half decoy
+      _ppusFragIndexCountArr = new unsigned short*[g_staticParams.options.iNumThreads]();
+      _ppiFragIndexTouchedArr = new int*[g_staticParams.options.iNumThreads]();
+      for (i=0; i<g_staticParams.options.iNumThreads; i++)
       {
-         strcpy(szPeffAttributeVariant, "");
-         strcpy(szPeffAttributeVariantComplex, "");
+         _ppusFragIndexCountArr[i] = new unsigned short[2*iNumQueries]();
+         _ppiFragIndexTouchedArr[i] = new int[2*iNumQueries];
       }
+   }
+   catch (std::bad_alloc& ba)
+   {
+      char szErrorMsg[SIZE_ERROR];
+      sprintf(szErrorMsg,  " Error - creating fragment ion index for %d spectra. bad_alloc: %s.\n", iNumQueries, ba.what());
+      sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
+      sprintf(szErrorMsg+strlen(szErrorMsg), "and \"fragindex_num_spectrumpeaks\" parameters to mitigate memory use.\n");
+      string strErrorMsg(szErrorMsg);
+      g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+      logerr(szErrorMsg);
+      DeleteFragmentIndex();
+      return false;
+   }
 
-      if (g_staticParams.peffInfo.iPeffSearch > 1)
-         strcpy(szPeffAttributeProcessed, "\\Processed=");
-      else
-         strcpy(szPeffAttributeProcessed, "");
-
-      int  iLenAttributeVariant = (int)strlen(szPeffAttributeVariant);
-      int  iLenAttributeVariantComplex = (int)strlen(szPeffAttributeVariantComplex);
-      int  iLenAttributeMod = (int)strlen(szPeffAttributeMod);
-      int  iNumBadChars = 0; // count # of bad (non-printing) characters in header 
- 
-      bool bHeadOfFasta = true;
-      // Loop through entire database.
-      while(!feof(fp))
-      {
+   _bFragIndexActive = true;
 
-         dbe.strName = "";
-         dbe.strSeq = "";
-         dbe.vectorPeffMod.clear();
-         dbe.vectorPeffVariantSimple.clear();
-         dbe.vectorPeffVariantComplex.clear();
-         dbe.vectorPeffProcessed.clear();
+   return true;
+}
 
-         if (bHeadOfFasta)
-         {
-            // skip through whitespace at head of line
-            while (isspace(iTmpCh))
-               iTmpCh = getc(fp);
 
-            // skip comment lines
-            if (iTmpCh == '#')
-            {
-               // skip to description line
-               while ((iTmpCh != '\n') && (iTmpCh != '\r') && (iTmpCh != EOF))
-                  iTmpCh = getc(fp);
-            }
+void CometSearch::DeleteFragmentIndex(void)
+{
+   int i;
 
-            bHeadOfFasta = false;
-         }
+   if (_ppusFragIndexCountArr != NULL)
+   {
+      for (i=0; i<g_staticParams.options.iNumThreads; i++)
+         delete [] _ppusFragIndexCountArr[i];
+      delete [] _ppusFragIndexCountArr;
+      _ppusFragIndexCountArr = NULL;
+   }
 
-         if (iTmpCh == '>') // Expect a '>' for sequence header line.
-         {
-            // grab file pointer here for this sequence entry
-            // this will be stored for protein references for each matched entry and
-            // will be used to retrieve actual protein references when printing output
-            dbe.lProteinFilePosition = ftell(fp);
+   if (_ppiFragIndexTouchedArr != NULL)
+   {
+      for (i=0; i<g_staticParams.options.iNumThreads; i++)
+         delete [] _ppiFragIndexTouchedArr[i];
+      delete [] _ppiFragIndexTouchedArr;
+      _ppiFragIndexTouchedArr = NULL;
+   }
 
-            bTrimDescr = false;
-            while (((iTmpCh = getc(fp)) != '\n') && (iTmpCh != '\r') && (iTmpCh != EOF))
-            {
-               if (!bTrimDescr && iscntrl(iTmpCh))
-                  bTrimDescr = true;
+   vector<unsigned int>().swap(_vuiFragIndexBinOffsets);
+   vector<int>().swap(_viFragIndexQueries);
+   vector<int>().swap(_viFragIndexMaxFragCharge);
 
-               if (!bTrimDescr && dbe.strName.size() < (WIDTH_REFERENCE-1))
-               {
-                  if (iTmpCh < 32 || iTmpCh>126)  // sanity check for reading binary (index) file
-                  {
-                     iNumBadChars++;
-                     if (iNumBadChars > 20)
-                     {
-                        logerr(" Too many non-printing characters in database header lines; wrong file type/format?\n");
-                        fclose(fp);
-                        return false;
-                     }
-                  }
-                  else
-                     dbe.strName += iTmpCh;
-               }
+   _iFragIndexNumBins = 0;
+   _bFragIndexActive = false;
+}
 
-               // load and parse PEFF header
-               if (g_staticParams.peffInfo.iPeffSearch)
-               {
-                  if (iTmpCh == '\\')
-                  {
-                     ungetc(iTmpCh, fp);
 
-                     // grab rest of description line here
-                     szPeffLine[0]='\0';
-                     fgets(szPeffLine, iLenSzLine, fp);
-                     while (!feof(fp) && szPeffLine[strlen(szPeffLine)-1]!='\n')
-                     {
-                        char *pTmp;
-                        iLenSzLine += 512;
-                        pTmp = (char *)realloc(szPeffLine, iLenSzLine);
-                        if (pTmp == NULL)
-                        {
-                           char szErrorMsg[SIZE_ERROR];
-                           sprintf(szErrorMsg,  " Error realloc(szPeffLine[%d])\n", iLenSzLine);
-                           string strErrorMsg(szErrorMsg);
-                           g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-                           logerr(szErrorMsg);
-                           fclose(fp);
-                           return false;
-                        }
-                        szPeffLine = pTmp;
-                        fgets(szPeffLine+(int)strlen(szPeffLine), iLenSzLine - (int)strlen(szPeffLine), fp);
-                     }
+// Allocate per thread xcorr histograms and matched peptide counts for the current
+// batch of queries so that XcorrScore() only needs the query lock for candidates
+// that can enter the stored results.
+bool CometSearch::CreateThreadScoring(void)
+{
+   int iNumQueries = (int)g_pvQuery.size();
+   int i;
 
-                     // grab from \ModResPsi or \ModResUnimod and \VariantSimple to end of line
-                     char *pStr;
-                     if (iLenAttributeMod>0 && (pStr = strstr(szPeffLine, szPeffAttributeMod)) != NULL)
-                     {
-                        char *pStr2;
-                        pStr += iLenAttributeMod;
+   DeleteThreadScoring();
 
-                        pStr2 = pStr;
+   if (!g_staticParams.options.bThreadLocalScoring
+         || g_staticParams.bIndexDb
+         || g_staticParams.options.bCreateIndex
+         || iNumQueries == 0)
+   {
+      return true;
+   }
 
-                        // need to find closing parenthesis
-                        int iTmp=0;  // count of number of open parenthesis
-                        while (1)
-                        {
-                           if ((iTmp == 0 && *pStr2 == ' ') || *pStr2 == '\r' || *pStr2=='\n')
-                              break;
-                           else if (*pStr2 == '(')
-                              iTmp++;
-                           else if (*pStr2 == ')')
-                              iTmp--;
+   try
+   {
+      _ppuiThreadHistogramArr = new unsigned int*[g_staticParams.options.iNumThreads]();
+      _ppuliThreadNumMatchedArr = new unsigned long int*[g_staticParams.options.iNumThreads]();
+      for (i=0; i<g_staticParams.options.iNumThreads; i++)
+      {
+         _ppuiThreadHistogramArr[i] = new unsigned int[(size_t)iNumQueries * HISTO_SIZE]();
+         _ppuliThreadNumMatchedArr[i] = new unsigned long int[2 * (size_t)iNumQueries]();
+      }
+   }
+   catch (std::bad_alloc& ba)
+   {
+      char szErrorMsg[SIZE_ERROR];
+      sprintf(szErrorMsg,  " Error - new(_ppuiThreadHistogramArr[%d]). bad_alloc: %s.\n", iNumQueries, ba.what());
+      sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
+      sprintf(szErrorMsg+strlen(szErrorMsg), "and \"thread_local_scoring\" parameters to mitigate memory use.\n");
+      string strErrorMsg(szErrorMsg);
+      g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+      logerr(szErrorMsg);
+      DeleteThreadScoring();
+      return false;
+   }
 
-                           pStr2++;
-                        }
+   return true;
+}
 
-                        iLen = pStr2 - pStr;
 
-                        if ( iLen > iLenAllocMods)
-                        {
-                           char *pTmp;
+// Add every thread's histograms and matched peptide counts into the queries.
+void CometSearch::MergeThreadScoring(void)
+{
+   int iNumQueries = (int)g_pvQuery.size();
+   int i;
+   int iWhichQuery;
 
-                           iLenAllocMods = iLen + 1000;
-                           pTmp=(char *)realloc(szMods, iLenAllocMods);
-                           if (pTmp == NULL)
-                           {
-                              char szErrorMsg[SIZE_ERROR];
-#ifdef _WIN32
-                              sprintf(szErrorMsg,  " Error realloc(szMods[%lld])\n", iLenAllocMods);
-#else
-                              sprintf(szErrorMsg,  " Error realloc(szMods[%ld])\n", iLenAllocMods);
-#endif
-                              string strErrorMsg(szErrorMsg);
-                              g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-                              logerr(szErrorMsg);
-                              fclose(fp);
-                              return false;
-                           }
-                           szMods = pTmp;
-                        }
+   if (_ppuiThreadHistogramArr == NULL)
+      return;
 
-                        strncpy(szMods, pStr, iLen);
-                        szMods[iLen]='\0';
+   for (iWhichQuery=0; iWhichQuery<iNumQueries; iWhichQuery++)
+   {
+      Query* pQuery = g_pvQuery.at(iWhichQuery);
+      unsigned long int uliNumScored = 0;
 
-                        if ( (pStr2 = strrchr(szMods, ')'))!=NULL)
-                        {
-                           pStr2++;
-                           *pStr2 = '\0';
-                        }
-                        else
-                        {
-                           char szErrorMsg[SIZE_ERROR];
-                           sprintf(szErrorMsg,  " Error: PEFF entry '%s' missing mod closing parenthesis\n", dbe.strName.c_str()); 
-                           string strErrorMsg(szErrorMsg);
-                           g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-                           logerr(szErrorMsg);
-                           fclose(fp);
-                           return false;
-                        }
+      for (i=0; i<g_staticParams.options.iNumThreads; i++)
+      {
+         unsigned int *puiHistogram = _ppuiThreadHistogramArr[i] + (size_t)iWhichQuery * HISTO_SIZE;
 
-                        int iPos;
-                        string strModID;
+         for (int iBin=0; iBin<HISTO_SIZE; iBin++)
+         {
+            pQuery->iXcorrHistogram[iBin] += puiHistogram[iBin];
+            uliNumScored += puiHistogram[iBin];
+         }
 
-                        // now tokenize/split szMods on ')' character
-                        string strModRes(szMods);
-                        istringstream ssMods(strModRes);
-                        while (!ssMods.eof())
-                        {
-                           string strModEntry;
-                           getline(ssMods, strModEntry, ')');
+         pQuery->_uliNumMatchedPeptides += _ppuliThreadNumMatchedArr[i][2*iWhichQuery];
+         pQuery->_uliNumMatchedDecoyPeptides += _ppuliThreadNumMatchedArr[i][2*iWhichQuery + 1];
+      }
 
-                           iPos = 0;
+      // same cap as incrementing iHistogramCount once per scored peptide
+      uliNumScored += pQuery->iHistogramCount;
+      pQuery->iHistogramCount = (uliNumScored < DECOY_SIZE) ? (int)uliNumScored : DECOY_SIZE;
+   }
 
-                           if (strModEntry.length() < 8)   // strModEntry should look like "(1|XXX:1|name"
-                              break;
+   DeleteThreadScoring();
+}
 
-                           // at this point, strModEntry should look like (118,121|MOD:00000 
-                           if (strModEntry[0]=='(' && isdigit(strModEntry[1]))  //handle possible '?' in the position field ; need to check that strModEntry looks like "(number"
-                           {
-                              // turn '|' to space
-                              std::string::iterator it;
-                              for (it = strModEntry.begin(); it != strModEntry.end(); ++it)
-                              {
-                                 if (*it == '|' || *it == '(')
-                                    *it = ' ';
-                              }
 
-                              // split "118,121 MOD:00000" into "118,121" and "MOD:00000"
-                              std::stringstream converter(strModEntry);
-                              string strPos;
-                              string strModID;
-                              converter >> strPos >> strModID;
+void CometSearch::DeleteThreadScoring(void)
+{
+   int i;
 
-                              // now tokenize on comma separated szPos
-                              istringstream ss(strPos);
-                              while (!ss.eof())
-                              {
-                                 string x;               // here's a nice, empty string
-                                 getline( ss, x, ',' );  // try to read the next field into it
-                                 iPos = atoi(x.c_str());
-                                 if (iPos <= 0)
-                                 {
-                                    if (g_staticParams.options.bVerboseOutput)
-                                    {
-                                       char szErrorMsg[SIZE_ERROR];
-                                       sprintf(szErrorMsg,  "Warning:  %s, %s=(%d|%s) ignored; modentry: %s\n",
-                                             dbe.strName.c_str(), szPeffAttributeMod, iPos, strModID.c_str(), strModEntry.c_str());
-                                       string strErrorMsg(szErrorMsg);
-                                       g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-                                       logerr(szErrorMsg);
-                                    }
-                                 }
-                                 else
-                                 {
-                                    struct PeffModStruct pData;
-                                    CometSearch pOBO;
+   if (_ppuiThreadHistogramArr != NULL)
+   {
+      for (i=0; i<g_staticParams.options.iNumThreads; i++)
+         delete [] _ppuiThreadHistogramArr[i];
+      delete [] _ppuiThreadHistogramArr;
+      _ppuiThreadHistogramArr = NULL;
+   }
 
-                                    pData.iPosition = iPos - 1;   // represent PEFF mod position in 0 array index coordinates
+   if (_ppuliThreadNumMatchedArr != NULL)
+   {
+      for (i=0; i<g_staticParams.options.iNumThreads; i++)
+         delete [] _ppuliThreadNumMatchedArr[i];
+      delete [] _ppuliThreadNumMatchedArr;
+      _ppuliThreadNumMatchedArr = NULL;
+   }
+}
 
-                                    // find strModID in vectorPeffOBO and get pData.dMassDiffAvg and pData.MassDiffMono
-                                    if (pOBO.MapOBO(strModID, &vectorPeffOBO, &pData))
-                                    {
-                                       dbe.vectorPeffMod.push_back(pData);
-                                    }
-                                 }
-                              }
-                           }
-                           else
-                           {
-                              if (g_staticParams.options.bVerboseOutput)
-                              {
-                                 char szErrorMsg[SIZE_ERROR];
-                                 sprintf(szErrorMsg,  "Warning:  %s, %s=(%d|%s) ignored; modentry: %s\n",
-                                       dbe.strName.c_str(), szPeffAttributeMod, iPos, strModID.c_str(), strModEntry.c_str());
-                                 string strErrorMsg(szErrorMsg);
-                                 g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-                                 logerr(szErrorMsg);
-                              }
-                           }
-                        }
-                     }
 
-                     if (iLenAttributeVariant>0 && (pStr = strstr(szPeffLine, szPeffAttributeVariant)) != NULL)
-                     {
-                        char *pStr2;
-                        pStr += iLenAttributeVariant;
+// Count, for the queries the current peptide will be scored against, how many of its
+// binned fragment ions fall on one of that query's indexed peaks.  These queries run
+// from iWhichQuery, the first one whose precursor tolerance matches dCalcPepMass, up to
+// the first one whose tolerance window starts above it, as in the callers' scoring
+// loops.  Each bin's query list is sorted, so only that range of it is visited.
+void CometSearch::FragmentIndexCountPeptide(int iLenPeptide,
+                                            bool bDecoyPep,
+                                            int iWhichQuery,
+                                            double dCalcPepMass)
+{
+   int i;
+   int ctCharge;
+   int ctIonSeries;
+   int ctLen;
+   int iLenMinus1 = iLenPeptide - 1;
+   int iNumQueries = (int)_viFragIndexMaxFragCharge.size();
+   int iEndQuery = iWhichQuery;
 
-                        pStr2 = pStr;
+   while (iEndQuery < iNumQueries && dCalcPepMass >= g_pvQuery.at(iEndQuery)->_pepMassInfo.dPeptideMassToleranceMinus)
+      iEndQuery++;
 
-                        // need to find closing parenthesis
-                        int iTmp=0;  // count of number of open parenthesis
-                        while (1)
-                        {
-                           if ((iTmp == 0 && *pStr2 == ' ') || *pStr2 == '\r' || *pStr2=='\n')
-                              break;
-                           else if (*pStr2 == '(')
-                              iTmp++;
-                           else if (*pStr2 == ')')
-                              iTmp--;
+   unsigned int (*p_uiBinnedIonMasses)[MAX_FRAGMENT_CHARGE+1][9][MAX_PEPTIDE_LEN][BIN_MOD_COUNT];
+   unsigned short *pusCounts;
+   int *piTouched;
+   int *piNumTouched;
 
-                           pStr2++;
-                        }
+   if (bDecoyPep)
+   {
+      p_uiBinnedIonMasses = &_uiBinnedIonMassesDecoy;
+      pusCounts = _pusFragIndexCounts + iNumQueries;
+      piTouched = _piFragIndexTouched + iNumQueries;
+      piNumTouched = &_iFragIndexNumTouchedDecoy;
+   }
+   else
+   {
+      p_uiBinnedIonMasses = &_uiBinnedIonMasses;
+      pusCounts = _pusFragIndexCounts;
+      piTouched = _piFragIndexTouched;
+      piNumTouched = &_iFragIndexNumTouched;
+   }
 
-                        iLen = pStr2 - pStr;
+   // reset counts of previous peptide
+   for (i=0; i<*piNumTouched; i++)
+      pusCounts[piTouched[i]] = 0;
+   *piNumTouched = 0;
 
-                        if ( iLen > iLenAllocMods)
-                        {
-                           char *pTmp;
-                           iLenAllocMods = iLen + 1000;
-                           pTmp=(char *)realloc(szMods, iLenAllocMods);
-                           if (pTmp == NULL)
-                           {
-                              char szErrorMsg[SIZE_ERROR];
-#ifdef _WIN32
-                              sprintf(szErrorMsg,  " Error realloc(szMods[%lld])\n", iLenAllocMods);
-#else
-                              sprintf(szErrorMsg,  " Error realloc(szMods[%ld])\n", iLenAllocMods);
-#endif
-                              string strErrorMsg(szErrorMsg);
-                              g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-                              logerr(szErrorMsg);
-                              fclose(fp);
-                              return false;
-                           }
-                           szMods = pTmp;
-                        }
+   for (ctCharge=1; ctCharge<=g_massRange.iMaxFragmentCharge; ctCharge++)
+   {
+      for (ctIonSeries=0; ctIonSeries<g_staticParams.ionInformation.iNumIonSeriesUsed; ctIonSeries++)
+      {
+         for (ctLen=0; ctLen<iLenMinus1; ctLen++)
+         {
+            unsigned int uiBin = (*p_uiBinnedIonMasses)[ctCharge][ctIonSeries][ctLen][0];
 
-                        strncpy(szMods, pStr, iLen);
-                        szMods[iLen]='\0';
+            if (uiBin == 0 || uiBin >= (unsigned int)_iFragIndexNumBins)
+               continue;
 
-                        if ( (pStr2 = strrchr(szMods, ')'))!=NULL)
-                        {
-                           pStr2++;
-                           *pStr2 = '\0';
-                        }
-                        else
-                        {
-                           char szErrorMsg[SIZE_ERROR];
-                           sprintf(szErrorMsg,  " Error: PEFF entry '%s' missing variant closing parenthesis\n", dbe.strName.c_str()); 
-                           string strErrorMsg(szErrorMsg);
-                           g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-                           logerr(szErrorMsg);
-                           fclose(fp);
-                           return false;
-                        }
+            const int *piBinEnd = _viFragIndexQueries.data() + _vuiFragIndexBinOffsets[uiBin+1];
+            const int *piQuery = _viFragIndexQueries.data() + _vuiFragIndexBinOffsets[uiBin];
 
-                        // parse VariantSimple entries
-                        string strMods(szMods);
-                        istringstream ssVariants(strMods);
-                        string strVariant;
-                        char cVariant;
-                        int iPos;
+            piQuery = lower_bound(piQuery, piBinEnd, iWhichQuery);
 
-                        while (!ssVariants.eof())
-                        {
-                           string strVariantEntry;
-                           getline(ssVariants, strVariantEntry, ')');
+            for (; piQuery < piBinEnd && *piQuery < iEndQuery; piQuery++)
+            {
+               if (_viFragIndexMaxFragCharge[*piQuery] >= ctCharge)
+               {
+                  if (pusCounts[*piQuery] == 0)
+                     piTouched[(*piNumTouched)++] = *piQuery;
+                  pusCounts[*piQuery]++;
+               }
+            }
+         }
+      }
+   }
+}
 
-                           //handle possible '?' in the position field; need to check that strVariantEntry looks like "(number"
-                           if (strVariantEntry[0]=='(' && isdigit(strVariantEntry[1]))
-                           {
-                              // turn '|' to space
-                              std::string::iterator it;
-                              for (it = strVariantEntry.begin(); it != strVariantEntry.end(); ++it)
-                              {
-                                 if (*it == '|' || *it == '(')
-                                    *it = ' ';
-                              }
 
-                              // split "8 C" into "8" and "C"
-                              iPos = -1;
-                              std::stringstream converter(strVariantEntry);
-                              converter >> iPos >> strVariant;
+// Zero the target and decoy counts left behind by the last peptide scored.
+void CometSearch::FragmentIndexResetCounts(void)
+{
+   int i;
+   int iNumQueries = (int)_viFragIndexMaxFragCharge.size();
 
-                              // make sure variant residue is just a single residue in VariantSimple entry
-                              cVariant = '\0';
-                              if (strVariant.length() == 1)
-                                 cVariant = strVariant[0];
+   for (i=0; i<_iFragIndexNumTouched; i++)
+      _pusFragIndexCounts[_piFragIndexTouched[i]] = 0;
+   _iFragIndexNumTouched = 0;
 
-                              // sanity check: make sure position is positive and residue is A-Z or *
-                              if (iPos<0 || ((cVariant<65 || cVariant>90) && cVariant!=42))  // char can be AA or *
-                              {
-                                 if (g_staticParams.options.bVerboseOutput)
-                                 {
-                                    char szErrorMsg[SIZE_ERROR];
-                                    sprintf(szErrorMsg,  "Warning:  %s, VariantSimple=(%d|%c) ignored\n", dbe.strName.c_str(), iPos, cVariant);
-                                    string strErrorMsg(szErrorMsg);
-                                    g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-                                    logerr(szErrorMsg);
-                                 }
-                              }
-                              else
-                              {
-                                 struct PeffVariantSimpleStruct pData;
+   for (i=0; i<_iFragIndexNumTouchedDecoy; i++)
+      _pusFragIndexCounts[iNumQueries + _piFragIndexTouched[iNumQueries + i]] = 0;
+   _iFragIndexNumTouchedDecoy = 0;
+}
 
-                                 pData.iPosition = iPos - 1;   // represent PEFF variant position in 0 array index coordinates
-                                 pData.cResidue = cVariant;
-                                 dbe.vectorPeffVariantSimple.push_back(pData);
-                              }
-                           }
-                        }
-                     }
 
-                     if (iLenAttributeVariantComplex > 0 && (pStr = strstr(szPeffLine, szPeffAttributeVariantComplex)) != NULL)
-                     {
-                       char* pStr2;
-                       pStr += iLenAttributeVariantComplex;
+// Returns true if candidate peptide shares enough fragment ions with query to be scored.
+bool CometSearch::FragmentIndexPassFilter(int iWhichQuery,
+                                          bool bDecoyPep)
+{
+   if (bDecoyPep)
+      iWhichQuery += (int)_viFragIndexMaxFragCharge.size();
+
+   return (_pusFragIndexCounts[iWhichQuery] >= g_staticParams.options.iFragIndexMinIonsScore);
+}
 
-                       pStr2 = pStr;
 
-                       // need to find closing parenthesis
-                       int iTmp = 0;  // count of number of open parenthesis
-                       while (1)
-                       {
-                         if ((iTmp == 0 && *pStr2 == ' ') || *pStr2 == '\r' || *pStr2 == '\n')
-                           break;
-                         else if (*pStr2 == '(')
-                           iTmp++;
-                         else if (*pStr2 == ')')
-                           iTmp--;
-
-                         pStr2++;
-                       }
-
-                       iLen = pStr2 - pStr;
-
-                       if (iLen > iLenAllocMods)
-                       {
-                         char* pTmp;
-                         iLenAllocMods = iLen + 1000;
-                         pTmp = (char*)realloc(szMods, iLenAllocMods);
-                         if (pTmp == NULL)
-                         {
-                           char szErrorMsg[SIZE_ERROR];
+bool CometSearch::RunSearch(void)
+{
+
+   CometSearch sqSearch;
+   return sqSearch.IndexSearch(NULL);
+
+}
+
+
+// Map an open database file read-only.  Returns NULL if the file cannot be mapped
+// so that the caller can fall back to reading through the FILE stream.
+const char *CometSearch::MapDatabaseFile(FILE *fp,
+                                         comet_fileoffset_t lSize)
+{
+   if (lSize <= 0 || (comet_fileoffset_t)(size_t)lSize != lSize)
+      return NULL;
+
 #ifdef _WIN32
-                           sprintf(szErrorMsg, " Error realloc(szMods[%lld])\n", iLenAllocMods);
+   HANDLE hFile = (HANDLE)_get_osfhandle(_fileno(fp));
+   if (hFile == INVALID_HANDLE_VALUE)
+      return NULL;
+
+   HANDLE hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+   if (hMapping == NULL)
+      return NULL;
+
+   const char *pMap = (const char *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+   CloseHandle(hMapping);  // the view keeps the mapping open
+
+   return pMap;
 #else
-                           sprintf(szErrorMsg, " Error realloc(szMods[%ld])\n", iLenAllocMods);
-#endif
-                           string strErrorMsg(szErrorMsg);
-                           g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-                           logerr(szErrorMsg);
-                           fclose(fp);
-                           return false;
-                         }
-                         szMods = pTmp;
-                       }
-
-                       strncpy(szMods, pStr, iLen);
-                       szMods[iLen] = '\0';
-
-                       if ((pStr2 = strrchr(szMods, ')')) != NULL)
-                       {
-                         pStr2++;
-                         *pStr2 = '\0';
-                       } else
-                       {
-                         char szErrorMsg[SIZE_ERROR];
-                         sprintf(szErrorMsg, " Error: PEFF entry '%s' missing variant closing parenthesis\n", dbe.strName.c_str());
-                         string strErrorMsg(szErrorMsg);
-                         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-                         logerr(szErrorMsg);
-                         fclose(fp);
-                         return false;
-                       }
-
-                       // parse VariantComplex entries
-                       string strMods(szMods);
-                       istringstream ssVariants(strMods);
-                       string strVariant;
-                       string strTag;
-                       int iPosA;
-                       int iPosB;
-
-                       while (!ssVariants.eof())
-                       {
-                         string strVariantEntry;
-                         getline(ssVariants, strVariantEntry, ')');
-
-                         //handle possible '?' in the position field; need to check that strVariantEntry looks like "(number"
-                         if (strVariantEntry[0] == '(' && isdigit(strVariantEntry[1]))
-                         {
-                           // turn '|' to space
-                           std::string::iterator it;
-                           for (it = strVariantEntry.begin(); it != strVariantEntry.end(); ++it)
-                           {
-                             if (*it == '|' || *it == '(')
-                               *it = ' ';
-                           }
-                           
-                           // split "8 10 C" into "8" and "10" and "C"
-                           strVariant.clear();
-                           iPosA = -1;
-                           std::stringstream converter(strVariantEntry);
-                           converter >> iPosA >> iPosB >> strVariant >> strTag;
-                           
-                           // presence of a double space "  " indicates deletion with Tag (special case format)
-                           if (strVariantEntry.find("  ") != string::npos)
-                           {
-                             strTag = strVariant;
-                             strVariant.clear();
-                           }
+   void *pMap = mmap(NULL, (size_t)lSize, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+   if (pMap == MAP_FAILED)
+      return NULL;
 
-                           // sanity check: make sure position is correct.
-                           // TODO: add sanity check to make sure replacement AAs are A-Z or *
-                           if (iPosA < 0 || iPosB < 0 || iPosB < iPosA) 
-                           {
-                             if (g_staticParams.options.bVerboseOutput)
-                             {
-                               char szErrorMsg[SIZE_ERROR];
-                               sprintf(szErrorMsg, "Warning:  %s, VariantComplex=(%d|%d|%s) ignored\n", dbe.strName.c_str(), iPosA, iPosB,strVariant.c_str());
-                               string strErrorMsg(szErrorMsg);
-                               g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-                               logerr(szErrorMsg);
-                             }
-                           } else
-                           {
-                             struct PeffVariantComplexStruct pData;
+   madvise(pMap, (size_t)lSize, MADV_SEQUENTIAL);
 
-                             pData.iPositionA = iPosA - 1;   // represent PEFF variant position in 0 array index coordinates
-                             pData.iPositionB = iPosB - 1;
-                             pData.sResidues = strVariant;
-                             dbe.vectorPeffVariantComplex.push_back(pData);
-                           }
-                         }
-                       }
-                     }
+   return (const char *)pMap;
+#endif
+}
 
-                     // exit out of this as end of line grabbed
-                     break;
-                  }
-               } // done with PEFF
-            }
 
-            if (dbe.strName.length() <= 0)
-            {
-               char szErrorMsg[SIZE_ERROR];
-               sprintf(szErrorMsg,  "\n Error - zero length sequence description; wrong database file/format?\n");
-               string strErrorMsg(szErrorMsg);
-               g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-               logerr(szErrorMsg);
-               return false;
-            }
+void CometSearch::UnmapDatabaseFile(const char *pMap,
+                                    comet_fileoffset_t lSize)
+{
+#ifdef _WIN32
+   UnmapViewOfFile(pMap);
+#else
+   munmap((void *)pMap, (size_t)lSize);
+#endif
+}
 
-            if (g_staticParams.options.bCreateIndex)
-            {
-               struct IndexProteinStruct sEntry;
 
-               // store protein name
-               strcpy(sEntry.szProt, dbe.strName.c_str());
-               sEntry.lProteinFilePosition = dbe.lProteinFilePosition;
-               g_pvProteinNames.insert({ sEntry.lProteinFilePosition, sEntry });
-            }
+// Parse a memory mapped FASTA or PEFF database and queue each entry for searching.
+// The entries are parsed as in the stream reader in RunSearch(), so protein names,
+// sequences and lProteinFilePosition offsets are identical.  After the head of the file
+// the buffer is split into chunks that start at a '>' following a newline; the search
+// threads parse chunks ahead of the one whose entries are being queued, so parsing
+// runs in parallel while the entries are still queued in file order.
+bool CometSearch::ReadMappedDatabase(const char *pMap,
+                                     comet_fileoffset_t lEndPos,
+                                     int iPercentStart,
+                                     int iPercentEnd,
+                                     vector<OBOStruct> *vectorPeffOBO,
+                                     ThreadPool *tp)
+{
+   const char *pPos = pMap;          // current character, as iTmpCh in the stream reader
+   const char *pEnd = pMap + lEndPos;
+   int iNumBadChars = 0;             // count # of bad (non-printing) characters in header
+   deque<std::shared_ptr<DatabaseChunkData>> dChunks;   // submitted chunks in file order
+   size_t tMaxChunks = 2 * (size_t)(g_staticParams.options.iNumThreads > 1 ? g_staticParams.options.iNumThreads : 1);
+
+   // skip through whitespace at head of file
+   while (pPos < pEnd && isspace((unsigned char)*pPos))
+      pPos++;
+
+   // skip comment line
+   if (pPos < pEnd && *pPos == '#')
+   {
+      while (pPos < pEnd && *pPos != '\n' && *pPos != '\r')
+         pPos++;
+   }
 
-            // Load sequence
-            while (((iTmpCh=getc(fp)) != '>') && (iTmpCh != EOF))
-            {
-               if ('a'<=iTmpCh && iTmpCh<='z')
-               {
-                  dbe.strSeq += iTmpCh - 32;  // convert toupper case so subtract 32 (i.e. 'A'-'a')
-                  g_staticParams.databaseInfo.uliTotAACount++;
-               }
-               else if ('A'<=iTmpCh && iTmpCh<='Z')
-               {
-                  dbe.strSeq += iTmpCh;
-                  g_staticParams.databaseInfo.uliTotAACount++;
-               }
-               else if (iTmpCh == '*')  // stop codon
-               {
-                  dbe.strSeq += iTmpCh;
-               }
-            }
+   // skip lines up to the first entry
+   while (pPos < pEnd && *pPos != '>')
+   {
+      // skip rest of line as fgets() into the stream reader's 8192 byte buffer would
+      const char *pLine = pPos + 1;
+      size_t iMaxLen = (size_t)(pEnd - pLine) < 8191 ? (size_t)(pEnd - pLine) : 8191;
+      const char *pNewLine = (const char *)memchr(pLine, '\n', iMaxLen);
 
-            // Allow up to 500 jobs/sequences to be queued before pausing; otherwise all
-            // sequences in the database will be loaded/queued all at once which can be
-            // a memory issue for extremely large fasta files
-            while (pSearchThreadPool->jobs_.size() >= 500)
-               pSearchThreadPool->wait_on_threads();
+      pPos = (pNewLine != NULL) ? pNewLine + 1 : pLine + iMaxLen;
+   }
 
-            // Now search sequence entry; add threading here so that
-            // each protein sequence is passed to a separate thread.
-            SearchThreadData *pSearchThreadData = new SearchThreadData(dbe);
+   while (pPos < pEnd || !dChunks.empty())
+   {
+      // keep up to tMaxChunks chunks parsing ahead
+      while (pPos < pEnd && dChunks.size() < tMaxChunks)
+      {
+         std::shared_ptr<DatabaseChunkData> pNewChunk = std::make_shared<DatabaseChunkData>();
 
-            pSearchThreadPool->doJob(std::bind(SearchThreadProc, pSearchThreadData, pSearchThreadPool));
+         pNewChunk->pMap = pMap;
+         pNewChunk->pStart = pPos;
+         pNewChunk->pEnd = pEnd;
+         pNewChunk->vectorPeffOBO = vectorPeffOBO;
 
-            g_staticParams.databaseInfo.iTotalNumProteins++;
+         // end the chunk at the first entry starting DATABASE_PARSE_CHUNK bytes on
+         if (pEnd - pPos > DATABASE_PARSE_CHUNK)
+         {
+            const char *pNewLine = pPos + DATABASE_PARSE_CHUNK;
 
-            if (!g_staticParams.options.bOutputSqtStream && !(g_staticParams.databaseInfo.iTotalNumProteins%500))
+            while ((pNewLine = (const char *)memchr(pNewLine, '\n', pEnd - pNewLine)) != NULL
+                  && pNewLine + 1 < pEnd)
             {
-               char szTmp[128];
-               lCurrPos = ftell(fp);
-               if (g_staticParams.options.bCreateIndex)
-                  sprintf(szTmp, "%3d%%", (int)(100.0*(0.005 + (double)lCurrPos/(double)lEndPos)));
-               else // go from iPercentStart to iPercentEnd, scaled by lCurrPos/iEndPos
-                  sprintf(szTmp, "%3d%%", (int)(((double)(iPercentStart + (iPercentEnd-iPercentStart)*(double)lCurrPos/(double)lEndPos) )));
-               logout(szTmp);
-               fflush(stdout);
-               logout("\b\b\b\b");
+               pNewLine++;
+               if (*pNewLine == '>')
+               {
+                  pNewChunk->pEnd = pNewLine;
+                  break;
+               }
             }
-
-            bSucceeded = !g_cometStatus.IsError() && !g_cometStatus.IsCancel();
-            if (!bSucceeded)
-               break;
-         }
-         else
-         {
-            fgets(szBuf, sizeof(szBuf), fp);
-            iTmpCh = getc(fp);
          }
+
+         tp->doJob(std::bind(ParseDatabaseChunkThreadProc, pNewChunk));
+         dChunks.push_back(pNewChunk);
+         pPos = pNewChunk->pEnd;
       }
 
-      // Wait for active search threads to complete processing.
+      std::shared_ptr<DatabaseChunkData> pChunk = dChunks.front();
+      dChunks.pop_front();
 
-      pSearchThreadPool->wait_on_threads();
+      // parse the chunk here unless a search thread already started on it
+      if (!pChunk->bClaimed.exchange(true))
+         ParseDatabaseChunk(pChunk.get());
+      else
+         Threading::WaitSemaphore(pChunk->semParsed);
 
-      // Check for errors one more time since there might have been an error
-      // while we were waiting for the threads.
-      if (bSucceeded)
+      for (size_t i = 0; i < pChunk->vEntries.size(); i++)
       {
-         bSucceeded = !g_cometStatus.IsError() && !g_cometStatus.IsCancel();
-      }
+         iNumBadChars += pChunk->viNumBadChars[i];
+         if (iNumBadChars > 20)
+         {
+            logerr(" Too many non-printing characters in database header lines; wrong file type/format?\n");
+            return false;
+         }
 
-      fclose(fp);
+         if (!QueueDatabaseEntry(std::move(pChunk->vEntries[i]), tp))
+            return false;
 
-      if (!g_staticParams.options.bOutputSqtStream)
-      {
-         char szTmp[128];
-         if (g_staticParams.options.bCreateIndex)
-            sprintf(szTmp, "100%%\n");
-         else
-            sprintf(szTmp, "%3d%%\n", iPercentEnd);
-         logout(szTmp);
-         fflush(stdout);
+         if (!g_staticParams.options.bOutputSqtStream && !(g_staticParams.databaseInfo.iTotalNumProteins%500))
+            ReportDatabaseProgress(pChunk->pEnd - pMap, lEndPos, iPercentStart, iPercentEnd);
       }
+      g_staticParams.databaseInfo.uliTotAACount += pChunk->uliAACount;
 
-      if (g_staticParams.peffInfo.iPeffSearch)
+      if (pChunk->iError != DatabaseChunkData::CHUNK_OK)
       {
-         free(szMods);
-         free(szPeffLine);
+         iNumBadChars += pChunk->iErrorNumBadChars;
+         if (iNumBadChars > 20)
+         {
+            logerr(" Too many non-printing characters in database header lines; wrong file type/format?\n");
+         }
+         else if (pChunk->iError == DatabaseChunkData::CHUNK_NO_DESCRIPTION)
+         {
+            char szErrorMsg[SIZE_ERROR];
+            sprintf(szErrorMsg,  "\n Error - zero length sequence description; wrong database file/format?\n");
+            string strErrorMsg(szErrorMsg);
+            g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+            logerr(szErrorMsg);
+         }
+         // a PEFF attribute error was reported when the chunk was parsed
+         return false;
       }
    }
 
-   return bSucceeded;
+   return true;
 }
 
 
-void CometSearch::ReadOBO(char *szOBO,
-                          vector<OBOStruct> *vectorPeffOBO)
+// Search thread job parsing a chunk of the mapped database ahead of the reader.
+void CometSearch::ParseDatabaseChunkThreadProc(std::shared_ptr<DatabaseChunkData> pChunk)
 {
-   FILE *fp;
-
-   if ( (fp=fopen(szOBO, "r")) != NULL)
+   if (!pChunk->bClaimed.exchange(true))
    {
-      char szLineOBO[SIZE_BUF];
+      ParseDatabaseChunk(pChunk.get());
+      Threading::SignalSemaphore(pChunk->semParsed);
+   }
+}
 
-      // store UniMod mod string "UNIMOD:1" and mass diffs 'delta_mono_mass "42.010565"' 'delta_avge_mass "42.0367"'
-      fgets(szLineOBO, SIZE_BUF, fp);
-      while (!feof(fp))
-      {
-         if (!strncmp(szLineOBO, "[Term]", 6))
-         {
-            OBOStruct pEntry;
 
-            pEntry.dMassDiffAvg = 0.0;
-            pEntry.dMassDiffMono = 0.0;
+// Parse the entries of a chunk of the mapped database.  Every entry starts at a '>'
+// and its sequence runs to the next '>', so the chunk is parsed on its own.  Parsing
+// stops at the first entry with a zero length description or malformed PEFF attributes.
+void CometSearch::ParseDatabaseChunk(DatabaseChunkData *pChunk)
+{
+   const char *pPos = pChunk->pStart;
+   const char *pEnd = pChunk->pEnd;
 
-            // keep reading until next [Term] line or EOF
-            // and store id: and mass diffs
+   while (pPos < pEnd)
+   {
+      sDBEntry dbe;
+      int iNumBadChars = 0;
 
-            // for UniMod, parse these entries:
-            //
-            // id: UNIMOD:6
-            // xref: delta_mono_mass "58.005479"
-            // xref: delta_avge_mass "58.0361"
-            //
-            // for PSI-Mod, parse these entries:
-            // id: MOD:00046
-            // xref: DiffAvg: "79.98"
-            // xref: DiffMono: "79.966331"
+      // file position just past the '>', same as ftell() in the stream reader
+      dbe.lProteinFilePosition = (comet_fileoffset_t)(pPos - pChunk->pMap) + 1;
+      pPos++;
 
-            while (fgets(szLineOBO, SIZE_BUF, fp))
-            {
-               char szTmp[MAX_PEFFMOD_LEN];
+      bool bTrimDescr = false;
+      bool bPeffLine = false;
+      while (pPos < pEnd && *pPos != '\n' && *pPos != '\r')
+      {
+         int iTmpCh = (unsigned char)*pPos++;
 
-               if (!strncmp(szLineOBO, "[Term]", 6))
-               {
-                  if (pEntry.dMassDiffMono != 0.0)
-                     (*vectorPeffOBO).push_back(pEntry);
+         if (!bTrimDescr && iscntrl(iTmpCh))
+            bTrimDescr = true;
 
-                  break;
-               }
-               else if (!strncmp(szLineOBO, "id: ", 4))
-               {
-                  sscanf(szLineOBO, "id: %16s", szTmp);
-                  pEntry.strMod = string(szTmp);
-               }
-               else if (!strncmp(szLineOBO, "xref: delta_mono_mass ", 22))
-                  sscanf(szLineOBO + 22, "\"%lf\"", &pEntry.dMassDiffMono);
-               else if (!strncmp(szLineOBO, "xref: delta_avge_mass ", 22))
-                  sscanf(szLineOBO + 22, "\"%lf\"", &pEntry.dMassDiffAvg);
-               else if (!strncmp(szLineOBO, "xref: DiffAvg: ", 15))
-                  sscanf(szLineOBO + 15, "\"%lf\"", &pEntry.dMassDiffAvg);
-               else if (!strncmp(szLineOBO, "xref: DiffMono: ", 16))
-                  sscanf(szLineOBO + 16, "\"%lf\"", &pEntry.dMassDiffMono);
-            }
-         }
-         else
+         if (!bTrimDescr && dbe.strName.size() < (WIDTH_REFERENCE-1))
          {
-            fgets(szLineOBO, SIZE_BUF, fp);
+            if (iTmpCh < 32 || iTmpCh>126)  // sanity check for reading binary (index) file
+               iNumBadChars++;
+            else
+               dbe.strName += iTmpCh;
          }
-      }
 
-      fclose(fp);
-   }
-   else
-   {
-      char szErrorMsg[SIZE_ERROR];
-      sprintf(szErrorMsg,  " Warning: cannot read PEFF OBO file \"%s\"\n", g_staticParams.peffInfo.szPeffOBO);
-      string strErrorMsg(szErrorMsg);
-      logout(szErrorMsg);
-   }
+         // load and parse PEFF header
+         if (g_staticParams.peffInfo.iPeffSearch && iTmpCh == '\\')
+         {
+            // rest of description line, including the newline, as fgets() in the stream reader
+            const char *pNewLine = (const char *)memchr(pPos, '\n', pEnd - pPos);
+            const char *pLineEnd = (pNewLine != NULL) ? pNewLine + 1 : pEnd;
+            string strPeffLine(pPos - 1, pLineEnd - (pPos - 1));
 
-}
+            pPos = pLineEnd;
+            bPeffLine = true;
 
+            if (!ParsePeffAttributes(&strPeffLine[0], dbe, pChunk->vectorPeffOBO))
+            {
+               pChunk->iError = DatabaseChunkData::CHUNK_PEFF_ERROR;
+               pChunk->iErrorNumBadChars = iNumBadChars;
+               return;
+            }
 
-bool CometSearch::MapOBO(string strMod, vector<OBOStruct> *vectorPeffOBO, struct PeffModStruct *pData)
+            // exit out of this as end of line grabbed
+            break;
+         }
+      }
+
+      if (dbe.strName.length() <= 0)
+      {
+         pChunk->iError = DatabaseChunkData::CHUNK_NO_DESCRIPTION;
+         pChunk->iErrorNumBadChars = iNumBadChars;
+         return;
+      }
+
+      // Load sequence; runs to the next '>' which is left as the current character
+      if (!bPeffLine && pPos < pEnd)
+         pPos++;
+
+      const char *pSeqEnd = (const char *)memchr(pPos, '>', pEnd - pPos);
+      if (pSeqEnd == NULL)
+         pSeqEnd = pEnd;
+
+      dbe.strSeq.reserve(pSeqEnd - pPos);
+
+      for (; pPos < pSeqEnd; pPos++)
+      {
+         char cResidue = *pPos;
+
+         if ('a'<=cResidue && cResidue<='z')
+         {
+            dbe.strSeq += cResidue - 32;  // convert toupper case so subtract 32 (i.e. 'A'-'a')
+            pChunk->uliAACount++;
+         }
+         else if ('A'<=cResidue && cResidue<='Z')
+         {
+            dbe.strSeq += cResidue;
+            pChunk->uliAACount++;
+         }
+         else if (cResidue == '*')  // stop codon
+         {
+            dbe.strSeq += cResidue;
+         }
+      }
+
+      pChunk->vEntries.push_back(std::move(dbe));
+      pChunk->viNumBadChars.push_back(iNumBadChars);
+   }
+}
+
+
+// Queue the pending group of database entries as one search thread job.
+void CometSearch::SubmitSearchJob(ThreadPool *tp)
 {
-   int iPos;
+   if (_pPendingSearchJob == NULL)
+      return;
 
-   pData->dMassDiffAvg = 0;
-   pData->dMassDiffMono = 0;
+   // Limit the number of queued jobs; otherwise the entire database could be
+   // loaded/queued all at once which can be a memory issue for extremely large
+   // fasta files.  The reader runs queued jobs itself until there is room.
+   tp->wait_on_queue((size_t)SEARCH_JOBS_PER_THREAD * g_staticParams.options.iNumThreads);
 
-   // find match of strMod in vectorPeffOBO and store diff masses in pData
+   tp->doJob(std::bind(SearchThreadProc, _pPendingSearchJob, tp));
 
-   iPos=BinarySearchPeffStrMod(0, (int)(*vectorPeffOBO).size(), strMod, *vectorPeffOBO);
+   _pPendingSearchJob = NULL;
+}
 
-   if (iPos != -1 && iPos< (int)(*vectorPeffOBO).size() )
-   {
-      pData->dMassDiffAvg = (*vectorPeffOBO).at(iPos).dMassDiffAvg;
-      pData->dMassDiffMono = (*vectorPeffOBO).at(iPos).dMassDiffMono;
 
-      if (!strMod.compare(0,7, "UNIMOD:"))
-         strncpy(pData->szMod, strMod.c_str(), MAX_PEFFMOD_LEN-1);  // UNIMOD:XXXXX
-      else if (!strMod.compare(0, 4, "MOD:"))
-         strncpy(pData->szMod, strMod.c_str(), MAX_PEFFMOD_LEN-1);  // MOD:XXXXX
-      else
-         strcpy(pData->szMod, "ERROR");
+// Hand a parsed database entry to a search thread.  Returns false on error or cancel.
+bool CometSearch::QueueDatabaseEntry(sDBEntry &&dbe,
+                                     ThreadPool *tp)
+{
+   if (g_staticParams.options.bCreateIndex)
+   {
+      struct IndexProteinStruct sEntry;
 
-      pData->szMod[MAX_PEFFMOD_LEN-1]='\0';
-      return true;
+      // store protein name; the whole field is written to the .idx, so clear its padding
+      memset(sEntry.szProt, 0, sizeof(sEntry.szProt));
+      strcpy(sEntry.szProt, dbe.strName.c_str());
+      sEntry.lProteinFilePosition = dbe.lProteinFilePosition;
+      g_pvProteinNames.insert({ sEntry.lProteinFilePosition, sEntry });
    }
-   else
+
+   if (_bDatabaseCacheFilling)
    {
-      if (g_staticParams.options.bVerboseOutput)
+      size_t tBytes = sizeof(sDBEntry) + dbe.strName.size() + dbe.strSeq.size()
+         + dbe.vectorPeffMod.size() * sizeof(PeffModStruct)
+         + dbe.vectorPeffVariantSimple.size() * sizeof(PeffVariantSimpleStruct)
+         + dbe.vectorPeffVariantComplex.size() * sizeof(PeffVariantComplexStruct)
+         + dbe.vectorPeffProcessed.size() * sizeof(PeffProcessedStruct);
+
+      // give up on caching once the database does not fit in the budget
+      if (_tDatabaseCacheBytes + tBytes > (size_t)g_staticParams.options.iDatabaseCacheSize * 1048576)
       {
-         char szErrorMsg[SIZE_ERROR];
-         sprintf(szErrorMsg,  " Warning: cannot find \"%s\" in OBO\n", strMod.c_str());
-         string strErrorMsg(szErrorMsg);
-         logerr(szErrorMsg);
+         ClearDatabaseCache();
+      }
+      else
+      {
+         _vDatabaseCache.push_back(dbe);
+         _tDatabaseCacheBytes += tBytes;
       }
-
-      return false;
    }
+
+   // Group entries into jobs of about SEARCH_JOB_RESIDUES residues so that
+   // databases of many short sequences are not dominated by job overhead.
+   if (_pPendingSearchJob == NULL)
+      _pPendingSearchJob = new SearchThreadData();
+
+   _pPendingSearchJob->AddEntry(std::move(dbe));
+
+   if (_pPendingSearchJob->tNumResidues >= SEARCH_JOB_RESIDUES)
+      SubmitSearchJob(tp);
+
+   g_staticParams.databaseInfo.iTotalNumProteins++;
+
+   return !g_cometStatus.IsError() && !g_cometStatus.IsCancel();
 }
 
 
-void CometSearch::SearchThreadProc(SearchThreadData *pSearchThreadData, ThreadPool* tp)
+// Search the database entries cached by an earlier spectrum batch instead of
+// reading and parsing the database file again.
+bool CometSearch::SearchDatabaseCache(int iPercentStart,
+                                      int iPercentEnd,
+                                      ThreadPool *tp)
 {
-   // Grab available array from shared memory pool.
-   int i;
+   bool bSucceeded = true;
+   comet_fileoffset_t lNumEntries = (comet_fileoffset_t)_vDatabaseCache.size();
 
-   Threading::LockMutex(g_searchMemoryPoolMutex);   
+   g_staticParams.databaseInfo.uliTotAACount = _uliDatabaseCacheAACount;
+   g_staticParams.databaseInfo.iTotalNumProteins = 0;
 
-   for (i=0; i < g_staticParams.options.iNumThreads; i++)
+   if (!g_staticParams.options.bOutputSqtStream)
    {
-      if (!_pbSearchMemoryPool[i])
+      logout("     - Search progress: ");
+      fflush(stdout);
+   }
+
+   for (auto it = _vDatabaseCache.begin(); it != _vDatabaseCache.end(); ++it)
+   {
+      if (!QueueDatabaseEntry(sDBEntry(*it), tp))
       {
-         _pbSearchMemoryPool[i] = true;
+         bSucceeded = false;
          break;
       }
-   }
 
-   // Fail-safe to stop if memory isn't available for the next thread.
-   // Needs better capture and return?
-   if (i == g_staticParams.options.iNumThreads)
-   {
-      printf("Error with memory pool.\n");
-      exit(1);
+      if (!g_staticParams.options.bOutputSqtStream && !(g_staticParams.databaseInfo.iTotalNumProteins%500))
+         ReportDatabaseProgress(g_staticParams.databaseInfo.iTotalNumProteins, lNumEntries, iPercentStart, iPercentEnd);
    }
 
-   Threading::UnlockMutex(g_searchMemoryPoolMutex);
+   SubmitSearchJob(tp);
 
-   // Give memory manager access to the thread.
-   pSearchThreadData->pbSearchMemoryPool = &_pbSearchMemoryPool[i];
+   // Wait for active search threads to complete processing.
+   tp->wait_on_threads();
 
-   CometSearch sqSearch;
-   // DoSearch now returns true/false, but we already log errors and set
-   // the global error variable before we get here, so no need to check
-   // the return value here.
-   sqSearch.DoSearch(pSearchThreadData->dbEntry, _ppbDuplFragmentArr[i]);
-   delete pSearchThreadData;
-   pSearchThreadData = NULL;
+   if (bSucceeded)
+      bSucceeded = !g_cometStatus.IsError() && !g_cometStatus.IsCancel();
+
+   MergeThreadScoring();
+
+   DeleteFragmentIndex();
+
+   if (!g_staticParams.options.bOutputSqtStream)
+   {
+      char szTmp[128];
+      sprintf(szTmp, "%3d%%\n", iPercentEnd);
+      logout(szTmp);
+      fflush(stdout);
+   }
+
+   return bSucceeded;
 }
 
 
-bool CometSearch::DoSearch(sDBEntry dbe, bool *pbDuplFragment)
+void CometSearch::ClearDatabaseCache(void)
 {
-   // Standard protein database search.
-   if (g_staticParams.options.iWhichReadingFrame == 0)
-   {
-      _proteinInfo.iProteinSeqLength = _proteinInfo.iTmpProteinSeqLength = (int)dbe.strSeq.size();
-      _proteinInfo.lProteinFilePosition = dbe.lProteinFilePosition;
-      //_proteinInfo.cPeffOrigResidue = '\0';
-      _proteinInfo.sPeffOrigResidues.clear();
-      _proteinInfo.iPeffOrigResiduePosition = NO_PEFF_VARIANT;  // used for PEFF variant (SAAV);  NO_PEFF_VARIANT set to off
-      _proteinInfo.iPeffNewResidueCount = 0;
+   vector<sDBEntry>().swap(_vDatabaseCache);
+   _tDatabaseCacheBytes = 0;
+   _uliDatabaseCacheAACount = 0;
+   _bDatabaseCacheFilling = false;
+   _bDatabaseCacheComplete = false;
+}
 
-      // have to pass sequence as it can be modified per below
-      if (!SearchForPeptides(dbe, (char *)dbe.strSeq.c_str(), 0, pbDuplFragment))
-         return false;
 
-      if (g_staticParams.options.bClipNtermMet && dbe.strSeq[0]=='M')
-      {
-         _proteinInfo.iTmpProteinSeqLength -= 1;   // remove 1 for M, used in checking termini
+void CometSearch::ReportDatabaseProgress(comet_fileoffset_t lCurrPos,
+                                         comet_fileoffset_t lEndPos,
+                                         int iPercentStart,
+                                         int iPercentEnd)
+{
+   char szTmp[128];
+
+   if (g_staticParams.options.bCreateIndex)
+      sprintf(szTmp, "%3d%%", (int)(100.0*(0.005 + (double)lCurrPos/(double)lEndPos)));
+   else // go from iPercentStart to iPercentEnd, scaled by lCurrPos/iEndPos
+      sprintf(szTmp, "%3d%%", (int)(((double)(iPercentStart + (iPercentEnd-iPercentStart)*(double)lCurrPos/(double)lEndPos) )));
+   logout(szTmp);
+   fflush(stdout);
+   logout("\b\b\b\b");
+}
 
-         if (!SearchForPeptides(dbe, (char *)dbe.strSeq.c_str()+1, 1, pbDuplFragment))
-            return false;
 
-         _proteinInfo.iTmpProteinSeqLength += 1;
-      }
+// bMoreBatches tells whether another spectrum batch will be searched after this
+// one; with spectrum_batch_pipeline the reader thread may already be loading it.
+bool CometSearch::RunSearch(int iPercentStart,
+                            int iPercentEnd,
+                            bool bMoreBatches,
+                            ThreadPool *tp)
+{
+   bool bSucceeded = true;
 
-      // Plug in an AA substitutions (or deletions) and do a search, requiring that AA be present
-      // in peptide or a flanking residue that causes a enzyme cut site
-      if (dbe.vectorPeffVariantSimple.size() > 0 || dbe.vectorPeffVariantComplex.size() > 0)
-         SearchForVariants(dbe, (char *)dbe.strSeq.c_str(), pbDuplFragment);
+   if (g_staticParams.bIndexDb)
+   {
+      CometSearch sqSearch;
+      bSucceeded = sqSearch.IndexSearch(tp);
    }
    else
    {
-      int ii;
+      sDBEntry dbe;
+      FILE *fp;
+      int iTmpCh = 0;
+      comet_fileoffset_t lEndPos = 0;
+      bool bTrimDescr = false;
+      string strPeffHeader;
+      char *szPeffLine = 0;         // store description line starting with first \ to parse above
+      int iLenSzLine = 0;
 
-      _proteinInfo.iProteinSeqLength = _proteinInfo.iTmpProteinSeqLength = (int)dbe.strSeq.size();
-      _proteinInfo.lProteinFilePosition = dbe.lProteinFilePosition;
-      //_proteinInfo.cPeffOrigResidue = '\0';
-      _proteinInfo.sPeffOrigResidues.clear();
-      _proteinInfo.iPeffOrigResiduePosition = NO_PEFF_VARIANT;
-      _proteinInfo.iPeffNewResidueCount = 0;
+      vector<OBOStruct> vectorPeffOBO;
 
-      // Nucleotide search; translate NA to AA.
 
-      if ((g_staticParams.options.iWhichReadingFrame == 1) ||
-          (g_staticParams.options.iWhichReadingFrame == 2) ||
-          (g_staticParams.options.iWhichReadingFrame == 3))
-      {
-         // Specific forward reading frames.
-         ii = g_staticParams.options.iWhichReadingFrame - 1;
+      //Reuse existing ThreadPool
+      ThreadPool *pSearchThreadPool = tp;
 
-         // Creates szProteinSeq[] for each reading frame.
-         if (!TranslateNA2AA(&ii, 1,(char *)dbe.strSeq.c_str()))
-            return false;
+      if (!CreateFragmentIndex())
+         return false;
 
-         if (!SearchForPeptides(dbe, _proteinInfo.pszProteinSeq, 0, pbDuplFragment))
-            return false;
-      }
-      else if ((g_staticParams.options.iWhichReadingFrame == 7) ||
-               (g_staticParams.options.iWhichReadingFrame == 9))
-      {
-         // All 3 forward reading frames.
-         for (ii=0; ii<3; ii++)
-         {
-            if (!TranslateNA2AA(&ii, 1,(char *)dbe.strSeq.c_str()))
-               return false;
+      if (!CreateThreadScoring())
+         return false;
 
-            if (!SearchForPeptides(dbe, _proteinInfo.pszProteinSeq, 0, pbDuplFragment))
-               return false;
-         }
+      if (_bDatabaseCacheComplete)
+         return SearchDatabaseCache(iPercentStart, iPercentEnd, pSearchThreadPool);
+      
+      g_staticParams.databaseInfo.uliTotAACount = 0;
+      g_staticParams.databaseInfo.iTotalNumProteins = 0;
+
+      // Keep the parsed entries in memory if another spectrum batch will follow.
+      if (g_staticParams.options.iDatabaseCacheSize > 0
+            && !g_staticParams.options.bCreateIndex
+            && bMoreBatches)
+      {
+         ClearDatabaseCache();
+         _bDatabaseCacheFilling = true;
       }
 
-      if ((g_staticParams.options.iWhichReadingFrame == 4) ||
-          (g_staticParams.options.iWhichReadingFrame == 5) ||
-          (g_staticParams.options.iWhichReadingFrame == 6) ||
-          (g_staticParams.options.iWhichReadingFrame == 8) ||
-          (g_staticParams.options.iWhichReadingFrame == 9))
+      if ((fp=fopen(g_staticParams.databaseInfo.szDatabase, "rb")) == NULL)
       {
-         char *pszTemp;
-         int seqSize;
+         char szErrorMsg[SIZE_ERROR];
+         sprintf(szErrorMsg, " Error (1) - cannot read database file \"%s\".\n", g_staticParams.databaseInfo.szDatabase);
+         string strErrorMsg(szErrorMsg);
+         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+         logerr(szErrorMsg);
+         return false;
+      }
 
-         // Generate complimentary strand.
-         seqSize = (int)dbe.strSeq.size()+1;
-         try
-         {
-            pszTemp = new char[seqSize];
-         }
-         catch (std::bad_alloc& ba)
+      fseek(fp, 0, SEEK_END);
+      lEndPos=ftell(fp);
+      rewind(fp);
+
+      // Load database entry header.
+      iTmpCh = getc(fp);
+
+      if (g_staticParams.peffInfo.iPeffSearch)
+      {
+         iLenSzLine = 2048;
+         szPeffLine = (char*)malloc( iLenSzLine* sizeof(char));
+         if (szPeffLine == NULL)
          {
             char szErrorMsg[SIZE_ERROR];
-            sprintf(szErrorMsg, " Error - new(szTemp[%d]). bad_alloc: %s.\n", seqSize, ba.what());
-            sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
-            sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to mitigate memory use.\n");
+            sprintf(szErrorMsg, " Error - malloc szPeffLine\n");
             string strErrorMsg(szErrorMsg);
             g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
             logerr(szErrorMsg);
             return false;
          }
 
-         memcpy(pszTemp, (char *)dbe.strSeq.c_str(), seqSize*sizeof(char));
-         for (ii=0; ii<seqSize; ii++)
+         // if PEFF database, make sure OBO file is specified
+         if (strlen(g_staticParams.peffInfo.szPeffOBO)==0)
          {
-            switch (dbe.strSeq[ii])
-            {
-               case 'G':
-                  pszTemp[ii] = 'C';
-                  break;
-               case 'C':
-                  pszTemp[ii] = 'G';
-                  break;
-               case 'T':
-                  pszTemp[ii] = 'A';
-                  break;
-               case 'A':
-                  pszTemp[ii] = 'T';
-                  break;
-               default:
-                  pszTemp[ii] = dbe.strSeq[ii];
-               break;
-            }
+            char szErrorMsg[SIZE_ERROR];
+            sprintf(szErrorMsg,  " Error: \"peff_format\" is specified but \"peff_obo\" is not set\n");
+            string strErrorMsg(szErrorMsg);
+            g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+            logerr(szErrorMsg);
+            exit(1);
          }
 
-         if ((g_staticParams.options.iWhichReadingFrame == 8) ||
-             (g_staticParams.options.iWhichReadingFrame == 9))
+         // read in PSI or UniMod file and get a map of all mod codes and mod masses
+         CometSearch pOBO;
+         if (strlen(g_staticParams.peffInfo.szPeffOBO) > 0)
          {
-            // 3 reading frames on complementary strand.
-            for (ii=0; ii<3; ii++)
-            {
-               if (!TranslateNA2AA(&ii, -1, pszTemp))
+            pOBO.ReadOBO(g_staticParams.peffInfo.szPeffOBO, &vectorPeffOBO);
+            sort(vectorPeffOBO.begin(), vectorPeffOBO.end());  // sort by strMod for efficient binary search
+         }
+      }
+
+      if (!g_staticParams.options.bOutputSqtStream && !g_staticParams.options.bCreateIndex)
+      {
+         logout("     - Search progress: ");
+         fflush(stdout);
+      }
+
+      char szBuf[8192];
+      int  iNumBadChars = 0; // count # of bad (non-printing) characters in header 
+ 
+      // The database is parsed straight from a read-only mapping of the file; a file
+      // that cannot be mapped goes through the stream reader.
+      const char *pMap = MapDatabaseFile(fp, lEndPos);
+
+      if (pMap != NULL)
+      {
+         bSucceeded = ReadMappedDatabase(pMap, lEndPos, iPercentStart, iPercentEnd, &vectorPeffOBO, pSearchThreadPool);
+      }
+      else
+      {
+         bool bHeadOfFasta = true;
+         // Loop through entire database.
+         while(!feof(fp))
+         {
+
+            dbe.strName = "";
+            dbe.strSeq = "";
+            dbe.vectorPeffMod.clear();
+            dbe.vectorPeffVariantSimple.clear();
+            dbe.vectorPeffVariantComplex.clear();
+            dbe.vectorPeffProcessed.clear();
+
+            if (bHeadOfFasta)
+            {
+               // skip through whitespace at head of line
+               while (isspace(iTmpCh))
+                  iTmpCh = getc(fp);
+
+               // skip comment lines
+               if (iTmpCh == '#')
+               {
+                  // skip to description line
+                  while ((iTmpCh != '\n') && (iTmpCh != '\r') && (iTmpCh != EOF))
+                     iTmpCh = getc(fp);
+               }
+
+               bHeadOfFasta = false;
+            }
+
+            if (iTmpCh == '>') // Expect a '>' for sequence header line.
+            {
+               // grab file pointer here for this sequence entry
+               // this will be stored for protein references for each matched entry and
+               // will be used to retrieve actual protein references when printing output
+               dbe.lProteinFilePosition = ftell(fp);
+
+               bTrimDescr = false;
+               while (((iTmpCh = getc(fp)) != '\n') && (iTmpCh != '\r') && (iTmpCh != EOF))
+               {
+                  if (!bTrimDescr && iscntrl(iTmpCh))
+                     bTrimDescr = true;
+
+                  if (!bTrimDescr && dbe.strName.size() < (WIDTH_REFERENCE-1))
+                  {
+                     if (iTmpCh < 32 || iTmpCh>126)  // sanity check for reading binary (index) file
+                     {
+                        iNumBadChars++;
+                        if (iNumBadChars > 20)
+                        {
+                           logerr(" Too many non-printing characters in database header lines; wrong file type/format?\n");
+                           fclose(fp);
+                           return false;
+                        }
+                     }
+                     else
+                        dbe.strName += iTmpCh;
+                  }
+
+                  // load and parse PEFF header
+                  if (g_staticParams.peffInfo.iPeffSearch)
+                  {
+                     if (iTmpCh == '\\')
+                     {
+                        ungetc(iTmpCh, fp);
+
+                        // grab rest of description line here
+                        szPeffLine[0]='\0';
+                        fgets(szPeffLine, iLenSzLine, fp);
+                        while (!feof(fp) && szPeffLine[strlen(szPeffLine)-1]!='\n')
+                        {
+                           char *pTmp;
+                           iLenSzLine += 512;
+                           pTmp = (char *)realloc(szPeffLine, iLenSzLine);
+                           if (pTmp == NULL)
+                           {
+                              char szErrorMsg[SIZE_ERROR];
+                              sprintf(szErrorMsg,  " Error realloc(szPeffLine[%d])\n", iLenSzLine);
+                              string strErrorMsg(szErrorMsg);
+                              g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+                              logerr(szErrorMsg);
+                              fclose(fp);
+                              return false;
+                           }
+                           szPeffLine = pTmp;
+                           fgets(szPeffLine+(int)strlen(szPeffLine), iLenSzLine - (int)strlen(szPeffLine), fp);
+                        }
+
+                        if (!ParsePeffAttributes(szPeffLine, dbe, &vectorPeffOBO))
+                        {
+                           fclose(fp);
+                           return false;
+                        }
+
+                        // exit out of this as end of line grabbed
+                        break;
+                     }
+                  } // done with PEFF
+               }
+
+               if (dbe.strName.length() <= 0)
+               {
+                  char szErrorMsg[SIZE_ERROR];
+                  sprintf(szErrorMsg,  "\n Error - zero length sequence description; wrong database file/format?\n");
+                  string strErrorMsg(szErrorMsg);
+                  g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+                  logerr(szErrorMsg);
                   return false;
+               }
+
+               // Load sequence
+               while (((iTmpCh=getc(fp)) != '>') && (iTmpCh != EOF))
+               {
+                  if ('a'<=iTmpCh && iTmpCh<='z')
+                  {
+                     dbe.strSeq += iTmpCh - 32;  // convert toupper case so subtract 32 (i.e. 'A'-'a')
+                     g_staticParams.databaseInfo.uliTotAACount++;
+                  }
+                  else if ('A'<=iTmpCh && iTmpCh<='Z')
+                  {
+                     dbe.strSeq += iTmpCh;
+                     g_staticParams.databaseInfo.uliTotAACount++;
+                  }
+                  else if (iTmpCh == '*')  // stop codon
+                  {
+                     dbe.strSeq += iTmpCh;
+                  }
+               }
+
+               if (!QueueDatabaseEntry(std::move(dbe), pSearchThreadPool))
+               {
+                  bSucceeded = false;
+                  break;
+               }
+
+               if (!g_staticParams.options.bOutputSqtStream && !(g_staticParams.databaseInfo.iTotalNumProteins%500))
+                  ReportDatabaseProgress(ftell(fp), lEndPos, iPercentStart, iPercentEnd);
+            }
+            else
+            {
+               fgets(szBuf, sizeof(szBuf), fp);
+               iTmpCh = getc(fp);
+            }
+         }
+      }
+
+      SubmitSearchJob(pSearchThreadPool);
+
+      // Wait for active search threads to complete processing.
+
+      pSearchThreadPool->wait_on_threads();
+
+      // Check for errors one more time since there might have been an error
+      // while we were waiting for the threads.
+      if (bSucceeded)
+      {
+         bSucceeded = !g_cometStatus.IsError() && !g_cometStatus.IsCancel();
+      }
+
+      if (_bDatabaseCacheFilling)
+      {
+         _bDatabaseCacheFilling = false;
+
+         if (bSucceeded)
+         {
+            _uliDatabaseCacheAACount = g_staticParams.databaseInfo.uliTotAACount;
+            _bDatabaseCacheComplete = true;
+         }
+         else
+            ClearDatabaseCache();
+      }
+
+      if (pMap != NULL)
+         UnmapDatabaseFile(pMap, lEndPos);
+
+      fclose(fp);
+
+      MergeThreadScoring();
+
+      DeleteFragmentIndex();
+
+      if (!g_staticParams.options.bOutputSqtStream)
+      {
+         char szTmp[128];
+         if (g_staticParams.options.bCreateIndex)
+            sprintf(szTmp, "100%%\n");
+         else
+            sprintf(szTmp, "%3d%%\n", iPercentEnd);
+         logout(szTmp);
+         fflush(stdout);
+      }
+
+      if (g_staticParams.peffInfo.iPeffSearch)
+         free(szPeffLine);
+   }
+
+   return bSucceeded;
+}
+
+
+// Parse the PEFF attributes of a description line, from its first backslash to the end
+// of the line, into the entry's mods and variants.  Shared by the stream reader in
+// RunSearch() and ReadMappedDatabase(); returns false on a malformed attribute.
+bool CometSearch::ParsePeffAttributes(char *szPeffLine,
+                                      sDBEntry &dbe,
+                                      vector<OBOStruct> *vectorPeffOBO)
+{
+   char szPeffAttributeMod[16];                                // from ModRes
+   char szPeffAttributeVariant[16];
+   char szPeffAttributeVariantComplex[32];
+
+   if (g_staticParams.peffInfo.iPeffSearch == 1 || g_staticParams.peffInfo.iPeffSearch == 3)
+      strcpy(szPeffAttributeMod, "\\ModResPsi=");
+   else if (g_staticParams.peffInfo.iPeffSearch == 2 || g_staticParams.peffInfo.iPeffSearch == 4)
+      strcpy(szPeffAttributeMod, "\\ModResUnimod=");
+   else
+      strcpy(szPeffAttributeMod, "");
+
+   if (g_staticParams.peffInfo.iPeffSearch == 1 || g_staticParams.peffInfo.iPeffSearch == 2
+         || g_staticParams.peffInfo.iPeffSearch == 5)
+   {
+      strcpy(szPeffAttributeVariant, "\\VariantSimple=");
+      strcpy(szPeffAttributeVariantComplex, "\\VariantComplex=");
+   }
+   else
+   {
+      strcpy(szPeffAttributeVariant, "");
+      strcpy(szPeffAttributeVariantComplex, "");
+   }
+
+   int  iLenAttributeVariant = (int)strlen(szPeffAttributeVariant);
+   int  iLenAttributeVariantComplex = (int)strlen(szPeffAttributeVariantComplex);
+   int  iLenAttributeMod = (int)strlen(szPeffAttributeMod);
+
+   // grab from \ModResPsi or \ModResUnimod and \VariantSimple to end of line
+   char *pStr;
+   if (iLenAttributeMod>0 && (pStr = strstr(szPeffLine, szPeffAttributeMod)) != NULL)
+   {
+      char *pStr2;
+      pStr += iLenAttributeMod;
+
+      pStr2 = pStr;
+
+      // need to find closing parenthesis
+      int iTmp=0;  // count of number of open parenthesis
+      while (1)
+      {
+         if ((iTmp == 0 && *pStr2 == ' ') || *pStr2 == '\r' || *pStr2=='\n' || *pStr2 == '\0')
+            break;
+         else if (*pStr2 == '(')
+            iTmp++;
+         else if (*pStr2 == ')')
+            iTmp--;
+
+         pStr2++;
+      }
+
+      string strMods(pStr, pStr2 - pStr);
+
+      size_t tClose = strMods.rfind(')');
+      if (tClose != string::npos)
+      {
+         strMods.resize(tClose + 1);
+      }
+      else
+      {
+         char szErrorMsg[SIZE_ERROR];
+         sprintf(szErrorMsg,  " Error: PEFF entry '%s' missing mod closing parenthesis\n", dbe.strName.c_str()); 
+         string strErrorMsg(szErrorMsg);
+         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+         logerr(szErrorMsg);
+         return false;
+      }
+
+      int iPos;
+      string strModID;
+
+      // now tokenize/split strMods on ')' character
+      istringstream ssMods(strMods);
+      while (!ssMods.eof())
+      {
+         string strModEntry;
+         getline(ssMods, strModEntry, ')');
+
+         iPos = 0;
+
+         if (strModEntry.length() < 8)   // strModEntry should look like "(1|XXX:1|name"
+            break;
+
+         // at this point, strModEntry should look like (118,121|MOD:00000 
+         if (strModEntry[0]=='(' && isdigit(strModEntry[1]))  //handle possible '?' in the position field ; need to check that strModEntry looks like "(number"
+         {
+            // turn '|' to space
+            std::string::iterator it;
+            for (it = strModEntry.begin(); it != strModEntry.end(); ++it)
+            {
+               if (*it == '|' || *it == '(')
+                  *it = ' ';
+            }
+
+            // split "118,121 MOD:00000" into "118,121" and "MOD:00000"
+            std::stringstream converter(strModEntry);
+            string strPos;
+            string strModID;
+            converter >> strPos >> strModID;
+
+            // now tokenize on comma separated szPos
+            istringstream ss(strPos);
+            while (!ss.eof())
+            {
+               string x;               // here's a nice, empty string
+               getline( ss, x, ',' );  // try to read the next field into it
+               iPos = atoi(x.c_str());
+               if (iPos <= 0)
+               {
+                  if (g_staticParams.options.bVerboseOutput)
+                  {
+                     char szErrorMsg[SIZE_ERROR];
+                     sprintf(szErrorMsg,  "Warning:  %s, %s=(%d|%s) ignored; modentry: %s\n",
+                           dbe.strName.c_str(), szPeffAttributeMod, iPos, strModID.c_str(), strModEntry.c_str());
+                     string strErrorMsg(szErrorMsg);
+                     g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+                     logerr(szErrorMsg);
+                  }
+               }
+               else
+               {
+                  struct PeffModStruct pData;
+                  CometSearch pOBO;
+
+                  pData.iPosition = iPos - 1;   // represent PEFF mod position in 0 array index coordinates
+
+                  // find strModID in vectorPeffOBO and get pData.dMassDiffAvg and pData.MassDiffMono
+                  if (pOBO.MapOBO(strModID, vectorPeffOBO, &pData))
+                  {
+                     dbe.vectorPeffMod.push_back(pData);
+                  }
+               }
+            }
+         }
+         else
+         {
+            if (g_staticParams.options.bVerboseOutput)
+            {
+               char szErrorMsg[SIZE_ERROR];
+               sprintf(szErrorMsg,  "Warning:  %s, %s=(%d|%s) ignored; modentry: %s\n",
+                     dbe.strName.c_str(), szPeffAttributeMod, iPos, strModID.c_str(), strModEntry.c_str());
+               string strErrorMsg(szErrorMsg);
+               g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+               logerr(szErrorMsg);
+            }
+         }
+      }
+   }
+
+   if (iLenAttributeVariant>0 && (pStr = strstr(szPeffLine, szPeffAttributeVariant)) != NULL)
+   {
+      char *pStr2;
+      pStr += iLenAttributeVariant;
+
+      pStr2 = pStr;
+
+      // need to find closing parenthesis
+      int iTmp=0;  // count of number of open parenthesis
+      while (1)
+      {
+         if ((iTmp == 0 && *pStr2 == ' ') || *pStr2 == '\r' || *pStr2=='\n' || *pStr2 == '\0')
+            break;
+         else if (*pStr2 == '(')
+            iTmp++;
+         else if (*pStr2 == ')')
+            iTmp--;
+
+         pStr2++;
+      }
+
+      string strMods(pStr, pStr2 - pStr);
+
+      size_t tClose = strMods.rfind(')');
+      if (tClose != string::npos)
+      {
+         strMods.resize(tClose + 1);
+      }
+      else
+      {
+         char szErrorMsg[SIZE_ERROR];
+         sprintf(szErrorMsg,  " Error: PEFF entry '%s' missing variant closing parenthesis\n", dbe.strName.c_str()); 
+         string strErrorMsg(szErrorMsg);
+         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+         logerr(szErrorMsg);
+         return false;
+      }
+
+      // parse VariantSimple entries
+      istringstream ssVariants(strMods);
+      string strVariant;
+      char cVariant;
+      int iPos;
+
+      while (!ssVariants.eof())
+      {
+         string strVariantEntry;
+         getline(ssVariants, strVariantEntry, ')');
+
+         //handle possible '?' in the position field; need to check that strVariantEntry looks like "(number"
+         if (strVariantEntry[0]=='(' && isdigit(strVariantEntry[1]))
+         {
+            // turn '|' to space
+            std::string::iterator it;
+            for (it = strVariantEntry.begin(); it != strVariantEntry.end(); ++it)
+            {
+               if (*it == '|' || *it == '(')
+                  *it = ' ';
+            }
+
+            // split "8 C" into "8" and "C"
+            iPos = -1;
+            std::stringstream converter(strVariantEntry);
+            converter >> iPos >> strVariant;
+
+            // make sure variant residue is just a single residue in VariantSimple entry
+            cVariant = '\0';
+            if (strVariant.length() == 1)
+               cVariant = strVariant[0];
+
+            // sanity check: make sure position is positive and residue is A-Z or *
+            if (iPos<0 || ((cVariant<65 || cVariant>90) && cVariant!=42))  // char can be AA or *
+            {
+               if (g_staticParams.options.bVerboseOutput)
+               {
+                  char szErrorMsg[SIZE_ERROR];
+                  sprintf(szErrorMsg,  "Warning:  %s, VariantSimple=(%d|%c) ignored\n", dbe.strName.c_str(), iPos, cVariant);
+                  string strErrorMsg(szErrorMsg);
+                  g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+                  logerr(szErrorMsg);
+               }
+            }
+            else
+            {
+               struct PeffVariantSimpleStruct pData;
+
+               pData.iPosition = iPos - 1;   // represent PEFF variant position in 0 array index coordinates
+               pData.cResidue = cVariant;
+               dbe.vectorPeffVariantSimple.push_back(pData);
+            }
+         }
+      }
+   }
+
+   if (iLenAttributeVariantComplex > 0 && (pStr = strstr(szPeffLine, szPeffAttributeVariantComplex)) != NULL)
+   {
+     char* pStr2;
+     pStr += iLenAttributeVariantComplex;
+
+     pStr2 = pStr;
+
+     // need to find closing parenthesis
+     int iTmp = 0;  // count of number of open parenthesis
+     while (1)
+     {
+       if ((iTmp == 0 && *pStr2 == ' ') || *pStr2 == '\r' || *pStr2 == '\n' || *pStr2 == '\0')
+         break;
+       else if (*pStr2 == '(')
+         iTmp++;
+       else if (*pStr2 == ')')
+         iTmp--;
+
+       pStr2++;
+     }
+
+     string strMods(pStr, pStr2 - pStr);
+
+     size_t tClose = strMods.rfind(')');
+     if (tClose != string::npos)
+     {
+       strMods.resize(tClose + 1);
+     } else
+     {
+       char szErrorMsg[SIZE_ERROR];
+       sprintf(szErrorMsg, " Error: PEFF entry '%s' missing variant closing parenthesis\n", dbe.strName.c_str());
+       string strErrorMsg(szErrorMsg);
+       g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+       logerr(szErrorMsg);
+       return false;
+     }
+
+     // parse VariantComplex entries
+     istringstream ssVariants(strMods);
+     string strVariant;
+     string strTag;
+     int iPosA;
+     int iPosB;
+
+     while (!ssVariants.eof())
+     {
+       string strVariantEntry;
+       getline(ssVariants, strVariantEntry, ')');
+
+       //handle possible '?' in the position field; need to check that strVariantEntry looks like "(number"
+       if (strVariantEntry[0] == '(' && isdigit(strVariantEntry[1]))
+       {
+         // turn '|' to space
+         std::string::iterator it;
+         for (it = strVariantEntry.begin(); it != strVariantEntry.end(); ++it)
+         {
+           if (*it == '|' || *it == '(')
+             *it = ' ';
+         }
+
+         // split "8 10 C" into "8" and "10" and "C"
+         strVariant.clear();
+         iPosA = -1;
+         std::stringstream converter(strVariantEntry);
+         converter >> iPosA >> iPosB >> strVariant >> strTag;
+
+         // presence of a double space "  " indicates deletion with Tag (special case format)
+         if (strVariantEntry.find("  ") != string::npos)
+         {
+           strTag = strVariant;
+           strVariant.clear();
+         }
+
+         // sanity check: make sure position is correct.
+         // TODO: add sanity check to make sure replacement AAs are A-Z or *
+         if (iPosA < 0 || iPosB < 0 || iPosB < iPosA) 
+         {
+           if (g_staticParams.options.bVerboseOutput)
+           {
+             char szErrorMsg[SIZE_ERROR];
+             sprintf(szErrorMsg, "Warning:  %s, VariantComplex=(%d|%d|%s) ignored\n", dbe.strName.c_str(), iPosA, iPosB,strVariant.c_str());
+             string strErrorMsg(szErrorMsg);
+             g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+             logerr(szErrorMsg);
+           }
+         } else
+         {
+           struct PeffVariantComplexStruct pData;
+
+           pData.iPositionA = iPosA - 1;   // represent PEFF variant position in 0 array index coordinates
+           pData.iPositionB = iPosB - 1;
+           pData.sResidues = strVariant;
+           dbe.vectorPeffVariantComplex.push_back(pData);
+         }
+       }
+     }
+   }
+
+   return true;
+}
+
+
+void CometSearch::ReadOBO(char *szOBO,
+                          vector<OBOStruct> *vectorPeffOBO)
+{
+   FILE *fp;
+
+   if ( (fp=fopen(szOBO, "r")) != NULL)
+   {
+      char szLineOBO[SIZE_BUF];
+
+      // store UniMod mod string "UNIMOD:1" and mass diffs 'delta_mono_mass "42.010565"' 'delta_avge_mass "42.0367"'
+      fgets(szLineOBO, SIZE_BUF, fp);
+      while (!feof(fp))
+      {
+         if (!strncmp(szLineOBO, "[Term]", 6))
+         {
+            OBOStruct pEntry;
+
+            pEntry.dMassDiffAvg = 0.0;
+            pEntry.dMassDiffMono = 0.0;
+
+            // keep reading until next [Term] line or EOF
+            // and store id: and mass diffs
+
+            // for UniMod, parse these entries:
+            //
+            // id: UNIMOD:6
+            // xref: delta_mono_mass "58.005479"
+            // xref: delta_avge_mass "58.0361"
+            //
+            // for PSI-Mod, parse these entries:
+            // id: MOD:00046
+            // xref: DiffAvg: "79.98"
+            // xref: DiffMono: "79.966331"
+
+            while (fgets(szLineOBO, SIZE_BUF, fp))
+            {
+               char szTmp[MAX_PEFFMOD_LEN];
+
+               if (!strncmp(szLineOBO, "[Term]", 6))
+               {
+                  if (pEntry.dMassDiffMono != 0.0)
+                     (*vectorPeffOBO).push_back(pEntry);
+
+                  break;
+               }
+               else if (!strncmp(szLineOBO, "id: ", 4))
+               {
+                  sscanf(szLineOBO, "id: %16s", szTmp);
+                  pEntry.strMod = string(szTmp);
+               }
+               else if (!strncmp(szLineOBO, "xref: delta_mono_mass ", 22))
+                  sscanf(szLineOBO + 22, "\"%lf\"", &pEntry.dMassDiffMono);
+               else if (!strncmp(szLineOBO, "xref: delta_avge_mass ", 22))
+                  sscanf(szLineOBO + 22, "\"%lf\"", &pEntry.dMassDiffAvg);
+               else if (!strncmp(szLineOBO, "xref: DiffAvg: ", 15))
+                  sscanf(szLineOBO + 15, "\"%lf\"", &pEntry.dMassDiffAvg);
+               else if (!strncmp(szLineOBO, "xref: DiffMono: ", 16))
+                  sscanf(szLineOBO + 16, "\"%lf\"", &pEntry.dMassDiffMono);
+            }
+         }
+         else
+         {
+            fgets(szLineOBO, SIZE_BUF, fp);
+         }
+      }
+
+      fclose(fp);
+   }
+   else
+   {
+      char szErrorMsg[SIZE_ERROR];
+      sprintf(szErrorMsg,  " Warning: cannot read PEFF OBO file \"%s\"\n", g_staticParams.peffInfo.szPeffOBO);
+      string strErrorMsg(szErrorMsg);
+      logout(szErrorMsg);
+   }
+
+}
+
+
+bool CometSearch::MapOBO(string strMod, vector<OBOStruct> *vectorPeffOBO, struct PeffModStruct *pData)
+{
+   int iPos;
+
+   pData->dMassDiffAvg = 0;
+   pData->dMassDiffMono = 0;
+
+   // find match of strMod in vectorPeffOBO and store diff masses in pData
+
+   iPos=BinarySearchPeffStrMod(0, (int)(*vectorPeffOBO).size(), strMod, *vectorPeffOBO);
+
+   if (iPos != -1 && iPos< (int)(*vectorPeffOBO).size() )
+   {
+      pData->dMassDiffAvg = (*vectorPeffOBO).at(iPos).dMassDiffAvg;
+      pData->dMassDiffMono = (*vectorPeffOBO).at(iPos).dMassDiffMono;
+
+      if (!strMod.compare(0,7, "UNIMOD:"))
+         strncpy(pData->szMod, strMod.c_str(), MAX_PEFFMOD_LEN-1);  // UNIMOD:XXXXX
+      else if (!strMod.compare(0, 4, "MOD:"))
+         strncpy(pData->szMod, strMod.c_str(), MAX_PEFFMOD_LEN-1);  // MOD:XXXXX
+      else
+         strcpy(pData->szMod, "ERROR");
+
+      pData->szMod[MAX_PEFFMOD_LEN-1]='\0';
+      return true;
+   }
+   else
+   {
+      if (g_staticParams.options.bVerboseOutput)
+      {
+         char szErrorMsg[SIZE_ERROR];
+         sprintf(szErrorMsg,  " Warning: cannot find \"%s\" in OBO\n", strMod.c_str());
+         string strErrorMsg(szErrorMsg);
+         logerr(szErrorMsg);
+      }
+
+      return false;
+   }
+}
+
+
+// Grab an available thread slot (duplicate fragment array, search object) from the
+// shared memory pool.
+int CometSearch::GetSearchThreadSlot(void)
+{
+   int i;
+
+   Threading::LockMutex(g_searchMemoryPoolMutex);   
+
+   for (i=0; i < g_staticParams.options.iNumThreads; i++)
+   {
+      if (!_pbSearchMemoryPool[i])
+      {
+         _pbSearchMemoryPool[i] = true;
+         break;
+      }
+   }
+
+   // Fail-safe to stop if memory isn't available for the next thread.
+   // Needs better capture and return?
+   if (i == g_staticParams.options.iNumThreads)
+   {
+      printf("Error with memory pool.\n");
+      exit(1);
+   }
+
+   Threading::UnlockMutex(g_searchMemoryPoolMutex);
+
+   return i;
+}
+
+
+// Returns the search object of thread slot i bound to this slot's per batch arrays.
+CometSearch *CometSearch::GetSearchContext(int i)
+{
+   CometSearch *pSearch = _ppSearchContextArr[i];
+
+   // Per batch arrays can be created or freed between uses of this search object.
+   if (_bFragIndexActive)
+   {
+      pSearch->_pusFragIndexCounts = _ppusFragIndexCountArr[i];
+      pSearch->_piFragIndexTouched = _ppiFragIndexTouchedArr[i];
+   }
+   else
+   {
+      pSearch->_pusFragIndexCounts = NULL;
+      pSearch->_piFragIndexTouched = NULL;
+   }
+
+   if (_ppuiThreadHistogramArr != NULL)
+   {
+      pSearch->_puiThreadHistogram = _ppuiThreadHistogramArr[i];
+      pSearch->_puliThreadNumMatched = _ppuliThreadNumMatchedArr[i];
+   }
+   else
+   {
+      pSearch->_puiThreadHistogram = NULL;
+      pSearch->_puliThreadNumMatched = NULL;
+   }
+
+   return pSearch;
+}
+
+
+void CometSearch::SearchThreadProc(SearchThreadData *pSearchThreadData, ThreadPool* tp)
+{
+   // Grab available array from shared memory pool.
+   int i = GetSearchThreadSlot();
+
+   // Give memory manager access to the thread.
+   pSearchThreadData->pbSearchMemoryPool = &_pbSearchMemoryPool[i];
+
+   CometSearch *pSearch = GetSearchContext(i);
+
+   // DoSearch now returns true/false, but we already log errors and set
+   // the global error variable before we get here, so no need to check
+   // the return value here.
+   for (auto it = pSearchThreadData->vdbEntries.begin(); it != pSearchThreadData->vdbEntries.end(); ++it)
+   {
+      if (g_cometStatus.IsError() || g_cometStatus.IsCancel())
+         break;
+
+      pSearch->DoSearch(*it, _ppbDuplFragmentArr[i]);
+
+      // Counts arrays stay with the thread slot; clear them before the slot is released.
+      if (_bFragIndexActive)
+         pSearch->FragmentIndexResetCounts();
+   }
+
+   if (g_staticParams.options.bCreateIndex)
+      pSearch->FlushIndexPeptides();
+
+   // Candidates reference this job's database entry, so are stored before it is freed.
+   pSearch->FlushPendingPeptides();
+
+   delete pSearchThreadData;
+   pSearchThreadData = NULL;
+}
+
+
+// With "thread_local_scoring", keep the best iNumStored distinct (xcorr, peptide hash)
+// pairs this thread has buffered for each query since the last flush.  A candidate
+// scoring no higher than all of them cannot enter the query's stored results, so is
+// not buffered.  An equal pair may be a duplicate of a kept peptide, which adds its
+// protein, so it is always buffered.
+bool CometSearch::PendingTopN(int iWhichQuery,
+                              bool bSeparateDecoy,
+                              double dXcorr,
+                              unsigned int uiHash)
+{
+   size_t tWhich = 2*(size_t)iWhichQuery + (bSeparateDecoy ? 1 : 0);
+   pair<double, unsigned int> key(dXcorr, uiHash);
+
+   if (_vvPendingTopN.size() < 2*g_pvQuery.size())
+      _vvPendingTopN.resize(2*g_pvQuery.size());
+
+   vector<pair<double, unsigned int> > &vTopN = _vvPendingTopN[tWhich];   // min heap
+
+   if (find(vTopN.begin(), vTopN.end(), key) != vTopN.end())
+      return true;
+
+   if (vTopN.empty())
+      _viPendingTopNTouched.push_back((int)tWhich);
+
+   if ((int)vTopN.size() < g_staticParams.options.iNumStored)
+   {
+      vTopN.push_back(key);
+      push_heap(vTopN.begin(), vTopN.end(), greater<pair<double, unsigned int> >());
+      return true;
+   }
+
+   if (dXcorr <= vTopN.front().first)
+      return false;
+
+   pop_heap(vTopN.begin(), vTopN.end(), greater<pair<double, unsigned int> >());
+   vTopN.back() = key;
+   push_heap(vTopN.begin(), vTopN.end(), greater<pair<double, unsigned int> >());
+
+   return true;
+}
+
+
+// Candidates are buffered per thread and stored in their queries in batches so that
+// each query lock is taken once per batch instead of once per candidate.
+void CometSearch::AddPendingPeptide(int iWhichQuery,
+                                    int iStartResidue,
+                                    int iEndResidue,
+                                    int iStartPos,
+                                    int iEndPos,
+                                    int iFoundVariableMod,
+                                    const char *szProteinSeq,
+                                    double dCalcPepMass,
+                                    double dXcorr,
+                                    bool bDecoyPep,
+                                    int *piVarModSites,
+                                    struct sDBEntry *dbe)
+{
+   _vPendingPeptides.emplace_back();
+
+   PendingPeptide &pending = _vPendingPeptides.back();
+
+   pending.dXcorr = dXcorr;
+   pending.dCalcPepMass = dCalcPepMass;
+   pending.iWhichQuery = iWhichQuery;
+   pending.iStartResidue = iStartResidue;
+   pending.iEndResidue = iEndResidue;
+   pending.iStartPos = iStartPos;
+   pending.iEndPos = iEndPos;
+   pending.iFoundVariableMod = iFoundVariableMod;
+   pending.bDecoyPep = bDecoyPep;
+   pending.dbe = dbe;
+   pending.iTmpProteinSeqLength = _proteinInfo.iTmpProteinSeqLength;
+   pending.iPeffOrigResiduePosition = _proteinInfo.iPeffOrigResiduePosition;
+   pending.iPeffNewResidueCount = _proteinInfo.iPeffNewResidueCount;
+   pending.sPeffOrigResidues = _proteinInfo.sPeffOrigResidues;
+
+   pending.bVarModSites = (piVarModSites != NULL);
+   if (piVarModSites != NULL)
+      memcpy(pending.piVarModSites, piVarModSites, _iSizepiVarModSites);
+
+   // The database entry outlives the buffer; decoy, variant and translated sequences
+   // are overwritten while the protein is searched so are copied.  SearchForVariants()
+   // puts a PEFF variant residue into the entry's sequence itself and restores the
+   // original residue afterwards, so a sequence holding a variant is copied too.
+   const char *pEntrySeq = dbe->strSeq.c_str();
+
+   if (_proteinInfo.iPeffOrigResiduePosition == NO_PEFF_VARIANT
+         && szProteinSeq >= pEntrySeq && szProteinSeq <= pEntrySeq + dbe->strSeq.size())
+   {
+      pending.bSeqInEntry = true;
+      pending.tSeqOffset = szProteinSeq - pEntrySeq;
+   }
+   else
+   {
+      if (szProteinSeq != _pPendingSequenceSource
+            || strcmp(szProteinSeq, &_vcPendingSequences[_tPendingSequenceOffset]))
+      {
+         _pPendingSequenceSource = szProteinSeq;
+         _tPendingSequenceOffset = _vcPendingSequences.size();
+         _vcPendingSequences.insert(_vcPendingSequences.end(), szProteinSeq, szProteinSeq + strlen(szProteinSeq) + 1);
+      }
+
+      pending.bSeqInEntry = false;
+      pending.tSeqOffset = _tPendingSequenceOffset;
+   }
+
+   if (_vPendingPeptides.size() >= PENDING_PEPTIDE_BATCH)
+      FlushPendingPeptides();
+}
+
+
+// Store the buffered candidates, locking each query once.  A query's candidates are
+// stored in the order they were scored, as without the buffer.
+void CometSearch::FlushPendingPeptides(void)
+{
+   if (_vPendingPeptides.size() == 0)
+      return;
+
+   vector<int> viOrder(_vPendingPeptides.size());
+   size_t i;
+
+   for (i=0; i<viOrder.size(); i++)
+      viOrder[i] = (int)i;
+
+   stable_sort(viOrder.begin(), viOrder.end(), [this](int a, int b)
+         { return _vPendingPeptides[a].iWhichQuery < _vPendingPeptides[b].iWhichQuery; });
+
+   // StorePeptide() reads the PEFF variant and sequence length of the protein being
+   // searched, which may still be in progress.
+   ProteinInfo proteinInfo = _proteinInfo;
+
+   i = 0;
+   while (i < viOrder.size())
+   {
+      int iWhichQuery = _vPendingPeptides[viOrder[i]].iWhichQuery;
+      Query* pQuery = g_pvQuery.at(iWhichQuery);
+
+      Threading::LockMutex(pQuery->accessMutex);
+
+      for (; i<viOrder.size() && _vPendingPeptides[viOrder[i]].iWhichQuery == iWhichQuery; i++)
+      {
+         PendingPeptide &pending = _vPendingPeptides[viOrder[i]];
+         char *szProteinSeq;
+
+         if (pending.bSeqInEntry)
+            szProteinSeq = (char *)pending.dbe->strSeq.c_str() + pending.tSeqOffset;
+         else
+            szProteinSeq = &_vcPendingSequences[pending.tSeqOffset];
+
+         _proteinInfo.iTmpProteinSeqLength = pending.iTmpProteinSeqLength;
+         _proteinInfo.iPeffOrigResiduePosition = pending.iPeffOrigResiduePosition;
+         _proteinInfo.iPeffNewResidueCount = pending.iPeffNewResidueCount;
+         _proteinInfo.sPeffOrigResidues = pending.sPeffOrigResidues;
+
+         StoreCandidate(iWhichQuery, pending.iStartResidue, pending.iEndResidue, pending.iStartPos, pending.iEndPos,
+               pending.iFoundVariableMod, szProteinSeq, pending.dCalcPepMass, pending.dXcorr, pending.bDecoyPep,
+               pending.bVarModSites ? pending.piVarModSites : NULL, pending.dbe);
+      }
+
+      Threading::UnlockMutex(pQuery->accessMutex);
+   }
+
+   _proteinInfo = proteinInfo;
+
+   _vPendingPeptides.clear();
+   _vcPendingSequences.clear();
+   _pPendingSequenceSource = NULL;
+
+   // Stored results now include everything the top N lists kept.
+   for (i=0; i<_viPendingTopNTouched.size(); i++)
+      _vvPendingTopN[_viPendingTopNTouched[i]].clear();
+   _viPendingTopNTouched.clear();
+}
+
+
+// Peptides for the index are buffered per thread and handed to the index builder
+// in batches so threads rarely wait on each other.
+void CometSearch::AddIndexPeptide(DBIndex &sEntry)
+{
+   _vIndexPeptides.push_back(sEntry);
+
+   if (_vIndexPeptides.size() >= INDEX_PEPTIDE_BATCH)
+      FlushIndexPeptides();
+}
+
+
+void CometSearch::FlushIndexPeptides(void)
+{
+   if (_vIndexPeptides.size() == 0)
+      return;
+
+   Threading::LockMutex(g_dbIndexMutex);
+   CometIndexBuilder::AddPeptides(_vIndexPeptides);
+   Threading::UnlockMutex(g_dbIndexMutex);
+
+   _vIndexPeptides.clear();
+}
+
+
+bool CometSearch::DoSearch(sDBEntry &dbe, bool *pbDuplFragment)
+{
+   // Sort PEFF entries by position once here; SearchForPeptides() and
+   // SearchForVariants() share this entry by reference.
+   if (dbe.vectorPeffMod.size() > 0) // sort vectorPeffMod by iPosition
+      sort(dbe.vectorPeffMod.begin(), dbe.vectorPeffMod.end());
+
+   if (dbe.vectorPeffVariantSimple.size() > 0) // sort peffVariantSimpleStruct by iPosition
+      sort(dbe.vectorPeffVariantSimple.begin(), dbe.vectorPeffVariantSimple.end());
+
+   if (dbe.vectorPeffVariantComplex.size() > 0) // sort peffVariantComplexStruct by iPositionA
+      sort(dbe.vectorPeffVariantComplex.begin(), dbe.vectorPeffVariantComplex.end());
+
+   // Standard protein database search.
+   if (g_staticParams.options.iWhichReadingFrame == 0)
+   {
+      _proteinInfo.iProteinSeqLength = _proteinInfo.iTmpProteinSeqLength = (int)dbe.strSeq.size();
+      _proteinInfo.lProteinFilePosition = dbe.lProteinFilePosition;
+      //_proteinInfo.cPeffOrigResidue = '\0';
+      _proteinInfo.sPeffOrigResidues.clear();
+      _proteinInfo.iPeffOrigResiduePosition = NO_PEFF_VARIANT;  // used for PEFF variant (SAAV);  NO_PEFF_VARIANT set to off
+      _proteinInfo.iPeffNewResidueCount = 0;
+
+      // have to pass sequence as it can be modified per below
+      if (!SearchForPeptides(dbe, (char *)dbe.strSeq.c_str(), 0, pbDuplFragment))
+         return false;
+
+      if (g_staticParams.options.bClipNtermMet && dbe.strSeq[0]=='M')
+      {
+         _proteinInfo.iTmpProteinSeqLength -= 1;   // remove 1 for M, used in checking termini
+
+         if (!SearchForPeptides(dbe, (char *)dbe.strSeq.c_str()+1, 1, pbDuplFragment))
+            return false;
+
+         _proteinInfo.iTmpProteinSeqLength += 1;
+      }
+
+      // Plug in an AA substitutions (or deletions) and do a search, requiring that AA be present
+      // in peptide or a flanking residue that causes a enzyme cut site
+      if (dbe.vectorPeffVariantSimple.size() > 0 || dbe.vectorPeffVariantComplex.size() > 0)
+         SearchForVariants(dbe, (char *)dbe.strSeq.c_str(), pbDuplFragment);
+   }
+   else
+   {
+      int ii;
+
+      _proteinInfo.iProteinSeqLength = _proteinInfo.iTmpProteinSeqLength = (int)dbe.strSeq.size();
+      _proteinInfo.lProteinFilePosition = dbe.lProteinFilePosition;
+      //_proteinInfo.cPeffOrigResidue = '\0';
+      _proteinInfo.sPeffOrigResidues.clear();
+      _proteinInfo.iPeffOrigResiduePosition = NO_PEFF_VARIANT;
+      _proteinInfo.iPeffNewResidueCount = 0;
+
+      // Nucleotide search; translate NA to AA.
+
+      if ((g_staticParams.options.iWhichReadingFrame == 1) ||
+          (g_staticParams.options.iWhichReadingFrame == 2) ||
+          (g_staticParams.options.iWhichReadingFrame == 3))
+      {
+         // Specific forward reading frames.
+         ii = g_staticParams.options.iWhichReadingFrame - 1;
+
+         // Creates szProteinSeq[] for each reading frame.
+         if (!TranslateNA2AA(&ii, 1,(char *)dbe.strSeq.c_str()))
+            return false;
+
+         if (!SearchForPeptides(dbe, _proteinInfo.pszProteinSeq, 0, pbDuplFragment))
+            return false;
+      }
+      else if ((g_staticParams.options.iWhichReadingFrame == 7) ||
+               (g_staticParams.options.iWhichReadingFrame == 9))
+      {
+         // All 3 forward reading frames.
+         for (ii=0; ii<3; ii++)
+         {
+            if (!TranslateNA2AA(&ii, 1,(char *)dbe.strSeq.c_str()))
+               return false;
+
+            if (!SearchForPeptides(dbe, _proteinInfo.pszProteinSeq, 0, pbDuplFragment))
+               return false;
+         }
+      }
+
+      if ((g_staticParams.options.iWhichReadingFrame == 4) ||
+          (g_staticParams.options.iWhichReadingFrame == 5) ||
+          (g_staticParams.options.iWhichReadingFrame == 6) ||
+          (g_staticParams.options.iWhichReadingFrame == 8) ||
+          (g_staticParams.options.iWhichReadingFrame == 9))
+      {
+         char *pszTemp;
+         int seqSize;
+
+         // Generate complimentary strand.
+         seqSize = (int)dbe.strSeq.size()+1;
+         try
+         {
+            pszTemp = new char[seqSize];
+         }
+         catch (std::bad_alloc& ba)
+         {
+            char szErrorMsg[SIZE_ERROR];
+            sprintf(szErrorMsg, " Error - new(szTemp[%d]). bad_alloc: %s.\n", seqSize, ba.what());
+            sprintf(szErrorMsg+strlen(szErrorMsg), "Comet ran out of memory. Look into \"spectrum_batch_size\"\n");
+            sprintf(szErrorMsg+strlen(szErrorMsg), "parameters to mitigate memory use.\n");
+            string strErrorMsg(szErrorMsg);
+            g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+            logerr(szErrorMsg);
+            return false;
+         }
+
+         memcpy(pszTemp, (char *)dbe.strSeq.c_str(), seqSize*sizeof(char));
+         for (ii=0; ii<seqSize; ii++)
+         {
+            switch (dbe.strSeq[ii])
+            {
+               case 'G':
+                  pszTemp[ii] = 'C';
+                  break;
+               case 'C':
+                  pszTemp[ii] = 'G';
+                  break;
+               case 'T':
+                  pszTemp[ii] = 'A';
+                  break;
+               case 'A':
+                  pszTemp[ii] = 'T';
+                  break;
+               default:
+                  pszTemp[ii] = dbe.strSeq[ii];
+               break;
+            }
+         }
+
+         if ((g_staticParams.options.iWhichReadingFrame == 8) ||
+             (g_staticParams.options.iWhichReadingFrame == 9))
+         {
+            // 3 reading frames on complementary strand.
+            for (ii=0; ii<3; ii++)
+            {
+               if (!TranslateNA2AA(&ii, -1, pszTemp))
+                  return false;
+
+               if (!SearchForPeptides(dbe, _proteinInfo.pszProteinSeq, 0, pbDuplFragment))
+                  return false;
+            }
+         }
+         else
+         {
+            // Specific reverse reading frame ... valid values are 4, 5 or 6.
+            ii = 6 - g_staticParams.options.iWhichReadingFrame;
+
+            if (ii == 0)
+               ii = 2;
+            else if (ii == 2)
+               ii=0;
+
+            if (!TranslateNA2AA(&ii, -1, pszTemp))
+               return false;
+
+            if (!SearchForPeptides(dbe, _proteinInfo.pszProteinSeq, 0, pbDuplFragment))
+               return false;
+         }
+
+         delete[] pszTemp;
+         pszTemp = NULL;
+      }
+   }
+
+   return true;
+}
+
+
+bool CometSearch::IndexSearch(ThreadPool *tp)
+{
+   // index is already loaded when kept resident for DoSingleSpectrumSearch()
+   if (_indexData.pData != NULL)
+      return SearchLoadedIndex(tp);
+
+   if (!LoadIndex())
+      return false;
+
+   bool bSucceeded = SearchLoadedIndex(tp);
+
+   UnloadIndex();
+
+   return bSucceeded;
+}
+
+
+// Load the .idx file into _indexData and apply its modification settings to
+// g_staticParams.  Called per search, or once from InitializeSingleSpectrumSearch()
+// so the index stays resident until UnloadIndex().
+bool CometSearch::LoadIndex(void)
+{
+   FILE *fp;
+
+   UnloadIndex();
+
+   if ((fp = fopen(g_staticParams.databaseInfo.szDatabase, "rb")) == NULL)
+   {
+      char szErrorMsg[SIZE_ERROR];
+      sprintf(szErrorMsg, " Error - cannot read indexed database file \"%s\" %s.\n", g_staticParams.databaseInfo.szDatabase, strerror(errno));
+      string strErrorMsg(szErrorMsg);
+      g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+      logerr(szErrorMsg);
+      return false;
+   }
+
+   comet_fseek(fp, 0, SEEK_END);
+   comet_fileoffset_t lFileSize = comet_ftell(fp);
+
+   if (lFileSize < (comet_fileoffset_t)sizeof(comet_fileoffset_t))
+   {
+      char szErr[256];
+      sprintf(szErr, " Error reading .idx database:  file is truncated.\n");
+      logerr(szErr);
+      fclose(fp);
+      return false;
+   }
+
+   // The index is read straight out of a read-only mapping of the whole file.  If the
+   // file cannot be mapped, read it into memory instead so that there is a single code
+   // path; file positions stored in the index are offsets into either.
+   char *pIndexBuffer = NULL;
+   const char *pIndexData = MapDatabaseFile(fp, lFileSize);
+
+   if (pIndexData == NULL)
+   {
+      try
+      {
+         pIndexBuffer = new char[(size_t)lFileSize];
+      }
+      catch (std::bad_alloc& ba)
+      {
+         char szErrorMsg[SIZE_ERROR];
+         sprintf(szErrorMsg,  " Error - new(pIndexBuffer[%lld]). bad_alloc: %s.\n", (long long)lFileSize, ba.what());
+         string strErrorMsg(szErrorMsg);
+         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+         logerr(szErrorMsg);
+         fclose(fp);
+         return false;
+      }
+
+      comet_fseek(fp, 0, SEEK_SET);
+      fread(pIndexBuffer, sizeof(char), (size_t)lFileSize, fp);
+      pIndexData = pIndexBuffer;
+   }
+
+   // the mapped view stays valid after the file is closed
+   fclose(fp);
+
+   _indexData.pData = pIndexData;
+   _indexData.pBuffer = pIndexBuffer;
+   _indexData.lFileSize = lFileSize;
+
+   // ignore any static masses in params file; only valid ones
+   // are those in database index
+   memset(g_staticParams.staticModifications.pdStaticMods, 0, sizeof(g_staticParams.staticModifications.pdStaticMods));
+
+   bool bSucceeded;
+
+   // version 2 and later files start with a binary header, version 1 files with a text line
+   if (lFileSize >= 16 && !memcmp(pIndexData, INDEX_FILE_MAGIC, 8))
+      bSucceeded = LoadIndexColumns();
+   else
+      bSucceeded = LoadIndexEntries();
+
+   if (!bSucceeded)
+      UnloadIndex();
+
+   return bSucceeded;
+}
+
+
+// Read the mass type and static and variable mods from the text lines at the start of
+// a version 1 index or in the params section of a version 2 index.
+bool CometSearch::ParseIndexParams(const char *pText,
+                                   comet_fileoffset_t lSize)
+{
+   char szBuf[SIZE_BUF];
+   comet_fileoffset_t lPos = 0;
+
+   bool bFoundStatic = false;
+   bool bFoundVariable = false;
+
+   // read in static and variable mods
+   while (lPos < lSize)
+   {
+      // copy out the next line like fgets()
+      comet_fileoffset_t lEnd = lPos;
+      while (lEnd < lSize && lEnd - lPos < SIZE_BUF - 1 && pText[lEnd++] != '\n')
+         ;
+      memcpy(szBuf, pText + lPos, (size_t)(lEnd - lPos));
+      szBuf[lEnd - lPos] = '\0';
+      lPos = lEnd;
+
+      if (!strncmp(szBuf, "MassType:", 9))
+      {
+         sscanf(szBuf, "%d %d", &g_staticParams.massUtility.bMonoMassesParent, &g_staticParams.massUtility.bMonoMassesFragment);
+      }
+
+      if (!strncmp(szBuf, "StaticMod:", 10))
+      {
+         char *tok;
+         char delims[] = " ";
+         int x=65;
+
+         // FIX:  hack here for setting static mods; need to reset masses ... fix later
+         CometMassSpecUtils::AssignMass(g_staticParams.massUtility.pdAAMassFragment,
+            g_staticParams.massUtility.bMonoMassesFragment,
+            &g_staticParams.massUtility.dOH2fragment);
+
+         bFoundStatic = true;
+         tok=strtok(szBuf+11, delims);
+         while (tok != NULL)
+         {
+            sscanf(tok, "%lf", &(g_staticParams.staticModifications.pdStaticMods[x]));
+            g_staticParams.massUtility.pdAAMassFragment[x] += g_staticParams.staticModifications.pdStaticMods[x];
+            tok = strtok(NULL, delims);
+            x++;
+            if (x==95)  // 65-90 stores A-Z then next 4 (ascii 91-94) are n/c term peptide, n/c term protein
+               break;
+         }
+
+         g_staticParams.staticModifications.dAddNterminusPeptide = g_staticParams.staticModifications.pdStaticMods[91];
+         g_staticParams.staticModifications.dAddCterminusPeptide = g_staticParams.staticModifications.pdStaticMods[92];
+         g_staticParams.staticModifications.dAddNterminusProtein = g_staticParams.staticModifications.pdStaticMods[93];
+         g_staticParams.staticModifications.dAddCterminusProtein = g_staticParams.staticModifications.pdStaticMods[94];
+
+         // have to set these here again once static mods are read
+         g_staticParams.precalcMasses.dNtermProton = g_staticParams.staticModifications.dAddNterminusPeptide
+            + PROTON_MASS;
+
+         g_staticParams.precalcMasses.dCtermOH2Proton = g_staticParams.staticModifications.dAddCterminusPeptide
+            + g_staticParams.massUtility.dOH2fragment
+            + PROTON_MASS;
+
+         g_staticParams.precalcMasses.dOH2ProtonCtermNterm = g_staticParams.massUtility.dOH2parent
+            + PROTON_MASS
+            + g_staticParams.staticModifications.dAddCterminusPeptide
+            + g_staticParams.staticModifications.dAddNterminusPeptide;
+      }
+
+      if (!strncmp(szBuf, "VariableMod:", 12))
+      {
+         char *tok;
+         char delims[] = " ";
+         int x=0;
+
+         bFoundVariable = true;
+
+         tok=strtok(szBuf+13, delims);
+         while (tok != NULL)
+         {
+            tok = strtok(NULL, delims); // skip list of var mod residues
+
+            // for index search, storing variable mods 0-9 in pdStaticMods array 0-9
+            sscanf(tok, "%lf:%lf", &(g_staticParams.variableModParameters.varModList[x].dVarModMass),
+                  &(g_staticParams.variableModParameters.varModList[x].dNeutralLoss));
+
+            if (g_staticParams.variableModParameters.varModList[x].dNeutralLoss != 0.0)
+               g_staticParams.variableModParameters.bUseFragmentNeutralLoss = true;
+
+            tok = strtok(NULL, delims);
+
+            x++;
+            if (x == VMODS)
+               break;
+         }
+         break;
+      }
+   }
+
+   if (!(bFoundStatic && bFoundVariable))
+   {
+      char szErr[256];
+      sprintf(szErr, " Error with index database format. Mods not parsed (%d %d).", bFoundStatic, bFoundVariable);
+      logerr(szErr);
+      return false;
+   }
+
+   // indexed searches will always set this to true
+   g_staticParams.variableModParameters.bVarModSearch = true;
+
+   return true;
+}
+
+
+// Version 1 index:  text header, protein names, variable length peptide entries in
+// mass order, then the mass range, peptide count and 0.1 Da mass index of entry file
+// positions.  The file ends with the file position of that mass range.
+bool CometSearch::LoadIndexEntries(void)
+{
+   const char *pIndexData = _indexData.pData;
+   comet_fileoffset_t lFileSize = _indexData.lFileSize;
+   comet_fileoffset_t lEndOfStruct;
+
+   if (!ParseIndexParams(pIndexData, lFileSize))
+      return false;
+
+   // read fp of index
+   comet_fileoffset_t clTmp;
+#ifdef _WIN32
+#ifdef _WIN64
+   clTmp = sizeof(comet_fileoffset_t);              //win64
+#else
+   clTmp = (long long)sizeof(comet_fileoffset_t);   //win32
+#endif
+#else
+   clTmp = sizeof(comet_fileoffset_t);              //linux
+#endif
+
+   memcpy(&lEndOfStruct, pIndexData + lFileSize - clTmp, sizeof(comet_fileoffset_t));
+
+   // read index
+   int iMinMass=0;
+   int iMaxMass=0;
+   uint64_t tNumPeptides=0;
+   comet_fileoffset_t lPos = lEndOfStruct;
+
+   if (lEndOfStruct >= 0 && lEndOfStruct + (comet_fileoffset_t)(2*sizeof(int) + sizeof(uint64_t)) <= lFileSize)
+   {
+      memcpy(&iMinMass, pIndexData + lPos, sizeof(int));
+      lPos += sizeof(int);
+      memcpy(&iMaxMass, pIndexData + lPos, sizeof(int));
+      lPos += sizeof(int);
+      memcpy(&tNumPeptides, pIndexData + lPos, sizeof(uint64_t));
+      lPos += sizeof(uint64_t);
+   }
+   else
+      iMinMass = -1;
+
+   // sanity checks
+   if (iMinMass < 0 || iMinMass > 20000 || iMaxMass < 0 || iMaxMass > 20000)
+   {
+      char szErr[256];
+      sprintf(szErr, " Error reading .idx database:  min mass %d, max mass %d, num peptides %zu\n", iMinMass, iMaxMass, tNumPeptides);
+      logerr(szErr);
+      return false;
+   }
+
+   int iMaxPeptideMass10 = iMaxMass * 10;
+   comet_fileoffset_t *lReadIndex = new comet_fileoffset_t[iMaxPeptideMass10];
+   for (int i=0; i< iMaxPeptideMass10; i++)
+      lReadIndex[i] = -1;
+
+   // copy out the mass index; it is not aligned within the file
+   comet_fileoffset_t lNumIndex = (lFileSize - lPos) / (comet_fileoffset_t)sizeof(comet_fileoffset_t);
+   if (lNumIndex > iMaxPeptideMass10)
+      lNumIndex = iMaxPeptideMass10;
+   memcpy(lReadIndex, pIndexData + lPos, (size_t)lNumIndex * sizeof(comet_fileoffset_t));
+
+
+   _indexData.iVersion = 1;
+   _indexData.lEndOfStruct = lEndOfStruct;
+   _indexData.iMinMass = iMinMass;
+   _indexData.iMaxMass = iMaxMass;
+   _indexData.tNumPeptides = tNumPeptides;
+   _indexData.lReadIndex = lReadIndex;
+
+   return true;
+}
+
+
+// Version 2 to 5 index, see IndexFileHeader.  The peptide columns are used in place
+// (version 5 ones are decoded first); each delta segment of a version 4 or 5 file
+// is loaded into _vIndexDeltas.
+bool CometSearch::LoadIndexColumns(void)
+{
+   const char *pIndexData = _indexData.pData;
+   comet_fileoffset_t lFileSize = _indexData.lFileSize;
+   IndexFileHeader header;
+   comet_fileoffset_t lEnd;
+   char szErr[256];
+
+   if (!LoadIndexSegment(0, &_indexData, &header, &lEnd))
+      return false;
+
+   // The index is loaded again for every RunSearch() pass so only check the whole
+   // file the first time it is seen.
+   if (header.tChecksum != _tIndexChecksumVerified || _strIndexVerified != g_staticParams.databaseInfo.szDatabase)
+   {
+      uint64_t tChecksum = IndexFileChecksum(INDEX_CHECKSUM_SEED, pIndexData + header.uiHeaderSize, (size_t)(lFileSize - header.uiHeaderSize));
+
+      if (tChecksum != header.tChecksum)
+      {
+         sprintf(szErr, " Error reading .idx database:  checksum mismatch; the file is corrupt or truncated.\n");
+         logerr(szErr);
+         return false;
+      }
+
+      _tIndexChecksumVerified = tChecksum;
+      _strIndexVerified = g_staticParams.databaseInfo.szDatabase;
+   }
+
+   if (!ParseIndexParams(pIndexData + header.sections[INDEX_SECTION_PARAMS].tOffset, (comet_fileoffset_t)header.sections[INDEX_SECTION_PARAMS].tSize))
+      return false;
+
+   // delta segments appended after the base index
+   if (header.uiVersion >= 4)
+   {
+      comet_fileoffset_t lStart = (lEnd + 7) / 8 * 8;
+
+      while (lStart < lFileSize)
+      {
+         IndexData segment;
+
+         segment.pData = pIndexData;
+         segment.lFileSize = lFileSize;
+
+         if (!LoadIndexSegment(lStart, &segment, &header, &lEnd))
+            return false;
+
+         _vIndexDeltas.push_back(segment);
+         lStart = (lEnd + 7) / 8 * 8;
+      }
+   }
+
+   return true;
+}
+
+
+// Check the header and sections of the index segment at file position lStart and
+// point pSegment at its columns.  plEnd gets the end of the segment's sections.
+bool CometSearch::LoadIndexSegment(comet_fileoffset_t lStart,
+                                   IndexData *pSegment,
+                                   IndexFileHeader *pHeader,
+                                   comet_fileoffset_t *plEnd)
+{
+   const char *pIndexData = pSegment->pData;
+   comet_fileoffset_t lFileSize = pSegment->lFileSize;
+   IndexFileHeader &header = *pHeader;
+   char szErr[256];
+
+   // a version 2 header has no INDEX_SECTION_FRAGMENT_BINS; it is left empty
+   memset(&header, 0, sizeof(IndexFileHeader));
+   if (lFileSize - lStart >= 16)
+      memcpy(&header, pIndexData + lStart, 16);
+
+   if (memcmp(header.szMagic, INDEX_FILE_MAGIC, 8)
+         || !((header.uiVersion >= 3 && header.uiVersion <= INDEX_FILE_VERSION_PACKED && header.uiHeaderSize == sizeof(IndexFileHeader))
+            || (header.uiVersion == 2 && lStart == 0 && header.uiHeaderSize == sizeof(IndexFileHeader) - sizeof(IndexFileSection)))
+         || (comet_fileoffset_t)header.uiHeaderSize > lFileSize - lStart)
+   {
+      sprintf(szErr, " Error reading .idx database:  unsupported index version %u.\n", header.uiVersion);
+      logerr(szErr);
+      return false;
+   }
+
+   memcpy(&header, pIndexData + lStart, header.uiHeaderSize);
+
+   *plEnd = lStart + header.uiHeaderSize;
+
+   for (int i = 0; i < INDEX_SECTION_COUNT; i++)
+   {
+      if (i == INDEX_SECTION_FRAGMENT_BINS && header.sections[i].tSize == 0)
+         continue;
+
+      if (header.sections[i].tOffset % 8 != 0
+            || header.sections[i].tOffset < (uint64_t)lStart + header.uiHeaderSize
+            || header.sections[i].tOffset > (uint64_t)lFileSize
+            || header.sections[i].tSize > (uint64_t)lFileSize - header.sections[i].tOffset)
+      {
+         sprintf(szErr, " Error reading .idx database:  section %d is outside of the file.\n", i);
+         logerr(szErr);
+         return false;
+      }
+
+      if ((comet_fileoffset_t)(header.sections[i].tOffset + header.sections[i].tSize) > *plEnd)
+         *plEnd = (comet_fileoffset_t)(header.sections[i].tOffset + header.sections[i].tSize);
+   }
+
+   uint64_t tNumPeptides = header.tNumPeptides;
+   const IndexFileSection *pSections = header.sections;
+   bool bPacked = (header.uiVersion == INDEX_FILE_VERSION_PACKED);
+
+   if (header.iMinMass < 0 || header.iMinMass > 20000 || header.iMaxMass < 0 || header.iMaxMass > 20000
+         || (!bPacked && (pSections[INDEX_SECTION_MASSES].tSize < tNumPeptides * sizeof(double)
+            || pSections[INDEX_SECTION_SEQUENCE_OFFSETS].tSize < (tNumPeptides + 1) * sizeof(uint64_t)
+            || pSections[INDEX_SECTION_MOD_OFFSETS].tSize < (tNumPeptides + 1) * sizeof(uint64_t)
+            || pSections[INDEX_SECTION_PROTEIN_REFS].tSize < tNumPeptides * sizeof(comet_fileoffset_t)))
+         || pSections[INDEX_SECTION_MASS_INDEX].tSize < (uint64_t)header.iMaxMass * 10 * sizeof(comet_fileoffset_t))
+   {
+      sprintf(szErr, " Error reading .idx database:  min mass %d, max mass %d, num peptides %zu\n", header.iMinMass, header.iMaxMass, (size_t)tNumPeptides);
+      logerr(szErr);
+      return false;
+   }
+
+   if (bPacked)
+   {
+      if (!UnpackIndexColumns(pSegment, header))
+         return false;
+   }
+   else
+   {
+      pSegment->pdMasses = (const double *)(pIndexData + pSections[INDEX_SECTION_MASSES].tOffset);
+      pSegment->ptSequenceOffsets = (const uint64_t *)(pIndexData + pSections[INDEX_SECTION_SEQUENCE_OFFSETS].tOffset);
+      pSegment->ptModOffsets = (const uint64_t *)(pIndexData + pSections[INDEX_SECTION_MOD_OFFSETS].tOffset);
+      pSegment->plProteinRefs = (const comet_fileoffset_t *)(pIndexData + pSections[INDEX_SECTION_PROTEIN_REFS].tOffset);
+   }
+
+   // optional binned fragment ions; each peptide has a run of bins per residue
+   // after its first
+   const IndexFragmentBinsHeader *pFragmentBins = NULL;
+   if (pSections[INDEX_SECTION_FRAGMENT_BINS].tSize > 0)
+   {
+      pFragmentBins = (const IndexFragmentBinsHeader *)(pIndexData + pSections[INDEX_SECTION_FRAGMENT_BINS].tOffset);
+
+      uint64_t tNumResidues = 0;
+      uint64_t tNumBins = 0;
+      if (pSections[INDEX_SECTION_FRAGMENT_BINS].tSize >= sizeof(IndexFragmentBinsHeader))
+      {
+         tNumResidues = pSegment->ptSequenceOffsets[tNumPeptides] / 5;
+         tNumBins = (uint64_t)pFragmentBins->iNumLadders * pFragmentBins->iMaxFragmentCharge * pFragmentBins->iNumIonSeries
+            * (tNumResidues - tNumPeptides);
+      }
+
+      if (pSections[INDEX_SECTION_FRAGMENT_BINS].tSize < sizeof(IndexFragmentBinsHeader)
+            || pFragmentBins->iNumLadders < 1 || pFragmentBins->iNumLadders > 2
+            || pFragmentBins->iMaxFragmentCharge < 1 || pFragmentBins->iMaxFragmentCharge > MAX_FRAGMENT_CHARGE
+            || pFragmentBins->iNumIonSeries < 1 || pFragmentBins->iNumIonSeries > NUM_ION_SERIES
+            || pSections[INDEX_SECTION_FRAGMENT_BINS].tSize < sizeof(IndexFragmentBinsHeader) + tNumBins * sizeof(unsigned int))
+      {
+         sprintf(szErr, " Error reading .idx database:  fragment ion section is corrupt.\n");
+         logerr(szErr);
+         delete[] pSegment->ptDecoded;
+         pSegment->ptDecoded = NULL;
+         return false;
+      }
+   }
 
-               if (!SearchForPeptides(dbe, _proteinInfo.pszProteinSeq, 0, pbDuplFragment))
-                  return false;
+   int iMaxPeptideMass10 = header.iMaxMass * 10;
+   comet_fileoffset_t *lReadIndex = new comet_fileoffset_t[iMaxPeptideMass10];
+   memcpy(lReadIndex, pIndexData + pSections[INDEX_SECTION_MASS_INDEX].tOffset, iMaxPeptideMass10 * sizeof(comet_fileoffset_t));
+
+   pSegment->iVersion = 2;
+   pSegment->iMinMass = header.iMinMass;
+   pSegment->iMaxMass = header.iMaxMass;
+   pSegment->tNumPeptides = tNumPeptides;
+   pSegment->lReadIndex = lReadIndex;
+   pSegment->pucSequences = (const unsigned char *)(pIndexData + pSections[INDEX_SECTION_SEQUENCES].tOffset);
+   pSegment->pucModSites = (const unsigned char *)(pIndexData + pSections[INDEX_SECTION_MOD_SITES].tOffset);
+   pSegment->pFragmentBins = pFragmentBins;
+   pSegment->puiFragmentBins = (pFragmentBins == NULL ? NULL : (const unsigned int *)(pFragmentBins + 1));
+
+   return true;
+}
+
+
+// LEB128 varint at *ptPos of a version 5 column tSize bytes long.
+static bool ReadIndexVarint(const unsigned char *pucColumn,
+                            uint64_t tSize,
+                            uint64_t *ptPos,
+                            uint64_t *ptValue)
+{
+   uint64_t tValue = 0;
+
+   for (int iShift = 0; iShift < 64 && *ptPos < tSize; iShift += 7)
+   {
+      unsigned char c = pucColumn[(*ptPos)++];
+
+      tValue |= (uint64_t)(c & 0x7F) << iShift;
+      if (!(c & 0x80))
+      {
+         *ptValue = tValue;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+
+// Decode the compressed columns of a version 5 segment, see IndexBlock, into the
+// version 4 layout in pSegment->ptDecoded:  masses, sequence bit offsets and mod
+// site offsets (each with an end entry), then protein list file positions.
+bool CometSearch::UnpackIndexColumns(IndexData *pSegment,
+                                     const IndexFileHeader &header)
+{
+   const char *pIndexData = pSegment->pData;
+   const IndexFileSection *pSections = header.sections;
+   uint64_t tNumPeptides = header.tNumPeptides;
+   uint64_t tNumBlocks = (tNumPeptides + INDEX_BLOCK_PEPTIDES - 1) / INDEX_BLOCK_PEPTIDES;
+   uint64_t tMassIndexSize = (uint64_t)header.iMaxMass * 10 * sizeof(comet_fileoffset_t);
+   char szErr[256];
+
+   if (pSections[INDEX_SECTION_SEQUENCE_OFFSETS].tSize < tNumPeptides
+         || pSections[INDEX_SECTION_MOD_OFFSETS].tSize < tNumPeptides
+         || pSections[INDEX_SECTION_MASS_INDEX].tSize < tMassIndexSize + tNumBlocks * sizeof(IndexBlock))
+   {
+      sprintf(szErr, " Error reading .idx database:  compressed columns are corrupt.\n");
+      logerr(szErr);
+      return false;
+   }
+
+   const unsigned char *pucMasses = (const unsigned char *)(pIndexData + pSections[INDEX_SECTION_MASSES].tOffset);
+   const unsigned char *pucLengths = (const unsigned char *)(pIndexData + pSections[INDEX_SECTION_SEQUENCE_OFFSETS].tOffset);
+   const unsigned char *pucNumModSites = (const unsigned char *)(pIndexData + pSections[INDEX_SECTION_MOD_OFFSETS].tOffset);
+   const unsigned char *pucProteinRefs = (const unsigned char *)(pIndexData + pSections[INDEX_SECTION_PROTEIN_REFS].tOffset);
+   const char *pBlocks = pIndexData + pSections[INDEX_SECTION_MASS_INDEX].tOffset + tMassIndexSize;
+   uint64_t tMassSize = pSections[INDEX_SECTION_MASSES].tSize;
+   uint64_t tProteinRefSize = pSections[INDEX_SECTION_PROTEIN_REFS].tSize;
+
+   uint64_t *ptDecoded = new uint64_t[4 * tNumPeptides + 2];
+   double *pdMasses = (double *)ptDecoded;
+   uint64_t *ptSequenceOffsets = ptDecoded + tNumPeptides;
+   uint64_t *ptModOffsets = ptSequenceOffsets + tNumPeptides + 1;
+   comet_fileoffset_t *plProteinRefs = (comet_fileoffset_t *)(ptModOffsets + tNumPeptides + 1);
+
+   uint64_t tBit = 0;
+   uint64_t tModSite = 0;
+   bool bValid = true;
+
+   for (uint64_t tBlock = 0; tBlock < tNumBlocks && bValid; tBlock++)
+   {
+      IndexBlock block;
+      memcpy(&block, pBlocks + tBlock * sizeof(IndexBlock), sizeof(IndexBlock));
+
+      // the blocks only allow starting the decode at any block; here they are checked
+      if (block.tSequenceBit != tBit || block.tModSite != tModSite
+            || block.tMassByte > tMassSize || tMassSize - block.tMassByte < sizeof(double))
+      {
+         bValid = false;
+         break;
+      }
+
+      uint64_t tMassPos = block.tMassByte + sizeof(double);
+      uint64_t tProteinRefPos = block.tProteinRefByte;
+      uint64_t tMassBits;
+      memcpy(&tMassBits, pucMasses + block.tMassByte, sizeof(double));
+
+      uint64_t tFirst = tBlock * INDEX_BLOCK_PEPTIDES;
+      uint64_t tLast = (tFirst + INDEX_BLOCK_PEPTIDES < tNumPeptides ? tFirst + INDEX_BLOCK_PEPTIDES : tNumPeptides);
+
+      for (uint64_t tPeptide = tFirst; tPeptide < tLast; tPeptide++)
+      {
+         uint64_t tValue;
+
+         if (tPeptide > tFirst)
+         {
+            if (!ReadIndexVarint(pucMasses, tMassSize, &tMassPos, &tValue))
+            {
+               bValid = false;
+               break;
             }
+            tMassBits += (tValue >> 1) ^ (~(tValue & 1) + 1);  // zigzag
          }
-         else
-         {
-            // Specific reverse reading frame ... valid values are 4, 5 or 6.
-            ii = 6 - g_staticParams.options.iWhichReadingFrame;
+         memcpy(pdMasses + tPeptide, &tMassBits, sizeof(double));
 
-            if (ii == 0)
-               ii = 2;
-            else if (ii == 2)
-               ii=0;
+         ptSequenceOffsets[tPeptide] = tBit;
+         tBit += 5 * (uint64_t)pucLengths[tPeptide];
 
-            if (!TranslateNA2AA(&ii, -1, pszTemp))
-               return false;
+         ptModOffsets[tPeptide] = tModSite;
+         tModSite += pucNumModSites[tPeptide];
 
-            if (!SearchForPeptides(dbe, _proteinInfo.pszProteinSeq, 0, pbDuplFragment))
-               return false;
+         if (!ReadIndexVarint(pucProteinRefs, tProteinRefSize, &tProteinRefPos, &tValue)
+               || tValue >= pSections[INDEX_SECTION_PROTEIN_LISTS].tSize)
+         {
+            bValid = false;
+            break;
          }
-
-         delete[] pszTemp;
-         pszTemp = NULL;
+         plProteinRefs[tPeptide] = (comet_fileoffset_t)(pSections[INDEX_SECTION_PROTEIN_LISTS].tOffset + tValue);
       }
    }
 
+   ptSequenceOffsets[tNumPeptides] = tBit;
+   ptModOffsets[tNumPeptides] = tModSite;
+
+   if (!bValid
+         || (tBit + 7) / 8 + 1 > pSections[INDEX_SECTION_SEQUENCES].tSize
+         || tModSite * 2 > pSections[INDEX_SECTION_MOD_SITES].tSize)
+   {
+      delete[] ptDecoded;
+      sprintf(szErr, " Error reading .idx database:  compressed columns are corrupt.\n");
+      logerr(szErr);
+      return false;
+   }
+
+   pSegment->ptDecoded = ptDecoded;
+   pSegment->pdMasses = pdMasses;
+   pSegment->ptSequenceOffsets = ptSequenceOffsets;
+   pSegment->ptModOffsets = ptModOffsets;
+   pSegment->plProteinRefs = plProteinRefs;
+
    return true;
 }
 
 
-bool CometSearch::IndexSearch(void)
+// FNV-1a hash of tSize bytes of pBuf, continuing from tChecksum.  Start with
+// INDEX_CHECKSUM_SEED.
+uint64_t CometSearch::IndexFileChecksum(uint64_t tChecksum,
+                                        const char *pBuf,
+                                        size_t tSize)
 {
-   comet_fileoffset_t lEndOfStruct;
-   char szBuf[SIZE_BUF];
-   FILE *fp;
+   for (size_t i = 0; i < tSize; i++)
+   {
+      tChecksum ^= (unsigned char)pBuf[i];
+      tChecksum *= 1099511628211ULL;
+   }
 
-   if ((fp = fopen(g_staticParams.databaseInfo.szDatabase, "rb")) == NULL)
+   return tChecksum;
+}
+
+
+void CometSearch::UnloadIndex(void)
+{
+   if (_indexData.pBuffer != NULL)
+      delete[] _indexData.pBuffer;
+   else if (_indexData.pData != NULL)
+      UnmapDatabaseFile(_indexData.pData, _indexData.lFileSize);
+
+   if (_indexData.lReadIndex != NULL)
+      delete[] _indexData.lReadIndex;
+
+   delete[] _indexData.ptDecoded;
+
+   // delta segments share the base index's mapping
+   for (size_t i = 0; i < _vIndexDeltas.size(); i++)
+   {
+      delete[] _vIndexDeltas.at(i).lReadIndex;
+      delete[] _vIndexDeltas.at(i).ptDecoded;
+   }
+
+   _indexData = IndexData();
+   _vIndexDeltas.clear();
+}
+
+
+// Hand every peptide of the loaded index, its base and delta segments, to
+// CometIndexBuilder to write it again as a single segment.  Protein names go into
+// g_pvProteinNames keyed by the file position of their first copy so a protein found
+// in several segments keeps one name.  pstrParams gets the base params section.
+bool CometSearch::CollectIndexPeptides(string *pstrParams)
+{
+   const char *pIndexData = _indexData.pData;
+
+   if (_indexData.iVersion < 2)
    {
       char szErrorMsg[SIZE_ERROR];
-      sprintf(szErrorMsg, " Error - cannot read indexed database file \"%s\" %s.\n", g_staticParams.databaseInfo.szDatabase, strerror(errno));
+      sprintf(szErrorMsg, " Error - version 1 index file \"%s\" cannot be compacted; create it again from its database.\n", g_staticParams.databaseInfo.szDatabase);
       string strErrorMsg(szErrorMsg);
       g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
       logerr(szErrorMsg);
       return false;
    }
 
-   // ignore any static masses in params file; only valid ones
-   // are those in database index
-   memset(g_staticParams.staticModifications.pdStaticMods, 0, sizeof(g_staticParams.staticModifications.pdStaticMods));
+   // the params section is the first one of every header version
+   IndexFileHeader header;
+   memcpy(&header, pIndexData, sizeof(IndexFileHeader) - sizeof(IndexFileSection));
+   pstrParams->assign(pIndexData + header.sections[INDEX_SECTION_PARAMS].tOffset, (size_t)header.sections[INDEX_SECTION_PARAMS].tSize);
 
-   bool bFoundStatic = false;
-   bool bFoundVariable = false;
+   CometSearch search;
+   map<string, comet_fileoffset_t> mapNames;   // protein name to its g_pvProteinNames key
+   DBIndex sDBI;
 
-   // read in static and variable mods
-   while (fgets(szBuf, sizeof(szBuf), fp))
+   for (size_t iSegment = 0; iSegment <= _vIndexDeltas.size(); iSegment++)
    {
-      if (!strncmp(szBuf, "MassType:", 9))
-      {
-         sscanf(szBuf, "%d %d", &g_staticParams.massUtility.bMonoMassesParent, &g_staticParams.massUtility.bMonoMassesFragment);
-      }
+      const IndexData *pSegment = (iSegment == 0 ? &_indexData : &_vIndexDeltas.at(iSegment - 1));
 
-      if (!strncmp(szBuf, "StaticMod:", 10))
+      for (uint64_t tPeptide = 0; tPeptide < pSegment->tNumPeptides; tPeptide++)
       {
-         char *tok;
-         char delims[] = " ";
-         int x=65;
+         DecodeIndexPeptide(pSegment, &sDBI, tPeptide);
 
-         // FIX:  hack here for setting static mods; need to reset masses ... fix later
-         CometMassSpecUtils::AssignMass(g_staticParams.massUtility.pdAAMassFragment,
-            g_staticParams.massUtility.bMonoMassesFragment,
-            &g_staticParams.massUtility.dOH2fragment);
+         long lSize;
+         const char *pOffsets = pIndexData + sDBI.lIndexProteinFilePosition;
 
-         bFoundStatic = true;
-         tok=strtok(szBuf+11, delims);
-         while (tok != NULL)
+         memcpy(&lSize, pOffsets, sizeof(long));
+         pOffsets += sizeof(long);
+
+         for (long x = 0; x < lSize; x++)
          {
-            sscanf(tok, "%lf", &(g_staticParams.staticModifications.pdStaticMods[x]));
-            g_staticParams.massUtility.pdAAMassFragment[x] += g_staticParams.staticModifications.pdStaticMods[x];
-            tok = strtok(NULL, delims);
-            x++;
-            if (x==95)  // 65-90 stores A-Z then next 4 (ascii 91-94) are n/c term peptide, n/c term protein
-               break;
-         }
+            comet_fileoffset_t lName;
+            memcpy(&lName, pOffsets + x * sizeof(comet_fileoffset_t), sizeof(comet_fileoffset_t));
 
-         g_staticParams.staticModifications.dAddNterminusPeptide = g_staticParams.staticModifications.pdStaticMods[91];
-         g_staticParams.staticModifications.dAddCterminusPeptide = g_staticParams.staticModifications.pdStaticMods[92];
-         g_staticParams.staticModifications.dAddNterminusProtein = g_staticParams.staticModifications.pdStaticMods[93];
-         g_staticParams.staticModifications.dAddCterminusProtein = g_staticParams.staticModifications.pdStaticMods[94];
+            string strName(pIndexData + lName, WIDTH_REFERENCE);
+            auto result = mapNames.find(strName);
 
-         // have to set these here again once static mods are read
-         g_staticParams.precalcMasses.dNtermProton = g_staticParams.staticModifications.dAddNterminusPeptide
-            + PROTON_MASS;
+            if (result == mapNames.end())
+            {
+               struct IndexProteinStruct sEntry;
 
-         g_staticParams.precalcMasses.dCtermOH2Proton = g_staticParams.staticModifications.dAddCterminusPeptide
-            + g_staticParams.massUtility.dOH2fragment
-            + PROTON_MASS;
+               memcpy(sEntry.szProt, pIndexData + lName, WIDTH_REFERENCE);
+               sEntry.lProteinFilePosition = lName;
+               g_pvProteinNames.insert({ lName, sEntry });
+               result = mapNames.insert({ strName, lName }).first;
+            }
 
-         g_staticParams.precalcMasses.dOH2ProtonCtermNterm = g_staticParams.massUtility.dOH2parent
-            + PROTON_MASS
-            + g_staticParams.staticModifications.dAddCterminusPeptide
-            + g_staticParams.staticModifications.dAddNterminusPeptide;
+            sDBI.lIndexProteinFilePosition = result->second;
+            search.AddIndexPeptide(sDBI);
+         }
       }
+   }
 
-      if (!strncmp(szBuf, "VariableMod:", 12))
-      {
-         char *tok;
-         char delims[] = " ";
-         int x=0;
+   search.FlushIndexPeptides();
 
-         bFoundVariable = true;
+   return true;
+}
 
-         tok=strtok(szBuf+13, delims);
-         while (tok != NULL)
-         {
-            tok = strtok(NULL, delims); // skip list of var mod residues
 
-            // for index search, storing variable mods 0-9 in pdStaticMods array 0-9
-            sscanf(tok, "%lf:%lf", &(g_staticParams.variableModParameters.varModList[x].dVarModMass),
-                  &(g_staticParams.variableModParameters.varModList[x].dNeutralLoss));
+// Search one segment of the loaded index.  With a thread pool the mass range is
+// queued as jobs that the caller waits on.
+void CometSearch::SearchIndexSegment(const IndexData *pSegment,
+                                     ThreadPool *tp)
+{
+   comet_fileoffset_t lEndOfStruct = pSegment->lEndOfStruct;
+   comet_fileoffset_t *lReadIndex = pSegment->lReadIndex;
+   int iMinMass = pSegment->iMinMass;
+   int iMaxMass = pSegment->iMaxMass;
 
-            if (g_staticParams.variableModParameters.varModList[x].dNeutralLoss != 0.0)
-               g_staticParams.variableModParameters.bUseFragmentNeutralLoss = true;
+   int iStart = (int)(g_massRange.dMinMass - 0.5);  // smallest mass/index start
+   int iEnd = (int)(g_massRange.dMaxMass + 0.5);  // largest mass/index end
 
-            tok = strtok(NULL, delims);
+   if (iStart > iMaxMass)  // smallest input mass is greater than what's stored in index
+   {
+      return;
+   }
 
-            x++;
-            if (x == VMODS)
-               break;
-         }
-         break;
-      }
+   if (iStart < iMinMass)
+      iStart = iMinMass;
+   if (iEnd > iMaxMass)
+      iEnd = iMaxMass;
+
+   int iStart10 = (int)(g_massRange.dMinMass*10.0 - 0.5);  // lReadIndex is at 0.1 resolution for index value so scale iStart/iEnd to be same
+   int iEnd10 = (int)(g_massRange.dMaxMass*10.0 + 0.5);
+
+   if (iStart10 < iMinMass*10)
+      iStart10 = iMinMass*10;
+   if (iEnd10 > iMaxMass*10)
+      iEnd10 = iMaxMass*10;
+
+   while (lReadIndex[iStart10] == -1 && iStart10 < iEnd10)
+      iStart10++;
+
+   if (lReadIndex[iStart10] == -1)  // no match found within tolerance
+   {
+      return;
    }
 
-   if (!(bFoundStatic && bFoundVariable))
+   if (tp != NULL)
    {
-      char szErr[256];
-      sprintf(szErr, " Error with index database format. Mods not parsed (%d %d).", bFoundStatic, bFoundVariable);
-      logerr(szErr);
-      fclose(fp);
-      return false;
+      // Split the 0.1 Da mass buckets into jobs; each job decodes its peptides from the
+      // shared read-only index data with its own search object.  More jobs than threads
+      // to balance the uneven number of peptides per mass range.
+      int iNumJobs = g_staticParams.options.iNumThreads * 8;
+      int iStep = (iEnd10 - iStart10) / iNumJobs + 1;
+
+      for (int iJobStart10 = iStart10; iJobStart10 <= iEnd10; iJobStart10 += iStep)
+      {
+         int iFirst10 = iJobStart10;
+         int iStop10 = iJobStart10 + iStep;
+
+         while (iFirst10 < iStop10 && iFirst10 <= iEnd10 && lReadIndex[iFirst10] == -1)
+            iFirst10++;
+
+         if (iFirst10 == iStop10 || iFirst10 > iEnd10)
+            continue;
+
+         IndexSearchThreadData *pIndexSearchThreadData = new IndexSearchThreadData();
+
+         pIndexSearchThreadData->pSegment = pSegment;
+         pIndexSearchThreadData->pIndexData = pSegment->pData;
+         pIndexSearchThreadData->lStartPos = lReadIndex[iFirst10];
+         pIndexSearchThreadData->lEndOfStruct = lEndOfStruct;
+         pIndexSearchThreadData->iEnd10 = iEnd10;
+         // the last job reads on to iEnd10 like the single threaded search
+         pIndexSearchThreadData->iStopMass10 = (iStop10 > iEnd10 ? INT_MAX : iStop10);
+
+         tp->doJob(std::bind(IndexSearchThreadProc, pIndexSearchThreadData));
+      }
+   }
+   else if (pSegment->iVersion >= 2)
+   {
+      IndexSearchColumnRange(pSegment, (uint64_t)lReadIndex[iStart10], iEnd10, INT_MAX, _ppbDuplFragmentArr[0]);
+   }
+   else
+   {
+      IndexSearchRange(pSegment->pData, lReadIndex[iStart10], iEnd10, INT_MAX, lEndOfStruct, _ppbDuplFragmentArr[0]);
    }
+}
 
-   // indexed searches will always set this to true
-   g_staticParams.variableModParameters.bVarModSearch = true;
 
-   // read fp of index
-   comet_fileoffset_t clTmp;
-#ifdef _WIN32
-#ifdef _WIN64
-   clTmp = sizeof(comet_fileoffset_t);              //win64
-#else
-   clTmp = (long long)sizeof(comet_fileoffset_t);   //win32
-#endif
-#else
-   clTmp = sizeof(comet_fileoffset_t);              //linux
-#endif
+// Search the single query in g_pvQuery against the loaded index and look up the
+// protein names of the top hits.
+bool CometSearch::SearchLoadedIndex(ThreadPool *tp)
+{
+   const char *pIndexData = _indexData.pData;
+   bool bThreaded = (tp != NULL && g_staticParams.options.iNumThreads > 1);
+
+   BuildIndexQueryWindows();
+
+   // the base index, then any delta segments appended to it
+   SearchIndexSegment(&_indexData, bThreaded ? tp : NULL);
+
+   for (size_t i = 0; i < _vIndexDeltas.size(); i++)
+      SearchIndexSegment(&_vIndexDeltas.at(i), bThreaded ? tp : NULL);
+
+   if (bThreaded)
+      tp->wait_on_threads();
+
+// for (vector<Query*>::iterator it = g_pvQuery.begin(); it != g_pvQuery.end(); ++it) // g_pvQuery is always size 1 here; for loop is useless
+   vector<Query*>::iterator it = g_pvQuery.begin();
+   {
+      int iNumMatchedPeptides;
+
+      iNumMatchedPeptides = (*it)->iMatchPeptideCount;
+      if (iNumMatchedPeptides > g_staticParams.options.iNumStored)
+         iNumMatchedPeptides = g_staticParams.options.iNumStored;
+
+      if (iNumMatchedPeptides > 0)  // will retrieve protein names here if there is one or more matched peptides
+      {
+         // sort and report results by xcorr; E-value calculation too expensive for real-time search
+         std::sort((*it)->_pResults, (*it)->_pResults + iNumMatchedPeptides, CometPostAnalysis::SortFnXcorr);
+
+         for (int ii = 0; ii < iNumMatchedPeptides; ii++)  // loop through all hits to this one spectrum query
+         {
+            if (ii > 0 && (*it)->_pResults[ii].fXcorr < (*it)->_pResults[0].fXcorr)  // do this only for peptides that have same top xcorr, could be more than 1
+               break;
+
+            vector<ProteinEntryStruct> *pvProteins;
+            bool bPrintDecoyPrefix = false;
+
+            // Note peptides can be from target or internal decoy. If peptide is from a target protein,
+            // Comet will only report target protein matches and not internal decoy protein matches.
+            // Decoy proteins only reported for peptides that are exclusively decoy matches.
+            if ((*it)->_pResults[ii].pWhichProtein.size() > 0)
+               pvProteins = &((*it)->_pResults[ii].pWhichProtein);   // list of target proteins
+            else
+            {
+               pvProteins = &((*it)->_pResults[ii].pWhichDecoyProtein);  // list of decoy proteins
+               bPrintDecoyPrefix = true;
+            }
+
+            // a peptide also in a delta segment of the index has a protein list there too;
+            // sorted, the names keep their database order
+            vector<comet_fileoffset_t> vOffsets;
+            for (size_t iList = 0; iList < pvProteins->size(); iList++)
+            {
+               if (pvProteins->at(iList).lWhichProtein < 0)
+                  continue;
 
-   comet_fseek(fp, -clTmp, SEEK_END);
-   fread(&lEndOfStruct, sizeof(comet_fileoffset_t), 1, fp);
+               long lSize;
+               const char *pOffsets = pIndexData + pvProteins->at(iList).lWhichProtein;
 
-   // read index
-   int iMinMass=0;
-   int iMaxMass=0;
-   uint64_t tNumPeptides=0;
-   comet_fseek(fp, lEndOfStruct, SEEK_SET);
-   fread(&iMinMass, sizeof(int), 1, fp);
-   fread(&iMaxMass, sizeof(int), 1, fp);
-   fread(&tNumPeptides, sizeof(uint64_t), 1, fp);
+               memcpy(&lSize, pOffsets, sizeof(long));  // count of protein offsets that this peptide matches to
+               pOffsets += sizeof(long);
 
-   // sanity checks
-   if (iMinMass < 0 || iMinMass > 20000 || iMaxMass < 0 || iMaxMass > 20000)
-   {
-      char szErr[256];
-      sprintf(szErr, " Error reading .idx database:  min mass %d, max mass %d, num peptides %zu\n", iMinMass, iMaxMass, tNumPeptides);
-      logerr(szErr);
-      fclose(fp);
-      return false;
+               for (long x = 0; x < lSize; x++)
+               {
+                  comet_fileoffset_t tmpoffset;
+                  memcpy(&tmpoffset, pOffsets + x * sizeof(comet_fileoffset_t), sizeof(comet_fileoffset_t));
+                  vOffsets.push_back(tmpoffset);
+               }
+            }
+
+            sort(vOffsets.begin(), vOffsets.end());
+            vOffsets.erase(unique(vOffsets.begin(), vOffsets.end()), vOffsets.end());
+            if (vOffsets.size() > MAX_PROTEINS)
+               vOffsets.resize(MAX_PROTEINS);
+
+            for (size_t x = 0; x < vOffsets.size(); x++)  // given each protein name offset, read the fixed width protein name
+            {
+               const char *pszName = pIndexData + vOffsets.at(x);
+               if (bPrintDecoyPrefix)
+                  (*it)->_pResults[ii].strSingleSearchProtein += g_staticParams.szDecoyPrefix;
+               (*it)->_pResults[ii].strSingleSearchProtein.append(pszName, strnlen(pszName, WIDTH_REFERENCE));
+               if (x < vOffsets.size() - 1)
+                  (*it)->_pResults[ii].strSingleSearchProtein += " : ";
+            }
+         }
+/*
+         for (int x = 0; x < iNumMatchedPeptides; x++)
+         {
+            printf("OK %d scan %d, pep %s, xcorr %f, mass %f, matchcount %d, prot %s\n", x,
+               (*it)->_spectrumInfoInternal.iScanNumber,
+               (*it)->_pResults[x].szPeptide,
+               (*it)->_pResults[x].fXcorr,
+               (*it)->_pResults[x].dPepMass,
+               (*it)->iMatchPeptideCount,
+               (*it)->_pResults[x].strSingleSearchProtein.c_str()); fflush(stdout);
+         }
+*/
+      }
    }
 
-   int iMaxPeptideMass10 = iMaxMass * 10;
-   comet_fileoffset_t *lReadIndex = new comet_fileoffset_t[iMaxPeptideMass10];
-   for (int i=0; i< iMaxPeptideMass10; i++)
-      lReadIndex[i] = -1;
+   return true;
+}
 
-   fread(lReadIndex, sizeof(comet_fileoffset_t), iMaxPeptideMass10, fp);
 
-   int iStart = (int)(g_massRange.dMinMass - 0.5);  // smallest mass/index start
-   int iEnd = (int)(g_massRange.dMaxMass + 0.5);  // largest mass/index end
+// Merge the mass tolerance windows of the queries in g_pvQuery into disjoint windows
+// in ascending order.  IndexSearchColumnRange() walks them alongside the index's mass
+// column and skips the peptides between windows without looking up a query.
+void CometSearch::BuildIndexQueryWindows(void)
+{
+   vector<pair<double, double> > vWindows;
 
-   if (iStart > iMaxMass)  // smallest input mass is greater than what's stored in index
+   vWindows.reserve(g_pvQuery.size());
+   for (vector<Query*>::iterator it = g_pvQuery.begin(); it != g_pvQuery.end(); ++it)
    {
-      delete[] lReadIndex;
-      fclose(fp);
-      return true;
+      vWindows.push_back(make_pair((*it)->_pepMassInfo.dPeptideMassToleranceMinus,
+                                   (*it)->_pepMassInfo.dPeptideMassTolerancePlus));
    }
 
-   if (iStart < iMinMass)
-      iStart = iMinMass;
-   if (iEnd > iMaxMass)
-      iEnd = iMaxMass;
+   sort(vWindows.begin(), vWindows.end());
 
-   int iStart10 = (int)(g_massRange.dMinMass*10.0 - 0.5);  // lReadIndex is at 0.1 resolution for index value so scale iStart/iEnd to be same
-   int iEnd10 = (int)(g_massRange.dMaxMass*10.0 + 0.5);
+   _vIndexQueryWindows.clear();
+   for (vector<pair<double, double> >::iterator it = vWindows.begin(); it != vWindows.end(); ++it)
+   {
+      if (!_vIndexQueryWindows.empty() && it->first <= _vIndexQueryWindows.back().second)
+      {
+         if (it->second > _vIndexQueryWindows.back().second)
+            _vIndexQueryWindows.back().second = it->second;
+      }
+      else
+         _vIndexQueryWindows.push_back(*it);
+   }
+}
 
-   if (iStart10 < iMinMass*10)
-      iStart10 = iMinMass*10;
-   if (iEnd10 > iMaxMass*10)
-      iEnd10 = iMaxMass*10;
 
+// Search the peptides of the .idx data starting at file position lStartPos through
+// mass index iEnd10; stops early at the first peptide whose 0.1 Da mass index is
+// iStopMass10 or more, which is where the next thread's range begins.
+void CometSearch::IndexSearchRange(const char *pIndexData,
+                                   comet_fileoffset_t lStartPos,
+                                   int iEnd10,
+                                   int iStopMass10,
+                                   comet_fileoffset_t lEndOfStruct,
+                                   bool *pbDuplFragment)
+{
    struct DBIndex sDBI;
    sDBEntry dbe;
 
-   while (lReadIndex[iStart10] == -1 && iStart10 < iEnd10)
-      iStart10++;
-
-   if (lReadIndex[iStart10] == -1)  // no match found within tolerance
-   {
-      delete[] lReadIndex;
-      fclose(fp);
-      return true;
-   }
-
-   comet_fseek(fp, lReadIndex[iStart10], SEEK_SET);
-   ReadDBIndexEntry(&sDBI, fp);
+   comet_fileoffset_t lPos = ReadDBIndexEntry(&sDBI, pIndexData, lStartPos);
    dbe.lProteinFilePosition = _proteinInfo.lProteinFilePosition;
 
    _proteinInfo.cPrevAA = sDBI.szPrevNextAA[0];
    _proteinInfo.cNextAA = sDBI.szPrevNextAA[1];
 
-   while ((int)(sDBI.dPepMass * 10) <= iEnd10)
+   while ((int)(sDBI.dPepMass * 10) <= iEnd10 && (int)(sDBI.dPepMass * 10) < iStopMass10)
    {
 /*
       printf("OK  index pep ");
@@ -1395,16 +3236,16 @@ bool CometSearch::IndexSearch(void)
 
       // Do the search
       if (iWhichQuery != -1)
-         AnalyzeIndexPep(iWhichQuery, sDBI, _ppbDuplFragmentArr[0], &dbe);
+         AnalyzeIndexPep(iWhichQuery, sDBI, pbDuplFragment, &dbe, NULL, NULL);
 
-      if (comet_ftell(fp)>=lEndOfStruct || sDBI.dPepMass>g_massRange.dMaxMass)
+      if (lPos>=lEndOfStruct || sDBI.dPepMass>g_massRange.dMaxMass)
          break;
 
-      ReadDBIndexEntry(&sDBI, fp);
+      lPos = ReadDBIndexEntry(&sDBI, pIndexData, lPos);
       dbe.lProteinFilePosition = _proteinInfo.lProteinFilePosition;
 
       // read past last entry in indexed db, need to break out of loop
-      if (feof(fp))
+      if (lPos > lEndOfStruct)
          break;
 
       _proteinInfo.cPrevAA = sDBI.szPrevNextAA[0];
@@ -1419,131 +3260,370 @@ bool CometSearch::IndexSearch(void)
             break;
       }
    }
+}
 
-// for (vector<Query*>::iterator it = g_pvQuery.begin(); it != g_pvQuery.end(); ++it) // g_pvQuery is always size 1 here; for loop is useless
-   vector<Query*>::iterator it = g_pvQuery.begin();
+
+// Version 2 counterpart of IndexSearchRange():  searches from peptide number
+// tStartPeptide.  Only the mass column is read until a peptide falls within the
+// tolerance of a query; a peptide below the next of _vIndexQueryWindows jumps
+// ahead with a binary search of the mass column.  Peptides are sorted by mass
+// within FLOAT_ZERO, which the window checks allow for.
+void CometSearch::IndexSearchColumnRange(const IndexData *pSegment,
+                                         uint64_t tStartPeptide,
+                                         int iEnd10,
+                                         int iStopMass10,
+                                         bool *pbDuplFragment)
+{
+   struct DBIndex sDBI;
+   sDBEntry dbe;
+   const double *pdMasses = pSegment->pdMasses;
+
+   // use the stored fragment ions when they match this search
+   const IndexFragmentBinsHeader *pFragmentBins = NULL;
+   const unsigned int *puiFragmentBins = NULL;
+   uint64_t iBinsPerResidue = 0;
+   if (UseIndexFragmentBins(pSegment))
    {
-      int iNumMatchedPeptides;
+      pFragmentBins = pSegment->pFragmentBins;
+      puiFragmentBins = pSegment->puiFragmentBins;
+      iBinsPerResidue = (uint64_t)pFragmentBins->iNumLadders * pFragmentBins->iMaxFragmentCharge
+         * pFragmentBins->iNumIonSeries;
+   }
 
-      iNumMatchedPeptides = (*it)->iMatchPeptideCount;
-      if (iNumMatchedPeptides > g_staticParams.options.iNumStored)
-         iNumMatchedPeptides = g_staticParams.options.iNumStored;
+   _proteinInfo.cPrevAA = '-';  // prev & next AA are not stored
+   _proteinInfo.cNextAA = '-';
 
-      if (iNumMatchedPeptides > 0)  // will retrieve protein names here if there is one or more matched peptides
+   vector<pair<double, double> >::const_iterator itWindow = _vIndexQueryWindows.begin();
+
+   for (uint64_t tPeptide = tStartPeptide; tPeptide < pSegment->tNumPeptides; tPeptide++)
+   {
+      double dPepMass = pdMasses[tPeptide];
+
+      if ((int)(dPepMass * 10) > iEnd10 || (int)(dPepMass * 10) >= iStopMass10 || dPepMass > g_massRange.dMaxMass)
+         break;
+
+      while (itWindow != _vIndexQueryWindows.end() && itWindow->second < dPepMass - FLOAT_ZERO)
+         ++itWindow;
+
+      if (itWindow == _vIndexQueryWindows.end())
+         break;
+
+      if (dPepMass < itWindow->first)
       {
-         // sort and report results by xcorr; E-value calculation too expensive for real-time search
-         std::sort((*it)->_pResults, (*it)->_pResults + iNumMatchedPeptides, CometPostAnalysis::SortFnXcorr);
+         // Every peptide before the first one not below the window less FLOAT_ZERO is
+         // lighter than the window and heavier than the previous one.
+         uint64_t tNext = (uint64_t)(std::lower_bound(pdMasses + tPeptide, pdMasses + pSegment->tNumPeptides,
+                  itWindow->first - FLOAT_ZERO) - pdMasses);
+
+         if (tNext > tPeptide)
+            tPeptide = tNext - 1;  // loop increment lands on tNext
+         continue;
+      }
 
-         for (int ii = 0; ii < iNumMatchedPeptides; ii++)  // loop through all hits to this one spectrum query
-         {
-            if (ii > 0 && (*it)->_pResults[ii].fXcorr < (*it)->_pResults[0].fXcorr)  // do this only for peptides that have same top xcorr, could be more than 1
-               break;
+      int iWhichQuery = BinarySearchMass(0, (int)g_pvQuery.size(), dPepMass);
 
-            std::vector<ProteinEntryStruct>::iterator itProt;
-            bool bPrintDecoyPrefix = false;
+      while (iWhichQuery > 0 && g_pvQuery.at(iWhichQuery)->_pepMassInfo.dPeptideMassTolerancePlus >= dPepMass)
+         iWhichQuery--;
 
-            // Note peptides can be from target or internal decoy. If peptide is from a target protein,
-            // Comet will only report target protein matches and not internal decoy protein matches.
-            // Decoy proteins only reported for peptides that are exclusively decoy matches.
-            if ((*it)->_pResults[ii].pWhichProtein.size() > 0)
-               itProt = (*it)->_pResults[ii].pWhichProtein.begin();   // list of target proteins
-            else
+      // Do the search
+      if (iWhichQuery != -1)
+      {
+         ReadDBIndexColumns(pSegment, &sDBI, tPeptide);
+         dbe.lProteinFilePosition = _proteinInfo.lProteinFilePosition;
+
+         // a peptide already in an earlier segment is scored again only to add its
+         // proteins to a stored result; it is not counted twice
+         _bIndexPeptideRepeated = (pSegment != &_indexData && IndexPeptideInEarlierSegment(pSegment, sDBI));
+
+         AnalyzeIndexPep(iWhichQuery, sDBI, pbDuplFragment, &dbe, pFragmentBins,
+               puiFragmentBins == NULL ? NULL : puiFragmentBins + iBinsPerResidue * (pSegment->ptSequenceOffsets[tPeptide] / 5 - tPeptide));
+
+         _bIndexPeptideRepeated = false;
+      }
+
+      if (g_staticParams.options.iMaxIndexRunTime > 0)
+      {
+         // now check search run time
+         std::chrono::high_resolution_clock::time_point tNow = std::chrono::high_resolution_clock::now();
+         auto tElapsedTime = std::chrono::duration_cast<chrono::milliseconds>(tNow - g_staticParams.tRealTimeStart).count();
+         if (tElapsedTime >= g_staticParams.options.iMaxIndexRunTime)
+            break;
+      }
+   }
+}
+
+
+// True if the binned fragment ions stored in the index segment are the ones this
+// search would calculate.
+bool CometSearch::UseIndexFragmentBins(const IndexData *pSegment)
+{
+   const IndexFragmentBinsHeader *pFragmentBins = pSegment->pFragmentBins;
+
+   if (pFragmentBins == NULL
+         || pFragmentBins->dInverseBinWidth != g_staticParams.dInverseBinWidth
+         || pFragmentBins->dOneMinusBinOffset != g_staticParams.dOneMinusBinOffset
+         || pFragmentBins->iMonoMassesFragment != g_staticParams.massUtility.bMonoMassesFragment
+         || pFragmentBins->iMaxFragmentCharge < g_massRange.iMaxFragmentCharge
+         || pFragmentBins->iNumIonSeries != g_staticParams.ionInformation.iNumIonSeriesUsed
+         || g_staticParams.variableModParameters.bUseFragmentNeutralLoss)
+   {
+      return false;
+   }
+
+   for (int i = 0; i < pFragmentBins->iNumIonSeries; i++)
+   {
+      if (pFragmentBins->piIonSeries[i] != g_staticParams.ionInformation.piSelectedIonSeries[i])
+         return false;
+   }
+
+   if (g_staticParams.options.iDecoySearch
+         && (pFragmentBins->iNumLadders < 2 || pFragmentBins->iSearchEnzymeOffSet != g_staticParams.enzymeInformation.iSearchEnzymeOffSet))
+   {
+      return false;
+   }
+
+   return true;
+}
+
+
+// Binned fragment ions of sDBI in the layout of INDEX_SECTION_FRAGMENT_BINS, using
+// the current binning, ion series and pHeader->iMaxFragmentCharge charges.  The
+// ladders are built exactly as AnalyzeIndexPep() builds them.
+void CometSearch::CalcIndexFragmentBins(DBIndex &sDBI,
+                                        const IndexFragmentBinsHeader *pHeader,
+                                        unsigned int *puiBins)
+{
+   double pdAAforward[MAX_PEPTIDE_LEN];
+   double pdAAreverse[MAX_PEPTIDE_LEN];
+   char szDecoyPeptide[MAX_PEPTIDE_LEN];
+   int piVarModSites[MAX_PEPTIDE_LEN_P2];
+   int piVarModSitesDecoy[MAX_PEPTIDE_LEN_P2];
+   int iLenPeptide = (int)strlen(sDBI.szPeptide);
+   int iEndPos = iLenPeptide - 1;
+   int i;
+
+   for (i = 0; i < iLenPeptide + 2; i++)
+      piVarModSites[i] = sDBI.pcVarModSites[i];
+
+   for (int iLadder = 0; iLadder < pHeader->iNumLadders; iLadder++)
+   {
+      char *szPeptide = sDBI.szPeptide;
+      int *piSites = piVarModSites;
+
+      if (iLadder == 1)
+      {
+         if (pHeader->iSearchEnzymeOffSet == 1)
+         {
+            // last residue stays the same:  change ABCDEK to EDCBAK
+            for (i = iEndPos - 1; i >= 0; i--)
             {
-               itProt = (*it)->_pResults[ii].pWhichDecoyProtein.begin();  // list of decoy proteins
-               bPrintDecoyPrefix = true;
+               szDecoyPeptide[iEndPos - i - 1] = sDBI.szPeptide[i];
+               piVarModSitesDecoy[iEndPos - i - 1] = piVarModSites[i];
             }
 
-            if (itProt->lWhichProtein > -1)
+            szDecoyPeptide[iEndPos] = sDBI.szPeptide[iEndPos];
+            piVarModSitesDecoy[iLenPeptide - 1] = piVarModSites[iLenPeptide - 1];
+         }
+         else
+         {
+            // first residue stays the same:  change ABCDEK to AKEDCB
+            for (i = iEndPos; i > 0; i--)
             {
-               long lSize;
-               vector<comet_fileoffset_t> vOffsets;
+               szDecoyPeptide[iEndPos - i + 1] = sDBI.szPeptide[i];
+               piVarModSitesDecoy[iEndPos - i + 1] = piVarModSites[i];
+            }
 
-               comet_fseek(fp, itProt->lWhichProtein, SEEK_SET);
-               fread(&lSize, sizeof(long), 1, fp);  // read count of protein offsets that this peptide matches to
+            szDecoyPeptide[0] = sDBI.szPeptide[0];
+            piVarModSitesDecoy[0] = piVarModSites[0];
+         }
 
-               if (lSize > MAX_PROTEINS)
-                  lSize = MAX_PROTEINS;
+         piVarModSitesDecoy[iLenPeptide] = piVarModSites[iLenPeptide];
+         piVarModSitesDecoy[iLenPeptide + 1] = piVarModSites[iLenPeptide + 1];
 
-               for (long x = 0; x < lSize; x++)  // loop through this count and read each file offset for each protein name
-               {
-                  comet_fileoffset_t tmpoffset;
-                  fread(&tmpoffset, sizeof(comet_fileoffset_t), 1, fp);
-                  vOffsets.push_back(tmpoffset);
-               }
-               for (long x = 0; x < lSize; x++)  // now given each protein name offset, seek to that position and read protein name
-               {
-                  char szTmp[WIDTH_REFERENCE];
-                  comet_fseek(fp, vOffsets.at(x), SEEK_SET);
-                  fread(szTmp, sizeof(char)*WIDTH_REFERENCE, 1, fp);
-                  if (bPrintDecoyPrefix)
-                     (*it)->_pResults[ii].strSingleSearchProtein += g_staticParams.szDecoyPrefix;
-                  (*it)->_pResults[ii].strSingleSearchProtein += szTmp;
-                  if (x < lSize - 1)
-                     (*it)->_pResults[ii].strSingleSearchProtein += " : ";
-               }
-            }
-         }
-/*
-         for (int x = 0; x < iNumMatchedPeptides; x++)
+         szPeptide = szDecoyPeptide;
+         piSites = piVarModSitesDecoy;
+      }
+
+      double dBion = g_staticParams.precalcMasses.dNtermProton;
+      double dYion = g_staticParams.precalcMasses.dCtermOH2Proton;
+
+      if (piSites[iLenPeptide] > 0)
+         dBion += g_staticParams.variableModParameters.varModList[piSites[iLenPeptide] - 1].dVarModMass;
+
+      if (piSites[iLenPeptide + 1] > 0)
+         dYion += g_staticParams.variableModParameters.varModList[piSites[iLenPeptide + 1] - 1].dVarModMass;
+
+      for (i = 0; i < iEndPos; i++)
+      {
+         int iPos2 = iEndPos - i;
+
+         dBion += g_staticParams.massUtility.pdAAMassFragment[(int)szPeptide[i]];
+         if (piSites[i] > 0)
+            dBion += g_staticParams.variableModParameters.varModList[piSites[i] - 1].dVarModMass;
+
+         dYion += g_staticParams.massUtility.pdAAMassFragment[(int)szPeptide[iPos2]];
+         if (piSites[iPos2] > 0)
+            dYion += g_staticParams.variableModParameters.varModList[piSites[iPos2] - 1].dVarModMass;
+
+         pdAAforward[i] = dBion;
+         pdAAreverse[i] = dYion;
+      }
+
+      for (int ctCharge = 1; ctCharge <= pHeader->iMaxFragmentCharge; ctCharge++)
+      {
+         for (int ctIonSeries = 0; ctIonSeries < pHeader->iNumIonSeries; ctIonSeries++)
          {
-            printf("OK %d scan %d, pep %s, xcorr %f, mass %f, matchcount %d, prot %s\n", x,
-               (*it)->_spectrumInfoInternal.iScanNumber,
-               (*it)->_pResults[x].szPeptide,
-               (*it)->_pResults[x].fXcorr,
-               (*it)->_pResults[x].dPepMass,
-               (*it)->iMatchPeptideCount,
-               (*it)->_pResults[x].strSingleSearchProtein.c_str()); fflush(stdout);
+            for (int ctLen = 0; ctLen < iEndPos; ctLen++)
+               *puiBins++ = BIN(GetFragmentIonMass(pHeader->piIonSeries[ctIonSeries], ctLen, ctCharge, pdAAforward, pdAAreverse));
          }
-*/
       }
    }
+}
 
-   delete [] lReadIndex;
-   fclose(fp);
-   return true;
+
+void CometSearch::IndexSearchThreadProc(IndexSearchThreadData *pIndexSearchThreadData)
+{
+   int i = GetSearchThreadSlot();
+
+   // Give memory manager access to the thread.
+   pIndexSearchThreadData->pbSearchMemoryPool = &_pbSearchMemoryPool[i];
+
+   CometSearch *pSearch = GetSearchContext(i);
+
+   if (pIndexSearchThreadData->pSegment->iVersion >= 2)
+   {
+      pSearch->IndexSearchColumnRange(pIndexSearchThreadData->pSegment,
+                                      (uint64_t)pIndexSearchThreadData->lStartPos,
+                                      pIndexSearchThreadData->iEnd10,
+                                      pIndexSearchThreadData->iStopMass10,
+                                      _ppbDuplFragmentArr[i]);
+   }
+   else
+   {
+      pSearch->IndexSearchRange(pIndexSearchThreadData->pIndexData,
+                                pIndexSearchThreadData->lStartPos,
+                                pIndexSearchThreadData->iEnd10,
+                                pIndexSearchThreadData->iStopMass10,
+                                pIndexSearchThreadData->lEndOfStruct,
+                                _ppbDuplFragmentArr[i]);
+   }
+
+   delete pIndexSearchThreadData;
+   pIndexSearchThreadData = NULL;
 }
 
 
-void CometSearch::ReadDBIndexEntry(struct DBIndex *sDBI, FILE *fp)
+// Decode the .idx peptide entry at file position lPos of pIndexData into sDBI and
+// return the file position of the next entry.
+comet_fileoffset_t CometSearch::ReadDBIndexEntry(struct DBIndex *sDBI,
+                                                 const char *pIndexData,
+                                                 comet_fileoffset_t lPos)
 {
+   const char *pEntry = pIndexData + lPos;
+
    int iLen;
-   fread(&iLen, sizeof(int), 1, fp);
-   fread(sDBI->szPeptide, sizeof(char), iLen, fp);
+   memcpy(&iLen, pEntry, sizeof(int));
+   pEntry += sizeof(int);
+   memcpy(sDBI->szPeptide, pEntry, iLen);
    sDBI->szPeptide[iLen] = '\0';
+   pEntry += iLen;
 
    sDBI->szPrevNextAA[0] = '-';  // currently not storing prev & next AA so set to '-' here
    sDBI->szPrevNextAA[1] = '-';
 
-   unsigned char cNumMods;  // number of var mods encoded as position:residue pairs
-   fread(&cNumMods, sizeof(unsigned char), 1, fp);  // read how many var mods are stored
+   unsigned char cNumMods = (unsigned char)*pEntry++;  // number of var mods encoded as position:residue pairs
 
    memset(sDBI->pcVarModSites, 0, sizeof(unsigned char)*iLen+2);
-   if (cNumMods > 0)
+   for (unsigned char x=0; x<cNumMods; x++)
    {
-      for (unsigned char x=0; x<cNumMods; x++)
-      {
-         unsigned char cPosition;
-         char cResidue;
-         fread(&cPosition, sizeof(unsigned char), 1, fp);
-         fread(&cResidue, sizeof(char), 1, fp);
-         sDBI->pcVarModSites[(int)cPosition] = cResidue;
-      }
+      unsigned char cPosition = (unsigned char)pEntry[0];
+      sDBI->pcVarModSites[(int)cPosition] = pEntry[1];
+      pEntry += 2;
    }
-   // done writing out mod sites
 
-   fread(&(sDBI->dPepMass), sizeof(double), 1, fp);
-   fread(&(sDBI->lIndexProteinFilePosition), sizeof(comet_fileoffset_t), 1, fp);
+   memcpy(&(sDBI->dPepMass), pEntry, sizeof(double));
+   pEntry += sizeof(double);
+   memcpy(&(sDBI->lIndexProteinFilePosition), pEntry, sizeof(comet_fileoffset_t));
+   pEntry += sizeof(comet_fileoffset_t);
 
-   // Now read in the protein file positions here; not used yet
-   _proteinInfo.lProteinFilePosition = comet_ftell(fp);
+   // The protein file positions follow; skip past them as they are only read for the
+   // reported peptides.
+   _proteinInfo.lProteinFilePosition = (comet_fileoffset_t)(pEntry - pIndexData);
    long lSize;
-   fread(&lSize, sizeof(long), 1, fp);
+   memcpy(&lSize, pEntry, sizeof(long));
+   pEntry += sizeof(long) + lSize * sizeof(comet_fileoffset_t);
+
+   return (comet_fileoffset_t)(pEntry - pIndexData);
+}
+
+
+// Decode peptide number tPeptide of a version 2 index segment into sDBI.
+void CometSearch::ReadDBIndexColumns(const IndexData *pSegment,
+                                     struct DBIndex *sDBI,
+                                     uint64_t tPeptide)
+{
+   DecodeIndexPeptide(pSegment, sDBI, tPeptide);
+
+   _proteinInfo.lProteinFilePosition = pSegment->plProteinRefs[tPeptide];
+}
+
+
+void CometSearch::DecodeIndexPeptide(const IndexData *pSegment,
+                                     struct DBIndex *sDBI,
+                                     uint64_t tPeptide)
+{
+   const unsigned char *pucSequences = pSegment->pucSequences;
+   uint64_t tBit = pSegment->ptSequenceOffsets[tPeptide];
+   int iLen = (int)((pSegment->ptSequenceOffsets[tPeptide + 1] - tBit) / 5);
+
+   for (int i = 0; i < iLen; i++)
+   {
+      unsigned int uiBits = pucSequences[tBit >> 3] | (pucSequences[(tBit >> 3) + 1] << 8);
+      sDBI->szPeptide[i] = (char)('A' - 1 + ((uiBits >> (tBit & 7)) & 0x1F));
+      tBit += 5;
+   }
+   sDBI->szPeptide[iLen] = '\0';
+
+   sDBI->szPrevNextAA[0] = '-';  // currently not storing prev & next AA so set to '-' here
+   sDBI->szPrevNextAA[1] = '-';
 
-   for (long x = 0; x < lSize; x++)
+   memset(sDBI->pcVarModSites, 0, sizeof(unsigned char)*iLen+2);
+   for (uint64_t x = pSegment->ptModOffsets[tPeptide]; x < pSegment->ptModOffsets[tPeptide + 1]; x++)
+      sDBI->pcVarModSites[pSegment->pucModSites[2*x]] = pSegment->pucModSites[2*x + 1];
+
+   sDBI->dPepMass = pSegment->pdMasses[tPeptide];
+   sDBI->lIndexProteinFilePosition = pSegment->plProteinRefs[tPeptide];
+}
+
+
+// True if sDBI, the same residues and variable mods, was already searched in the
+// base index or a delta segment before pSegment.
+bool CometSearch::IndexPeptideInEarlierSegment(const IndexData *pSegment,
+                                               DBIndex &sDBI)
+{
+   int iLen2 = (int)strlen(sDBI.szPeptide) + 2;
+   DBIndex sEntry;
+
+   for (size_t i = 0; i <= _vIndexDeltas.size(); i++)
    {
-      comet_fileoffset_t tmpoffset;
-      fread(&tmpoffset, sizeof(comet_fileoffset_t), 1, fp);
+      const IndexData *pEarlier = (i == 0 ? &_indexData : &_vIndexDeltas.at(i - 1));
+
+      if (pEarlier == pSegment)
+         break;
+
+      // segments are in mass order; the same peptide's mass can differ by rounding
+      const double *pdEnd = pEarlier->pdMasses + pEarlier->tNumPeptides;
+      for (const double *pdMass = std::lower_bound(pEarlier->pdMasses, pdEnd, sDBI.dPepMass - FLOAT_ZERO);
+            pdMass < pdEnd && *pdMass <= sDBI.dPepMass + FLOAT_ZERO; pdMass++)
+      {
+         DecodeIndexPeptide(pEarlier, &sEntry, (uint64_t)(pdMass - pEarlier->pdMasses));
+
+         if (!strcmp(sEntry.szPeptide, sDBI.szPeptide) && !memcmp(sEntry.pcVarModSites, sDBI.pcVarModSites, iLen2))
+            return true;
+      }
    }
+
+   return false;
 }
 
 
@@ -1553,7 +3633,7 @@ void CometSearch::ReadDBIndexEntry(struct DBIndex *sDBI, FILE *fp)
 // iNtermPeptideOnly==1 specifies clipped methionine sequence
 // iNtermPeptideOnly==2 specifies clipped methionine sequence due to the
 //                      PEFF variant becoming the clipped methionine
-bool CometSearch::SearchForPeptides(struct sDBEntry dbe,
+bool CometSearch::SearchForPeptides(struct sDBEntry &dbe,
                                     char *szProteinSeq,
                                     int iNtermPeptideOnly,
                                     bool *pbDuplFragment)
@@ -1591,16 +3671,7 @@ bool CometSearch::SearchForPeptides(struct sDBEntry dbe,
 
    iLenProtein = _proteinInfo.iTmpProteinSeqLength;
 
-   int iFirstResiduePosition = 0;
-
-   if (dbe.vectorPeffMod.size() > 0) // sort vectorPeffMod by iPosition
-      sort(dbe.vectorPeffMod.begin(), dbe.vectorPeffMod.end());
-
-   if (dbe.vectorPeffVariantSimple.size() > 0) // sort peffVariantSimpleStruct by iPosition
-      sort(dbe.vectorPeffVariantSimple.begin(), dbe.vectorPeffVariantSimple.end());
-
-   if (dbe.vectorPeffVariantComplex.size() > 0) // sort peffVariantComplexStruct by iPositionA
-     sort(dbe.vectorPeffVariantComplex.begin(), dbe.vectorPeffVariantComplex.end());
+   int iFirstResiduePosition = 0;
 
    memset(piVarModCounts, 0, sizeof(piVarModCounts));
 
@@ -1676,8 +3747,6 @@ bool CometSearch::SearchForPeptides(struct sDBEntry dbe,
          {
             if (WithinMassTolerance(dCalcPepMass, szProteinSeq, iStartPos, iEndPos) == 1)
             {
-               Threading::LockMutex(g_pvQueryMutex);
-
                // add to DBIndex vector
                DBIndex sEntry;
                sEntry.dPepMass = dCalcPepMass;  //MH+ mass
@@ -1698,9 +3767,7 @@ bool CometSearch::SearchForPeptides(struct sDBEntry dbe,
                sEntry.lIndexProteinFilePosition = _proteinInfo.lProteinFilePosition;
                memset(sEntry.pcVarModSites, 0, sizeof(char)*(iLenPeptide+2));
 
-               g_pvDBIndex.push_back(sEntry);
-
-               Threading::UnlockMutex(g_pvQueryMutex);
+               AddIndexPeptide(sEntry);
             }
          }
          else if (!g_staticParams.variableModParameters.bRequireVarMod)
@@ -1840,6 +3907,7 @@ bool CometSearch::SearchForPeptides(struct sDBEntry dbe,
             if (iWhichQuery != -1)
             {
                bool bFirstTimeThroughLoopForPeptide = true;
+               char szDecoyPeptide[MAX_PEPTIDE_LEN_P2];  // Allow for prev/next AA in string.
 
                // Compare calculated fragment ions against all matching query spectra.
                while (iWhichQuery < (int)g_pvQuery.size())
@@ -1853,8 +3921,6 @@ bool CometSearch::SearchForPeptides(struct sDBEntry dbe,
                   // Mass tolerance check for particular query against this candidate peptide mass.
                   if (CheckMassMatch(iWhichQuery, dCalcPepMass))
                   {
-                     char szDecoyPeptide[MAX_PEPTIDE_LEN_P2];  // Allow for prev/next AA in string.
-
                      // Calculate ion series just once to compare against all relevant query spectra.
                      if (bFirstTimeThroughLoopForPeptide && !g_staticParams.options.bCreateIndex)
                      {
@@ -1956,149 +4022,173 @@ bool CometSearch::SearchForPeptides(struct sDBEntry dbe,
                               }
                            }
                         }
-                     }
-
-                     if (bFirstTimeThroughLoopForPeptide)
-                         bFirstTimeThroughLoopForPeptide = false;
-
-                     XcorrScore(szProteinSeq, iStartPos, iEndPos, iStartPos, iEndPos, iFoundVariableMod,
-                           dCalcPepMass, false, iWhichQuery, iLenPeptide, piVarModSites, &dbe);
 
-                     // Also take care of decoy here.
-                     if (g_staticParams.options.iDecoySearch)
-                     {
-                        // Generate reverse peptide.  Keep prev and next AA in szDecoyPeptide string.
-                        // So actual reverse peptide starts at position 1 and ends at len-2 (as len-1
-                        // is next AA).
+                        if (_bFragIndexActive)
+                           FragmentIndexCountPeptide(iLenPeptide, false, iWhichQuery, dCalcPepMass);
 
-                        int iLenMinus1 = iEndPos - iStartPos; // Equals iLenPeptide minus 1.
-                        double dBion = g_staticParams.precalcMasses.dNtermProton;
-                        double dYion = g_staticParams.precalcMasses.dCtermOH2Proton;
+                        // Also take care of decoy here.  The decoy peptide and its fragment ions do
+                        // not depend on the query so they're calculated once here; only the precursor
+                        // NL peaks, which depend on the query charge, are added for each query below.
+                        if (g_staticParams.options.iDecoySearch)
+                        {
+                           // Generate reverse peptide.  Keep prev and next AA in szDecoyPeptide string.
+                           // So actual reverse peptide starts at position 1 and ends at len-2 (as len-1
+                           // is next AA).
 
-                        // Store flanking residues from original sequence.
-                        if (iStartPos==0)
-                           szDecoyPeptide[0]='-';
-                        else
-                           szDecoyPeptide[0]=szProteinSeq[iStartPos-1];
+                           // Store flanking residues from original sequence.
+                           if (iStartPos==0)
+                              szDecoyPeptide[0]='-';
+                           else
+                              szDecoyPeptide[0]=szProteinSeq[iStartPos-1];
 
-                        if (iEndPos == iProteinSeqLengthMinus1)
-                           szDecoyPeptide[iLenPeptide+1]='-';
-                        else
-                           szDecoyPeptide[iLenPeptide+1]=szProteinSeq[iEndPos+1];
-                        szDecoyPeptide[iLenPeptide+2]='\0';
+                           if (iEndPos == iProteinSeqLengthMinus1)
+                              szDecoyPeptide[iLenPeptide+1]='-';
+                           else
+                              szDecoyPeptide[iLenPeptide+1]=szProteinSeq[iEndPos+1];
+                           szDecoyPeptide[iLenPeptide+2]='\0';
 
-                        if (g_staticParams.enzymeInformation.iSearchEnzymeOffSet==1)
-                        {
-                           // Last residue stays the same:  change ABCDEK to EDCBAK.
-                           for (i=iEndPos-1; i>=iStartPos; i--)
-                              szDecoyPeptide[iEndPos-i] = szProteinSeq[i];
+                           if (g_staticParams.enzymeInformation.iSearchEnzymeOffSet==1)
+                           {
+                              // Last residue stays the same:  change ABCDEK to EDCBAK.
+                              for (i=iEndPos-1; i>=iStartPos; i--)
+                                 szDecoyPeptide[iEndPos-i] = szProteinSeq[i];
 
-                           szDecoyPeptide[iEndPos-iStartPos+1]=szProteinSeq[iEndPos];  // Last residue stays same.
-                        }
-                        else
-                        {
-                           // First residue stays the same:  change ABCDEK to AKEDCB.
-                           for (i=iEndPos; i>=iStartPos+1; i--)
-                              szDecoyPeptide[iEndPos-i+2] = szProteinSeq[i];
+                              szDecoyPeptide[iEndPos-iStartPos+1]=szProteinSeq[iEndPos];  // Last residue stays same.
+                           }
+                           else
+                           {
+                              // First residue stays the same:  change ABCDEK to AKEDCB.
+                              for (i=iEndPos; i>=iStartPos+1; i--)
+                                 szDecoyPeptide[iEndPos-i+2] = szProteinSeq[i];
 
-                           szDecoyPeptide[1]=szProteinSeq[iStartPos];  // First residue stays same.
-                        }
+                              szDecoyPeptide[1]=szProteinSeq[iStartPos];  // First residue stays same.
+                           }
 
-                        // Now given szDecoyPeptide, calculate pdAAforwardDecoy and pdAAreverseDecoy.
-                        dBion = g_staticParams.precalcMasses.dNtermProton;
-                        dYion = g_staticParams.precalcMasses.dCtermOH2Proton;
+                           // Now given szDecoyPeptide, calculate pdAAforwardDecoy and pdAAreverseDecoy.
+                           dBion = g_staticParams.precalcMasses.dNtermProton;
+                           dYion = g_staticParams.precalcMasses.dCtermOH2Proton;
 
-                        if (iStartPos == 0)
-                           dBion += g_staticParams.staticModifications.dAddNterminusProtein;
-                        if (iEndPos == iProteinSeqLengthMinus1)
-                           dYion += g_staticParams.staticModifications.dAddCterminusProtein;
+                           if (iStartPos == 0)
+                              dBion += g_staticParams.staticModifications.dAddNterminusProtein;
+                           if (iEndPos == iProteinSeqLengthMinus1)
+                              dYion += g_staticParams.staticModifications.dAddCterminusProtein;
 
-                        int iDecoyStartPos;       // This is start/end for newly created decoy peptide
-                        int iDecoyEndPos;
-                        int iPosForward;
-                        int iPosReverse;
+                           int iDecoyStartPos;       // This is start/end for newly created decoy peptide
+                           int iDecoyEndPos;
 
-                        iDecoyStartPos = 1;
-                        iDecoyEndPos = (int)strlen(szDecoyPeptide)-2;
+                           iDecoyStartPos = 1;
+                           iDecoyEndPos = (int)strlen(szDecoyPeptide)-2;
 
-                        for (i=iDecoyStartPos; i<iDecoyEndPos; i++)
-                        {
-                           iPosForward = i - iDecoyStartPos;
-                           iPosReverse = iDecoyEndPos - iPosForward;
+                           for (i=iDecoyStartPos; i<iDecoyEndPos; i++)
+                           {
+                              iPosForward = i - iDecoyStartPos;
+                              iPosReverse = iDecoyEndPos - iPosForward;
 
-                           dBion += g_staticParams.massUtility.pdAAMassFragment[(int)szDecoyPeptide[i]];
-                           _pdAAforwardDecoy[iPosForward] = dBion;
+                              dBion += g_staticParams.massUtility.pdAAMassFragment[(int)szDecoyPeptide[i]];
+                              _pdAAforwardDecoy[iPosForward] = dBion;
 
-                           dYion += g_staticParams.massUtility.pdAAMassFragment[(int)szDecoyPeptide[iPosReverse]];
-                           _pdAAreverseDecoy[iPosForward] = dYion;
-                        }
+                              dYion += g_staticParams.massUtility.pdAAMassFragment[(int)szDecoyPeptide[iPosReverse]];
+                              _pdAAreverseDecoy[iPosForward] = dYion;
+                           }
 
-                        for (ctCharge=1; ctCharge<=g_massRange.iMaxFragmentCharge; ctCharge++)
-                        {
-                           for (ctIonSeries=0; ctIonSeries<g_staticParams.ionInformation.iNumIonSeriesUsed; ctIonSeries++)
+                           for (ctCharge=1; ctCharge<=g_massRange.iMaxFragmentCharge; ctCharge++)
                            {
-                              iWhichIonSeries = g_staticParams.ionInformation.piSelectedIonSeries[ctIonSeries];
-
-                              for (ctLen=0; ctLen<iLenMinus1; ctLen++)
+                              for (ctIonSeries=0; ctIonSeries<g_staticParams.ionInformation.iNumIonSeriesUsed; ctIonSeries++)
                               {
-                                 pbDuplFragment[BIN(GetFragmentIonMass(iWhichIonSeries, ctLen, ctCharge, _pdAAforwardDecoy, _pdAAreverseDecoy))] = false;
-                                 _uiBinnedIonMassesDecoy[ctCharge][ctIonSeries][ctLen][0] = 0;
+                                 iWhichIonSeries = g_staticParams.ionInformation.piSelectedIonSeries[ctIonSeries];
+
+                                 for (ctLen=0; ctLen<iLenMinus1; ctLen++)
+                                 {
+                                    pbDuplFragment[BIN(GetFragmentIonMass(iWhichIonSeries, ctLen, ctCharge, _pdAAforwardDecoy, _pdAAreverseDecoy))] = false;
+                                    _uiBinnedIonMassesDecoy[ctCharge][ctIonSeries][ctLen][0] = 0;
+                                 }
                               }
                            }
-                        }
 
-                        for (int ctNL=0; ctNL<g_staticParams.iPrecursorNLSize; ctNL++)
-                        {
-                           for (ctCharge=g_pvQuery.at(iWhichQuery)->_spectrumInfoInternal.iChargeState; ctCharge>=1; ctCharge--)
+                           // Now get the set of binned fragment ions once to compare this peptide against all matching spectra.
+                           for (ctCharge=1; ctCharge<=g_massRange.iMaxFragmentCharge; ctCharge++)
                            {
-                              double dNLMass = (dCalcPepMass - PROTON_MASS - g_staticParams.precursorNLIons[ctNL] + ctCharge*PROTON_MASS)/ctCharge;
-                              int iVal = BIN(dNLMass);
-
-                              if (iVal > 0)
+                              for (ctIonSeries=0; ctIonSeries<g_staticParams.ionInformation.iNumIonSeriesUsed; ctIonSeries++)
                               {
-                                 pbDuplFragment[iVal] = false;
-                                 _uiBinnedPrecursorNLDecoy[ctNL][ctCharge] = 0;
+                                 iWhichIonSeries = g_staticParams.ionInformation.piSelectedIonSeries[ctIonSeries];
+
+                                 // As both _pdAAforward and _pdAAreverse are increasing, loop through
+                                 // iLenPeptide-1 to complete set of internal fragment ions.
+                                 for (ctLen=0; ctLen<iLenMinus1; ctLen++)
+                                 {
+                                    double dFragMass = GetFragmentIonMass(iWhichIonSeries, ctLen, ctCharge, _pdAAforwardDecoy, _pdAAreverseDecoy);
+                                    int iVal = BIN(dFragMass);
+
+                                    if (pbDuplFragment[iVal] == false)
+                                    {
+                                       _uiBinnedIonMassesDecoy[ctCharge][ctIonSeries][ctLen][0] = iVal;
+                                       pbDuplFragment[iVal] = true;
+                                    }
+                                 }
                               }
                            }
+
+                           // No fragment NL peaks here as unmodified
+
+                           if (_bFragIndexActive)
+                              FragmentIndexCountPeptide(iLenPeptide, true, iWhichQuery, dCalcPepMass);
                         }
+                     }
 
-                        // Now get the set of binned fragment ions once to compare this peptide against all matching spectra.
-                        for (ctCharge=1; ctCharge<=g_massRange.iMaxFragmentCharge; ctCharge++)
+                     if (bFirstTimeThroughLoopForPeptide)
+                         bFirstTimeThroughLoopForPeptide = false;
+
+                     XcorrScore(szProteinSeq, iStartPos, iEndPos, iStartPos, iEndPos, iFoundVariableMod,
+                           dCalcPepMass, false, iWhichQuery, iLenPeptide, piVarModSites, &dbe);
+
+                     if (g_staticParams.options.iDecoySearch)
+                     {
+                        // Precursor NL peaks depend on the query charge so are set for each query.
+                        if (g_staticParams.iPrecursorNLSize > 0)
                         {
-                           for (ctIonSeries=0; ctIonSeries<g_staticParams.ionInformation.iNumIonSeriesUsed; ctIonSeries++)
-                           {
-                              iWhichIonSeries = g_staticParams.ionInformation.piSelectedIonSeries[ctIonSeries];
+                           int iLenMinus1 = iEndPos - iStartPos; // Equals iLenPeptide minus 1.
 
-                              // As both _pdAAforward and _pdAAreverse are increasing, loop through
-                              // iLenPeptide-1 to complete set of internal fragment ions.
-                              for (ctLen=0; ctLen<iLenMinus1; ctLen++)
+                           for (int ctNL=0; ctNL<g_staticParams.iPrecursorNLSize; ctNL++)
+                           {
+                              for (ctCharge=g_pvQuery.at(iWhichQuery)->_spectrumInfoInternal.iChargeState; ctCharge>=1; ctCharge--)
                               {
-                                 double dFragMass = GetFragmentIonMass(iWhichIonSeries, ctLen, ctCharge, _pdAAforwardDecoy, _pdAAreverseDecoy);
-                                 int iVal = BIN(dFragMass);
+                                 double dNLMass = (dCalcPepMass - PROTON_MASS - g_staticParams.precursorNLIons[ctNL] + ctCharge*PROTON_MASS)/ctCharge;
+                                 int iVal = BIN(dNLMass);
 
-                                 if (pbDuplFragment[iVal] == false)
+                                 if (iVal > 0)
                                  {
-                                    _uiBinnedIonMassesDecoy[ctCharge][ctIonSeries][ctLen][0] = iVal;
-                                    pbDuplFragment[iVal] = true;
+                                    pbDuplFragment[iVal] = false;
+                                    _uiBinnedPrecursorNLDecoy[ctNL][ctCharge] = 0;
                                  }
                               }
                            }
-                        }
 
-                        // No fragment NL peaks here as unmodified
-
-                        // Precursor NL peaks added here
-                        for (int ctNL=0; ctNL<g_staticParams.iPrecursorNLSize; ctNL++)
-                        {
-                           for (ctCharge=g_pvQuery.at(iWhichQuery)->_spectrumInfoInternal.iChargeState; ctCharge>=1; ctCharge--)
+                           // Restore decoy fragment ion bins so precursor NL peaks aren't counted twice.
+                           for (ctCharge=1; ctCharge<=g_massRange.iMaxFragmentCharge; ctCharge++)
                            {
-                              double dNLMass = (dCalcPepMass - PROTON_MASS - g_staticParams.precursorNLIons[ctNL] + ctCharge*PROTON_MASS)/ctCharge;
-                              int iVal = BIN(dNLMass);
+                              for (ctIonSeries=0; ctIonSeries<g_staticParams.ionInformation.iNumIonSeriesUsed; ctIonSeries++)
+                              {
+                                 for (ctLen=0; ctLen<iLenMinus1; ctLen++)
+                                 {
+                                    if (_uiBinnedIonMassesDecoy[ctCharge][ctIonSeries][ctLen][0] > 0)
+                                       pbDuplFragment[_uiBinnedIonMassesDecoy[ctCharge][ctIonSeries][ctLen][0]] = true;
+                                 }
+                              }
+                           }
 
-                              if (iVal > 0 && pbDuplFragment[iVal] == false)
+                           // Precursor NL peaks added here
+                           for (int ctNL=0; ctNL<g_staticParams.iPrecursorNLSize; ctNL++)
+                           {
+                              for (ctCharge=g_pvQuery.at(iWhichQuery)->_spectrumInfoInternal.iChargeState; ctCharge>=1; ctCharge--)
                               {
-                                 _uiBinnedPrecursorNLDecoy[ctNL][ctCharge] = iVal;
-                                 pbDuplFragment[iVal] = true;
+                                 double dNLMass = (dCalcPepMass - PROTON_MASS - g_staticParams.precursorNLIons[ctNL] + ctCharge*PROTON_MASS)/ctCharge;
+                                 int iVal = BIN(dNLMass);
+
+                                 if (iVal > 0 && pbDuplFragment[iVal] == false)
+                                 {
+                                    _uiBinnedPrecursorNLDecoy[ctNL][ctCharge] = iVal;
+                                    pbDuplFragment[iVal] = true;
+                                 }
                               }
                            }
                         }
@@ -2199,10 +4289,14 @@ bool CometSearch::SearchForPeptides(struct sDBEntry dbe,
 }
 
 
+// puiPeptideBins is the peptide's entry in INDEX_SECTION_FRAGMENT_BINS when it can be
+// used in place of building the fragment ion ladders, otherwise NULL.
 void CometSearch::AnalyzeIndexPep(int iWhichQuery,
-                                  DBIndex sDBI,
+                                  const DBIndex &sDBI,
                                   bool *pbDuplFragment,
-                                  struct sDBEntry *dbe)
+                                  struct sDBEntry *dbe,
+                                  const IndexFragmentBinsHeader *pFragmentBins,
+                                  const unsigned int *puiPeptideBins)
 {
    int iWhichIonSeries;
    int ctIonSeries;
@@ -2307,28 +4401,43 @@ void CometSearch::AnalyzeIndexPep(int iWhichQuery,
                iFoundVariableMod = 1;
             }
 
-            // Generate pdAAforward for sDBI.szPeptide
-            for (int i=iStartPos; i<iEndPos; i++)
+            if (puiPeptideBins != NULL)
             {
-               int iPos = i - iStartPos;
-               int iPos2 = iEndPos - i + iStartPos;
-
-               dBion += g_staticParams.massUtility.pdAAMassFragment[(int)sDBI.szPeptide[i]];
-               if (piVarModSites[iPos] > 0)
+               // ladders are stored; only note whether a residue is modified
+               for (i=iStartPos; i<=iEndPos && iLenMinus1>0; i++)
                {
-                  dBion += g_staticParams.variableModParameters.varModList[piVarModSites[iPos]-1].dVarModMass;
-                  iFoundVariableMod = 1;
+                  if (piVarModSites[i - iStartPos] > 0)
+                  {
+                     iFoundVariableMod = 1;
+                     iFoundVariableModDecoy = 1;
+                  }
                }
-
-               dYion += g_staticParams.massUtility.pdAAMassFragment[(int)sDBI.szPeptide[iPos2]];
-               if (piVarModSites[iPos2] > 0)
+            }
+            else
+            {
+               // Generate pdAAforward for sDBI.szPeptide
+               for (int i=iStartPos; i<iEndPos; i++)
                {
-                  dYion += g_staticParams.variableModParameters.varModList[piVarModSites[iPos2]-1].dVarModMass;
-                  iFoundVariableMod = 1;
-               }
+                  int iPos = i - iStartPos;
+                  int iPos2 = iEndPos - i + iStartPos;
+
+                  dBion += g_staticParams.massUtility.pdAAMassFragment[(int)sDBI.szPeptide[i]];
+                  if (piVarModSites[iPos] > 0)
+                  {
+                     dBion += g_staticParams.variableModParameters.varModList[piVarModSites[iPos]-1].dVarModMass;
+                     iFoundVariableMod = 1;
+                  }
+
+                  dYion += g_staticParams.massUtility.pdAAMassFragment[(int)sDBI.szPeptide[iPos2]];
+                  if (piVarModSites[iPos2] > 0)
+                  {
+                     dYion += g_staticParams.variableModParameters.varModList[piVarModSites[iPos2]-1].dVarModMass;
+                     iFoundVariableMod = 1;
+                  }
 
-               _pdAAforward[iPos] = dBion;
-               _pdAAreverse[iPos] = dYion;
+                  _pdAAforward[iPos] = dBion;
+                  _pdAAreverse[iPos] = dYion;
+               }
             }
 
             // Now get the set of binned fragment ions once to compare this peptide against all matching spectra.
@@ -2341,9 +4450,18 @@ void CometSearch::AnalyzeIndexPep(int iWhichQuery,
 
                   for (ctLen=0; ctLen<iLenMinus1; ctLen++)
                   {
-                     double dFragMass = GetFragmentIonMass(iWhichIonSeries, ctLen, ctCharge, _pdAAforward, _pdAAreverse);
+                     double dFragMass = 0.0;
+                     int iVal;
 
-                     pbDuplFragment[BIN(dFragMass)] = false;
+                     if (puiPeptideBins != NULL)
+                        iVal = (int)puiPeptideBins[((ctCharge-1)*g_staticParams.ionInformation.iNumIonSeriesUsed + ctIonSeries)*iLenMinus1 + ctLen];
+                     else
+                     {
+                        dFragMass = GetFragmentIonMass(iWhichIonSeries, ctLen, ctCharge, _pdAAforward, _pdAAreverse);
+                        iVal = BIN(dFragMass);
+                     }
+
+                     pbDuplFragment[iVal] = false;
                      _uiBinnedIonMasses[ctCharge][ctIonSeries][ctLen][0] = 0;
 
                      // initialize fragmentNL
@@ -2395,8 +4513,16 @@ void CometSearch::AnalyzeIndexPep(int iWhichQuery,
                   // iLenPeptide-1 to complete set of internal fragment ions.
                   for (ctLen=0; ctLen<iLenMinus1; ctLen++)
                   {
-                     double dFragMass = GetFragmentIonMass(iWhichIonSeries, ctLen, ctCharge, _pdAAforward, _pdAAreverse);
-                     int iVal = BIN(dFragMass);
+                     double dFragMass = 0.0;
+                     int iVal;
+
+                     if (puiPeptideBins != NULL)
+                        iVal = (int)puiPeptideBins[((ctCharge-1)*g_staticParams.ionInformation.iNumIonSeriesUsed + ctIonSeries)*iLenMinus1 + ctLen];
+                     else
+                     {
+                        dFragMass = GetFragmentIonMass(iWhichIonSeries, ctLen, ctCharge, _pdAAforward, _pdAAreverse);
+                        iVal = BIN(dFragMass);
+                     }
 
                      if (pbDuplFragment[iVal] == false)
                      {
@@ -2498,6 +4624,15 @@ void CometSearch::AnalyzeIndexPep(int iWhichQuery,
                int iDecoyStartPos = iStartPos;
                int iDecoyEndPos = iEndPos;
 
+               // the decoy ladder follows the target ladder in the stored fragment ions
+               const unsigned int *puiDecoyBins = NULL;
+               if (puiPeptideBins != NULL)
+               {
+                  puiDecoyBins = puiPeptideBins + pFragmentBins->iMaxFragmentCharge
+                     * g_staticParams.ionInformation.iNumIonSeriesUsed * iLenMinus1;
+                  iDecoyEndPos = iDecoyStartPos;  // no need to generate pdAAforward
+               }
+
                // Generate pdAAforward for szDecoyPeptide
                for (i = iDecoyStartPos; i < iDecoyEndPos; i++)
                {
@@ -2532,9 +4667,18 @@ void CometSearch::AnalyzeIndexPep(int iWhichQuery,
 
                      for (ctLen = 0; ctLen < iLenMinus1; ctLen++)
                      {
-                        double dFragMass = GetFragmentIonMass(iWhichIonSeries, ctLen, ctCharge, _pdAAforwardDecoy, _pdAAreverseDecoy);
+                        double dFragMass = 0.0;
+                        int iVal;
 
-                        pbDuplFragment[BIN(dFragMass)] = false;
+                        if (puiDecoyBins != NULL)
+                           iVal = (int)puiDecoyBins[((ctCharge - 1) * g_staticParams.ionInformation.iNumIonSeriesUsed + ctIonSeries) * iLenMinus1 + ctLen];
+                        else
+                        {
+                           dFragMass = GetFragmentIonMass(iWhichIonSeries, ctLen, ctCharge, _pdAAforwardDecoy, _pdAAreverseDecoy);
+                           iVal = BIN(dFragMass);
+                        }
+
+                        pbDuplFragment[iVal] = false;
                         _uiBinnedIonMassesDecoy[ctCharge][ctIonSeries][ctLen][0] = 0;
 
                         // initialize fragmentNL
@@ -2586,8 +4730,16 @@ void CometSearch::AnalyzeIndexPep(int iWhichQuery,
                      // iLenPeptide-1 to complete set of internal fragment ions.
                      for (ctLen = 0; ctLen < iLenMinus1; ctLen++)
                      {
-                        double dFragMass = GetFragmentIonMass(iWhichIonSeries, ctLen, ctCharge, _pdAAforwardDecoy, _pdAAreverseDecoy);
-                        int iVal = BIN(dFragMass);
+                        double dFragMass = 0.0;
+                        int iVal;
+
+                        if (puiDecoyBins != NULL)
+                           iVal = (int)puiDecoyBins[((ctCharge - 1) * g_staticParams.ionInformation.iNumIonSeriesUsed + ctIonSeries) * iLenMinus1 + ctLen];
+                        else
+                        {
+                           dFragMass = GetFragmentIonMass(iWhichIonSeries, ctLen, ctCharge, _pdAAforwardDecoy, _pdAAreverseDecoy);
+                           iVal = BIN(dFragMass);
+                        }
 
                         if (pbDuplFragment[iVal] == false)
                         {
@@ -2653,7 +4805,7 @@ void CometSearch::AnalyzeIndexPep(int iWhichQuery,
 // Analyze regions of the sequence that are affected by the variant
 // Each analyzed peptide must either contain the variant or be flanked
 // by the variant enabling new enzyme-digested peptide
-void CometSearch::SearchForVariants(struct sDBEntry dbe,
+void CometSearch::SearchForVariants(struct sDBEntry &dbe,
                                     char *szProteinSeq,
                                     bool *pbDuplFragment)
 
@@ -3560,69 +5712,286 @@ char CometSearch::GetAA(int i,
       }
    }
 
-   else if (szDNASequence[iBase1]=='T')
+   else if (szDNASequence[iBase1]=='T')
+   {
+      if (szDNASequence[iBase2]=='C')
+         return ('S');
+      else if (szDNASequence[iBase2]=='T')
+      {
+         if (szDNASequence[iBase3]=='T' || szDNASequence[iBase3]=='C')
+            return ('F');
+         else if (szDNASequence[iBase3]=='A' || szDNASequence[iBase3]=='G')
+            return ('L');
+      }
+      else if (szDNASequence[iBase2]=='A')
+      {
+         if (szDNASequence[iBase3]=='T' || szDNASequence[iBase3]=='C')
+            return ('Y');
+         else if (szDNASequence[iBase3]=='A' || szDNASequence[iBase3]=='G')
+            return ('@');
+      }
+      else if (szDNASequence[iBase2]=='G')
+      {
+         if (szDNASequence[iBase3]=='T' || szDNASequence[iBase3]=='C')
+            return ('C');
+         else if (szDNASequence[iBase3]=='A')
+            return ('@');
+         else if (szDNASequence[iBase3]=='G')
+            return ('W');
+      }
+   }
+
+   else if (szDNASequence[iBase1]=='A')
+   {
+      if (szDNASequence[iBase2]=='C')
+         return ('T');
+      else if (szDNASequence[iBase2]=='T')
+      {
+         if (szDNASequence[iBase3]=='T' || szDNASequence[iBase3]=='C' || szDNASequence[iBase3]=='A')
+            return ('I');
+         else if (szDNASequence[iBase3]=='G')
+            return ('M');
+      }
+      else if (szDNASequence[iBase2]=='A')
+      {
+         if (szDNASequence[iBase3]=='T' || szDNASequence[iBase3]=='C')
+            return ('N');
+         else if (szDNASequence[iBase3]=='A' || szDNASequence[iBase3]=='G')
+            return ('K');
+      }
+      else if (szDNASequence[iBase2]=='G')
+      {
+         if (szDNASequence[iBase3]=='T' || szDNASequence[iBase3]=='C')
+            return ('S');
+         else if (szDNASequence[iBase3]=='A' || szDNASequence[iBase3]=='G')
+            return ('R');
+      }
+   }
+
+   return ('*');
+
+}
+
+
+#ifdef COMET_FLAT_XCORR_X86
+__attribute__((target("avx2")))
+static double FlatXcorrSumAVX2(const float *pfData,
+                               const unsigned int *puiBins,
+                               int iCount)
+{
+   __m256d vSumLo = _mm256_setzero_pd();
+   __m256d vSumHi = _mm256_setzero_pd();
+   int i = 0;
+
+   for (; i+8<=iCount; i+=8)
+   {
+      __m256 vData = _mm256_i32gather_ps(pfData, _mm256_loadu_si256((const __m256i *)(puiBins + i)), 4);
+
+      vSumLo = _mm256_add_pd(vSumLo, _mm256_cvtps_pd(_mm256_castps256_ps128(vData)));
+      vSumHi = _mm256_add_pd(vSumHi, _mm256_cvtps_pd(_mm256_extractf128_ps(vData, 1)));
+   }
+
+   double pdSum[4];
+   _mm256_storeu_pd(pdSum, _mm256_add_pd(vSumLo, vSumHi));
+
+   double dSum = pdSum[0] + pdSum[1] + pdSum[2] + pdSum[3];
+
+   for (; i<iCount; i++)
+      dSum += pfData[puiBins[i]];
+
+   return dSum;
+}
+
+
+__attribute__((target("avx512f")))
+static double FlatXcorrSumAVX512(const float *pfData,
+                                 const unsigned int *puiBins,
+                                 int iCount)
+{
+   __m512d vSumLo = _mm512_setzero_pd();
+   __m512d vSumHi = _mm512_setzero_pd();
+   int i = 0;
+
+   // The masked forms with zeroed sources are used throughout; the plain intrinsics
+   // start from an undefined register that gcc warns about.
+   for (; i+16<=iCount; i+=16)
+   {
+      __m512 vData = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xFFFF,
+            _mm512_loadu_si512((const void *)(puiBins + i)), pfData, 4);
+      __m512d vData64 = _mm512_castps_pd(vData);
+
+      vSumLo = _mm512_add_pd(vSumLo,
+            _mm512_maskz_cvtps_pd(0xFF, _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, vData64, 0))));
+      vSumHi = _mm512_add_pd(vSumHi,
+            _mm512_maskz_cvtps_pd(0xFF, _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, vData64, 1))));
+   }
+
+   double pdSum[8];
+   _mm512_storeu_pd(pdSum, _mm512_add_pd(vSumLo, vSumHi));
+
+   double dSum = (pdSum[0] + pdSum[1] + pdSum[2] + pdSum[3]) + (pdSum[4] + pdSum[5] + pdSum[6] + pdSum[7]);
+
+   for (; i<iCount; i++)
+      dSum += pfData[puiBins[i]];
+
+   return dSum;
+}
+#endif
+
+
+double CometSearch::FlatXcorrSumScalar(const float *pfData,
+                                       const unsigned int *puiBins,
+                                       int iCount)
+{
+   double dSum = 0.0;
+
+   for (int i=0; i<iCount; i++)
+      dSum += pfData[puiBins[i]];
+
+   return dSum;
+}
+
+
+// Use the given kernel for FlatXcorrSum(); false if this CPU or build does not have it.
+bool CometSearch::SetFlatXcorrKernel(int iKernel)
+{
+   if (iKernel == FLAT_XCORR_SCALAR)
+   {
+      _pfnFlatXcorrSum = FlatXcorrSumScalar;
+      return true;
+   }
+
+#ifdef COMET_FLAT_XCORR_X86
+   __builtin_cpu_init();
+
+   if (iKernel == FLAT_XCORR_AVX512 && __builtin_cpu_supports("avx512f"))
+   {
+      _pfnFlatXcorrSum = FlatXcorrSumAVX512;
+      return true;
+   }
+   else if (iKernel == FLAT_XCORR_AVX2 && __builtin_cpu_supports("avx2"))
+   {
+      _pfnFlatXcorrSum = FlatXcorrSumAVX2;
+      return true;
+   }
+#endif
+
+   return false;
+}
+
+
+// Gathers only pay off when the fast xcorr array does not fit in the L1 cache; for
+// wider fragment bins the scalar loads are as fast and skip the gather setup.
+void CometSearch::SelectFlatXcorrKernel(double dFragmentBinSize)
+{
+   if (dFragmentBinSize >= FLAT_XCORR_SCALAR_BIN_SIZE
+         || (!SetFlatXcorrKernel(FLAT_XCORR_AVX512) && !SetFlatXcorrKernel(FLAT_XCORR_AVX2)))
    {
-      if (szDNASequence[iBase2]=='C')
-         return ('S');
-      else if (szDNASequence[iBase2]=='T')
-      {
-         if (szDNASequence[iBase3]=='T' || szDNASequence[iBase3]=='C')
-            return ('F');
-         else if (szDNASequence[iBase3]=='A' || szDNASequence[iBase3]=='G')
-            return ('L');
-      }
-      else if (szDNASequence[iBase2]=='A')
-      {
-         if (szDNASequence[iBase3]=='T' || szDNASequence[iBase3]=='C')
-            return ('Y');
-         else if (szDNASequence[iBase3]=='A' || szDNASequence[iBase3]=='G')
-            return ('@');
-      }
-      else if (szDNASequence[iBase2]=='G')
-      {
-         if (szDNASequence[iBase3]=='T' || szDNASequence[iBase3]=='C')
-            return ('C');
-         else if (szDNASequence[iBase3]=='A')
-            return ('@');
-         else if (szDNASequence[iBase3]=='G')
-            return ('W');
-      }
+      SetFlatXcorrKernel(FLAT_XCORR_SCALAR);
    }
+}
 
-   else if (szDNASequence[iBase1]=='A')
+
+// "flat_xcorr" version of the fragment ion loops in XcorrScore().  Bins are collected
+// into short lists per fast xcorr array and summed by _pfnFlatXcorrSum.  Bins past the
+// end of the flat array map to bin 0, which like every unused bin holds 0.  The lists
+// and the vector kernels add in a different order than the sparse path, so the double
+// sum can differ in its last bits; the float xcorr reported is the same.
+double CometSearch::FlatXcorrScore(Query *pQuery,
+                                   int iFoundVariableMod,
+                                   int iLenPeptide,
+                                   unsigned int (*p_uiBinnedIonMasses)[MAX_FRAGMENT_CHARGE+1][9][MAX_PEPTIDE_LEN][BIN_MOD_COUNT],
+                                   unsigned int (*p_uiBinnedPrecursorNL)[MAX_PRECURSOR_NL_SIZE][MAX_PRECURSOR_CHARGE])
+{
+   const int iBinListSize = 256;
+   unsigned int puiBins[iBinListSize];
+   unsigned int puiBinsNL[iBinListSize];
+   int iNumBins = 0;
+   int iNumBinsNL = 0;
+
+   const float *pfData = pQuery->pfFlatFastXcorrData;
+   const float *pfDataNL = pQuery->pfFlatFastXcorrDataNL;
+   unsigned int uiFlatSize = (unsigned int)pQuery->iFlatXcorrDataSize;
+   int iLenPeptideMinus1 = iLenPeptide - 1;
+   double dXcorr = 0.0;
+
+   bool bModNL = (g_staticParams.variableModParameters.bUseFragmentNeutralLoss && iFoundVariableMod==2);
+
+   for (int ctCharge=1; ctCharge<=pQuery->_spectrumInfoInternal.iMaxFragCharge; ctCharge++)
    {
-      if (szDNASequence[iBase2]=='C')
-         return ('T');
-      else if (szDNASequence[iBase2]=='T')
-      {
-         if (szDNASequence[iBase3]=='T' || szDNASequence[iBase3]=='C' || szDNASequence[iBase3]=='A')
-            return ('I');
-         else if (szDNASequence[iBase3]=='G')
-            return ('M');
-      }
-      else if (szDNASequence[iBase2]=='A')
+      for (int ctIonSeries=0; ctIonSeries<g_staticParams.ionInformation.iNumIonSeriesUsed; ctIonSeries++)
       {
-         if (szDNASequence[iBase3]=='T' || szDNASequence[iBase3]=='C')
-            return ('N');
-         else if (szDNASequence[iBase3]=='A' || szDNASequence[iBase3]=='G')
-            return ('K');
+         int iWhichIonSeries = g_staticParams.ionInformation.piSelectedIonSeries[ctIonSeries];
+
+         // charge 1 a, b, y ions are scored against the water/ammonia loss data when enabled
+         bool bUseNLData = (ctCharge == 1
+               && g_staticParams.ionInformation.bUseWaterAmmoniaLoss
+               && (iWhichIonSeries==ION_SERIES_A || iWhichIonSeries==ION_SERIES_B || iWhichIonSeries==ION_SERIES_Y));
+
+         unsigned int *puiList = (bUseNLData ? puiBinsNL : puiBins);
+         int *piNum = (bUseNLData ? &iNumBinsNL : &iNumBins);
+
+         for (int ctLen=0; ctLen<iLenPeptideMinus1; ctLen++)
+         {
+            unsigned int *puiIon = (*p_uiBinnedIonMasses)[ctCharge][ctIonSeries][ctLen];
+
+            if (puiIon[0] == 0)
+               continue;
+
+            puiList[(*piNum)++] = (puiIon[0] < uiFlatSize ? puiIon[0] : 0);
+
+            // As in the sparse path, fragment neutral losses are only scored when the
+            // unmodified ion falls within a populated sparse matrix row.
+            int x = puiIon[0] / SPARSE_MATRIX_SIZE;
+
+            if (bModNL && x < pQuery->iFastXcorrDataSize
+                  && (bUseNLData ? pQuery->ppfSparseFastXcorrDataNL : pQuery->ppfSparseFastXcorrData)[x] != NULL)
+            {
+               for (int ii=0; ii<VMODS; ii++)
+               {
+                  if (g_staticParams.variableModParameters.varModList[ii].dNeutralLoss != 0.0)
+                     puiList[(*piNum)++] = (puiIon[ii+1] < uiFlatSize ? puiIon[ii+1] : 0);
+               }
+            }
+
+            // flush before a full ion plus its neutral losses could overflow the list
+            if (*piNum > iBinListSize - BIN_MOD_COUNT)
+            {
+               dXcorr += _pfnFlatXcorrSum(bUseNLData ? pfDataNL : pfData, puiList, *piNum);
+               *piNum = 0;
+            }
+         }
       }
-      else if (szDNASequence[iBase2]=='G')
+   }
+
+   // precursor NL
+   for (int ctNL=0; ctNL<g_staticParams.iPrecursorNLSize; ctNL++)
+   {
+      for (int ctZ=pQuery->_spectrumInfoInternal.iChargeState; ctZ>=1; ctZ--)
       {
-         if (szDNASequence[iBase3]=='T' || szDNASequence[iBase3]=='C')
-            return ('S');
-         else if (szDNASequence[iBase3]=='A' || szDNASequence[iBase3]=='G')
-            return ('R');
+         unsigned int bin = (*p_uiBinnedPrecursorNL)[ctNL][ctZ];
+
+         puiBins[iNumBins++] = (bin < uiFlatSize ? bin : 0);
+
+         if (iNumBins == iBinListSize)
+         {
+            dXcorr += _pfnFlatXcorrSum(pfData, puiBins, iNumBins);
+            iNumBins = 0;
+         }
       }
    }
 
-   return ('*');
+   if (iNumBins > 0)
+      dXcorr += _pfnFlatXcorrSum(pfData, puiBins, iNumBins);
+   if (iNumBinsNL > 0)
+      dXcorr += _pfnFlatXcorrSum(pfDataNL, puiBinsNL, iNumBinsNL);
 
+   return dXcorr;
 }
 
 
 // Compares sequence to MSMS spectrum by matching ion intensities.
-void CometSearch::XcorrScore(char *szProteinSeq,
+void CometSearch::XcorrScore(const char *szProteinSeq,
                              int iStartResidue,        // needed for decoy peptide; otherwise just duplicate of iStartPos
                              int iEndResidue,
                              int iStartPos,
@@ -3641,6 +6010,15 @@ void CometSearch::XcorrScore(char *szProteinSeq,
    double dXcorr;
    int iLenPeptideMinus1 = iLenPeptide - 1;
 
+   // Candidates that the fragment ion index does not shortlist for this query are not
+   // scored, but they are still counted, in histogram bin 0 like other low scores, so
+   // E-values are estimated from the same number of candidates as a full search.  The
+   // E-value fit only uses the cumulative counts of the top scoring bins, which these
+   // candidates with few shared ions seldom reach, and an unchanged total keeps the
+   // number of decoy scores GenerateXcorrDecoys() adds the same.  Leaving them out of
+   // the histogram moves E-values much further from those of a full search.
+   bool bFragIndexSkip = (_bFragIndexActive && !FragmentIndexPassFilter(iWhichQuery, bDecoyPep));
+
    // Pointer to either regular or decoy uiBinnedIonMasses[][][][][].
    unsigned int (*p_uiBinnedIonMasses)[MAX_FRAGMENT_CHARGE+1][9][MAX_PEPTIDE_LEN][BIN_MOD_COUNT];
    unsigned int (*p_uiBinnedPrecursorNL)[MAX_PRECURSOR_NL_SIZE][MAX_PRECURSOR_CHARGE];
@@ -3665,157 +6043,233 @@ void CometSearch::XcorrScore(char *szProteinSeq,
 
    dXcorr = 0.0;
 
-   // iMax is largest x-value allowed as iMax+1 is allocated and we're 0-index
-   int iMax = pQuery->_spectrumInfoInternal.iArraySize/SPARSE_MATRIX_SIZE;
+   if (bFragIndexSkip)
+   {
+      // dXcorr stays 0.0
+   }
+   else if (pQuery->pfFlatFastXcorrData != NULL)
+   {
+      dXcorr = FlatXcorrScore(pQuery, iFoundVariableMod, iLenPeptide, p_uiBinnedIonMasses, p_uiBinnedPrecursorNL);
+   }
+   else
+   {
+      // iMax is largest x-value allowed as iMax+1 is allocated and we're 0-index
+      int iMax = pQuery->_spectrumInfoInternal.iArraySize/SPARSE_MATRIX_SIZE;
 
-   int bin,x,y;
+      int bin,x,y;
 
-   for (ctCharge=1; ctCharge<=pQuery->_spectrumInfoInternal.iMaxFragCharge; ctCharge++)
-   {
-      for (ctIonSeries=0; ctIonSeries<g_staticParams.ionInformation.iNumIonSeriesUsed; ctIonSeries++)
+      for (ctCharge=1; ctCharge<=pQuery->_spectrumInfoInternal.iMaxFragCharge; ctCharge++)
       {
-         iWhichIonSeries = g_staticParams.ionInformation.piSelectedIonSeries[ctIonSeries];
-
-         if (g_staticParams.ionInformation.bUseWaterAmmoniaLoss
-               && (iWhichIonSeries==ION_SERIES_A || iWhichIonSeries==ION_SERIES_B || iWhichIonSeries==ION_SERIES_Y))
+         for (ctIonSeries=0; ctIonSeries<g_staticParams.ionInformation.iNumIonSeriesUsed; ctIonSeries++)
          {
-            bUseWaterAmmoniaNLPeaks = true;
-         }
-         else
-            bUseWaterAmmoniaNLPeaks = false;
+            iWhichIonSeries = g_staticParams.ionInformation.piSelectedIonSeries[ctIonSeries];
 
-         if (ctCharge == 1 && bUseWaterAmmoniaNLPeaks)
-         {
-            ppSparseFastXcorrData = pQuery->ppfSparseFastXcorrDataNL;
-         }
-         else
-         {
-            ppSparseFastXcorrData = pQuery->ppfSparseFastXcorrData;
-         }
+            if (g_staticParams.ionInformation.bUseWaterAmmoniaLoss
+                  && (iWhichIonSeries==ION_SERIES_A || iWhichIonSeries==ION_SERIES_B || iWhichIonSeries==ION_SERIES_Y))
+            {
+               bUseWaterAmmoniaNLPeaks = true;
+            }
+            else
+               bUseWaterAmmoniaNLPeaks = false;
 
-         for (ctLen=0; ctLen<iLenPeptideMinus1; ctLen++)
-         {
-            //MH: newer sparse matrix converts bin to sparse matrix bin
-            bin = *(*(*(*(*p_uiBinnedIonMasses + ctCharge) + ctIonSeries)  +ctLen) + 0);
-/*
-            if (bin < 0)
+            if (ctCharge == 1 && bUseWaterAmmoniaNLPeaks)
             {
-               char szErrorMsg[SIZE_ERROR];
-               sprintf(szErrorMsg,  " Error1 in CometSearch::XcorrScore: bin %d, scan %d, ctZ %d, ctIon %d, ctLen %d\n",
-                     bin, g_pvQuery.at(iWhichQuery)->_spectrumInfoInternal.iScanNumber,
-                     ctCharge, ctIonSeries, ctLen);
-               logout(szErrorMsg);
-               continue;
+               ppSparseFastXcorrData = pQuery->ppfSparseFastXcorrDataNL;
+            }
+            else
+            {
+               ppSparseFastXcorrData = pQuery->ppfSparseFastXcorrData;
             }
-*/
-            x = bin / SPARSE_MATRIX_SIZE;
 
-            if (bin <= 0 || x>iMax || ppSparseFastXcorrData[x]==NULL) // x should never be > iMax so this is just a safety check
-               continue;
+            for (ctLen=0; ctLen<iLenPeptideMinus1; ctLen++)
+            {
+               //MH: newer sparse matrix converts bin to sparse matrix bin
+               bin = *(*(*(*(*p_uiBinnedIonMasses + ctCharge) + ctIonSeries)  +ctLen) + 0);
+   /*
+               if (bin < 0)
+               {
+                  char szErrorMsg[SIZE_ERROR];
+                  sprintf(szErrorMsg,  " Error1 in CometSearch::XcorrScore: bin %d, scan %d, ctZ %d, ctIon %d, ctLen %d\n",
+                        bin, g_pvQuery.at(iWhichQuery)->_spectrumInfoInternal.iScanNumber,
+                        ctCharge, ctIonSeries, ctLen);
+                  logout(szErrorMsg);
+                  continue;
+               }
+   */
+               x = bin / SPARSE_MATRIX_SIZE;
 
-            y = bin - (x*SPARSE_MATRIX_SIZE);
+               if (bin <= 0 || x>iMax || ppSparseFastXcorrData[x]==NULL) // x should never be > iMax so this is just a safety check
+                  continue;
 
-            dXcorr += ppSparseFastXcorrData[x][y];
+               y = bin - (x*SPARSE_MATRIX_SIZE);
 
-            if (g_staticParams.variableModParameters.bUseFragmentNeutralLoss && iFoundVariableMod==2)
-            {
-               for (int ii = 0; ii < VMODS; ii++)
+               dXcorr += ppSparseFastXcorrData[x][y];
+
+               if (g_staticParams.variableModParameters.bUseFragmentNeutralLoss && iFoundVariableMod==2)
                {
-                  if (g_staticParams.variableModParameters.varModList[ii].dNeutralLoss != 0.0)
+                  for (int ii = 0; ii < VMODS; ii++)
                   {
-                     //x+1 here as 0 is the base fragment ion series
-                     // *(*(*(*(*p_uiBinnedIonMasses + ctCharge)+ctIonSeries)+ctLen)+NL) gives uiBinnedIonMasses[ctCharge][ctIonSeries][ctLen][NL].
-                     bin = *(*(*(*(*p_uiBinnedIonMasses + ctCharge) + ctIonSeries)  +ctLen) + ii+1);
-/*
-                     if (bin < 0)
+                     if (g_staticParams.variableModParameters.varModList[ii].dNeutralLoss != 0.0)
                      {
-                        char szErrorMsg[SIZE_ERROR];
-                        sprintf(szErrorMsg,  " Error2 in CometSearch::XcorrScore: bin %d, scan %d, ctZ %d, ctIon %d, ctLen %d, mod %d\n",
-                              bin, g_pvQuery.at(iWhichQuery)->_spectrumInfoInternal.iScanNumber,
-                              ctCharge, ctIonSeries, ctLen, ii);
-                        logout(szErrorMsg);
-                        continue;
-                     }
-*/
-                     x = bin / SPARSE_MATRIX_SIZE;
+                        //x+1 here as 0 is the base fragment ion series
+                        // *(*(*(*(*p_uiBinnedIonMasses + ctCharge)+ctIonSeries)+ctLen)+NL) gives uiBinnedIonMasses[ctCharge][ctIonSeries][ctLen][NL].
+                        bin = *(*(*(*(*p_uiBinnedIonMasses + ctCharge) + ctIonSeries)  +ctLen) + ii+1);
+   /*
+                        if (bin < 0)
+                        {
+                           char szErrorMsg[SIZE_ERROR];
+                           sprintf(szErrorMsg,  " Error2 in CometSearch::XcorrScore: bin %d, scan %d, ctZ %d, ctIon %d, ctLen %d, mod %d\n",
+                                 bin, g_pvQuery.at(iWhichQuery)->_spectrumInfoInternal.iScanNumber,
+                                 ctCharge, ctIonSeries, ctLen, ii);
+                           logout(szErrorMsg);
+                           continue;
+                        }
+   */
+                        x = bin / SPARSE_MATRIX_SIZE;
 
-                     if (bin <= 0 || x>iMax || ppSparseFastXcorrData[x]==NULL) // x should never be > iMax so this is just a safety check
-                        continue;
+                        if (bin <= 0 || x>iMax || ppSparseFastXcorrData[x]==NULL) // x should never be > iMax so this is just a safety check
+                           continue;
 
-                     y = bin - (x*SPARSE_MATRIX_SIZE);
+                        y = bin - (x*SPARSE_MATRIX_SIZE);
 
-                     dXcorr += ppSparseFastXcorrData[x][y];
+                        dXcorr += ppSparseFastXcorrData[x][y];
+                     }
                   }
                }
             }
          }
       }
-   }
 
-   // precursor NL
-   ppSparseFastXcorrData = pQuery->ppfSparseFastXcorrData;
-   for (int ctNL=0; ctNL<g_staticParams.iPrecursorNLSize; ctNL++)
-   {
-      for (int ctZ=g_pvQuery.at(iWhichQuery)->_spectrumInfoInternal.iChargeState; ctZ>=1; ctZ--)
+      // precursor NL
+      ppSparseFastXcorrData = pQuery->ppfSparseFastXcorrData;
+      for (int ctNL=0; ctNL<g_staticParams.iPrecursorNLSize; ctNL++)
       {
-         bin = *(*(*p_uiBinnedPrecursorNL + ctNL) + ctZ);
-/*
-         if (bin < 0)
+         for (int ctZ=g_pvQuery.at(iWhichQuery)->_spectrumInfoInternal.iChargeState; ctZ>=1; ctZ--)
          {
-            char szErrorMsg[SIZE_ERROR];
-            sprintf(szErrorMsg,  " Error3 in CometSearch::XcorrScore: bin %d, scan %d, ctNL %d, ctZ %d\n",
-                  bin, g_pvQuery.at(iWhichQuery)->_spectrumInfoInternal.iScanNumber, ctNL, ctZ);
-            logout(szErrorMsg);
-            continue;
-         }
-*/
-         x = bin / SPARSE_MATRIX_SIZE;
+            bin = *(*(*p_uiBinnedPrecursorNL + ctNL) + ctZ);
+   /*
+            if (bin < 0)
+            {
+               char szErrorMsg[SIZE_ERROR];
+               sprintf(szErrorMsg,  " Error3 in CometSearch::XcorrScore: bin %d, scan %d, ctNL %d, ctZ %d\n",
+                     bin, g_pvQuery.at(iWhichQuery)->_spectrumInfoInternal.iScanNumber, ctNL, ctZ);
+               logout(szErrorMsg);
+               continue;
+            }
+   */
+            x = bin / SPARSE_MATRIX_SIZE;
 
-         if (bin <= 0 || x>iMax || ppSparseFastXcorrData[x]==NULL) // x should never be > iMax so this is just a safety check
-            continue;
+            if (bin <= 0 || x>iMax || ppSparseFastXcorrData[x]==NULL) // x should never be > iMax so this is just a safety check
+               continue;
 
-         y = bin - (x*SPARSE_MATRIX_SIZE);
+            y = bin - (x*SPARSE_MATRIX_SIZE);
 
-         dXcorr += ppSparseFastXcorrData[x][y];
+            dXcorr += ppSparseFastXcorrData[x][y];
+         }
       }
    }
 
    dXcorr *= 0.005;  // Scale intensities to 50 and divide score by 1E4.
 
-   Threading::LockMutex(pQuery->accessMutex);
-
-   // Increment matched peptide counts.
-   if (bDecoyPep && g_staticParams.options.iDecoySearch == 2)
-      pQuery->_uliNumMatchedDecoyPeptides++;
-   else
-      pQuery->_uliNumMatchedPeptides++;
+   bool bSeparateDecoy = (bDecoyPep && g_staticParams.options.iDecoySearch == 2);
+   int iHistogramBin = -1;
 
    if (g_staticParams.options.bPrintExpectScore
          || g_staticParams.options.bOutputPepXMLFile
          || g_staticParams.options.bOutputPercolatorFile
          || g_staticParams.options.bOutputTxtFile)
    {
-      int iTmp;
+      iHistogramBin = (int)(dXcorr * 10.0 + 0.5);
+
+      if (iHistogramBin < 0) // possible for CRUX compiled option to have a negative xcorr
+         iHistogramBin = 0;  // lump these all in the zero bin of the histogram
+
+      if (iHistogramBin >= HISTO_SIZE)
+         iHistogramBin = HISTO_SIZE - 1;
+   }
+
+   if (_puiThreadHistogram != NULL)
+   {
+      // Thread local counts, merged into the query by MergeThreadScoring().
+      if (!_bIndexPeptideRepeated)
+      {
+         _puliThreadNumMatched[2*iWhichQuery + (bSeparateDecoy ? 1 : 0)]++;
+
+         if (iHistogramBin >= 0)
+            _puiThreadHistogram[(size_t)iWhichQuery * HISTO_SIZE + iHistogramBin]++;
+      }
+
+      if (bFragIndexSkip)
+         return;
+
+      // The lowest stored score only ever increases, so a candidate that does not beat
+      // it here cannot be stored; the others are buffered and checked again under the
+      // lock when the buffer is flushed.
+      if (dXcorr <= (bSeparateDecoy ? pQuery->dLowestDecoyXcorrScore : pQuery->dLowestXcorrScore).load(std::memory_order_relaxed))
+         return;
+
+      if (PendingTopN(iWhichQuery, bSeparateDecoy, dXcorr, PeptideHash(szProteinSeq + iStartPos, iEndPos - iStartPos + 1)))
+      {
+         AddPendingPeptide(iWhichQuery, iStartResidue, iEndResidue, iStartPos, iEndPos, iFoundVariableMod, szProteinSeq,
+               dCalcPepMass, dXcorr, bDecoyPep, piVarModSites, dbe);
+      }
+
+      return;
+   }
 
-      iTmp = (int)(dXcorr * 10.0 + 0.5);
+   Threading::LockMutex(pQuery->accessMutex);
 
-      if (iTmp < 0) // possible for CRUX compiled option to have a negative xcorr
-         iTmp = 0;  // lump these all in the zero bin of the histogram
+   if (_puiThreadHistogram == NULL && !_bIndexPeptideRepeated)
+   {
+      // Increment matched peptide counts.
+      if (bSeparateDecoy)
+         pQuery->_uliNumMatchedDecoyPeptides++;
+      else
+         pQuery->_uliNumMatchedPeptides++;
 
-      if (iTmp >= HISTO_SIZE)
-         iTmp = HISTO_SIZE - 1;
+      if (iHistogramBin >= 0)
+      {
+         pQuery->iXcorrHistogram[iHistogramBin] += 1;
+         if (pQuery->iHistogramCount < DECOY_SIZE)
+            pQuery->iHistogramCount += 1;
+      }
+   }
 
-      pQuery->iXcorrHistogram[iTmp] += 1;
-      if (pQuery->iHistogramCount < DECOY_SIZE)
-         pQuery->iHistogramCount += 1;
+   if (!bFragIndexSkip)
+   {
+      StoreCandidate(iWhichQuery, iStartResidue, iEndResidue, iStartPos, iEndPos, iFoundVariableMod, szProteinSeq,
+            dCalcPepMass, dXcorr, bDecoyPep, piVarModSites, dbe);
    }
 
+   Threading::UnlockMutex(pQuery->accessMutex);
+}
+
+
+// Store a scored candidate in its query's results unless it is no better than the lowest
+// stored result; a duplicate of a stored peptide only adds its protein.  The caller holds
+// the query's accessMutex.
+void CometSearch::StoreCandidate(int iWhichQuery,
+                                 int iStartResidue,
+                                 int iEndResidue,
+                                 int iStartPos,
+                                 int iEndPos,
+                                 int iFoundVariableMod,
+                                 const char *szProteinSeq,
+                                 double dCalcPepMass,
+                                 double dXcorr,
+                                 bool bDecoyPep,
+                                 int *piVarModSites,
+                                 struct sDBEntry *dbe)
+{
+   Query* pQuery = g_pvQuery.at(iWhichQuery);
+
    if (bDecoyPep && g_staticParams.options.iDecoySearch==2)
    {
       if (dXcorr > pQuery->dLowestDecoyXcorrScore)
       {
          // no need to check duplicates if indexed database search and !g_staticParams.options.bTreatSameIL
-         if (g_staticParams.bIndexDb && !g_staticParams.options.bTreatSameIL)
+         // unless the index has delta segments, which can repeat a peptide
+         if (g_staticParams.bIndexDb && !g_staticParams.options.bTreatSameIL && _vIndexDeltas.empty())
          {
             StorePeptide(iWhichQuery, iStartResidue, iStartPos, iEndPos, iFoundVariableMod, szProteinSeq,
                   dCalcPepMass, dXcorr, bDecoyPep,  piVarModSites, dbe);
@@ -3833,7 +6287,9 @@ void CometSearch::XcorrScore(char *szProteinSeq,
       if (dXcorr > pQuery->dLowestXcorrScore)
       {
          // no need to check duplicates if indexed database search and !g_staticParams.options.bTreatSameIL and no internal decoys
-         if (g_staticParams.bIndexDb && !g_staticParams.options.bTreatSameIL && g_staticParams.options.iDecoySearch == 0)
+         // unless the index has delta segments, which can repeat a peptide
+         if (g_staticParams.bIndexDb && !g_staticParams.options.bTreatSameIL && g_staticParams.options.iDecoySearch == 0
+               && _vIndexDeltas.empty())
          {
             StorePeptide(iWhichQuery, iStartResidue, iStartPos, iEndPos, iFoundVariableMod, szProteinSeq,
                   dCalcPepMass, dXcorr, bDecoyPep, piVarModSites, dbe);
@@ -3846,8 +6302,6 @@ void CometSearch::XcorrScore(char *szProteinSeq,
          }
       }
    }
-
-   Threading::UnlockMutex(pQuery->accessMutex);
 }
 
 
@@ -3893,7 +6347,7 @@ void CometSearch::StorePeptide(int iWhichQuery,
                                int iStartPos,
                                int iEndPos,
                                int iFoundVariableMod,
-                               char *szProteinSeq,
+                               const char *szProteinSeq,
                                double dCalcPepMass,
                                double dXcorr,
                                bool bDecoyPep,
@@ -3995,60 +6449,50 @@ void CometSearch::StorePeptide(int iWhichQuery,
       pQuery->_pDecoys[siLowestDecoySpScoreIndex].pWhichDecoyProtein.push_back(pTmp);
       pQuery->_pDecoys[siLowestDecoySpScoreIndex].lProteinFilePosition = dbe->lProteinFilePosition;
 
+      pQuery->_pDecoys[siLowestDecoySpScoreIndex].vPeffMods.clear();
+
       if (g_staticParams.variableModParameters.bVarModSearch)
       {
          if (!iFoundVariableMod)   // Normal peptide in variable mod search.
          {
             memset(pQuery->_pDecoys[siLowestDecoySpScoreIndex].piVarModSites, 0, _iSizepiVarModSites);
-            memset(pQuery->_pDecoys[siLowestDecoySpScoreIndex].pdVarModSites, 0, _iSizepdVarModSites);
          }
          else
          {
             memcpy(pQuery->_pDecoys[siLowestDecoySpScoreIndex].piVarModSites, piVarModSites, _iSizepiVarModSites);
 
+            // variable mod masses come from varModList; PEFF mods are kept with the entry
             int iVal;
             for (i=0; i<iLenPeptide2; i++)
             {
                iVal = pQuery->_pDecoys[siLowestDecoySpScoreIndex].piVarModSites[i];
 
-               if (iVal > 0)
-               {
-                  pQuery->_pDecoys[siLowestDecoySpScoreIndex].pdVarModSites[i]
-                     = g_staticParams.variableModParameters.varModList[iVal-1].dVarModMass;
-               }
-               else if (iVal < 0)
+               if (iVal < 0)
                {
-                  pQuery->_pDecoys[siLowestDecoySpScoreIndex].pdVarModSites[i] = dbe->vectorPeffMod.at(-iVal-1).dMassDiffMono;
-                  strcpy(pQuery->_pDecoys[siLowestDecoySpScoreIndex].pszMod[i], dbe->vectorPeffMod.at(-iVal-1).szMod);
+                  struct ResultsPeffMod pPeffMod;
+
+                  pPeffMod.iPosition = i;
+                  pPeffMod.dMassDiffMono = dbe->vectorPeffMod.at(-iVal-1).dMassDiffMono;
+                  strcpy(pPeffMod.szMod, dbe->vectorPeffMod.at(-iVal-1).szMod);
+                  pQuery->_pDecoys[siLowestDecoySpScoreIndex].vPeffMods.push_back(pPeffMod);
                }
-               else
-                  pQuery->_pDecoys[siLowestDecoySpScoreIndex].pdVarModSites[i] = 0.0;
             }
          }
       }
       else
       {
          memset(pQuery->_pDecoys[siLowestDecoySpScoreIndex].piVarModSites, 0, _iSizepiVarModSites);
-         memset(pQuery->_pDecoys[siLowestDecoySpScoreIndex].pdVarModSites, 0, _iSizepdVarModSites);
       }
 
-      // Get new lowest score.
-      pQuery->dLowestDecoyXcorrScore = pQuery->_pDecoys[0].fXcorr;
-      siLowestDecoySpScoreIndex=0;
+      pQuery->vuiDecoysHash[siLowestDecoySpScoreIndex] = PeptideHash(pQuery->_pDecoys[siLowestDecoySpScoreIndex].szPeptide, iLenPeptide);
 
-      for (i=g_staticParams.options.iNumStored-1; i>0; i--)
-      {
-         if (pQuery->_pDecoys[i].fXcorr < pQuery->dLowestDecoyXcorrScore || pQuery->_pDecoys[i].iLenPeptide == 0)
-         {
-            pQuery->dLowestDecoyXcorrScore = pQuery->_pDecoys[i].fXcorr;
-            siLowestDecoySpScoreIndex = i;
-         }
-      }
+      // Get new lowest score.
+      siLowestDecoySpScoreIndex = NextLowestResult(pQuery->_pDecoys, pQuery->vsiDecoysHeap);
 
       pQuery->siLowestDecoySpScoreIndex = siLowestDecoySpScoreIndex;
 
-      // round lowest score to 6 significant digits
-      int iTmp = (int)(pQuery->dLowestDecoyXcorrScore * 1000000);
+      // round lowest score to 6 significant digits; stored once as it is read without the lock
+      int iTmp = (int)((double)pQuery->_pDecoys[siLowestDecoySpScoreIndex].fXcorr * 1000000);
       pQuery->dLowestDecoyXcorrScore = (double)iTmp / 1000000.0;
    }
    else
@@ -4136,62 +6580,125 @@ void CometSearch::StorePeptide(int iWhichQuery,
       else
          pQuery->_pResults[siLowestSpScoreIndex].pWhichProtein.push_back(pTmp);
 
+      pQuery->_pResults[siLowestSpScoreIndex].vPeffMods.clear();
+
       if (g_staticParams.variableModParameters.bVarModSearch)
       {
          if (!iFoundVariableMod)  // Normal peptide in variable mod search.
          {
             memset(pQuery->_pResults[siLowestSpScoreIndex].piVarModSites, 0, _iSizepiVarModSites);
-            memset(pQuery->_pResults[siLowestSpScoreIndex].pdVarModSites, 0, _iSizepdVarModSites);
          }
          else
          {
             memcpy(pQuery->_pResults[siLowestSpScoreIndex].piVarModSites, piVarModSites, _iSizepiVarModSites);
 
+            // variable mod masses come from varModList; PEFF mods are kept with the entry
             int iVal;
             for (i=0; i<iLenPeptide + 2; i++)
             {
                iVal = pQuery->_pResults[siLowestSpScoreIndex].piVarModSites[i];
 
-               if (iVal > 0)
-               {
-                  pQuery->_pResults[siLowestSpScoreIndex].pdVarModSites[i]
-                     = g_staticParams.variableModParameters.varModList[iVal-1].dVarModMass;
-               }
-               else if (iVal < 0)
+               if (iVal < 0)
                {
-                  pQuery->_pResults[siLowestSpScoreIndex].pdVarModSites[i] = dbe->vectorPeffMod.at(-iVal-1).dMassDiffMono;
-                  strcpy(pQuery->_pResults[siLowestSpScoreIndex].pszMod[i], dbe->vectorPeffMod.at(-iVal-1).szMod);
+                  struct ResultsPeffMod pPeffMod;
+
+                  pPeffMod.iPosition = i;
+                  pPeffMod.dMassDiffMono = dbe->vectorPeffMod.at(-iVal-1).dMassDiffMono;
+                  strcpy(pPeffMod.szMod, dbe->vectorPeffMod.at(-iVal-1).szMod);
+                  pQuery->_pResults[siLowestSpScoreIndex].vPeffMods.push_back(pPeffMod);
                }
-               else
-                  pQuery->_pResults[siLowestSpScoreIndex].pdVarModSites[i] = 0.0;
             }
          }
       }
       else
       {
          memset(pQuery->_pResults[siLowestSpScoreIndex].piVarModSites, 0, _iSizepiVarModSites);
-         memset(pQuery->_pResults[siLowestSpScoreIndex].pdVarModSites, 0, _iSizepdVarModSites);
       }
 
+      pQuery->vuiResultsHash[siLowestSpScoreIndex] = PeptideHash(pQuery->_pResults[siLowestSpScoreIndex].szPeptide, iLenPeptide);
+
       // Get new lowest score.
-      pQuery->dLowestXcorrScore = pQuery->_pResults[0].fXcorr;
-      siLowestSpScoreIndex=0;
+      siLowestSpScoreIndex = NextLowestResult(pQuery->_pResults, pQuery->vsiResultsHeap);
+
+      pQuery->siLowestSpScoreIndex = siLowestSpScoreIndex;
+
+      // round lowest score to 6 significant digits; stored once as it is read without the lock
+      int iTmp = (int)((double)pQuery->_pResults[siLowestSpScoreIndex].fXcorr * 1000000);
+      pQuery->dLowestXcorrScore = (double)iTmp / 1000000.0;
+   }
+}
+
+
+// Hash of peptide length and sequence with I and L treated as the same residue, so
+// peptides that CheckDuplicate() could consider equal always share a hash.
+unsigned int CometSearch::PeptideHash(const char *szPeptide,
+                                      int iLenPeptide)
+{
+   unsigned int uiHash = 2166136261u ^ (unsigned int)iLenPeptide;   // FNV-1a
 
-      for (i=g_staticParams.options.iNumStored-1; i>0; i--)
+   for (int i=0; i<iLenPeptide; i++)
+   {
+      char cResidue = (szPeptide[i] == 'I' ? 'L' : szPeptide[i]);
+      uiHash = (uiHash ^ (unsigned char)cResidue) * 16777619u;
+   }
+
+   return uiHash;
+}
+
+
+// Return the index of the entry to be replaced by the next stored peptide.  Until
+// every entry is filled this is the original rescan: the lowest xcorr, with an empty
+// entry taking precedence and ties going to entry 0 and then to the highest index.
+// Once all entries are filled vsiHeap keeps them as a min heap with that same order,
+// and only the previous lowest entry, just overwritten, needs to be re-sorted.
+short CometSearch::NextLowestResult(Results *pResults,
+                                    vector<short> &vsiHeap)
+{
+   int iNumStored = g_staticParams.options.iNumStored;
+
+   // true if entry a is replaced before entry b
+   auto compareLowest = [pResults, iNumStored](short a, short b)
+   {
+      if (pResults[a].fXcorr != pResults[b].fXcorr)
+         return pResults[a].fXcorr < pResults[b].fXcorr;
+      return (a == 0 ? 0 : iNumStored - a) < (b == 0 ? 0 : iNumStored - b);
+   };
+   // std heap functions keep the largest element first
+   auto compareHeap = [&compareLowest](short a, short b) { return compareLowest(b, a); };
+
+   if (!vsiHeap.empty())
+   {
+      std::pop_heap(vsiHeap.begin(), vsiHeap.end(), compareHeap);
+      std::push_heap(vsiHeap.begin(), vsiHeap.end(), compareHeap);
+      return vsiHeap[0];
+   }
+
+   int i;
+   short siLowest = 0;
+   float fLowest = pResults[0].fXcorr;
+   bool bAnyEmpty = (pResults[0].iLenPeptide == 0);
+
+   for (i=iNumStored-1; i>0; i--)
+   {
+      if (pResults[i].fXcorr < fLowest || pResults[i].iLenPeptide == 0)
       {
-         if (pQuery->_pResults[i].fXcorr < pQuery->dLowestXcorrScore || pQuery->_pResults[i].iLenPeptide == 0)
-         {
-            pQuery->dLowestXcorrScore = pQuery->_pResults[i].fXcorr;
-            siLowestSpScoreIndex = i;
-         }
+         fLowest = pResults[i].fXcorr;
+         siLowest = i;
       }
 
-      pQuery->siLowestSpScoreIndex = siLowestSpScoreIndex;
+      if (pResults[i].iLenPeptide == 0)
+         bAnyEmpty = true;
+   }
 
-      // round lowest score to 6 significant digits
-      int iTmp = (int)(pQuery->dLowestXcorrScore * 1000000);
-      pQuery->dLowestXcorrScore = (double)iTmp / 1000000.0;
+   if (!bAnyEmpty)
+   {
+      vsiHeap.resize(iNumStored);
+      for (i=0; i<iNumStored; i++)
+         vsiHeap[i] = i;
+      std::make_heap(vsiHeap.begin(), vsiHeap.end(), compareHeap);
    }
+
+   return siLowest;
 }
 
 
@@ -4202,7 +6709,7 @@ int CometSearch::CheckDuplicate(int iWhichQuery,
                                 int iEndPos,
                                 int iFoundVariableMod,
                                 double dCalcPepMass,
-                                char *szProteinSeq,
+                                const char *szProteinSeq,
                                 bool bDecoyPep,
                                 int *piVarModSites,
                                 struct sDBEntry *dbe)
@@ -4214,10 +6721,16 @@ int CometSearch::CheckDuplicate(int iWhichQuery,
 
    iLenMinus1 = iEndPos-iStartPos+1;
 
+   // Stored peptides with a different hash cannot be duplicates; see PeptideHash().
+   unsigned int uiHash = PeptideHash(szProteinSeq + iStartPos, iLenMinus1);
+
    if (g_staticParams.options.iDecoySearch == 2 && bDecoyPep)
    {
       for (i=0; i<g_staticParams.options.iNumStored; i++)
       {
+         if (pQuery->vuiDecoysHash[i] != uiHash)
+            continue;
+
          // Quick check of peptide sequence length first.
          if (iLenMinus1 == pQuery->_pDecoys[i].iLenPeptide && isEqual(dCalcPepMass, pQuery->_pDecoys[i].dPepMass))
          {
@@ -4269,14 +6782,12 @@ int CometSearch::CheckDuplicate(int iWhichQuery,
                      else if (iVal < 0)
                      {
                         // must loop through each modsite and see if OBO string is same
-                        if (strcmp(dbe->vectorPeffMod.at(-(piVarModSites[ii])-1).szMod, pQuery->_pDecoys[i].pszMod[ii]))
+                        if (strcmp(dbe->vectorPeffMod.at(-(piVarModSites[ii])-1).szMod, pQuery->_pDecoys[i].PeffModName(ii)))
                         {
                            bIsDuplicate = 0;
                            break;
                         }
                      }
-                     else
-                        pQuery->_pDecoys[i].pdVarModSites[i] = 0.0;
                   }
                }
                else
@@ -4335,6 +6846,9 @@ int CometSearch::CheckDuplicate(int iWhichQuery,
    {
       for (i=0; i<g_staticParams.options.iNumStored; i++)
       {
+         if (pQuery->vuiResultsHash[i] != uiHash)
+            continue;
+
          // Quick check of peptide sequence length.
          if (iLenMinus1 == pQuery->_pResults[i].iLenPeptide && isEqual(dCalcPepMass, pQuery->_pResults[i].dPepMass))
          {
@@ -4386,7 +6900,7 @@ int CometSearch::CheckDuplicate(int iWhichQuery,
                      else // iVal < 0
                      {
                         // must loop through each modsite and see if OBO string is same
-                        if (strcmp(dbe->vectorPeffMod.at(-(piVarModSites[ii])-1).szMod, pQuery->_pResults[i].pszMod[ii]))
+                        if (strcmp(dbe->vectorPeffMod.at(-(piVarModSites[ii])-1).szMod, pQuery->_pResults[i].PeffModName(ii)))
                         {
                            bIsDuplicate = 0;
                            break;
@@ -5954,8 +8468,6 @@ bool CometSearch::MergeVarMods(char *szProteinSeq,
       {
          if (g_staticParams.options.bCreateIndex)
          {
-            Threading::LockMutex(g_pvQueryMutex);
-
             // add to DBIndex vector
             DBIndex sDBTmp;
             sDBTmp.dPepMass = dCalcPepMass;  //MH+ mass
@@ -5979,9 +8491,7 @@ bool CometSearch::MergeVarMods(char *szProteinSeq,
             for (int x=0; x<iLen2; x++)  // +2 for n/c term mods
                sDBTmp.pcVarModSites[x] = piVarModSites[x];
 
-            g_pvDBIndex.push_back(sDBTmp);
-
-            Threading::UnlockMutex(g_pvQueryMutex);
+            AddIndexPeptide(sDBTmp);
          }
          else
          {
@@ -6241,6 +8751,9 @@ bool CometSearch::CalcVarModIons(char *szProteinSeq,
                   }
                }
             }
+
+            if (_bFragIndexActive)
+               FragmentIndexCountPeptide(iLenPeptide, false, iWhichQuery, dCalcPepMass);
          }
 
          XcorrScore(szProteinSeq, _varModInfo.iStartPos, _varModInfo.iEndPos, _varModInfo.iStartPos, _varModInfo.iEndPos,
@@ -6530,6 +9043,9 @@ bool CometSearch::CalcVarModIons(char *szProteinSeq,
                      }
                   }
                }
+
+               if (_bFragIndexActive)
+                  FragmentIndexCountPeptide(iLenPeptide, true, iWhichQuery, dCalcPepMass);
             }
          }
 
@@ -20,26 +20,28 @@
 
 #include "Common.h"
 #include "CometDataInternal.h"
+#include <atomic>
+#include <memory>
 
 struct SearchThreadData
 {
-   sDBEntry dbEntry;
+   vector<sDBEntry> vdbEntries;   // consecutive database entries searched by one job
+   size_t tNumResidues;
    bool *pbSearchMemoryPool;
    ThreadPool *tp;
   
 
    SearchThreadData()
    {
+      tNumResidues = 0;
+      pbSearchMemoryPool = NULL;
    }
 
-   SearchThreadData(sDBEntry &dbEntry_in)
+   void AddEntry(sDBEntry &&dbEntry_in)
    {
-      dbEntry.strName = dbEntry_in.strName;
-      dbEntry.strSeq = dbEntry_in.strSeq;
-      dbEntry.lProteinFilePosition = dbEntry_in.lProteinFilePosition;
-      dbEntry.vectorPeffMod = dbEntry_in.vectorPeffMod;
-      dbEntry.vectorPeffVariantSimple = dbEntry_in.vectorPeffVariantSimple;
-      dbEntry.vectorPeffVariantComplex = dbEntry_in.vectorPeffVariantComplex;
+      tNumResidues += dbEntry_in.strSeq.size();
+
+      vdbEntries.push_back(std::move(dbEntry_in));
    }
 
    ~SearchThreadData()
@@ -54,13 +56,127 @@ struct SearchThreadData
          pbSearchMemoryPool=NULL;
       }
 
-      dbEntry.vectorPeffMod.clear();
-      dbEntry.vectorPeffVariantSimple.clear();
+      vdbEntries.clear();
 
       //Threading::UnlockMutex(g_searchMemoryPoolMutex);
    }
 };
 
+// The .idx peptide index, or one delta segment of it, as loaded by
+// CometSearch::LoadIndex().
+struct IndexData
+{
+   const char *pData;                 // mapped .idx file; entries are read at their file positions
+   char *pBuffer;                     // heap copy of the file when it could not be mapped
+   comet_fileoffset_t lFileSize;
+   int iVersion;                      // 1 = variable length peptide entries, 2 = IndexFileHeader and columns
+   comet_fileoffset_t lEndOfStruct;   // end of the peptide entries (version 1)
+   int iMinMass;
+   int iMaxMass;
+   uint64_t tNumPeptides;
+   comet_fileoffset_t *lReadIndex;    // first peptide in each 0.1 Da mass bin:  file position (version 1) or number (version 2)
+   uint64_t *ptDecoded;               // heap copy of the columns below decoded from a version 5 segment
+
+   // version 2 columns, pointing into pData
+   const double *pdMasses;
+   const uint64_t *ptSequenceOffsets;
+   const unsigned char *pucSequences;
+   const uint64_t *ptModOffsets;
+   const unsigned char *pucModSites;
+   const comet_fileoffset_t *plProteinRefs;
+   const IndexFragmentBinsHeader *pFragmentBins;   // NULL if the file has no INDEX_SECTION_FRAGMENT_BINS
+   const unsigned int *puiFragmentBins;
+
+   IndexData()
+   {
+      pData = NULL;
+      pBuffer = NULL;
+      lFileSize = 0;
+      iVersion = 0;
+      lEndOfStruct = 0;
+      iMinMass = 0;
+      iMaxMass = 0;
+      tNumPeptides = 0;
+      lReadIndex = NULL;
+      ptDecoded = NULL;
+      pdMasses = NULL;
+      ptSequenceOffsets = NULL;
+      pucSequences = NULL;
+      ptModOffsets = NULL;
+      pucModSites = NULL;
+      plProteinRefs = NULL;
+      pFragmentBins = NULL;
+      puiFragmentBins = NULL;
+   }
+};
+
+// One mass range of the .idx peptide index searched by a thread.
+struct IndexSearchThreadData
+{
+   const IndexData *pSegment;         // loaded index segment searched
+   const char *pIndexData;            // mapped .idx file shared by all jobs
+   comet_fileoffset_t lStartPos;      // first peptide in the range:  file position (version 1) or number (version 2)
+   comet_fileoffset_t lEndOfStruct;   // end of the peptide entries
+   int iEnd10;                        // largest 0.1 Da mass index searched
+   int iStopMass10;                   // 0.1 Da mass index where the next range starts
+   bool *pbSearchMemoryPool;
+
+   IndexSearchThreadData()
+   {
+      pSegment = NULL;
+      pIndexData = NULL;
+      pbSearchMemoryPool = NULL;
+   }
+
+   ~IndexSearchThreadData()
+   {
+      // Mark that the memory is no longer in use.
+      // DO NOT FREE MEMORY HERE. Just release pointer.
+      if (pbSearchMemoryPool!=NULL)
+      {
+         *pbSearchMemoryPool=false;
+         pbSearchMemoryPool=NULL;
+      }
+   }
+};
+
+// A piece of a memory mapped database, from the '>' of one entry up to the '>' of
+// the entry after its last, parsed ahead by a search thread; see ReadMappedDatabase().
+struct DatabaseChunkData
+{
+   enum { CHUNK_OK, CHUNK_NO_DESCRIPTION, CHUNK_PEFF_ERROR };
+
+   const char *pMap;                     // start of the mapped file, for lProteinFilePosition
+   const char *pStart;
+   const char *pEnd;
+   vector<OBOStruct> *vectorPeffOBO;
+   vector<sDBEntry> vEntries;            // parsed entries in file order
+   vector<int> viNumBadChars;            // non-printing header characters of each entry
+   unsigned long int uliAACount;
+   int iError;                           // why the entry after vEntries could not be parsed
+   int iErrorNumBadChars;                // non-printing header characters of that entry
+   std::atomic<bool> bClaimed;           // set by whichever of the job or the reader parses it
+   Semaphore semParsed;                  // signalled when a search thread has parsed it
+
+   DatabaseChunkData()
+   {
+      pMap = NULL;
+      pStart = NULL;
+      pEnd = NULL;
+      vectorPeffOBO = NULL;
+      uliAACount = 0;
+      iError = CHUNK_OK;
+      iErrorNumBadChars = 0;
+      bClaimed = false;
+      Threading::CreateSemaphore(&semParsed);
+   }
+
+   ~DatabaseChunkData()
+   {
+      Threading::DestroySemaphore(semParsed);
+   }
+};
+
 class CometSearch
 {
 public:
@@ -72,13 +188,44 @@ public:
    static bool DeallocateMemory(int maxNumThreads);
    static bool RunSearch(int iPercentStart,
                          int iPercentEnd,
+                         bool bMoreBatches,
                          ThreadPool* tp);
    static bool RunSearch(void);    // for DoSingleSpectrumSearch() to call IndexSearch()
+   static bool LoadIndex(void);    // keep the .idx resident across RunSearch(void) calls
+   static void UnloadIndex(void);
+   static bool CollectIndexPeptides(string *pstrParams);   // to compact the loaded index
+   static uint64_t IndexFileChecksum(uint64_t tChecksum,
+                                     const char *pBuf,
+                                     size_t tSize);
+   static bool ParseIndexParams(const char *pText,
+                                comet_fileoffset_t lSize);
+   static void CalcIndexFragmentBins(DBIndex &sDBI,
+                                     const IndexFragmentBinsHeader *pHeader,
+                                     unsigned int *puiBins);
    static void SearchThreadProc(SearchThreadData *pSearchThreadData,
                                 ThreadPool *tp);
-   bool DoSearch(sDBEntry dbe,
+   static bool CreateFragmentIndex(void);   // build fragment ion index over current g_pvQuery batch
+   static void DeleteFragmentIndex(void);
+   static bool CreateThreadScoring(void);   // per thread histograms for "thread_local_scoring"
+   static void MergeThreadScoring(void);
+   static void DeleteThreadScoring(void);
+   bool DoSearch(sDBEntry &dbe,
                  bool *pbDuplFragment);
 
+   // "flat_xcorr" kernels, also timed by bench/xcorr_kernels.cpp
+   enum { FLAT_XCORR_SCALAR, FLAT_XCORR_AVX2, FLAT_XCORR_AVX512 };
+   static double FlatXcorrSumScalar(const float *pfData,
+                                    const unsigned int *puiBins,
+                                    int iCount);
+   static double FlatXcorrSum(const float *pfData,
+                              const unsigned int *puiBins,
+                              int iCount)
+   {
+      return _pfnFlatXcorrSum(pfData, puiBins, iCount);
+   }
+   static bool SetFlatXcorrKernel(int iKernel);
+   static void SelectFlatXcorrKernel(double dFragmentBinSize);
+
 private:
 
    // Core search functions
@@ -112,7 +259,7 @@ private:
                                 vector<PeffPositionStruct>* vPeffArray,
                                 int iStartPos,
                                 int iEndPos);
-   void XcorrScore(char *szProteinSeq,
+   void XcorrScore(const char *szProteinSeq,
                    int iStartResidue,
                    int iEndResidue,
                    int iStartPos,
@@ -124,6 +271,11 @@ private:
                    int iLenPeptide,
                    int *piVarModSites,
                    struct sDBEntry *dbe);
+   double FlatXcorrScore(Query *pQuery,
+                         int iFoundVariableMod,
+                         int iLenPeptide,
+                         unsigned int (*p_uiBinnedIonMasses)[MAX_FRAGMENT_CHARGE+1][9][MAX_PEPTIDE_LEN][BIN_MOD_COUNT],
+                         unsigned int (*p_uiBinnedPrecursorNL)[MAX_PRECURSOR_NL_SIZE][MAX_PRECURSOR_CHARGE]);
    bool CheckEnzymeTermini(char *szProteinSeq,
                            int iStartPos,
                            int iEndPos);
@@ -133,11 +285,11 @@ private:
                               int iStartPos);
    bool CheckMassMatch(int iWhichQuery,
                        double dCalcPepMass);
-   double GetFragmentIonMass(int iWhichIonSeries,
-                             int i,
-                             int ctCharge,
-                             double *pdAAforward,
-                             double *pdAAreverse);
+   static double GetFragmentIonMass(int iWhichIonSeries,
+                                    int i,
+                                    int ctCharge,
+                                    double *pdAAforward,
+                                    double *pdAAreverse);
    int CheckDuplicate(int iWhichQuery,
                       int iStartResidue,
                       int iEndResidue,
@@ -145,7 +297,7 @@ private:
                       int iEndPos,
                       int iFoundVariableMod,
                       double dCalcPepMass,
-                      char *szProteinSeq,
+                      const char *szProteinSeq,
                       bool bDecoyResults,
                       int *piVarModSites,
                       struct sDBEntry *dbe);
@@ -154,12 +306,45 @@ private:
                      int iStartPos,
                      int iEndPos,
                      int iFoundVariableMod,
-                     char *szProteinSeq,
+                     const char *szProteinSeq,
                      double dCalcPepMass,
                      double dXcorr,
                      bool bStoreSeparateDecoy,
                      int *piVarModSites,
                      struct sDBEntry *dbe);
+   void StoreCandidate(int iWhichQuery,
+                       int iStartResidue,
+                       int iEndResidue,
+                       int iStartPos,
+                       int iEndPos,
+                       int iFoundVariableMod,
+                       const char *szProteinSeq,
+                       double dCalcPepMass,
+                       double dXcorr,
+                       bool bDecoyPep,
+                       int *piVarModSites,
+                       struct sDBEntry *dbe);
+   bool PendingTopN(int iWhichQuery,
+                    bool bSeparateDecoy,
+                    double dXcorr,
+                    unsigned int uiHash);
+   void AddPendingPeptide(int iWhichQuery,
+                          int iStartResidue,
+                          int iEndResidue,
+                          int iStartPos,
+                          int iEndPos,
+                          int iFoundVariableMod,
+                          const char *szProteinSeq,
+                          double dCalcPepMass,
+                          double dXcorr,
+                          bool bDecoyPep,
+                          int *piVarModSites,
+                          struct sDBEntry *dbe);
+   void FlushPendingPeptides(void);
+   static unsigned int PeptideHash(const char *szPeptide,
+                                   int iLenPeptide);
+   static short NextLowestResult(Results *pResults,
+                                 vector<short> &vsiHeap);
    void VariableModSearch(char *szProteinSeq,
                           int varModCounts[],
                           int iStartPos,
@@ -189,22 +374,96 @@ private:
                        double dCalcPepMass,
                        int iLenPeptide,
                        struct sDBEntry *dbe);
-   bool IndexSearch(void);
-   void ReadDBIndexEntry(struct DBIndex *sDBI, FILE *fp);
-   bool SearchForPeptides(struct sDBEntry dbe,
+   bool IndexSearch(ThreadPool *tp);
+   bool SearchLoadedIndex(ThreadPool *tp);
+   static void BuildIndexQueryWindows(void);
+   void SearchIndexSegment(const IndexData *pSegment,
+                           ThreadPool *tp);
+   void IndexSearchRange(const char *pIndexData,
+                         comet_fileoffset_t lStartPos,
+                         int iEnd10,
+                         int iStopMass10,
+                         comet_fileoffset_t lEndOfStruct,
+                         bool *pbDuplFragment);
+   void IndexSearchColumnRange(const IndexData *pSegment,
+                               uint64_t tStartPeptide,
+                               int iEnd10,
+                               int iStopMass10,
+                               bool *pbDuplFragment);
+   static bool UseIndexFragmentBins(const IndexData *pSegment);
+   static void IndexSearchThreadProc(IndexSearchThreadData *pIndexSearchThreadData);
+   static int GetSearchThreadSlot(void);
+   static CometSearch *GetSearchContext(int i);
+   comet_fileoffset_t ReadDBIndexEntry(struct DBIndex *sDBI,
+                                       const char *pIndexData,
+                                       comet_fileoffset_t lPos);
+   void ReadDBIndexColumns(const IndexData *pSegment,
+                           struct DBIndex *sDBI,
+                           uint64_t tPeptide);
+   static void DecodeIndexPeptide(const IndexData *pSegment,
+                                  struct DBIndex *sDBI,
+                                  uint64_t tPeptide);
+   static bool IndexPeptideInEarlierSegment(const IndexData *pSegment,
+                                            DBIndex &sDBI);
+   bool SearchForPeptides(struct sDBEntry &dbe,
                           char *szProteinSeq,
                           int iNtermPeptideOnly,  // used in clipped methionine sequence
                           bool *pbDuplFragment);
-   void SearchForVariants(struct sDBEntry dbe,
+   void SearchForVariants(struct sDBEntry &dbe,
                           char *szProteinSeq,
                           bool *pbDuplFragment);
    bool TranslateNA2AA(int *frame,
                        int iDirection,
                        char *sDNASequence);
+   void FragmentIndexCountPeptide(int iLenPeptide,
+                                  bool bDecoyPep,
+                                  int iWhichQuery,
+                                  double dCalcPepMass);
+   bool FragmentIndexPassFilter(int iWhichQuery,
+                                bool bDecoyPep);
+   void FragmentIndexResetCounts(void);
+   void AddIndexPeptide(DBIndex &sEntry);
+   void FlushIndexPeptides(void);
+   static const char *MapDatabaseFile(FILE *fp,
+                                      comet_fileoffset_t lSize);
+   static void UnmapDatabaseFile(const char *pMap,
+                                 comet_fileoffset_t lSize);
+   static bool LoadIndexEntries(void);
+   static bool LoadIndexColumns(void);
+   static bool UnpackIndexColumns(IndexData *pSegment,
+                                  const IndexFileHeader &header);
+   static bool LoadIndexSegment(comet_fileoffset_t lStart,
+                                IndexData *pSegment,
+                                IndexFileHeader *pHeader,
+                                comet_fileoffset_t *plEnd);
+   static bool ReadMappedDatabase(const char *pMap,
+                                  comet_fileoffset_t lEndPos,
+                                  int iPercentStart,
+                                  int iPercentEnd,
+                                  vector<OBOStruct> *vectorPeffOBO,
+                                  ThreadPool *tp);
+   static void ParseDatabaseChunkThreadProc(std::shared_ptr<DatabaseChunkData> pChunk);
+   static void ParseDatabaseChunk(DatabaseChunkData *pChunk);
+   static bool ParsePeffAttributes(char *szPeffLine,
+                                   sDBEntry &dbe,
+                                   vector<OBOStruct> *vectorPeffOBO);
+   static void SubmitSearchJob(ThreadPool *tp);
+   static bool QueueDatabaseEntry(sDBEntry &&dbe,
+                                  ThreadPool *tp);
+   static bool SearchDatabaseCache(int iPercentStart,
+                                   int iPercentEnd,
+                                   ThreadPool *tp);
+   static void ClearDatabaseCache(void);
+   static void ReportDatabaseProgress(comet_fileoffset_t lCurrPos,
+                                      comet_fileoffset_t lEndPos,
+                                      int iPercentStart,
+                                      int iPercentEnd);
    void AnalyzeIndexPep(int iWhichQuery,
-                        DBIndex sTmp,
+                        const DBIndex &sDBI,
                         bool *pbDuplFragment,
-                        struct sDBEntry *dbe);
+                        struct sDBEntry *dbe,
+                        const IndexFragmentBinsHeader *pFragmentBins,
+                        const unsigned int *puiPeptideBins);
 
    char GetAA(int i,
               int iDirection,
@@ -265,6 +524,30 @@ private:
        char cNextAA;  // hack for indexdb realtime search
    };
 
+   // Candidate buffered by a "thread_local_scoring" search thread until FlushPendingPeptides()
+   // stores it, with the parts of the search state that StoreCandidate() reads.
+   struct PendingPeptide
+   {
+       double dXcorr;
+       double dCalcPepMass;
+       int    iWhichQuery;
+       int    iStartResidue;
+       int    iEndResidue;
+       int    iStartPos;
+       int    iEndPos;
+       int    iFoundVariableMod;
+       bool   bDecoyPep;
+       bool   bVarModSites;                       // piVarModSites holds a copy of the caller's array
+       bool   bSeqInEntry;                        // sequence is dbe->strSeq, else a copy in _vcPendingSequences
+       size_t tSeqOffset;                         // start of the sequence in either
+       struct sDBEntry *dbe;
+       int    iTmpProteinSeqLength;
+       int    iPeffOrigResiduePosition;
+       int    iPeffNewResidueCount;
+       string sPeffOrigResidues;
+       int    piVarModSites[MAX_PEPTIDE_LEN_P2];
+   };
+
    struct SpectrumInfoInternal
    {
       Spectrum *pSpectrum;
@@ -281,7 +564,6 @@ private:
    double             _pdAAforwardDecoy[MAX_PEPTIDE_LEN]; // Stores fragment ion fragment ladder calc.; sum AA masses including mods
    double             _pdAAreverseDecoy[MAX_PEPTIDE_LEN]; // Stores n-term fragment ion fragment ladder calc.; sum AA masses including mods
    int                _iSizepiVarModSites;
-   int                _iSizepdVarModSites;
    VarModInfo         _varModInfo;
    ProteinInfo        _proteinInfo;
 
@@ -290,8 +572,59 @@ private:
    unsigned int       _uiBinnedPrecursorNL[MAX_PRECURSOR_NL_SIZE][MAX_PRECURSOR_CHARGE];
    unsigned int       _uiBinnedPrecursorNLDecoy[MAX_PRECURSOR_NL_SIZE][MAX_PRECURSOR_CHARGE];
 
+   unsigned short    *_pusFragIndexCounts;    // shared fragment ion count of current target, then decoy, peptide for each query
+   int               *_piFragIndexTouched;    // queries with non-zero entries in _pusFragIndexCounts
+   int                _iFragIndexNumTouched;
+   int                _iFragIndexNumTouchedDecoy;
+
+   unsigned int      *_puiThreadHistogram;    // this thread's xcorr histogram of each query, HISTO_SIZE per query
+   unsigned long int *_puliThreadNumMatched;  // this thread's # matched target, then decoy, peptides of each query
+
+   // "thread_local_scoring" candidates not yet stored in their query, see AddPendingPeptide()
+   vector<PendingPeptide> _vPendingPeptides;
+   vector<char>       _vcPendingSequences;    // copies of candidate sequences that are not in their sDBEntry
+   const char        *_pPendingSequenceSource;   // sequence last copied to _vcPendingSequences
+   size_t             _tPendingSequenceOffset;   // and where
+   vector<vector<pair<double, unsigned int> > > _vvPendingTopN;   // best (xcorr, hash) pairs buffered for each query, see PendingTopN()
+   vector<int>        _viPendingTopNTouched;  // non-empty entries of _vvPendingTopN
+   vector<DBIndex>    _vIndexPeptides;        // this thread's peptides not yet handed to CometIndexBuilder
+   bool               _bIndexPeptideRepeated; // index peptide being scored was already counted in an earlier segment
+
    static bool *_pbSearchMemoryPool;    // Pool of memory to be shared by search threads
    static bool **_ppbDuplFragmentArr;   // Number of arrays equals number of threads
+   static CometSearch **_ppSearchContextArr;   // One long-lived search object per thread slot
+   static SearchThreadData *_pPendingSearchJob; // Entries collected by the database reader for the next job
+   static IndexData _indexData;                 // loaded .idx file, see LoadIndex()
+   static vector<IndexData> _vIndexDeltas;      // and the delta segments appended to it
+   static vector<pair<double, double> > _vIndexQueryWindows;   // merged query mass tolerance windows, ascending
+   static uint64_t _tIndexChecksumVerified;     // checksum of the last version 2 .idx file checked
+   static string _strIndexVerified;             // and its path
+
+   // Fragment ion index: maps each fragment bin to the queries having one of their
+   // most intense peaks in that bin.  Stored in compressed row format.
+   static bool _bFragIndexActive;
+   static int _iFragIndexNumBins;
+   static vector<unsigned int> _vuiFragIndexBinOffsets;    // start of each bin's entries in _viFragIndexQueries
+   static vector<int> _viFragIndexQueries;                 // query indices, ascending within each bin
+   static vector<int> _viFragIndexMaxFragCharge;           // max fragment charge of each query
+   static unsigned short **_ppusFragIndexCountArr;         // one count array per thread
+   static int **_ppiFragIndexTouchedArr;                   // one touched list per thread
+
+   // Parsed database entries kept across spectrum batches, see "database_cache_size"
+   static vector<sDBEntry> _vDatabaseCache;
+   static size_t _tDatabaseCacheBytes;
+   static unsigned long int _uliDatabaseCacheAACount;
+   static bool _bDatabaseCacheFilling;     // current RunSearch() pass is adding entries
+   static bool _bDatabaseCacheComplete;    // cache holds entire database; replay instead of reading file
+
+   // Per thread score histograms and matched peptide counts, see "thread_local_scoring"
+   static unsigned int **_ppuiThreadHistogramArr;
+   static unsigned long int **_ppuliThreadNumMatchedArr;
+
+   // Sums pfData[] over a list of bins for "flat_xcorr"; chosen at runtime by CPU features
+   static double (*_pfnFlatXcorrSum)(const float *pfData,
+                                     const unsigned int *puiBins,
+                                     int iCount);
 };
 
 #endif // _COMETSEARCH_H_
@@ -25,6 +25,7 @@
 #include "CometWritePepXML.h"
 #include "CometWriteMzIdentML.h"
 #include "CometWritePercolator.h"
+#include "CometIndexBuilder.h"
 #include "CometDataInternal.h"
 #include "CometSearchManager.h"
 #include "CometStatus.h"
@@ -43,6 +44,8 @@ map<long long, IndexProteinStruct>    g_pvProteinNames;  // for db index
 Mutex                         g_pvQueryMutex;
 Mutex                         g_preprocessMemoryPoolMutex;
 Mutex                         g_searchMemoryPoolMutex;
+Mutex                         g_dbIndexMutex;
+Mutex                         g_proteinCacheMutex;
 CometStatus                   g_cometStatus;
 string                        g_sCometVersion;
 
@@ -286,6 +289,14 @@ static bool AllocateResultsMem()
          }
       }
 
+      pQuery->vuiResultsHash.assign(g_staticParams.options.iNumStored, 0);
+      pQuery->vsiResultsHeap.clear();
+      if (g_staticParams.options.iDecoySearch==2)
+      {
+         pQuery->vuiDecoysHash.assign(g_staticParams.options.iNumStored, 0);
+         pQuery->vsiDecoysHeap.clear();
+      }
+
       for (int j=0; j<g_staticParams.options.iNumStored; j++)
       {
          pQuery->_pResults[j].dPepMass = 0.0;
@@ -505,7 +516,8 @@ static bool ValidateSequenceDatabaseFile()
    if (!strcmp(g_staticParams.databaseInfo.szDatabase+strlen(g_staticParams.databaseInfo.szDatabase)-4, ".idx"))
       g_staticParams.bIndexDb = 1;
 
-   if (g_staticParams.options.bCreateIndex && g_staticParams.bIndexDb)
+   // creating an index from an .idx database compacts it; appending needs a FASTA
+   if (g_staticParams.szIndexAppend[0] != '\0' && g_staticParams.bIndexDb)
    {
       sprintf(szErrorMsg, " Error - input database already indexed: \"%s\".\n", g_staticParams.databaseInfo.szDatabase);
       string strErrorMsg(szErrorMsg);
@@ -552,6 +564,7 @@ static bool ValidatePeptideLengthRange()
    return true;
 }
 
+
 /******************************************************************************
 *
 * CometSearchManager class implementation.
@@ -560,7 +573,8 @@ static bool ValidatePeptideLengthRange()
 
 CometSearchManager::CometSearchManager() :
     singleSearchInitializationComplete(false),
-    singleSearchThreadCount(1)
+    singleSearchThreadCount(1),
+    singleSearchLatencyNext(0)
 {
    // Initialize the mutexes we'll use to protect global data.
    Threading::CreateMutex(&g_pvQueryMutex);
@@ -571,6 +585,12 @@ CometSearchManager::CometSearchManager() :
    // Initialize the mutex we'll use to protect the search memory pool
    Threading::CreateMutex(&g_searchMemoryPoolMutex);
 
+   // Initialize the mutex we'll use to protect g_pvDBIndex while creating an index
+   Threading::CreateMutex(&g_dbIndexMutex);
+
+   // Initialize the mutex we'll use to protect the protein name cache used by output
+   Threading::CreateMutex(&g_proteinCacheMutex);
+
    // Initialize the Comet version
    SetParam("# comet_version", comet_version, comet_version);
    _tp = new ThreadPool();
@@ -587,6 +607,12 @@ CometSearchManager::~CometSearchManager()
    // Destroy the mutex we used to protect the search memory pool
    Threading::DestroyMutex(g_searchMemoryPoolMutex);
 
+   // Destroy the mutex we used to protect g_pvDBIndex
+   Threading::DestroyMutex(g_dbIndexMutex);
+
+   // Destroy the mutex we used to protect the protein name cache
+   Threading::DestroyMutex(g_proteinCacheMutex);
+
    //std::vector calls destructor of every element it contains when clear() is called
    g_pvInputFiles.clear();
 
@@ -779,6 +805,12 @@ bool CometSearchManager::InitializeStaticParams()
 
    GetParamValue("create_index", g_staticParams.options.bCreateIndex);
 
+   if (GetParamValue("index_append", strData) && strData.length() > 0)
+   {
+      strcpy(g_staticParams.szIndexAppend, strData.c_str());
+      g_staticParams.options.bCreateIndex = 1;
+   }
+
    GetParamValue("max_iterations", g_staticParams.options.lMaxIterations);
 
    GetParamValue("max_index_runtime", g_staticParams.options.iMaxIndexRunTime);
@@ -903,6 +935,54 @@ bool CometSearchManager::InitializeStaticParams()
          g_staticParams.options.iSpectrumBatchSize = iIntData;
    }
 
+   if (GetParamValue("spectrum_batch_pipeline", iIntData))
+   {
+      if (iIntData > 0)
+         g_staticParams.options.bSpectrumBatchPipeline = 1;
+   }
+
+   if (GetParamValue("database_cache_size", iIntData))
+   {
+      if (iIntData >= 0)
+         g_staticParams.options.iDatabaseCacheSize = iIntData;
+   }
+
+   if (GetParamValue("index_build_memory", iIntData))
+   {
+      if (iIntData >= 0)
+         g_staticParams.options.iIndexBuildMemory = iIntData;
+   }
+
+   if (GetParamValue("preload_protein_names", iIntData))
+   {
+      if (iIntData > 0)
+         g_staticParams.options.bPreloadProteinNames = 1;
+   }
+
+   if (GetParamValue("index_fragment_bins", iIntData))
+   {
+      if (iIntData > 0)
+         g_staticParams.options.bIndexFragmentBins = 1;
+   }
+
+   if (GetParamValue("index_compress", iIntData))
+   {
+      if (iIntData > 0)
+         g_staticParams.options.bIndexCompress = 1;
+   }
+
+   if (GetParamValue("thread_local_scoring", iIntData))
+   {
+      if (iIntData > 0)
+         g_staticParams.options.bThreadLocalScoring = 1;
+   }
+
+   if (GetParamValue("flat_xcorr", iIntData))
+   {
+      if (iIntData > 0)
+         g_staticParams.options.bFlatXcorr = 1;
+   }
+
    iIntData = 0;
    if (GetParamValue("minimum_peaks", iIntData))
    {
@@ -932,6 +1012,32 @@ bool CometSearchManager::InitializeStaticParams()
       g_staticParams.options.iMaxIndexRunTime = iIntData;
    }
 
+   if (GetParamValue("fragindex_search", iIntData))
+   {
+      if (iIntData > 0)
+         g_staticParams.options.bFragIndexSearch = 1;
+   }
+
+   if (GetParamValue("fragindex_min_ions_score", iIntData))
+   {
+      if (iIntData >= 0)
+         g_staticParams.options.iFragIndexMinIonsScore = iIntData;
+   }
+
+   if (GetParamValue("fragindex_num_spectrumpeaks", iIntData))
+   {
+      if (iIntData > 0)
+         g_staticParams.options.iFragIndexNumSpectrumPeaks = iIntData;
+   }
+
+   GetParamValue("fragindex_min_fragmentmass", g_staticParams.options.dFragIndexMinMass);
+   if (g_staticParams.options.dFragIndexMinMass < 0.0)
+      g_staticParams.options.dFragIndexMinMass = 0.0;
+
+   GetParamValue("fragindex_max_fragmentmass", g_staticParams.options.dFragIndexMaxMass);
+   if (g_staticParams.options.dFragIndexMaxMass < g_staticParams.options.dFragIndexMinMass)
+      g_staticParams.options.dFragIndexMaxMass = g_staticParams.options.dFragIndexMinMass;
+
    if (GetParamValue("precursor_charge", intRangeData))
    {
       if ((intRangeData.iStart > 0) && (intRangeData.iEnd >= intRangeData.iStart))
@@ -1723,6 +1829,10 @@ bool CometSearchManager::DoSearch()
       }
    }
 
+   // protein names read for output are kept for every input file searched
+   // against this database
+   CometMassSpecUtils::ClearProteinCache();
+
    for (int i=0; i<(int)g_pvInputFiles.size(); i++)
    {
       bSucceeded = UpdateInputFile(g_pvInputFiles.at(i));
@@ -2127,6 +2237,9 @@ bool CometSearchManager::DoSearch()
          // We want to read only MS2/MS3 scans.
          SetMSLevelFilter(mstReader);
 
+         // mzML/mzXML peaks are decoded by the preprocessing threads, not while reading.
+         mstReader.setDeferDecode(true);
+
          // We need to reset some of the static variables in-between input files
          CometPreprocess::Reset();
 
@@ -2141,14 +2254,27 @@ bool CometSearchManager::DoSearch()
             return false;
          }
 
+         if (g_staticParams.options.bPreloadProteinNames)
+            CometMassSpecUtils::PreloadProteinNames(fpdb);
+
          if (g_staticParams.options.iSpectrumBatchSize == 0)
          {
             logout("   - Reading all spectra into memory; set \"spectrum_batch_size\" if search terminates here.\n");
             fflush(stdout);
          }
 
+         // With spectrum_batch_pipeline, the next batch is read and preprocessed while the
+         // current one is searched and written so at most two batches are in memory.
+         bool bPipelineBatches = g_staticParams.options.bSpectrumBatchPipeline
+            && g_staticParams.options.iSpectrumBatchSize > 0;
+
+         // Whether a batch follows the current one.  It is read before StartPrefetch();
+         // from then on _bDoneProcessingAllSpectra is updated by the reader thread.
+         bool bMoreBatches = false;
+
          int iBatchNum = 0;
-         while (!CometPreprocess::DoneProcessingAllSpectra()) // Loop through iMaxSpectraPerSearch
+         while (CometPreprocess::PrefetchPending()
+               || !CometPreprocess::DoneProcessingAllSpectra()) // Loop through iMaxSpectraPerSearch
          {
             iBatchNum++;
 #ifdef PERF_DEBUG
@@ -2187,7 +2313,10 @@ bool CometSearchManager::DoSearch()
             // spectra, we MUST "goto cleanup_results" before exiting the loop,
             // or we will create a memory leak!
     
-            bSucceeded = CometPreprocess::LoadAndPreprocessSpectra(mstReader, iFirstScan, iLastScan, iAnalysisType, tp);
+            if (CometPreprocess::PrefetchPending())
+               bSucceeded = CometPreprocess::FinishPrefetch();
+            else
+               bSucceeded = CometPreprocess::LoadAndPreprocessSpectra(mstReader, iFirstScan, iLastScan, iAnalysisType, tp);
 
             if (!bSucceeded)
                goto cleanup_results;
@@ -2195,6 +2324,12 @@ bool CometSearchManager::DoSearch()
             iPercentStart = iPercentEnd;
             iPercentEnd = mstReader.getPercent();
 
+            bMoreBatches = !CometPreprocess::DoneProcessingAllSpectra();
+
+            // mstReader belongs to the reader thread until FinishPrefetch().
+            if (bPipelineBatches && bMoreBatches)
+               CometPreprocess::StartPrefetch(mstReader, iFirstScan, iLastScan, iAnalysisType);
+
 #ifdef PERF_DEBUG
             if (!g_staticParams.options.bOutputSqtStream)
             {
@@ -2302,7 +2437,7 @@ bool CometSearchManager::DoSearch()
             g_cometStatus.SetStatusMsg(string("Running search..."));
 
             // Now that spectra are loaded to memory and sorted, do search.
-            bSucceeded = CometSearch::RunSearch(iPercentStart, iPercentEnd, tp);
+            bSucceeded = CometSearch::RunSearch(iPercentStart, iPercentEnd, bMoreBatches, tp);
             if (!bSucceeded)
                goto cleanup_results;
 
@@ -2429,6 +2564,8 @@ bool CometSearchManager::DoSearch()
                break;
          }
 
+         CometPreprocess::DiscardPrefetch();
+
          if (bSucceeded)
          {
             if (iTotalSpectraSearched == 0)
@@ -2517,7 +2654,7 @@ bool CometSearchManager::DoSearch()
 //    g_staticParams.precursorNLIons.clear();
 
       //MH: Deallocate spectral processing memory.
-//    CometPreprocess::DeallocateMemory(g_staticParams.options.iNumThreads);
+//    CometPreprocess::DeallocateMemory();
 
       // Deallocate search memory
       CometSearch::DeallocateMemory(g_staticParams.options.iNumThreads);
@@ -2609,6 +2746,8 @@ bool CometSearchManager::DoSearch()
          break;
    }
 
+   CometMassSpecUtils::ClearProteinCache();
+
    if (bBlankSearchFile)
       return false;
    else
@@ -2646,6 +2785,21 @@ bool CometSearchManager::InitializeSingleSpectrumSearch()
    if (!bSucceeded)
       return bSucceeded;
 
+   // Load the .idx file, including its mods and protein names, once here instead of
+   // in every DoSingleSpectrumSearch() call.
+   if (g_staticParams.bIndexDb)
+   {
+      bSucceeded = CometSearch::LoadIndex();
+      if (!bSucceeded)
+      {
+         CometSearch::DeallocateMemory(g_staticParams.options.iNumThreads);
+         return bSucceeded;
+      }
+   }
+
+   singleSearchLatencies.clear();
+   singleSearchLatencyNext = 0;
+
    singleSearchInitializationComplete = true;
    return true;
 }
@@ -2656,11 +2810,13 @@ void CometSearchManager::FinalizeSingleSpectrumSearch()
    if (singleSearchInitializationComplete)
    {
       //MH: Deallocate spectral processing memory.
-//    CometPreprocess::DeallocateMemory(singleSearchThreadCount);
+//    CometPreprocess::DeallocateMemory();
 
       // Deallocate search memory
       CometSearch::DeallocateMemory(singleSearchThreadCount);
 
+      CometSearch::UnloadIndex();
+
       singleSearchInitializationComplete = false;
    }
 }
@@ -2711,6 +2867,7 @@ bool CometSearchManager::DoSingleSpectrumSearch(int iPrecursorCharge,
    if (g_pvQuery.empty())
    {
       delete[] pdTmpSpectrum;
+      RecordSingleSearchLatency();
       return false; // no search to run
    }
 
@@ -2780,7 +2937,7 @@ bool CometSearchManager::DoSingleSpectrumSearch(int iPrecursorCharge,
       if (pOutput[0].piVarModSites[pOutput[0].iLenPeptide] != 0)
       {
          std::stringstream ss;
-         ss << "n[" << std::fixed << std::setprecision(4) << pOutput[0].pdVarModSites[pOutput[0].iLenPeptide] << "]";
+         ss << "n[" << std::fixed << std::setprecision(4) << pOutput[0].VarModMass(pOutput[0].iLenPeptide) << "]";
          strReturnPeptide += ss.str();
       }
 
@@ -2791,7 +2948,7 @@ bool CometSearchManager::DoSingleSpectrumSearch(int iPrecursorCharge,
          if (pOutput[0].piVarModSites[i] != 0)
          {
             std::stringstream ss;
-            ss << "[" << std::fixed << std::setprecision(4) << pOutput[0].pdVarModSites[i] << "]";
+            ss << "[" << std::fixed << std::setprecision(4) << pOutput[0].VarModMass(i) << "]";
             strReturnPeptide += ss.str();
          }
       }
@@ -2800,7 +2957,7 @@ bool CometSearchManager::DoSingleSpectrumSearch(int iPrecursorCharge,
       if (pOutput[0].piVarModSites[pOutput[0].iLenPeptide + 1] != 0)
       {
          std::stringstream ss;
-         ss << "c[" << std::fixed << std::setprecision(4) << pOutput[0].pdVarModSites[pOutput[0].iLenPeptide + 1] << "]";
+         ss << "c[" << std::fixed << std::setprecision(4) << pOutput[0].VarModMass(pOutput[0].iLenPeptide + 1) << "]";
          strReturnPeptide += ss.str();
       }
 
@@ -2929,10 +3086,10 @@ bool CometSearchManager::DoSingleSpectrumSearch(int iPrecursorCharge,
          if (g_staticParams.variableModParameters.bVarModSearch)
          {
             if (pQuery->_pResults[0].piVarModSites[i] != 0)
-               dBion += pQuery->_pResults[0].pdVarModSites[i];
+               dBion += pQuery->_pResults[0].VarModMass(i);
 
             if (pQuery->_pResults[0].piVarModSites[iPos] != 0)
-               dYion += pQuery->_pResults[0].pdVarModSites[iPos];
+               dYion += pQuery->_pResults[0].VarModMass(iPos);
          }
 
          map<int, double>::iterator it;
@@ -3052,97 +3209,50 @@ cleanup_results:
 
    delete[] pdTmpSpectrum;
 
+   RecordSingleSearchLatency();
+
    return bSucceeded;
 }
 
 
-// this sort function needs to compare peptide, modification state, and protein file pointer
-bool CometSearchManager::CompareByPeptide(const DBIndex &lhs,
-                                          const DBIndex &rhs)
+// Add the time since tRealTimeStart to the most recent SINGLE_SEARCH_LATENCY_WINDOW
+// DoSingleSpectrumSearch() latencies.
+void CometSearchManager::RecordSingleSearchLatency(void)
 {
-   if (!strcmp(lhs.szPeptide, rhs.szPeptide))
-   {
-      // peptides are same here so look at mass next
-      if (fabs(lhs.dPepMass - rhs.dPepMass) > FLOAT_ZERO)
-      {
-         // masses are different
-         if (lhs.dPepMass < rhs.dPepMass)
-            return true;
-         else
-            return false;
-      }
+   std::chrono::high_resolution_clock::time_point tNow = std::chrono::high_resolution_clock::now();
+   double dLatency = std::chrono::duration<double, std::milli>(tNow - g_staticParams.tRealTimeStart).count();
 
-      // same sequences and masses here so next look at mod state
-      int iLen = (int)strlen(lhs.szPeptide)+2;
-      for (int i=0; i<iLen; i++)
-      {
-         if (lhs.pcVarModSites[i] != rhs.pcVarModSites[i])
-         {
-            // different mod state
-            if (lhs.pcVarModSites[i] > rhs.pcVarModSites[i])
-               return true;
-            else
-               return false;
-         }
-      }
-
-      // at this point, same peptide, same mass, same mods so return first protein
-      if (lhs.lIndexProteinFilePosition < rhs.lIndexProteinFilePosition)
-         return true;
-      else
-         return false;
-   }
-
-   // peptides are different
-   if (strcmp(lhs.szPeptide, rhs.szPeptide)<0)
-      return true;
+   if (singleSearchLatencies.size() < SINGLE_SEARCH_LATENCY_WINDOW)
+      singleSearchLatencies.push_back(dLatency);
    else
-      return false;
-};
+      singleSearchLatencies[singleSearchLatencyNext] = dLatency;
+
+   singleSearchLatencyNext = (singleSearchLatencyNext + 1) % SINGLE_SEARCH_LATENCY_WINDOW;
+}
 
 
-// sort by mass, then peptide, then modification state, then protein fp location
-bool CometSearchManager::CompareByMass(const DBIndex &lhs,
-                                       const DBIndex &rhs)
+// Median and 99th percentile, in milliseconds, of the most recent DoSingleSpectrumSearch()
+// calls since InitializeSingleSpectrumSearch().  Returns the number of calls included.
+int CometSearchManager::GetSingleSpectrumSearchLatency(double &dP50,
+                                                       double &dP99)
 {
-   if (fabs(lhs.dPepMass - rhs.dPepMass) > FLOAT_ZERO)
-   {
-      // masses are different
-      if (lhs.dPepMass < rhs.dPepMass)
-         return true;
-      else
-         return false;
-   }
+   dP50 = 0.0;
+   dP99 = 0.0;
 
-   // at this point, peptides are same mass so next need to compare sequences
+   if (singleSearchLatencies.empty())
+      return 0;
 
-   if (!strcmp(lhs.szPeptide, rhs.szPeptide))
-   {
-      // same sequences and masses here so next look at mod state
-      for (unsigned int i=0; i<strlen(lhs.szPeptide)+2; i++)
-      {
-         if (lhs.pcVarModSites[i] != rhs.pcVarModSites[i])
-         {
-            if (lhs.pcVarModSites[i] > rhs.pcVarModSites[i])
-               return true;
-            else
-               return false;
-         }
-      }
+   vector<double> vLatencies(singleSearchLatencies);
+   size_t tNum = vLatencies.size();
+   size_t tP50 = (tNum - 1) / 2;           // nearest rank
+   size_t tP99 = (tNum * 99 + 99) / 100 - 1;
 
-      // at this point, same peptide, same mass, same mods so return first protein
-      if (lhs.lIndexProteinFilePosition < rhs.lIndexProteinFilePosition)
-         return true;
-      else
-         return false;
-   }
-
-   // if here, peptide sequences are different (but w/same mass) so sort alphabetically
-   if (strcmp(lhs.szPeptide, rhs.szPeptide) < 0)
-      return true;
-   else
-      return false;
+   std::nth_element(vLatencies.begin(), vLatencies.begin() + tP50, vLatencies.end());
+   dP50 = vLatencies[tP50];
+   std::nth_element(vLatencies.begin(), vLatencies.begin() + tP99, vLatencies.end());
+   dP99 = vLatencies[tP99];
 
+   return (int)tNum;
 }
 
 
@@ -3154,20 +3264,43 @@ bool CometSearchManager::WriteIndexedDatabase(void)
 
    ThreadPool * tp = _tp;
 
+   if (g_staticParams.bIndexDb)
+      return CompactIndexedDatabase();
+
+   // peptides of the database are either written to a new index or appended to
+   // an existing one as a delta segment
+   bool bAppend = (g_staticParams.szIndexAppend[0] != '\0');
+
    const int iIndex_SIZE_FILE=SIZE_FILE+4;
    char szIndexFile[iIndex_SIZE_FILE];
-   sprintf(szIndexFile, "%s.idx", g_staticParams.databaseInfo.szDatabase);
+   if (bAppend)
+      strcpy(szIndexFile, g_staticParams.szIndexAppend);
+   else
+      sprintf(szIndexFile, "%s.idx", g_staticParams.databaseInfo.szDatabase);
 
-   if ((fptr = fopen(szIndexFile, "wb")) == NULL)
+   if ((fptr = fopen(szIndexFile, bAppend ? "r+b" : "wb")) == NULL)
    {
       printf(" Error - cannot open index file %s to write\n", szIndexFile);
       exit(1);
    }
 
-   sprintf(szOut, " Creating peptide index file: ");
+   if (bAppend)
+      sprintf(szOut, " Appending to peptide index file: ");
+   else
+      sprintf(szOut, " Creating peptide index file: ");
    logout(szOut);
    fflush(stdout);
 
+   CometIndexBuilder::Initialize(szIndexFile, tp);
+
+   // check the index before the database is digested
+   if (bAppend && !CometIndexBuilder::CheckAppendIndex(fptr))
+   {
+      fclose(fptr);
+      CometIndexBuilder::Cleanup();
+      return false;
+   }
+
    bSucceeded = CometSearch::AllocateMemory(g_staticParams.options.iNumThreads);
 
    g_massRange.dMinMass = g_staticParams.options.dPeptideMassLow;
@@ -3180,258 +3313,136 @@ bool CometSearchManager::WriteIndexedDatabase(void)
       g_massRange.bNarrowMassRange = false;
 
    if (bSucceeded)
-     bSucceeded = CometSearch::RunSearch(0, 0, tp);
+     bSucceeded = CometSearch::RunSearch(0, 0, false, tp);
 
    if (!bSucceeded)
    {
       char szErrorMsg[SIZE_ERROR];
       sprintf(szErrorMsg, " Error performing RunSearch() to create indexed database. \n");
       logerr(szErrorMsg);
+      fclose(fptr);
       CometSearch::DeallocateMemory(g_staticParams.options.iNumThreads);
+      CometIndexBuilder::Cleanup();
       return false;
    }
 
    // sanity check
-   if (g_pvDBIndex.size() == 0)
+   if (CometIndexBuilder::NumPeptides() == 0)
    {
       char szErrorMsg[SIZE_ERROR];
       sprintf(szErrorMsg, " Error - no peptides in index; check the input database file.\n");
       logerr(szErrorMsg);
+      fclose(fptr);
       CometSearch::DeallocateMemory(g_staticParams.options.iNumThreads);
+      CometIndexBuilder::Cleanup();
       return false;
    }
 
-   // remove duplicates
-   sprintf(szOut, " - removing duplicates\n");
-   logout(szOut);
-   fflush(stdout);
+   if (bAppend)
+      bSucceeded = CometIndexBuilder::AppendIndex(fptr);
+   else
+      bSucceeded = CometIndexBuilder::WriteIndex(fptr, NULL);
 
-   // keep unique entries only; sort by peptide/modification state and protein
-   // first sort by peptide, then mod state, then protein file position
-   sort(g_pvDBIndex.begin(), g_pvDBIndex.end(), CompareByPeptide);
-
-   // At this point, need to create g_pvProteinsList protein file position vector of vectors to map each peptide
-   // to every protein. g_pvDBIndex.at().lProteinFilePosition is now reference to protein vector entry
-   vector<vector<comet_fileoffset_t>> g_pvProteinsList;
-   vector<comet_fileoffset_t> temp;  // stores list of duplicate proteins which gets pushed to g_pvProteinsList
-
-   // Create g_pvProteinsList.  This is a vector of vectors.  Each element is vector list
-   // of duplicate proteins (generated as "temp") ... these are generated by looping
-   // through g_pvDBIndex and looking for consecutive, same peptides.  Once the "temp"
-   // vector is assigned the lIndexProteinFilePosition offset, the g_pvDBIndex entry is
-   // is assigned lProtCount to lIndexProteinFilePosition.  This is used later to look up
-   // the right vector element of duplicate proteins later.
-   long lProtCount = 0;
-   for (size_t i = 0; i < g_pvDBIndex.size(); i++)
-   {
-      if (i == 0)
-      {
-         temp.push_back(g_pvDBIndex.at(i).lIndexProteinFilePosition);
-         g_pvDBIndex.at(i).lIndexProteinFilePosition = lProtCount;
-      }
-      else
-      {
-         // each unique peptide, irregardless of mod state, will have the same list
-         // of matched proteins
-         if (!strcmp(g_pvDBIndex.at(i).szPeptide, g_pvDBIndex.at(i-1).szPeptide))
-         {
-            temp.push_back(g_pvDBIndex.at(i).lIndexProteinFilePosition);
-            g_pvDBIndex.at(i).lIndexProteinFilePosition = lProtCount;
-         }
-         else
-         {
-            // different peptide + mod state so go ahead and push temp onto g_pvProteinsList
-            // and store current protein reference into new temp
-            // temp can have duplicates due to mod forms of peptide so make unique here
-            sort(temp.begin(), temp.end());
-            temp.erase(unique(temp.begin(), temp.end()), temp.end() );
-            g_pvProteinsList.push_back(temp);
-
-            lProtCount++; // start new row in g_pvProteinsList
-            temp.clear();
-            temp.push_back(g_pvDBIndex.at(i).lIndexProteinFilePosition);
-            g_pvDBIndex.at(i).lIndexProteinFilePosition = lProtCount;
-         }
-      }
+   fclose(fptr);
+
+   if (bSucceeded)
+   {
+      sprintf(szOut, " - done\n");
+      logout(szOut);
+      fflush(stdout);
    }
-   // now at end of loop, push last temp onto g_pvProteinsList
-   sort(temp.begin(), temp.end());
-   temp.erase(unique(temp.begin(), temp.end()), temp.end() );
-   g_pvProteinsList.push_back(temp);
 
-   g_pvDBIndex.erase(unique(g_pvDBIndex.begin(), g_pvDBIndex.end()), g_pvDBIndex.end());
+   CometSearch::DeallocateMemory(g_staticParams.options.iNumThreads);
 
-   // sort by mass;
-   sort(g_pvDBIndex.begin(), g_pvDBIndex.end(), CompareByMass);
+   CometIndexBuilder::Cleanup();
+   g_pvProteinNames.clear();
+
+   return bSucceeded;
+}
 
-/*
-   for (std::vector<DBIndex>::iterator it = g_pvDBIndex.begin(); it != g_pvDBIndex.end(); ++it)
-   {
-      printf("OK after unique ");
-      if ((*it).pcVarModSites[strlen((*it).szPeptide)] != 0)
-         printf("n*");
-      for (unsigned int x = 0; x < strlen((*it).szPeptide); x++)
-      {
-         printf("%c", (*it).szPeptide[x]);
-         if ((*it).pcVarModSites[x] != 0)
-            printf("*");
-      }
-      if ((*it).pcVarModSites[strlen((*it).szPeptide) + 1] != 0)
-         printf("c*");
-      printf("   %f   %lld\n", (*it).dPepMass, (*it).lIndexProteinFilePosition);
-   }
-   printf("\n");
-*/
 
-   sprintf(szOut, " - writing file\n");
+// Rewrite an .idx database with its delta segments folded into a single segment.
+// The compacted index is written next to it and then replaces it.
+bool CometSearchManager::CompactIndexedDatabase(void)
+{
+   FILE *fptr;
+   bool bSucceeded;
+   char szOut[256];
+   char szErrorMsg[SIZE_ERROR];
+   string strParams;
+
+   ThreadPool * tp = _tp;
+
+   const int iIndex_SIZE_FILE=SIZE_FILE+12;
+   char szIndexFile[iIndex_SIZE_FILE];
+   sprintf(szIndexFile, "%s.compact", g_staticParams.databaseInfo.szDatabase);
+
+   sprintf(szOut, " Compacting peptide index file: ");
    logout(szOut);
    fflush(stdout);
 
-   // write out index header
-   fprintf(fptr, "Comet indexed database.  Comet version %s\n", g_sCometVersion.c_str());
-   fprintf(fptr, "InputDB:  %s\n", g_staticParams.databaseInfo.szDatabase);
-   fprintf(fptr, "MassRange: %lf %lf\n", g_staticParams.options.dPeptideMassLow, g_staticParams.options.dPeptideMassHigh);
-   fprintf(fptr, "MassType: %d %d\n", g_staticParams.massUtility.bMonoMassesParent, g_staticParams.massUtility.bMonoMassesFragment);
-   fprintf(fptr, "Enzyme: %s [%d %s %s]\n", g_staticParams.enzymeInformation.szSearchEnzymeName,
-      g_staticParams.enzymeInformation.iSearchEnzymeOffSet, 
-      g_staticParams.enzymeInformation.szSearchEnzymeBreakAA, 
-      g_staticParams.enzymeInformation.szSearchEnzymeNoBreakAA);
-   fprintf(fptr, "Enzyme2: %s [%d %s %s]\n", g_staticParams.enzymeInformation.szSearchEnzyme2Name,
-      g_staticParams.enzymeInformation.iSearchEnzyme2OffSet, 
-      g_staticParams.enzymeInformation.szSearchEnzyme2BreakAA, 
-      g_staticParams.enzymeInformation.szSearchEnzyme2NoBreakAA);
-   fprintf(fptr, "NumPeptides: %ld\n", (long)g_pvDBIndex.size());
-
-   // write out static mod params A to Z is ascii 65 to 90 then terminal mods
-   fprintf(fptr, "StaticMod:");
-   for (int x = 65; x <= 90; x++)
-      fprintf(fptr, " %lf", g_staticParams.staticModifications.pdStaticMods[x]);
-   fprintf(fptr, " %lf", g_staticParams.staticModifications.dAddNterminusPeptide);
-   fprintf(fptr, " %lf", g_staticParams.staticModifications.dAddCterminusPeptide);
-   fprintf(fptr, " %lf", g_staticParams.staticModifications.dAddNterminusProtein);
-   fprintf(fptr, " %lf\n", g_staticParams.staticModifications.dAddCterminusProtein);
-
-   // write out variable mod params
-   fprintf(fptr, "VariableMod:");
-   for (int x = 0; x < VMODS; x++)
-   {
-      fprintf(fptr, " %s %lf:%lf", g_staticParams.variableModParameters.varModList[x].szVarModChar,
-            g_staticParams.variableModParameters.varModList[x].dVarModMass,
-            g_staticParams.variableModParameters.varModList[x].dNeutralLoss);
-   }
-   fprintf(fptr, "\n\n");
-
-   int iTmp = (int)g_pvProteinNames.size();
-   comet_fileoffset_t *lProteinIndex = new comet_fileoffset_t[iTmp];
-   for (int i = 0; i < iTmp; i++)
-      lProteinIndex[i] = -1;
-
-   // first just write out protein names. Track file position of each protein name
-   int ctProteinNames = 0;
-   for (auto it = g_pvProteinNames.begin(); it != g_pvProteinNames.end(); ++it)
-   {
-      lProteinIndex[ctProteinNames] = comet_ftell(fptr);
-      fwrite(it->second.szProt, sizeof(char)*WIDTH_REFERENCE, 1, fptr);
-      it->second.iWhichProtein = ctProteinNames;
-      ctProteinNames++;
-   }
-
-   // next write out the peptides and track peptide mass index
-   int iMaxPeptideMass = (int)(g_staticParams.options.dPeptideMassHigh);
-   int iMaxPeptideMass10 = iMaxPeptideMass * 10;  // make mass index at resolution of 0.1 Da
-   comet_fileoffset_t *lIndex = new comet_fileoffset_t[iMaxPeptideMass10 + 1];
-   for (int x = 0; x <= iMaxPeptideMass10; x++)
-      lIndex[x] = -1;
-
-   // write out peptide entry here
-   int iPrevMass10 = 0;
-   int iWhichProtein = 0;
-   long lNumMatchedProteins = 0;
-   for (std::vector<DBIndex>::iterator it = g_pvDBIndex.begin(); it != g_pvDBIndex.end(); ++it)
-   {
-      if ((int)((*it).dPepMass * 10.0) > iPrevMass10)
-      {
-         iPrevMass10 = (int)((*it).dPepMass * 10.0);
-         if (iPrevMass10 < iMaxPeptideMass10)
-            lIndex[iPrevMass10] = comet_ftell(fptr);
-      }
+   CometIndexBuilder::Initialize(szIndexFile, tp);
+
+   tp->fillPool( g_staticParams.options.iNumThreads < 0 ? 0 : g_staticParams.options.iNumThreads-1);  
+
+   bSucceeded = CometSearch::LoadIndex() && CometSearch::CollectIndexPeptides(&strParams);
 
-      int iLen = (int)strlen((*it).szPeptide);
-      fwrite(&iLen, sizeof(int), 1, fptr);
-      fwrite((*it).szPeptide, sizeof(char), iLen, fptr);
-//    fwrite((*it).szPrevNextAA, sizeof(char), 2, fptr);
+   CometSearch::UnloadIndex();
 
-      // write out for char 0=no mod, N=mod.  If N, write out var mods as N pairs (pos,whichmod)
-      int iLen2 = iLen + 2;
-      unsigned char cNumMods = 0; 
-      for (unsigned char x=0; x<iLen2; x++)
+   // the compacted index keeps the mass range of the original
+   if (bSucceeded)
+   {
+      const char *pszMassRange = strstr(strParams.c_str(), "MassRange:");
+
+      if (pszMassRange == NULL || sscanf(pszMassRange + 10, "%lf %lf",
+               &g_staticParams.options.dPeptideMassLow, &g_staticParams.options.dPeptideMassHigh) != 2)
       {
-         if ((*it).pcVarModSites[x] != 0)
-            cNumMods++;
+         sprintf(szErrorMsg, " Error - no mass range in index file %s.\n", g_staticParams.databaseInfo.szDatabase);
+         string strErrorMsg(szErrorMsg);
+         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+         logerr(szErrorMsg);
+         bSucceeded = false;
       }
-      fwrite(&cNumMods, sizeof(unsigned char), 1, fptr);
+   }
 
-      if (cNumMods > 0)
+   if (bSucceeded)
+   {
+      if ((fptr = fopen(szIndexFile, "wb")) == NULL)
       {
-         for (unsigned char x=0; x<iLen2; x++)
-         {
-            if ((*it).pcVarModSites[x] != 0)
-            {
-               char cWhichMod = (*it).pcVarModSites[x];
-               fwrite(&x, sizeof(unsigned char), 1, fptr);
-               fwrite(&cWhichMod , sizeof(char), 1, fptr);
-            }
-         }
+         printf(" Error - cannot open index file %s to write\n", szIndexFile);
+         exit(1);
       }
 
-      // done writing out mod sites
-
-      fwrite(&((*it).dPepMass), sizeof(double), 1, fptr);
-      fwrite(&((*it).lIndexProteinFilePosition), sizeof(comet_fileoffset_t), 1, fptr);
-
-      // now write out all duplicate proteins file positions
-      lNumMatchedProteins = (long)g_pvProteinsList.at((*it).lIndexProteinFilePosition).size();
+      bSucceeded = CometIndexBuilder::WriteIndex(fptr, &strParams);
 
-      if (lNumMatchedProteins > g_staticParams.options.iMaxDuplicateProteins)
-         lNumMatchedProteins = g_staticParams.options.iMaxDuplicateProteins;
+      fclose(fptr);
 
-      fwrite(&lNumMatchedProteins, sizeof(long), 1, fptr);
-
-      for (long x = 0; x < lNumMatchedProteins; x++)
+      if (bSucceeded)
       {
-         // find protein by matching g_pvProteinNames.lProteinFilePosition to g_pvProteinNames.lProteinIndex;
-         auto result = g_pvProteinNames.find((g_pvProteinsList.at((*it).lIndexProteinFilePosition)).at(x));
-         if (result != g_pvProteinNames.end())
+         remove(g_staticParams.databaseInfo.szDatabase);
+
+         if (rename(szIndexFile, g_staticParams.databaseInfo.szDatabase) != 0)
          {
-            iWhichProtein = result->second.iWhichProtein;
+            sprintf(szErrorMsg, " Error - cannot rename %s to %s.\n", szIndexFile, g_staticParams.databaseInfo.szDatabase);
+            string strErrorMsg(szErrorMsg);
+            g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+            logerr(szErrorMsg);
+            bSucceeded = false;
          }
-
-         fwrite(&(lProteinIndex[iWhichProtein]), sizeof(comet_fileoffset_t), 1, fptr);
       }
+      else
+         remove(szIndexFile);
    }
 
-   comet_fileoffset_t lEndOfPeptides = comet_ftell(fptr);
-
-   int iTmpCh = (int)(g_staticParams.options.dPeptideMassLow);
-   fwrite(&iTmpCh, sizeof(int), 1, fptr);  // write min mass
-   fwrite(&iMaxPeptideMass, sizeof(int), 1, fptr);  // write max mass
-   uint64_t tNumPeptides = g_pvDBIndex.size();
-   fwrite(&tNumPeptides, sizeof(uint64_t), 1, fptr);  // write # of peptides
-   fwrite(lIndex, sizeof(comet_fileoffset_t), iMaxPeptideMass10, fptr); // write index
-   fwrite(&lEndOfPeptides, sizeof(comet_fileoffset_t), 1, fptr);  // write ftell position of min/max mass, # peptides, peptide index
-
-   fclose(fptr);
-
-   sprintf(szOut, " - done\n");
-   logout(" - done\n");
-   fflush(stdout);
-
-   CometSearch::DeallocateMemory(g_staticParams.options.iNumThreads);
+   if (bSucceeded)
+   {
+      sprintf(szOut, " - done\n");
+      logout(szOut);
+      fflush(stdout);
+   }
 
-   g_pvDBIndex.clear();
+   CometIndexBuilder::Cleanup();
    g_pvProteinNames.clear();
-   delete[] lProteinIndex;
-   delete[] lIndex;
 
    return bSucceeded;
 }
@@ -45,6 +45,8 @@ public:
                                        string& strReturnProtein,
                                        vector<Fragment> & matchedFragments,
                                        Scores & pScores);
+   virtual int GetSingleSpectrumSearchLatency(double &dP50,
+                                              double &dP99);
    virtual void AddInputFiles(vector<InputFileInfo*> &pvInputFiles);
    virtual void SetOutputFileBaseName(const char *pszBaseName);
    virtual void SetParam(const string &name, const string &strValue, const string &value);
@@ -77,17 +79,17 @@ public:
 
 private:
    bool InitializeStaticParams();
-   static bool CompareByPeptide(const DBIndex &lhs,
-                                const DBIndex &rhs);
-   static bool CompareByMass(const DBIndex &lhs,
-                             const DBIndex &rhs);
    static bool WriteIndexedDatabase(void);
+   static bool CompactIndexedDatabase(void);
 
    static void UpdatePrevNextAA(int iWhichQuery,
                                 int iPrintTargetDecoy);
+   void RecordSingleSearchLatency(void);
 
    bool singleSearchInitializationComplete;
    int singleSearchThreadCount;
+   vector<double> singleSearchLatencies;    // recent DoSingleSpectrumSearch() times in ms
+   size_t singleSearchLatencyNext;          // next slot to overwrite once the window is full
    std::map<std::string, CometParam*> _mapStaticParams;
 };
 
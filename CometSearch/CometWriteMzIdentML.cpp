@@ -1564,7 +1564,7 @@ void CometWriteMzIdentML::PrintTmpPSM(int iWhichQuery,
          for (int i=0; i<pOutput[iWhichResult].iLenPeptide; i++)
          {
             if (pOutput[iWhichResult].piVarModSites[i] != 0)
-               fprintf(fpout, "%d:%0.6f;", i, pOutput[iWhichResult].pdVarModSites[i]);
+               fprintf(fpout, "%d:%0.6f;", i, pOutput[iWhichResult].VarModMass(i));
          }
 
          fprintf(fpout, "\t");
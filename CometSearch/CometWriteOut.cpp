@@ -588,12 +588,12 @@ void CometWriteOut::PrintIons(int iWhichQuery,
       if (g_staticParams.variableModParameters.bVarModSearch)
       {
          if (pQuery->_pResults[0].piVarModSites[i] != 0)
-            dBion += pQuery->_pResults[0].pdVarModSites[i];   // PEFF need to validate this change
+            dBion += pQuery->_pResults[0].VarModMass(i);   // PEFF need to validate this change
 //          dBion += g_staticParams.variableModParameters.varModList[pQuery->_pResults[0].piVarModSites[i]-1].dVarModMass;
 
 
          if (pQuery->_pResults[0].piVarModSites[iPos] != 0)
-            dYion += pQuery->_pResults[0].pdVarModSites[iPos];
+            dYion += pQuery->_pResults[0].VarModMass(iPos);
 //          dYion += g_staticParams.variableModParameters.varModList[pQuery->_pResults[0].piVarModSites[iPos]-1].dVarModMass;
       }
 
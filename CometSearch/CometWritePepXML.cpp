@@ -784,7 +784,7 @@ void CometWritePepXML::PrintPepXMLSearchHit(int iWhichQuery,
          if (pOutput[iWhichResult].piVarModSites[i] != 0)
          {
             sprintf(szModPep+strlen(szModPep), "[%0.0f]",
-                  pOutput[iWhichResult].pdVarModSites[i] + g_staticParams.massUtility.pdAAMassFragment[(int)pOutput[iWhichResult].szPeptide[i]]);
+                  pOutput[iWhichResult].VarModMass(i) + g_staticParams.massUtility.pdAAMassFragment[(int)pOutput[iWhichResult].szPeptide[i]]);
          }
       }
       if (bCtermVariable)
@@ -807,17 +807,17 @@ void CometWritePepXML::PrintPepXMLSearchHit(int iWhichQuery,
 
             fprintf(fpout, "     <mod_aminoacid_mass position=\"%d\" mass=\"%0.6f\"",
                   i+1,
-                  g_staticParams.massUtility.pdAAMassFragment[iResidue] + pOutput[iWhichResult].pdVarModSites[i]);
+                  g_staticParams.massUtility.pdAAMassFragment[iResidue] + pOutput[iWhichResult].VarModMass(i));
             
             if (!isEqual(dStaticMass, 0.0))
                fprintf(fpout, " static=\"%0.6f\"", dStaticMass);
 
             if (pOutput[iWhichResult].piVarModSites[i] != 0)
-               fprintf(fpout, " variable=\"%0.6f\"", pOutput[iWhichResult].pdVarModSites[i]);
+               fprintf(fpout, " variable=\"%0.6f\"", pOutput[iWhichResult].VarModMass(i));
 
             if (pOutput[iWhichResult].piVarModSites[i] < 0)
             {
-               fprintf(fpout, " source=\"peff\" id=\"%s\"/>\n", pOutput[iWhichResult].pszMod[i]);
+               fprintf(fpout, " source=\"peff\" id=\"%s\"/>\n", pOutput[iWhichResult].PeffModName(i));
             }
             else if (pOutput[iWhichResult].piVarModSites[i] > 0)
                fprintf(fpout, " source=\"param\"/>\n");
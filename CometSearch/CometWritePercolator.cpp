@@ -337,7 +337,7 @@ void CometWritePercolator::PrintPercolatorSearchHit(int iWhichQuery,
       fprintf(fpout, "%c", pOutput[iWhichResult].szPeptide[i]);
 
       if (pOutput[iWhichResult].piVarModSites[i] != 0)
-         fprintf(fpout, "[%0.4f]", pOutput[iWhichResult].pdVarModSites[i]);
+         fprintf(fpout, "[%0.4f]", pOutput[iWhichResult].VarModMass(i));
    }
    if (bCterm)
       fprintf(fpout, "c[%0.4f]", dCterm);
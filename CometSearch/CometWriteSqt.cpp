@@ -326,7 +326,7 @@ void CometWriteSqt::PrintSqtLine(int iRankXcorr,
          sprintf(szBuf+strlen(szBuf), "%c", pOutput[iWhichResult].szPeptide[i]);
 
          if (g_staticParams.variableModParameters.bVarModSearch && pOutput[iWhichResult].piVarModSites[i] != 0)
-            sprintf(szBuf+strlen(szBuf), "[%0.4f]", pOutput[iWhichResult].pdVarModSites[i]);
+            sprintf(szBuf+strlen(szBuf), "[%0.4f]", pOutput[iWhichResult].VarModMass(i));
       }
 
       if (bCterm)
@@ -205,7 +205,7 @@ void CometWriteTxt::PrintResults(int iWhichQuery,
             fprintf(fpout, "%c", pOutput[iWhichResult].szPeptide[i]);
 
             if (pOutput[iWhichResult].piVarModSites[i] != 0)
-               fprintf(fpout, "[%0.4f]", pOutput[iWhichResult].pdVarModSites[i]);
+               fprintf(fpout, "[%0.4f]", pOutput[iWhichResult].VarModMass(i));
          }
          if (bCterm)
             fprintf(fpout, "c[%0.4f]", dCterm);
@@ -384,7 +384,7 @@ void CometWriteTxt::PrintResults(int iWhichQuery,
             fprintf(fpout, "%c", pOutput[iWhichResult].szPeptide[i]);
 
             if (pOutput[iWhichResult].piVarModSites[i] != 0)
-               fprintf(fpout, "[%0.4f]", pOutput[iWhichResult].pdVarModSites[i]);
+               fprintf(fpout, "[%0.4f]", pOutput[iWhichResult].VarModMass(i));
          }
          if (bCterm)
             fprintf(fpout, "c[%0.4f]", dCterm);
@@ -402,9 +402,9 @@ void CometWriteTxt::PrintResults(int iWhichQuery,
                fprintf(fpout, "%c", pOutput[iWhichResult].szPeptide[i]);
             
                if (pOutput[iWhichResult].piVarModSites[i] < 0)
-                  fprintf(fpout, "[%s]", pOutput[iWhichResult].pszMod[i]);
+                  fprintf(fpout, "[%s]", pOutput[iWhichResult].PeffModName(i));
                else if (pOutput[iWhichResult].piVarModSites[i] > 0)
-                  fprintf(fpout, "[%0.4f]", pOutput[iWhichResult].pdVarModSites[i]);
+                  fprintf(fpout, "[%0.4f]", pOutput[iWhichResult].VarModMass(i));
             }
             if (bCterm)
                fprintf(fpout, "c[%0.4f]", dCterm);
@@ -564,9 +564,9 @@ void CometWriteTxt::PrintModifications(FILE *fpout,
             bFirst=false;
 
          if (g_staticParams.variableModParameters.bVarModSearch && pOutput[iWhichResult].piVarModSites[i] > 0)
-            fprintf(fpout, "%d_V_%0.6f", i+1, pOutput[iWhichResult].pdVarModSites[i]);  // variable mod
+            fprintf(fpout, "%d_V_%0.6f", i+1, pOutput[iWhichResult].VarModMass(i));  // variable mod
          else
-            fprintf(fpout, "%d_P_%0.6f", i+1, pOutput[iWhichResult].pdVarModSites[i]);  // PEFF mod
+            fprintf(fpout, "%d_P_%0.6f", i+1, pOutput[iWhichResult].VarModMass(i));  // PEFF mod
          bPrintMod = true;
       }
    }
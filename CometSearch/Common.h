@@ -23,6 +23,8 @@
 #include <sstream>
 #include <ctime>
 
+#include <cstdlib>
+
 #ifdef _WIN32
 //socket
 #ifndef WIN32_LEAN_AND_MEAN
@@ -30,6 +32,7 @@
 #endif
 #include <direct.h>
 #include <errno.h>
+#include <malloc.h>
 #define STRCMP_IGNORE_CASE(a,b) _strcmpi(a,b)
 #include <io.h>
 typedef __int64 comet_fileoffset_t;
@@ -82,6 +85,30 @@ extern string g_sCometVersion;   // version string including git hash
 
 #define isEqual(x, y) (std::abs(x-y) <= ( (std::abs(x) > std::abs(y) ? std::abs(y) : std::abs(x)) * FLT_EPSILON))
 
+// 64 byte aligned allocation for arrays that are read with SIMD instructions
+inline void *comet_aligned_malloc(size_t tSize)
+{
+#ifdef _WIN32
+   return _aligned_malloc(tSize, 64);
+#else
+   void *p = NULL;
+
+   if (posix_memalign(&p, 64, tSize) != 0)
+      return NULL;
+
+   return p;
+#endif
+}
+
+inline void comet_aligned_free(void *p)
+{
+#ifdef _WIN32
+   _aligned_free(p);
+#else
+   free(p);
+#endif
+}
+
 using namespace MSToolkit;
 #ifdef CRUX
 #define logout(szString) cerr << szString
@@ -66,12 +66,18 @@ public:
    ThreadPool () : shutdown_ (false)
    {
       running_count_ = 0;
+      pool_waiter_ = false;
+      Threading::CreateSemaphore(&job_queued_);
+      Threading::CreateSemaphore(&pool_changed_);
    }
 
    ThreadPool (int threads) : shutdown_ (false)
    {
       // Create the specified number of threads
       running_count_ = 0;
+      pool_waiter_ = false;
+      Threading::CreateSemaphore(&job_queued_);
+      Threading::CreateSemaphore(&pool_changed_);
       threads_.reserve (threads);
       fillPool(threads);
    }
@@ -135,16 +141,17 @@ public:
 
          if (this->jobs_.empty () || this->running_count_ < (int) this->threads_.capacity() )
          {
+            if (this->jobs_.empty () && this->running_count_ == 0)
+            {
+               this->UNLOCK(&this->lock_);
+               break;
+            }
+
+            // When threads are still busy and no jobs to do, sleep until a
+            // thread takes a job or goes idle.
+            this->pool_waiter_ = true;
             this->UNLOCK(&this->lock_);
-            //Threading::ThreadSleep(100);
-            // When threads are still busy and no jobs to do wait ...
-#if !defined(_WIN32) && !defined(__APPLE__)
-            pthread_yield();
-#elif __APPLE__
-            sched_yield();
-#else
-            std::this_thread::yield();
-#endif
+            Threading::WaitSemaphore(this->pool_changed_);
          }
          else
          {
@@ -174,27 +181,72 @@ public:
       }
    }
 
+   // Like wait_on_threads() but returns as soon as fewer than max_jobs jobs are
+   // queued, so a producer can help with the backlog and then resume producing.
+   void wait_on_queue(size_t max_jobs)
+   {
+      std::function <void (void)> job;
+      while (true)
+      {
+         this->LOCK(&this->lock_);
+
+         if (this->jobs_.size() < max_jobs)
+         {
+            this->UNLOCK(&this->lock_);
+            return;
+         }
+
+         if (this->running_count_ < (int) this->threads_.capacity())
+         {
+            // Idle threads are about to pick up the queued jobs; sleep until one does.
+            this->pool_waiter_ = true;
+            this->UNLOCK(&this->lock_);
+            Threading::WaitSemaphore(this->pool_changed_);
+         }
+         else
+         {
+            job = std::move (this->jobs_.front ());
+            this->jobs_.pop_front();
+
+            this->UNLOCK(&this->lock_);
+            // Do the job without holding any locks
+            try
+            {
+               job();
+            }
+            catch (std::exception& e)
+            {
+               cerr << "WARNING: running job exception ... " << e.what() << " ... exiting ... " <<  endl;
+               return;
+            }
+         }
+      }
+   }
+
    void wait_for_available_thread()
    {
-      this->LOCK(&countlock_);
-      while(data_.size() > 0 && running_count_ >= (int)data_.size())
+      if (data_.size() == 0)
+         return;
+
+      // running_count_ is updated by the pool threads under lock_
+      this->LOCK(&lock_);
+      while(running_count_ >= (int)data_.size())
       {
-         this->UNLOCK(&countlock_);
-#if !defined(_WIN32) && !defined(__APPLE__)
-         pthread_yield();
-#elif __APPLE__
-         sched_yield();
-#else
-         std::this_thread::yield();
-#endif
-         this->LOCK(&countlock_);
+         pool_waiter_ = true;
+         this->UNLOCK(&lock_);
+         Threading::WaitSemaphore(pool_changed_);
+         this->LOCK(&lock_);
       }
-      this->UNLOCK(&countlock_);
+      this->UNLOCK(&lock_);
    }
 
    void drainPool()
    {
       shutdown_ = true;
+
+      // Wake the idle threads; each one passes the signal on as it exits.
+      Threading::SignalSemaphore(job_queued_);
+
       for (size_t i = 0; i < data_.size(); i++)
       {
 #ifdef _WIN32
@@ -214,6 +266,8 @@ public:
    ~ThreadPool ()
    {
       drainPool();
+      Threading::DestroySemaphore(job_queued_);
+      Threading::DestroySemaphore(pool_changed_);
    }
 
    void doJob (std::function <void (void)> func)
@@ -223,6 +277,20 @@ public:
       this->LOCK(&lock_);
       jobs_.emplace_back (std::move (func));
       this->UNLOCK(&lock_);
+
+      Threading::SignalSemaphore(job_queued_);
+   }
+
+   // Wake a thread sleeping in wait_on_threads(), wait_on_queue() or
+   // wait_for_available_thread().  Called with lock_ held whenever a pool
+   // thread takes a job or goes idle.
+   void wake_pool_waiter()
+   {
+      if (pool_waiter_)
+      {
+         pool_waiter_ = false;
+         Threading::SignalSemaphore(pool_changed_);
+      }
    }
 
    void incrementRunningCount()
@@ -293,6 +361,9 @@ public:
    int running_count_;
    bool shutdown_;
    std::deque <std::function <void (void)>> jobs_;
+   bool pool_waiter_;         // a caller is waiting on pool_changed_; guarded by lock_
+   Semaphore job_queued_;     // wakes an idle pool thread; passed on while jobs remain
+   Semaphore pool_changed_;   // signalled when a thread takes a job or goes idle while pool_waiter_ is set
 
    vector<thpldata*> data_;
 
@@ -329,15 +400,17 @@ inline void* threadStart(void* ptr)
 
       while (! tp->shutdown_ && tp->jobs_.empty())
       {
+         if  (did_job)
+         {
+            tp->running_count_ --;
+            did_job = false;
+            tp->wake_pool_waiter();
+         }
+
          tp->UNLOCK(&tp->lock_);
 
-#if !defined(_WIN32) && !defined(__APPLE__)
-         pthread_yield();
-#elif __APPLE__
-         sched_yield();
-#else
-         std::this_thread::yield();
-#endif
+         // Sleep until doJob() queues a job or drainPool() shuts down
+         Threading::WaitSemaphore(tp->job_queued_);
 
          if (tp->threads_.capacity() == 0)
 #ifdef _WIN32
@@ -345,14 +418,7 @@ inline void* threadStart(void* ptr)
 #else
             return NULL;
 #endif
-         //sleep some before reacquiring lock
-         //Threading::ThreadSleep(100);
          tp->LOCK(&tp->lock_);
-         if  (did_job)
-         {
-            tp->running_count_ --;
-            did_job = false;
-         }
       }
 
       if (tp->jobs_.empty ())
@@ -361,6 +427,7 @@ inline void* threadStart(void* ptr)
          if (VERBOSE)
             std::cerr << "Thread " << i << " terminates" << std::endl;
          tp->UNLOCK(&tp->lock_);
+         Threading::SignalSemaphore(tp->job_queued_);
 #ifdef _WIN32
          return 1;
 #else
@@ -378,7 +445,15 @@ inline void* threadStart(void* ptr)
          if (!did_job)
             tp->running_count_ ++;
 
+         tp->wake_pool_waiter();
+
+         // The signal from doJob() woke one thread; pass it on while jobs remain.
+         bool more_jobs = !tp->jobs_.empty();
+
          tp->UNLOCK(&tp->lock_);
+
+         if (more_jobs)
+            Threading::SignalSemaphore(tp->job_queued_);
          // Do the job without holding any locks
          try
          {
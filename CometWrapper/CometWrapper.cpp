@@ -130,6 +130,26 @@ bool CometSearchManagerWrapper::DoSingleSpectrumSearch(int iPrecursorCharge,
     return isSuccess;
 }
 
+int CometSearchManagerWrapper::GetSingleSpectrumSearchLatency([Out] double% dP50,
+                                                              [Out] double% dP99)
+{
+    dP50 = 0.0;
+    dP99 = 0.0;
+
+    if (!_pSearchMgr)
+    {
+        return 0;
+    }
+
+    double dTmpP50;
+    double dTmpP99;
+    int iNumSearches = _pSearchMgr->GetSingleSpectrumSearchLatency(dTmpP50, dTmpP99);
+
+    dP50 = dTmpP50;
+    dP99 = dTmpP99;
+    return iNumSearches;
+}
+
 
 bool CometSearchManagerWrapper::AddInputFiles(List<InputFileInfoWrapper^> ^inputFilesList)
 {
@@ -48,6 +48,8 @@ namespace CometWrapper {
                                     [Out] String^% szProtein,
                                     [Out] List<FragmentWrapper^>^% matchingFragments,
                                     [Out] ScoreWrapper^% score);
+        int GetSingleSpectrumSearchLatency([Out] double% dP50,
+                                           [Out] double% dP99);
 
         // Need to convert vector to List and back
         bool AddInputFiles(List<InputFileInfoWrapper^> ^inputFilesList);
@@ -118,6 +118,9 @@ class MSReader {
   //File compression
   void setCompression(bool b);
 
+  //For mzML/mzXML files: leave peaks encoded for Spectrum::decodePeaks()
+  void setDeferDecode(bool b);
+
   //for Sqlite
   void createIndex(); 
 
@@ -145,6 +148,9 @@ class MSReader {
   //File compression
   bool compressMe;
 
+  //Deferred peak decoding
+  bool deferDecode;
+
   //mzXML support variables;
   mzParser::ramp_fileoffset_t  *pScanIndex;
   mzParser::RAMPFILE  *rampFileIn;
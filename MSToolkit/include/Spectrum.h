@@ -22,6 +22,10 @@ limitations under the License.
 #include <cstdlib>
 #include <iomanip>
 
+namespace mzParser {
+struct sEncodedPeaks;
+}
+
 namespace MSToolkit {
 class Spectrum {
  public:
@@ -54,6 +58,7 @@ class Spectrum {
   void			    	clear();
 	void						clearMZ();
 	void						clearPeaks();
+  void            decodePeaks();  //decodes peaks left encoded by MSReader::setDeferDecode
   void				    erase(unsigned int);
   void				    erase(unsigned int, unsigned int);
   void            eraseEZ(unsigned int);
@@ -103,6 +108,7 @@ class Spectrum {
   void            setConversionD(double);
   void            setConversionE(double);
   void            setConversionI(double);
+  void            setEncodedPeaks(mzParser::sEncodedPeaks&);  //takes the contents; see decodePeaks()
   void            setFileID(std::string);
   void    				setFileType(MSSpectrumType);
   void            setIonInjectionTime(float);
@@ -117,6 +123,7 @@ class Spectrum {
   void            setTIC(double);
   void            setMsLevel(int level);
   int			      	size();
+  int             sizeEncoded();  //peaks waiting for decodePeaks()
   int             sizeEZ();
 	int							sizeMZ();   //also returns size of monoMZ
   int             sizeSPS();
@@ -177,6 +184,7 @@ class Spectrum {
   int              centroidStatus;  //0=profile, 1=centroid, 2=unknown
   double           scanWinLower;    //the instrument spectrum m/z range
   double           scanWinUpper;    //the instrument spectrum m/z range
+  mzParser::sEncodedPeaks* encodedPeaks;  //peaks not yet decoded; NULL once decoded
 
   //private:
   //Functions
@@ -254,6 +254,43 @@ typedef struct sPrecursorIon{
   }
 } sPrecursorIon;
 
+//Base64 text of one binary data array and what is needed to decode it.
+typedef struct sEncodedArray{
+  std::string data;
+  long encodedLen;      //mzML encodedLength, or mzXML compressedLen
+  int  dataType;        //1=32-bit float, 2=64-bit float
+  bool networkData;     //i.e. big endian
+  bool zlib;
+  bool numpressLinear;
+  bool numpressPic;
+  bool numpressSlof;
+  sEncodedArray(){
+    encodedLen=0;
+    dataType=0;
+    networkData=false;
+    zlib=false;
+    numpressLinear=false;
+    numpressPic=false;
+    numpressSlof=false;
+  }
+} sEncodedArray;
+
+//Peaks of a spectrum read by a handler with deferred decoding (see setDeferDecode).
+//Decoding them with decodePeaks() needs no parser state, so it can be done on
+//another thread after the next spectrum has been read.
+typedef struct sEncodedPeaks{
+  int format;           //0=none, 1=mzML m/z and intensity arrays, 2=mzXML interleaved m/z-intensity pairs in mz
+  int peaksCount;
+  sEncodedArray mz;
+  sEncodedArray intensity;
+  sEncodedPeaks(){
+    format=0;
+    peaksCount=0;
+  }
+} sEncodedPeaks;
+
+void decodePeaks(const sEncodedPeaks& e, std::vector<double>& vdM, std::vector<double>& vdI);
+
 class BasicSpectrum  {
 public:
 
@@ -290,6 +327,7 @@ public:
   void setScanIndex(int num);
   void setScanNum(int num);
   void setTotalIonCurrent(double d);
+  void swapEncodedPeaks(sEncodedPeaks& e);
 
   //Accessors
   int           getActivation();
@@ -342,6 +380,7 @@ protected:
   int             scanIndex;            //when scan numbers aren't enough, there are indexes (start at 1)
   int             scanNum;              //identifying scan number
   double          totalIonCurrent;
+  sEncodedPeaks   encodedPeaks;         //Undecoded data points when the handler defers decoding
   std::vector<specDP>* vData;                //Spectrum data points
   std::vector<sPrecursorIon>* vPrecursor;
      
@@ -453,6 +492,8 @@ private:
 //------------------------------------------------
 
 int b64_decode_mio (char *dest, const char *src, size_t size);
+int b64_decode_mio_scalar (char *dest, const char *src, size_t size);
+int b64_decode_doubles (double *dest, int count, const char *src, size_t srcLen, int width, bool bNet);
 int b64_encode (char *dest, const char *src, int len);
 
 class mzpSAXHandler{
@@ -529,6 +570,9 @@ public:
   bool                    readHeaderFromOffset(f_off offset, int scNm=-1);
   bool                    readSpectrum(int num=-1);
   bool                    readSpectrumFromOffset(f_off offset, int scNm=-1);
+  void                    setDeferDecode(bool b);
+
+  static void decodePeaks(const sEncodedPeaks& e, std::vector<double>& vdM, std::vector<double>& vdI);
   
 protected:
 
@@ -554,13 +598,13 @@ private:
   void  stopParser();
 
   //  mzpSAXMzmlHandler Base64 conversion functions
-  void decode(std::vector<double>& d);
+  static void decode(const sEncodedArray& a, int peaksCount, std::vector<double>& d);
   //void decode32(vector<double>& d);
   //void decode64(vector<double>& d);
   //void decompress32(vector<double>& d);
   //void decompress64(vector<double>& d);
-  unsigned long dtohl(uint32_t l, bool bNet);
-  uint64_t dtohl(uint64_t l, bool bNet);
+  static unsigned long dtohl(uint32_t l, bool bNet);
+  static uint64_t dtohl(uint64_t l, bool bNet);
 
   //  mzpSAXMzmlHandler Flags indicating parser is inside a particular tag.
   bool m_bInIndexedMzML;
@@ -574,6 +618,7 @@ private:
 
   //  mzpSAXMzmlHandler procedural flags.
   bool m_bChromatogramIndex;
+  bool m_bDeferDecode;  // keep spectrum peaks encoded; see sEncodedPeaks
   bool m_bHeaderOnly;
   bool m_bLowPrecision;
   bool m_bNetworkData;  // i.e. big endian
@@ -599,6 +644,7 @@ private:
   BasicChromatogram*      chromat;
   std::string                  m_ccurrentRefGroupName;
   long                    m_encodedLen;            // For compressed data
+  sEncodedPeaks           m_encodedPeaks;          // Peaks of the current spectrum when decoding is deferred
   instrumentInfo          m_instrument;
   sPrecursorIon           m_precursorIon;
   int                     m_peaksCount;            // Count of peaks in spectrum
@@ -641,6 +687,9 @@ public:
   bool            readHeaderFromOffset(f_off offset);
   bool            readSpectrum(int num=-1);
   bool            readSpectrumFromOffset(f_off offset);
+  void            setDeferDecode(bool b);
+
+  static void decodePeaks(const sEncodedPeaks& e, std::vector<double>& vdM, std::vector<double>& vdI);
   
 protected:
 
@@ -652,12 +701,12 @@ private:
   void  stopParser();
 
   //  mzpSAXMzxmlHandler Base64 conversion functions
-  void decode32();
-  void decode64();
-  void decompress32();
-  void decompress64();
-  unsigned long dtohl(uint32_t l, bool bNet);
-  uint64_t dtohl(uint64_t l, bool bNet);
+  static void decode32(const sEncodedArray& a, int peaksCount, std::vector<double>& vdM, std::vector<double>& vdI);
+  static void decode64(const sEncodedArray& a, int peaksCount, std::vector<double>& vdM, std::vector<double>& vdI);
+  static void decompress32(const sEncodedArray& a, int peaksCount, std::vector<double>& vdM, std::vector<double>& vdI);
+  static void decompress64(const sEncodedArray& a, int peaksCount, std::vector<double>& vdM, std::vector<double>& vdI);
+  static unsigned long dtohl(uint32_t l, bool bNet);
+  static uint64_t dtohl(uint64_t l, bool bNet);
 
   //  mzpSAXMzxmlHandler Flags indicating parser is inside a particular tag.
   bool m_bInDataProcessing;
@@ -670,6 +719,7 @@ private:
 
   //  mzpSAXMzxmlHandler procedural flags.
   bool m_bCompressedData;
+  bool m_bDeferDecode;  // keep spectrum peaks encoded; see sEncodedPeaks
   bool m_bHeaderOnly;
   bool m_bLowPrecision;
   bool m_bNetworkData;  // i.e. big endian
@@ -684,6 +734,7 @@ private:
 
   //  mzpSAXMzxmlHandler data members.
   uLong                   m_compressLen;  // For compressed data
+  sEncodedPeaks           m_encodedPeaks; // Peaks of the current spectrum when decoding is deferred
   instrumentInfo          m_instrument;
   int                     m_peaksCount;    // Count of peaks in spectrum
   sPrecursorIon           m_precursorIon;
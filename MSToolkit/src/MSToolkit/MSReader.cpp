@@ -25,6 +25,7 @@ MSReader::MSReader(){
   iMZPrecision=4;
   rampFileOpen=false;
   compressMe=false;
+  deferDecode=false;
   rawFileOpen=false;
   exportMGF=false;
   highResMGF=false;
@@ -1999,12 +2000,22 @@ bool MSReader::readMZPFile(const char* c, Spectrum& s, int scNum){
     }
   }
   //store the spectrum
+  if(rampFileIn->mzML!=NULL) rampFileIn->mzML->setDeferDecode(deferDecode);
+  if(rampFileIn->mzXML!=NULL) rampFileIn->mzXML->setDeferDecode(deferDecode);
 	pPeaks = readPeaks(rampFileIn, pScanIndex[rampIndex],rampIndex);
-	j=0;
-	for(i=0;i<scanHeader.peaksCount;i++){
-		s.add((double)pPeaks[j],(float)pPeaks[j+1]);
-		j+=2;
-	}
+  if(deferDecode){
+    //peaks stay encoded until Spectrum::decodePeaks()
+    mzParser::sEncodedPeaks e;
+    rampFileIn->bs->swapEncodedPeaks(e);
+    if(e.format!=0) s.setEncodedPeaks(e);
+  }
+  if(s.sizeEncoded()==0){
+	  j=0;
+	  for(i=0;i<scanHeader.peaksCount;i++){
+		  s.add((double)pPeaks[j],(float)pPeaks[j+1]);
+		  j+=2;
+	  }
+  }
   lastReadScanNum = scanHeader.acquisitionNum;
 
 	free(pPeaks);
@@ -2034,6 +2045,10 @@ void MSReader::setRawFilter(char *c){
   #endif
 }
 
+void MSReader::setDeferDecode(bool b){
+  deferDecode=b;
+}
+
 void MSReader::setHighResMGF(bool b){
   highResMGF=b;
 }
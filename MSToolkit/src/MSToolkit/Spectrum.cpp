@@ -14,6 +14,7 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 #include "Spectrum.h"
+#include "mzParser.h"
 #include <iostream>
 #include <iomanip>
 
@@ -50,6 +51,7 @@ Spectrum::Spectrum(){
   vPeaks = new vector<Peak_T>;
   vEZ = new vector<EZState>;
   vZ = new vector<ZState>;
+  encodedPeaks=NULL;
   actMethod=mstNA;
 
   strcpy(rawFilter,"");
@@ -65,6 +67,7 @@ Spectrum::~Spectrum(){
 	if(mz) delete mz;
   if(monoMZ) delete monoMZ;
   if(sps) delete sps;
+  if(encodedPeaks) delete encodedPeaks;
 }
 
 Spectrum::Spectrum(const Spectrum& s){
@@ -112,6 +115,8 @@ Spectrum::Spectrum(const Spectrum& s){
   for(i=0;i<s.vZ->size();i++){
     vZ->push_back(s.vZ->at(i));
   }
+  if(s.encodedPeaks) encodedPeaks = new mzParser::sEncodedPeaks(*s.encodedPeaks);
+  else encodedPeaks = NULL;
   strcpy(rawFilter,s.rawFilter);
   strcpy(nativeID,s.nativeID);
 }
@@ -147,6 +152,9 @@ Spectrum& Spectrum::operator=(const Spectrum& s){
     for(i=0;i<s.vZ->size();i++){
       vZ->push_back(s.vZ->at(i));
     }
+    delete encodedPeaks;
+    if(s.encodedPeaks) encodedPeaks = new mzParser::sEncodedPeaks(*s.encodedPeaks);
+    else encodedPeaks = NULL;
     rTime = s.rTime;
     charge = s.charge;
     scanNumber = s.scanNumber;
@@ -265,6 +273,8 @@ void Spectrum::clear(){
   monoMZ = new vector<double>;
   delete sps;
   sps = new vector<double>;
+  delete encodedPeaks;
+  encodedPeaks = NULL;
 	scanNumber = 0;
   scanNumber2 = 0;
 	rTime = 0;
@@ -293,6 +303,23 @@ void Spectrum::clearMZ(){
 void Spectrum::clearPeaks(){
 	delete vPeaks;
 	vPeaks = new vector<Peak_T>;
+  delete encodedPeaks;
+  encodedPeaks = NULL;
+}
+
+/* Decodes the peaks kept encoded by a reader with deferred decoding. The
+   encoded data is self-contained, so this may run on any thread. */
+void Spectrum::decodePeaks(){
+  if(encodedPeaks==NULL) return;
+
+  vector<double> vdM;
+  vector<double> vdI;
+  mzParser::decodePeaks(*encodedPeaks,vdM,vdI);
+  delete encodedPeaks;
+  encodedPeaks = NULL;
+
+  vPeaks->reserve(vPeaks->size()+vdM.size());
+  for(size_t i=0;i<vdM.size() && i<vdI.size();i++) add(vdM[i],(float)vdI[i]);
 }
 
 /* Erases element i in the spectrum. */
@@ -584,6 +611,11 @@ int Spectrum::size(){
   return (int)vPeaks->size();
 }
 
+int Spectrum::sizeEncoded(){
+  if(encodedPeaks==NULL) return 0;
+  return encodedPeaks->peaksCount;
+}
+
 int Spectrum::sizeEZ(){
 	return (int)vEZ->size();
 }
@@ -641,6 +673,11 @@ void Spectrum::setPeaks(vector<Peak_T> peaks) {
   }
 }
 
+void Spectrum::setEncodedPeaks(mzParser::sEncodedPeaks& e){
+  if(encodedPeaks==NULL) encodedPeaks = new mzParser::sEncodedPeaks;
+  swap(*encodedPeaks,e);
+}
+
 void Spectrum::setActivationMethod(MSActivation m){
   actMethod=m;
 }
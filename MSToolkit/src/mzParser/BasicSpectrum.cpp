@@ -70,6 +70,7 @@ BasicSpectrum::BasicSpectrum(const BasicSpectrum& s){
   scanIndex=s.scanIndex;
   scanNum=s.scanNum;
   totalIonCurrent=s.totalIonCurrent;
+  encodedPeaks=s.encodedPeaks;
   strcpy(idString,s.idString);
   strcpy(filterLine,s.filterLine);
 }
@@ -111,6 +112,7 @@ BasicSpectrum& BasicSpectrum::operator=(const BasicSpectrum& s){
     scanIndex=s.scanIndex;
     scanNum=s.scanNum;
     totalIonCurrent=s.totalIonCurrent;
+    encodedPeaks=s.encodedPeaks;
     strcpy(filterLine,s.filterLine);
     strcpy(idString,s.idString);
   }
@@ -147,6 +149,7 @@ void BasicSpectrum::clear(){
   scanIndex=0;
   scanNum=-1;
   totalIonCurrent=0.0;
+  encodedPeaks=sEncodedPeaks();
   vData->clear();
   vPrecursor->clear();
 }
@@ -175,6 +178,7 @@ void BasicSpectrum::setPrecursorScanNum(int i){ precursorScanNum=i;}
 void BasicSpectrum::setRTime(float f){ rTime=f;}
 void BasicSpectrum::setScanIndex(int num) { scanIndex=num;}
 void BasicSpectrum::setScanNum(int num){scanNum=num;}
+void BasicSpectrum::swapEncodedPeaks(sEncodedPeaks& e){ swap(encodedPeaks,e);}
 void BasicSpectrum::setTotalIonCurrent(double d){ totalIonCurrent=d;}
 
 //------------------------------------------
@@ -274,3 +274,18 @@ int MzParser::checkFileType(const char* fname){
   cerr << "Unknown file type. No file loaded." << endl;
   return 0;
 }
+
+void mzParser::decodePeaks(const sEncodedPeaks& e, vector<double>& vdM, vector<double>& vdI){
+  vdM.clear();
+  vdI.clear();
+  switch(e.format){
+  case 1:
+    mzpSAXMzmlHandler::decodePeaks(e,vdM,vdI);
+    break;
+  case 2:
+    mzpSAXMzxmlHandler::decodePeaks(e,vdM,vdI);
+    break;
+  default:
+    break;
+  }
+}
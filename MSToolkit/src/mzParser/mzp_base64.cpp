@@ -12,6 +12,13 @@
 //#include "base64.h"
 #include "mzParser.h"
 
+// Runtime dispatched SSSE3/AVX2 decoding of whole 4 character groups; other builds,
+// and whatever the vector loops leave over, use the scalar decoder.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define MZP_BASE64_X86
+#include <immintrin.h>
+#endif
+
 inline int getPosition( char buf );
 
 static const unsigned char *b64_tbl = (const unsigned char*) "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
@@ -115,7 +122,7 @@ inline int getPosition( char buf )
 
 
 // Returns the total number of bytes decoded
-int mzParser::b64_decode_mio ( char *dest,  const char *src, size_t size )
+static int b64_decode_scalar ( char *dest,  const char *src, size_t size )
 {
 	char *temp = dest;
 	char *end = dest + size;
@@ -190,3 +197,169 @@ int mzParser::b64_decode_mio ( char *dest,  const char *src, size_t size )
 		*temp++ = ( a << 6) | ( b );
 	}
 }
+
+#ifdef MZP_BASE64_X86
+/* The vector decoders translate and check 16 (32) characters with nibble lookup
+ * tables and pack them into 12 (24) bytes. They stop at the first block holding
+ * anything but A-Z, a-z, 0-9, '+' or '/' (padding, a terminator, whitespace), or
+ * when the block would not fit in dest, and return the characters consumed. Only
+ * the decoded bytes are stored: some callers pass a size larger than their buffer. */
+__attribute__((target("ssse3")))
+static size_t b64_decode_ssse3(char* dest, size_t size, const char* src, size_t srcLen){
+  const __m128i lutLo=_mm_setr_epi8(0x15,0x11,0x11,0x11,0x11,0x11,0x11,0x11,0x11,0x11,0x13,0x1A,0x1B,0x1B,0x1B,0x1A);
+  const __m128i lutHi=_mm_setr_epi8(0x10,0x10,0x01,0x02,0x04,0x08,0x04,0x08,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10);
+  const __m128i lutRoll=_mm_setr_epi8(0,16,19,4,-65,-65,-71,-71,0,0,0,0,0,0,0,0);
+  const __m128i mask2F=_mm_set1_epi8(0x2F);
+  const __m128i pack=_mm_setr_epi8(2,1,0,6,5,4,10,9,8,14,13,12,-1,-1,-1,-1);
+  size_t i=0;
+  size_t o=0;
+
+  while(i+16<=srcLen && o+12<=size){
+    __m128i str=_mm_loadu_si128((const __m128i*)(src+i));
+    __m128i hiNibbles=_mm_and_si128(_mm_srli_epi32(str,4),mask2F);
+    __m128i lo=_mm_shuffle_epi8(lutLo,_mm_and_si128(str,mask2F));
+    __m128i hi=_mm_shuffle_epi8(lutHi,hiNibbles);
+    if(_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo,hi),_mm_setzero_si128()))!=0) break;
+
+    //characters to 6-bit values, then 4 x 6 bits to 3 bytes per 32-bit lane
+    __m128i roll=_mm_shuffle_epi8(lutRoll,_mm_add_epi8(_mm_cmpeq_epi8(str,mask2F),hiNibbles));
+    str=_mm_add_epi8(str,roll);
+    str=_mm_maddubs_epi16(str,_mm_set1_epi32(0x01400140));
+    str=_mm_madd_epi16(str,_mm_set1_epi32(0x00011000));
+    str=_mm_shuffle_epi8(str,pack);
+    _mm_storel_epi64((__m128i*)(dest+o),str);
+    int iLast=_mm_cvtsi128_si32(_mm_srli_si128(str,8));
+    memcpy(dest+o+8,&iLast,4);
+
+    i+=16;
+    o+=12;
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t b64_decode_avx2(char* dest, size_t size, const char* src, size_t srcLen){
+  const __m256i lutLo=_mm256_setr_epi8(0x15,0x11,0x11,0x11,0x11,0x11,0x11,0x11,0x11,0x11,0x13,0x1A,0x1B,0x1B,0x1B,0x1A,
+                                       0x15,0x11,0x11,0x11,0x11,0x11,0x11,0x11,0x11,0x11,0x13,0x1A,0x1B,0x1B,0x1B,0x1A);
+  const __m256i lutHi=_mm256_setr_epi8(0x10,0x10,0x01,0x02,0x04,0x08,0x04,0x08,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,
+                                       0x10,0x10,0x01,0x02,0x04,0x08,0x04,0x08,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10);
+  const __m256i lutRoll=_mm256_setr_epi8(0,16,19,4,-65,-65,-71,-71,0,0,0,0,0,0,0,0,
+                                         0,16,19,4,-65,-65,-71,-71,0,0,0,0,0,0,0,0);
+  const __m256i mask2F=_mm256_set1_epi8(0x2F);
+  const __m256i pack=_mm256_setr_epi8(2,1,0,6,5,4,10,9,8,14,13,12,-1,-1,-1,-1,
+                                      2,1,0,6,5,4,10,9,8,14,13,12,-1,-1,-1,-1);
+  const __m256i join=_mm256_setr_epi32(0,1,2,4,5,6,-1,-1);
+  size_t i=0;
+  size_t o=0;
+
+  while(i+32<=srcLen && o+24<=size){
+    __m256i str=_mm256_loadu_si256((const __m256i*)(src+i));
+    __m256i hiNibbles=_mm256_and_si256(_mm256_srli_epi32(str,4),mask2F);
+    __m256i lo=_mm256_shuffle_epi8(lutLo,_mm256_and_si256(str,mask2F));
+    __m256i hi=_mm256_shuffle_epi8(lutHi,hiNibbles);
+    if(!_mm256_testz_si256(lo,hi)) break;
+
+    __m256i roll=_mm256_shuffle_epi8(lutRoll,_mm256_add_epi8(_mm256_cmpeq_epi8(str,mask2F),hiNibbles));
+    str=_mm256_add_epi8(str,roll);
+    str=_mm256_maddubs_epi16(str,_mm256_set1_epi32(0x01400140));
+    str=_mm256_madd_epi16(str,_mm256_set1_epi32(0x00011000));
+    str=_mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(str,pack),join);
+    _mm_storeu_si128((__m128i*)(dest+o),_mm256_castsi256_si128(str));
+    _mm_storel_epi64((__m128i*)(dest+o+16),_mm256_extracti128_si256(str,1));
+
+    i+=32;
+    o+=24;
+  }
+  return i;
+}
+#endif
+
+static size_t b64_decode_none(char*, size_t, const char*, size_t){
+  return 0;
+}
+
+typedef size_t (*b64BlockDecoder)(char*, size_t, const char*, size_t);
+
+static b64BlockDecoder b64_select_decoder(){
+#ifdef MZP_BASE64_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) return b64_decode_avx2;
+  if(__builtin_cpu_supports("ssse3")) return b64_decode_ssse3;
+#endif
+  return b64_decode_none;
+}
+
+// Decodes at most size bytes from srcLen characters of src; same result as
+// b64_decode_scalar.
+static int b64_decode_fast(char* dest, size_t size, const char* src, size_t srcLen){
+  static const b64BlockDecoder pfnDecode=b64_select_decoder();
+  size_t i=pfnDecode(dest,size,src,srcLen);
+  size_t o=i/4*3;
+  return (int)o + b64_decode_scalar(dest+o,src+i,size-o);
+}
+
+int mzParser::b64_decode_mio(char *dest, const char *src, size_t size){
+  return b64_decode_fast(dest,size,src,strlen(src));
+}
+
+// b64_decode_mio without the vector loops, to check them against (bench/peak_decode.cpp).
+int mzParser::b64_decode_mio_scalar(char *dest, const char *src, size_t size){
+  return b64_decode_scalar(dest,src,size);
+}
+
+static inline uint32_t b64_swap32(uint32_t l){
+  return (l << 24) | ((l << 8) & 0xFF0000) | (l >> 24) | ((l >> 8) & 0x00FF00);
+}
+
+static inline uint64_t b64_swap64(uint64_t l){
+  return (l << 56) | ((l << 40) & 0x00FF000000000000LL) | ((l << 24) & 0x0000FF0000000000LL) | ((l << 8) & 0x000000FF00000000LL) |
+    (l >> 56) | ((l >> 40) & 0x000000000000FF00LL) | ((l >> 24) & 0x0000000000FF0000LL) | ((l >> 8) & 0x00000000FF000000LL);
+}
+
+// Decodes count 32-bit (width 4) or 64-bit (width 8) floats into dest, with the same
+// byte order handling as the handlers' dtohl. The text is decoded a few KB at a time
+// so each block is converted while it is still in cache, without a buffer for the
+// whole array. Returns the number of values decoded.
+int mzParser::b64_decode_doubles(double *dest, int count, const char *src, size_t srcLen, int width, bool bNet){
+  const size_t blockSize=3072;  //multiple of 3 and 8: 4096 characters, whole values
+  unsigned char block[blockSize];
+  size_t remaining=(size_t)count*width;
+  int n=0;
+
+#ifdef OSX
+  bool bSwap=!bNet;
+#else
+  bool bSwap=bNet;
+#endif
+
+  while(remaining>0){
+    size_t want = remaining<blockSize ? remaining : blockSize;
+    size_t len=(size_t)b64_decode_fast((char*)block,want,src,srcLen);
+    size_t j;
+
+    if(width==4){
+      uint32_t u;
+      float f;
+      for(j=0;j+4<=len;j+=4){
+        memcpy(&u,block+j,4);
+        if(bSwap) u=b64_swap32(u);
+        memcpy(&f,&u,4);
+        dest[n++]=f;
+      }
+    } else {
+      uint64_t u;
+      for(j=0;j+8<=len;j+=8){
+        memcpy(&u,block+j,8);
+        if(bSwap) u=b64_swap64(u);
+        memcpy(dest+n,&u,8);
+        n++;
+      }
+    }
+
+    if(len<want) break;
+    remaining-=len;
+    src+=len/3*4;
+    srcLen = srcLen>len/3*4 ? srcLen-len/3*4 : 0;
+  }
+  return n;
+}
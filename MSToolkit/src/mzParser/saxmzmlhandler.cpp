@@ -39,6 +39,7 @@ using namespace mzParser;
 
 mzpSAXMzmlHandler::mzpSAXMzmlHandler(BasicSpectrum* bs){
   m_bChromatogramIndex = false;
+  m_bDeferDecode = false;
   m_bInmzArrayBinary = false;
   m_bInintenArrayBinary = false;
   m_bInRefGroup = false;
@@ -68,6 +69,7 @@ mzpSAXMzmlHandler::mzpSAXMzmlHandler(BasicSpectrum* bs){
 
 mzpSAXMzmlHandler::mzpSAXMzmlHandler(BasicSpectrum* bs, BasicChromatogram* cs){
   m_bChromatogramIndex = false;
+  m_bDeferDecode = false;
   m_bInmzArrayBinary = false;
   m_bInintenArrayBinary = false;
   m_bInRefGroup = false;
@@ -500,14 +502,40 @@ void mzpSAXMzmlHandler::processCVParam(const char* name, const char* accession,
 
 void mzpSAXMzmlHandler::processData()
 {
+  if(!m_bInmzArrayBinary && !m_bInintenArrayBinary) return;
+
+  sEncodedArray a;
+  a.data.swap(m_strData);
+  a.encodedLen=m_encodedLen;
+  a.dataType=m_iDataType;
+  a.networkData=m_bNetworkData;
+  a.zlib=m_bZlib;
+  a.numpressLinear=m_bNumpressLinear;
+  a.numpressPic=m_bNumpressPic;
+  a.numpressSlof=m_bNumpressSlof;
+
+  //Deferred decoding only keeps the array; see decodePeaks().
+  if(m_bDeferDecode) {
+    m_encodedPeaks.format=1;
+    m_encodedPeaks.peaksCount=m_peaksCount;
+    if(m_bInmzArrayBinary) {
+      swap(m_encodedPeaks.mz,a);
+      vdM.clear();
+    } else {
+      swap(m_encodedPeaks.intensity,a);
+      vdI.clear();
+    }
+    return;
+  }
+
   if(m_bInmzArrayBinary) {
-    decode(vdM);
+    decode(a, m_peaksCount, vdM);
     //if(m_bLowPrecision && !m_bCompressedData) decode32(vdM);
     //else if(m_bLowPrecision && m_bCompressedData) decompress32(vdM);
     //else if(!m_bLowPrecision && !m_bCompressedData) decode64(vdM);
     //else decompress64(vdM);
   } else if(m_bInintenArrayBinary) {
-    decode(vdI);
+    decode(a, m_peaksCount, vdI);
     //if(m_bLowPrecision && !m_bCompressedData) decode32(vdI);
     //else if(m_bLowPrecision && m_bCompressedData) decompress32(vdI);
     //else if(!m_bLowPrecision && !m_bCompressedData) decode64(vdI);
@@ -661,6 +689,10 @@ bool mzpSAXMzmlHandler::readSpectrumFromOffset(f_off offset, int scNm){
 
 void mzpSAXMzmlHandler::pushChromatogram(){
   TimeIntensityPair tip;
+  if(m_encodedPeaks.format!=0){
+    decodePeaks(m_encodedPeaks,vdM,vdI);
+    m_encodedPeaks=sEncodedPeaks();
+  }
   for(unsigned int i=0;i<vdM.size();i++)  {
     tip.time = vdM[i];
     tip.intensity = vdI[i];
@@ -676,14 +708,28 @@ void mzpSAXMzmlHandler::pushSpectrum(){
     dp.intensity = vdI[i];
     spec->addDP(dp);
   }
+
+  if(m_encodedPeaks.format!=0){
+    spec->swapEncodedPeaks(m_encodedPeaks);
+    m_encodedPeaks=sEncodedPeaks();
+  }
   
 }
 
-void mzpSAXMzmlHandler::decode(vector<double>& d){
+void mzpSAXMzmlHandler::setDeferDecode(bool b){
+  m_bDeferDecode=b;
+}
+
+void mzpSAXMzmlHandler::decodePeaks(const sEncodedPeaks& e, vector<double>& vdM, vector<double>& vdI){
+  decode(e.mz, e.peaksCount, vdM);
+  decode(e.intensity, e.peaksCount, vdI);
+}
+
+void mzpSAXMzmlHandler::decode(const sEncodedArray& a, int peaksCount, vector<double>& d){
 
   //If there is no data, back out now
   d.clear();
-  if(m_peaksCount < 1) return;
+  if(peaksCount < 1) return;
 
   //For byte order correction
   union udata32 {
@@ -696,10 +742,17 @@ void mzpSAXMzmlHandler::decode(vector<double>& d){
     uint64_t i;  
   } uData64; 
 
-  const char* pData = m_strData.data();
-  size_t stringSize = m_strData.size();
+  const char* pData = a.data.data();
+  size_t stringSize = a.data.size();
+
+  //Uncompressed floats are decoded and byte order corrected in a single pass
+  if(!a.zlib && !a.numpressLinear && !a.numpressSlof && !a.numpressPic && (a.dataType==1 || a.dataType==2)){
+    d.resize(peaksCount);
+    b64_decode_doubles(&d[0],peaksCount,pData,stringSize,a.dataType==1 ? 4 : 8,a.networkData);
+    return;
+  }
 
-  char* decoded = new char[m_encodedLen];  //array for decoded base64 string
+  char* decoded = new char[a.encodedLen];  //array for decoded base64 string
   int decodeLen;
   Bytef* unzipped = NULL;
   uLong unzippedLen;
@@ -710,19 +763,19 @@ void mzpSAXMzmlHandler::decode(vector<double>& d){
   decodeLen = b64_decode_mio(decoded,(char*)pData,stringSize);
 
   //zlib decompression
-  if(m_bZlib) {
+  if(a.zlib) {
 
-    if(m_iDataType==1) {
-      unzippedLen = m_peaksCount*sizeof(uint32_t);
-    } else if(m_iDataType==2) {
-      unzippedLen = m_peaksCount*sizeof(uint64_t);
+    if(a.dataType==1) {
+      unzippedLen = peaksCount*sizeof(uint32_t);
+    } else if(a.dataType==2) {
+      unzippedLen = peaksCount*sizeof(uint64_t);
     } else {
-      if(!m_bNumpressLinear && !m_bNumpressSlof && !m_bNumpressPic){
+      if(!a.numpressLinear && !a.numpressSlof && !a.numpressPic){
         cout << "Unknown data format to unzip. Stopping file read." << endl;
         exit(EXIT_FAILURE);
       }
     //don't know the unzipped size of numpressed data, so assume it to be no larger than unpressed 64-bit data
-    unzippedLen = m_peaksCount*sizeof(uint64_t);
+    unzippedLen = peaksCount*sizeof(uint64_t);
     }
 
     unzipped = new Bytef[unzippedLen];
@@ -732,18 +785,18 @@ void mzpSAXMzmlHandler::decode(vector<double>& d){
   }
 
   //Numpress decompression
-  if(m_bNumpressLinear || m_bNumpressSlof || m_bNumpressPic){
-    double* unpressed=new double[m_peaksCount];
+  if(a.numpressLinear || a.numpressSlof || a.numpressPic){
+    double* unpressed=new double[peaksCount];
   
     try{
-        if(m_bNumpressLinear){
-          if(m_bZlib) ms::numpress::MSNumpress::decodeLinear((unsigned char*)unzipped,(const size_t)unzippedLen,unpressed);
+        if(a.numpressLinear){
+          if(a.zlib) ms::numpress::MSNumpress::decodeLinear((unsigned char*)unzipped,(const size_t)unzippedLen,unpressed);
           else ms::numpress::MSNumpress::decodeLinear((unsigned char*)decoded,decodeLen,unpressed);
-        } else if(m_bNumpressSlof){
-          if(m_bZlib) ms::numpress::MSNumpress::decodeSlof((unsigned char*)unzipped,(const size_t)unzippedLen,unpressed);
+        } else if(a.numpressSlof){
+          if(a.zlib) ms::numpress::MSNumpress::decodeSlof((unsigned char*)unzipped,(const size_t)unzippedLen,unpressed);
           else ms::numpress::MSNumpress::decodeSlof((unsigned char*)decoded,decodeLen,unpressed);
-        } else if(m_bNumpressPic){
-          if(m_bZlib) ms::numpress::MSNumpress::decodePic((unsigned char*)unzipped,(const size_t)unzippedLen,unpressed);
+        } else if(a.numpressPic){
+          if(a.zlib) ms::numpress::MSNumpress::decodePic((unsigned char*)unzipped,(const size_t)unzippedLen,unpressed);
           else ms::numpress::MSNumpress::decodePic((unsigned char*)decoded,decodeLen,unpressed);
         }
     } catch (const char* ch){
@@ -751,40 +804,40 @@ void mzpSAXMzmlHandler::decode(vector<double>& d){
       exit(EXIT_FAILURE);
     }
 
-    if(m_bZlib) delete [] unzipped;
+    if(a.zlib) delete [] unzipped;
     else delete [] decoded;
-    for(i=0;i<m_peaksCount;i++) d.push_back(unpressed[i]);
+    for(i=0;i<peaksCount;i++) d.push_back(unpressed[i]);
     delete [] unpressed;
     return;
   }
 
   //Byte order correction
-  if(m_bZlib){
-    if(m_iDataType==1){
+  if(a.zlib){
+    if(a.dataType==1){
       uint32_t* unzipped32 = (uint32_t*)unzipped;
-      for(i=0;i<m_peaksCount;i++){
-        uData32.i = dtohl(unzipped32[i], m_bNetworkData);
+      for(i=0;i<peaksCount;i++){
+        uData32.i = dtohl(unzipped32[i], a.networkData);
         d.push_back(uData32.d);
       }
-    } else if(m_iDataType==2) {
+    } else if(a.dataType==2) {
       uint64_t* unzipped64 = (uint64_t*)unzipped;
-      for(i=0;i<m_peaksCount;i++){
-        uData64.i = dtohl(unzipped64[i], m_bNetworkData);
+      for(i=0;i<peaksCount;i++){
+        uData64.i = dtohl(unzipped64[i], a.networkData);
         d.push_back(uData64.d);
       }
     }
     delete [] unzipped;
   } else {
-    if(m_iDataType==1){
+    if(a.dataType==1){
       uint32_t* decoded32 = (uint32_t*)decoded;
-      for(i=0;i<m_peaksCount;i++){
-        uData32.i = dtohl(decoded32[i], m_bNetworkData);
+      for(i=0;i<peaksCount;i++){
+        uData32.i = dtohl(decoded32[i], a.networkData);
         d.push_back(uData32.d);
       }
-    } else if(m_iDataType==2) {
+    } else if(a.dataType==2) {
       uint64_t* decoded64 = (uint64_t*)decoded;
-      for(i=0;i<m_peaksCount;i++){
-        uData64.i = dtohl(decoded64[i], m_bNetworkData);
+      for(i=0;i<peaksCount;i++){
+        uData64.i = dtohl(decoded64[i], a.networkData);
         d.push_back(uData64.d);
       }
     }
@@ -32,6 +32,7 @@ mzpSAXMzxmlHandler::mzpSAXMzxmlHandler(BasicSpectrum* bs){
   m_bInIndex=false;
   m_bInPeaks=false;
   m_bCompressedData=false;
+  m_bDeferDecode=false;
   m_bHeaderOnly=false;
   m_bLowPrecision=false;
   m_bNetworkData=true;
@@ -208,10 +209,21 @@ void mzpSAXMzxmlHandler::endElement(const XML_Char *el) {
     }
 
   } else if(isElement("peaks",el)){
-    if(m_bLowPrecision && m_bCompressedData) decompress32();
-    else if(m_bLowPrecision && !m_bCompressedData) decode32();
-    else if(!m_bLowPrecision && m_bCompressedData) decompress64();
-    else decode64();
+    m_encodedPeaks.format=2;
+    m_encodedPeaks.peaksCount=m_peaksCount;
+    m_encodedPeaks.mz.data.swap(m_strData);
+    m_encodedPeaks.mz.encodedLen=(long)m_compressLen;
+    m_encodedPeaks.mz.dataType=(m_bLowPrecision ? 1 : 2);
+    m_encodedPeaks.mz.networkData=m_bNetworkData;
+    m_encodedPeaks.mz.zlib=m_bCompressedData;
+    //Deferred decoding only keeps the peaks; see decodePeaks().
+    if(m_bDeferDecode){
+      vdM.clear();
+      vdI.clear();
+    } else {
+      decodePeaks(m_encodedPeaks,vdM,vdI);
+      m_encodedPeaks=sEncodedPeaks();
+    }
     m_bInPeaks = false;
 
   } else if(isElement("precursorMz", el)) {
@@ -361,14 +373,31 @@ void mzpSAXMzxmlHandler::pushSpectrum(){
     dp.intensity = vdI[i];
     spec->addDP(dp);
   }
+
+  if(m_encodedPeaks.format!=0){
+    spec->swapEncodedPeaks(m_encodedPeaks);
+    m_encodedPeaks=sEncodedPeaks();
+  }
   
 }
 
-void mzpSAXMzxmlHandler::decompress32(){
+void mzpSAXMzxmlHandler::setDeferDecode(bool b){
+  m_bDeferDecode=b;
+}
+
+void mzpSAXMzxmlHandler::decodePeaks(const sEncodedPeaks& e, vector<double>& vdM, vector<double>& vdI){
+  const sEncodedArray& a=e.mz;
+  if(a.dataType==1 && a.zlib) decompress32(a,e.peaksCount,vdM,vdI);
+  else if(a.dataType==1 && !a.zlib) decode32(a,e.peaksCount,vdM,vdI);
+  else if(a.dataType!=1 && a.zlib) decompress64(a,e.peaksCount,vdM,vdI);
+  else decode64(a,e.peaksCount,vdM,vdI);
+}
+
+void mzpSAXMzxmlHandler::decompress32(const sEncodedArray& a, int peaksCount, vector<double>& vdM, vector<double>& vdI){
 
   vdM.clear();
   vdI.clear();
-  if(m_peaksCount < 1) return;
+  if(peaksCount < 1) return;
   
   union udata {
     float f;
@@ -378,37 +407,37 @@ void mzpSAXMzxmlHandler::decompress32(){
   uLong uncomprLen;
   uint32_t* data;
   int length;
-  const char* pData = m_strData.data();
-  size_t stringSize = m_strData.size();
+  const char* pData = a.data.data();
+  size_t stringSize = a.data.size();
   
   //Decode base64
-  char* pDecoded = (char*) new char[m_compressLen];
-  memset(pDecoded, 0, m_compressLen);
+  char* pDecoded = (char*) new char[a.encodedLen];
+  memset(pDecoded, 0, a.encodedLen);
   length = b64_decode_mio( (char*) pDecoded , (char*) pData, stringSize );
   pData=NULL;
 
   //zLib decompression
-  data = new uint32_t[m_peaksCount*2];
-  uncomprLen = m_peaksCount * 2 * sizeof(uint32_t);
+  data = new uint32_t[peaksCount*2];
+  uncomprLen = peaksCount * 2 * sizeof(uint32_t);
   uncompress((Bytef*)data, &uncomprLen, (const Bytef*)pDecoded, length);
   delete [] pDecoded;
 
   //write data to arrays
   int n = 0;
-  for(int i=0;i<m_peaksCount;i++){
-    uData.i = dtohl(data[n++], m_bNetworkData);
+  for(int i=0;i<peaksCount;i++){
+    uData.i = dtohl(data[n++], a.networkData);
     vdM.push_back((double)uData.f);
-    uData.i = dtohl(data[n++], m_bNetworkData);
+    uData.i = dtohl(data[n++], a.networkData);
     vdI.push_back((double)uData.f);
   }
   delete [] data;
 }
 
-void mzpSAXMzxmlHandler::decompress64(){
+void mzpSAXMzxmlHandler::decompress64(const sEncodedArray& a, int peaksCount, vector<double>& vdM, vector<double>& vdI){
 
   vdM.clear();
   vdI.clear();
-  if(m_peaksCount < 1) return;
+  if(peaksCount < 1) return;
   
   union udata {
     double d;
@@ -418,27 +447,27 @@ void mzpSAXMzxmlHandler::decompress64(){
   uLong uncomprLen;
   uint64_t* data;
   int length;
-  const char* pData = m_strData.data();
-  size_t stringSize = m_strData.size();
+  const char* pData = a.data.data();
+  size_t stringSize = a.data.size();
   
   //Decode base64
-  char* pDecoded = (char*) new char[m_compressLen];
-  memset(pDecoded, 0, m_compressLen);
+  char* pDecoded = (char*) new char[a.encodedLen];
+  memset(pDecoded, 0, a.encodedLen);
   length = b64_decode_mio( (char*) pDecoded , (char*) pData, stringSize );
   pData=NULL;
 
   //zLib decompression
-  data = new uint64_t[m_peaksCount*2];
-  uncomprLen = m_peaksCount * 2 * sizeof(uint64_t);
+  data = new uint64_t[peaksCount*2];
+  uncomprLen = peaksCount * 2 * sizeof(uint64_t);
   uncompress((Bytef*)data, &uncomprLen, (const Bytef*)pDecoded, length);
   delete [] pDecoded;
 
   //write data to arrays
   int n = 0;
-  for(int i=0;i<m_peaksCount;i++){
-    uData.i = dtohl(data[n++], m_bNetworkData);
+  for(int i=0;i<peaksCount;i++){
+    uData.i = dtohl(data[n++], a.networkData);
     vdM.push_back(uData.d);
-    uData.i = dtohl(data[n++], m_bNetworkData);
+    uData.i = dtohl(data[n++], a.networkData);
     vdI.push_back(uData.d);
   }
   delete [] data;
@@ -446,93 +475,58 @@ void mzpSAXMzxmlHandler::decompress64(){
 }
 
 
-void mzpSAXMzxmlHandler::decode32(){
-// This code block was revised so that it packs floats correctly
-// on both 64 and 32 bit machines, by making use of the uint32_t
-// data type. -S. Wiley
-  const char* pData = m_strData.data();
-  size_t stringSize = m_strData.size();
-  
-  size_t size = m_peaksCount * 2 * sizeof(uint32_t);
-  char* pDecoded = (char *) new char[size];
-  memset(pDecoded, 0, size);
-
-  if(m_peaksCount > 0) {
-    // Base64 decoding
-    // By comparing the size of the unpacked data and the expected size
-    // an additional check of the data file integrity can be performed
-    int length = b64_decode_mio( (char*) pDecoded , (char*) pData, stringSize );
-    if(length != size) {
-      cout << " decoded size " << length << " and required size " << (unsigned long)size << " dont match:\n";
-      cout << " Cause: possible corrupted file.\n";
-      exit(EXIT_FAILURE);
-    }
-  }
-
-  // And byte order correction
-  union udata {
-    float fData;
-    uint32_t iData;  
-  } uData; 
+void mzpSAXMzxmlHandler::decode32(const sEncodedArray& a, int peaksCount, vector<double>& vdM, vector<double>& vdI){
+  const char* pData = a.data.data();
+  size_t stringSize = a.data.size();
 
   vdM.clear();
   vdI.clear();
-  int n = 0;
-  uint32_t* pDecodedInts = (uint32_t*)pDecoded; // cast to uint_32 for reading int sized chunks
-  for(int i = 0; i < m_peaksCount; i++) {
-    uData.iData = dtohl(pDecodedInts[n++], m_bNetworkData);
-    vdM.push_back((double)uData.fData);
-    uData.iData = dtohl(pDecodedInts[n++], m_bNetworkData);
-    vdI.push_back((double)uData.fData);
+  if(peaksCount < 1) return;
+
+  // Base64 decoding and byte order correction of the interleaved m/z-intensity pairs
+  // By comparing the size of the unpacked data and the expected size
+  // an additional check of the data file integrity can be performed
+  vector<double> vdPairs(peaksCount * 2);
+  int length = b64_decode_doubles(&vdPairs[0], peaksCount * 2, pData, stringSize, sizeof(uint32_t), a.networkData);
+  if(length != peaksCount * 2) {
+    cout << " decoded size " << length * sizeof(uint32_t) << " and required size " << (unsigned long)(peaksCount * 2 * sizeof(uint32_t)) << " dont match:\n";
+    cout << " Cause: possible corrupted file.\n";
+    exit(EXIT_FAILURE);
   }
 
-  // Free allocated memory
-  delete[] pDecoded;
-}
-
-void mzpSAXMzxmlHandler::decode64(){
-
-// This code block was revised so that it packs floats correctly
-// on both 64 and 32 bit machines, by making use of the uint32_t
-// data type. -S. Wiley
-  const char* pData = m_strData.data();
-  size_t stringSize = m_strData.size();
-
-  size_t size = m_peaksCount * 2 * sizeof(uint64_t);
-  char* pDecoded = (char *) new char[size];
-  memset(pDecoded, 0, size);
-
-  if(m_peaksCount > 0) {
-    // Base64 decoding
-    // By comparing the size of the unpacked data and the expected size
-    // an additional check of the data file integrity can be performed
-    int length = b64_decode_mio( (char*) pDecoded , (char*) pData, stringSize );
-    if(length != size) {
-      cout << " decoded size " << length << " and required size " << (unsigned long)size << " dont match:\n";
-      cout << " Cause: possible corrupted file.\n";
-      exit(EXIT_FAILURE);
-    }
+  vdM.reserve(peaksCount);
+  vdI.reserve(peaksCount);
+  for(int i = 0; i < peaksCount; i++) {
+    vdM.push_back(vdPairs[i * 2]);
+    vdI.push_back(vdPairs[i * 2 + 1]);
   }
+}
 
-  // And byte order correction
-  union udata {
-    double fData;
-    uint64_t iData;  
-  } uData; 
+void mzpSAXMzxmlHandler::decode64(const sEncodedArray& a, int peaksCount, vector<double>& vdM, vector<double>& vdI){
+  const char* pData = a.data.data();
+  size_t stringSize = a.data.size();
 
   vdM.clear();
   vdI.clear();
-  int n = 0;
-  uint64_t* pDecodedInts = (uint64_t*)pDecoded; // cast to uint_64 for reading int sized chunks
-  for(int i = 0; i < m_peaksCount; i++) {
-    uData.iData = dtohl(pDecodedInts[n++], m_bNetworkData);
-    vdM.push_back(uData.fData);
-    uData.iData = dtohl(pDecodedInts[n++], m_bNetworkData);
-    vdI.push_back(uData.fData);
+  if(peaksCount < 1) return;
+
+  // Base64 decoding and byte order correction of the interleaved m/z-intensity pairs
+  // By comparing the size of the unpacked data and the expected size
+  // an additional check of the data file integrity can be performed
+  vector<double> vdPairs(peaksCount * 2);
+  int length = b64_decode_doubles(&vdPairs[0], peaksCount * 2, pData, stringSize, sizeof(uint64_t), a.networkData);
+  if(length != peaksCount * 2) {
+    cout << " decoded size " << length * sizeof(uint64_t) << " and required size " << (unsigned long)(peaksCount * 2 * sizeof(uint64_t)) << " dont match:\n";
+    cout << " Cause: possible corrupted file.\n";
+    exit(EXIT_FAILURE);
   }
 
-  // Free allocated memory
-  delete[] pDecoded;
+  vdM.reserve(peaksCount);
+  vdI.reserve(peaksCount);
+  for(int i = 0; i < peaksCount; i++) {
+    vdM.push_back(vdPairs[i * 2]);
+    vdI.push_back(vdPairs[i * 2 + 1]);
+  }
 }
 
 unsigned long mzpSAXMzxmlHandler::dtohl(uint32_t l, bool bNet) {
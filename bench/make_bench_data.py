@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+# Writes the synthetic FASTA database and MS2 spectra used by run_bench.sh into the
+# given directory: like tests/data/make_test_data.py, but large enough to time.  The
+# spectra are also written as bench.mzML (64-bit m/z, 32-bit intensities) and
+# bench.mzXML (32-bit, network byte order), indexed, with uncompressed base64 peak arrays.
+#    make_bench_data.py <directory> [number of proteins] [number of spectra]
+# The output is deterministic so timings of different builds are comparable.
+import base64
+import os
+import random
+import struct
+import sys
+
+random.seed(11)
+AA = "ACDEFGHIKLMNPQRSTVWY"
+MONO = {'G':57.02146, 'A':71.03711, 'S':87.03203, 'P':97.05276, 'V':99.06841, 'T':101.04768,
+        'C':103.00919+57.021464, 'L':113.08406, 'I':113.08406, 'N':114.04293, 'D':115.02694,
+        'Q':128.05858, 'K':128.09496, 'E':129.04259, 'M':131.04049, 'H':137.05891, 'F':147.06841,
+        'R':156.10111, 'Y':163.06333, 'W':186.07931}
+H2O = 18.010565
+PROTON = 1.00727646688
+
+outdir = sys.argv[1]
+num_proteins = int(sys.argv[2]) if len(sys.argv) > 2 else 20000
+num_spectra = int(sys.argv[3]) if len(sys.argv) > 3 else 1000
+
+proteins = []
+with open(os.path.join(outdir, "bench.fasta"), "w") as f:
+    for i in range(num_proteins):
+        seq = "".join(random.choice(AA) for _ in range(random.randint(50, 800)))
+        proteins.append(seq)
+        f.write(">sp|B%06d|BENCH%d_HUMAN bench protein %d OS=Homo sapiens\n" % (i, i, i))
+        for j in range(0, len(seq), 60):
+            f.write(seq[j:j+60] + "\n")
+
+peptides = []
+for seq in proteins:
+    cur = ""
+    for c in seq:
+        cur += c
+        if c in "KR":
+            if 7 <= len(cur) <= 25:
+                peptides.append(cur)
+            cur = ""
+    if len(peptides) >= 4 * num_spectra:
+        break
+random.shuffle(peptides)
+
+spectra = []
+with open(os.path.join(outdir, "bench.ms2"), "w") as f:
+    f.write("H\tCreationDate\tsynthetic\n")
+    for scan, pep in enumerate(peptides[:num_spectra], 1):
+        mass = sum(MONO[c] for c in pep) + H2O
+        z = random.choice([2, 3])
+        ions = []
+        b = PROTON
+        for c in pep[:-1]:
+            b += MONO[c]
+            ions.append(b)
+        y = H2O + PROTON
+        for c in reversed(pep[1:]):
+            y += MONO[c]
+            ions.append(y)
+        ions += [random.uniform(150, mass) for _ in range(100)]
+        f.write("S\t%d\t%d\t%.5f\n" % (scan, scan, (mass + z*PROTON) / z))
+        f.write("Z\t%d\t%.5f\n" % (z, mass + PROTON))
+        peaks = [(mz + random.gauss(0, 0.005), random.uniform(100, 1000)) for mz in sorted(ions)]
+        spectra.append((scan, z, (mass + z*PROTON) / z, peaks))
+        for mz, inten in peaks:
+            f.write("%.4f %.1f\n" % (mz, inten))
+
+def b64(fmt, values):
+    return base64.b64encode(struct.pack(fmt % len(values), *values)).decode()
+
+# Both files carry the offset index that MSToolkit reads them by.
+out = ['<?xml version="1.0" encoding="utf-8"?>\n'
+       '<indexedmzML xmlns="http://psi.hupo.org/ms/mzml">\n'
+       '<mzML xmlns="http://psi.hupo.org/ms/mzml" version="1.1.0">\n'
+       '<run id="bench">\n<spectrumList count="%d">\n' % len(spectra)]
+offsets = []
+for i, (scan, z, mz, peaks) in enumerate(spectra):
+    offsets.append(sum(len(x) for x in out))
+    arrays = [("MS:1000523", "64-bit float", "MS:1000514", "m/z array", b64("<%dd", [p[0] for p in peaks])),
+              ("MS:1000521", "32-bit float", "MS:1000515", "intensity array", b64("<%df", [p[1] for p in peaks]))]
+    out.append('<spectrum index="%d" id="scan=%d" defaultArrayLength="%d">\n'
+               '<cvParam cvRef="MS" accession="MS:1000511" name="ms level" value="2"/>\n'
+               '<precursorList count="1">\n<precursor>\n<selectedIonList count="1">\n<selectedIon>\n'
+               '<cvParam cvRef="MS" accession="MS:1000744" name="selected ion m/z" value="%.5f"/>\n'
+               '<cvParam cvRef="MS" accession="MS:1000041" name="charge state" value="%d"/>\n'
+               '</selectedIon>\n</selectedIonList>\n</precursor>\n</precursorList>\n'
+               '<binaryDataArrayList count="2">\n' % (i, scan, len(peaks), mz, z))
+    for acc, name, arrayacc, arrayname, text in arrays:
+        out.append('<binaryDataArray encodedLength="%d">\n'
+                   '<cvParam cvRef="MS" accession="%s" name="%s"/>\n'
+                   '<cvParam cvRef="MS" accession="MS:1000576" name="no compression"/>\n'
+                   '<cvParam cvRef="MS" accession="%s" name="%s"/>\n'
+                   '<binary>%s</binary>\n</binaryDataArray>\n' % (len(text), acc, name, arrayacc, arrayname, text))
+    out.append('</binaryDataArrayList>\n</spectrum>\n')
+out.append('</spectrumList>\n</run>\n</mzML>\n')
+index_offset = sum(len(x) for x in out)
+out.append('<indexList count="1">\n<index name="spectrum">\n')
+out += ['<offset idRef="scan=%d">%d</offset>\n' % (s[0], o) for s, o in zip(spectra, offsets)]
+out.append('</index>\n</indexList>\n<indexListOffset>%d</indexListOffset>\n</indexedmzML>\n' % index_offset)
+with open(os.path.join(outdir, "bench.mzML"), "w") as f:
+    f.write("".join(out))
+
+out = ['<?xml version="1.0" encoding="ISO-8859-1"?>\n'
+       '<mzXML xmlns="http://sashimi.sourceforge.net/schema_revision/mzXML_3.2">\n<msRun scanCount="%d">\n' % len(spectra)]
+offsets = []
+for scan, z, mz, peaks in spectra:
+    offsets.append(sum(len(x) for x in out))
+    out.append('<scan num="%d" msLevel="2" peaksCount="%d">\n'
+               '<precursorMz precursorCharge="%d">%.5f</precursorMz>\n'
+               '<peaks precision="32" byteOrder="network" contentType="m/z-int" compressionType="none" compressedLen="0">%s</peaks>\n'
+               '</scan>\n' % (scan, len(peaks), z, mz, b64(">%df", [v for p in peaks for v in p])))
+out.append('</msRun>\n')
+index_offset = sum(len(x) for x in out)
+out.append('<index name="scan">\n')
+out += ['<offset id="%d">%d</offset>\n' % (s[0], o) for s, o in zip(spectra, offsets)]
+out.append('</index>\n<indexOffset>%d</indexOffset>\n</mzXML>\n' % index_offset)
+with open(os.path.join(outdir, "bench.mzXML"), "w") as f:
+    f.write("".join(out))
@@ -0,0 +1,273 @@
+// Decodes the base64 peak arrays of mzML and mzXML files with the scalar decoder and
+// with the runtime dispatched SIMD decoder of MSToolkit, checks that both give the
+// same bytes and the same peak values, and times them.
+//    peak_decode.exe file.mzML|file.mzXML ...
+// Arrays are taken from <binary> (mzML) and <peaks> (mzXML) elements.  For zlib
+// compressed arrays only the base64 step is compared.
+
+#include "mzParser.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct PeakArray
+{
+   string strBase64;
+   int iWidth;          // 4 or 8 byte floats
+   bool bNet;           // big endian (mzXML "network" byte order)
+   bool bCompressed;    // zlib; decoded bytes are not peak values
+};
+
+// Text between the first cStart after tPos and the following szEnd; returns the
+// position after szEnd, or string::npos.
+static size_t ElementText(const string &strFile,
+                          size_t tPos,
+                          char cStart,
+                          const char *szEnd,
+                          string *pstrText)
+{
+   size_t tStart = strFile.find(cStart, tPos);
+   if (tStart == string::npos)
+      return string::npos;
+
+   size_t tEnd = strFile.find(szEnd, tStart);
+   if (tEnd == string::npos)
+      return string::npos;
+
+   pstrText->assign(strFile, tStart + 1, tEnd - tStart - 1);
+   return tEnd + strlen(szEnd);
+}
+
+
+static void FindMzMLArrays(const string &strFile,
+                           vector<PeakArray> *pvArrays)
+{
+   size_t tPos = 0;
+
+   while ((tPos = strFile.find("<binaryDataArray ", tPos)) != string::npos)
+   {
+      size_t tEnd = strFile.find("</binaryDataArray>", tPos);
+      if (tEnd == string::npos)
+         break;
+
+      string strArray(strFile, tPos, tEnd - tPos);
+      size_t tBinary = strArray.find("<binary>");
+      PeakArray array;
+
+      array.iWidth = (strArray.find("MS:1000521") != string::npos ? 4 : 8);   // 32-bit float, else 64-bit
+      array.bNet = false;
+      array.bCompressed = (strArray.find("MS:1000574") != string::npos);     // zlib compression
+
+      if (tBinary != string::npos && ElementText(strArray, tBinary, '>', "</binary>", &array.strBase64) != string::npos)
+         pvArrays->push_back(array);
+
+      tPos = tEnd;
+   }
+}
+
+
+static void FindMzXMLArrays(const string &strFile,
+                            vector<PeakArray> *pvArrays)
+{
+   size_t tPos = 0;
+
+   while ((tPos = strFile.find("<peaks ", tPos)) != string::npos)
+   {
+      size_t tTagEnd = strFile.find('>', tPos);
+      if (tTagEnd == string::npos)
+         break;
+
+      string strTag(strFile, tPos, tTagEnd - tPos);
+      PeakArray array;
+
+      array.iWidth = (strTag.find("precision=\"64\"") != string::npos ? 8 : 4);
+      array.bNet = (strTag.find("byteOrder=\"network\"") != string::npos);
+      array.bCompressed = (strTag.find("compressionType=\"zlib\"") != string::npos);
+
+      tPos = ElementText(strFile, tPos, '>', "</peaks>", &array.strBase64);
+      if (tPos == string::npos)
+         break;
+
+      pvArrays->push_back(array);
+   }
+}
+
+
+// Decoded bytes to peak values as the mzML and mzXML handlers do.
+static void BytesToDoubles(const char *pBytes,
+                           int iCount,
+                           int iWidth,
+                           bool bNet,
+                           double *pdValues)
+{
+#ifdef OSX
+   bool bSwap = !bNet;
+#else
+   bool bSwap = bNet;
+#endif
+
+   for (int i=0; i<iCount; i++)
+   {
+      unsigned char pucValue[8];
+
+      for (int ii=0; ii<iWidth; ii++)
+         pucValue[ii] = (unsigned char)pBytes[i*iWidth + (bSwap ? iWidth - 1 - ii : ii)];
+
+      if (iWidth == 4)
+      {
+         float fValue;
+         memcpy(&fValue, pucValue, 4);
+         pdValues[i] = fValue;
+      }
+      else
+         memcpy(&pdValues[i], pucValue, 8);
+   }
+}
+
+
+// Decode every array with both paths; returns false at the first difference.
+static bool CompareArrays(const char *szFile,
+                          const vector<PeakArray> &vArrays)
+{
+   for (size_t i=0; i<vArrays.size(); i++)
+   {
+      const PeakArray &array = vArrays[i];
+      size_t tSize = array.strBase64.size() / 4 * 3;
+      vector<char> vScalar(tSize + 1);
+      vector<char> vSimd(tSize + 1);
+
+      int iScalar = mzParser::b64_decode_mio_scalar(vScalar.data(), array.strBase64.c_str(), tSize);
+      int iSimd = mzParser::b64_decode_mio(vSimd.data(), array.strBase64.c_str(), tSize);
+
+      if (iScalar != iSimd || memcmp(vScalar.data(), vSimd.data(), iScalar))
+      {
+         printf(" Error - %s array %d: base64 decoding differs\n", szFile, (int)i);
+         return false;
+      }
+
+      if (array.bCompressed)
+         continue;
+
+      int iCount = iScalar / array.iWidth;
+      vector<double> vdScalar(iCount);
+      vector<double> vdSimd(iCount + 1);
+
+      BytesToDoubles(vScalar.data(), iCount, array.iWidth, array.bNet, vdScalar.data());
+      int iDecoded = mzParser::b64_decode_doubles(vdSimd.data(), iCount, array.strBase64.c_str(),
+            array.strBase64.size(), array.iWidth, array.bNet);
+
+      if (iDecoded != iCount || memcmp(vdScalar.data(), vdSimd.data(), sizeof(double) * iCount))
+      {
+         printf(" Error - %s array %d: peak values differ\n", szFile, (int)i);
+         return false;
+      }
+   }
+
+   return true;
+}
+
+
+// Decode all arrays to peak values iNumPasses times; returns MB of base64 text per second.
+static double TimeDecode(const vector<PeakArray> &vArrays,
+                         int iNumPasses,
+                         bool bSimd)
+{
+   vector<char> vBytes;
+   vector<double> vdValues;
+   size_t tTotal = 0;
+
+   auto tStart = std::chrono::steady_clock::now();
+
+   for (int iPass=0; iPass<iNumPasses; iPass++)
+   {
+      for (size_t i=0; i<vArrays.size(); i++)
+      {
+         const PeakArray &array = vArrays[i];
+         size_t tSize = array.strBase64.size() / 4 * 3;
+         int iCount = (int)(tSize / array.iWidth);
+
+         vBytes.resize(tSize + 1);
+         vdValues.resize(iCount + 1);
+         tTotal += array.strBase64.size();
+
+         if (array.bCompressed)
+         {
+            if (bSimd)
+               mzParser::b64_decode_mio(vBytes.data(), array.strBase64.c_str(), tSize);
+            else
+               mzParser::b64_decode_mio_scalar(vBytes.data(), array.strBase64.c_str(), tSize);
+         }
+         else if (bSimd)
+         {
+            mzParser::b64_decode_doubles(vdValues.data(), iCount, array.strBase64.c_str(),
+                  array.strBase64.size(), array.iWidth, array.bNet);
+         }
+         else
+         {
+            int iLen = mzParser::b64_decode_mio_scalar(vBytes.data(), array.strBase64.c_str(), tSize);
+            BytesToDoubles(vBytes.data(), iLen / array.iWidth, array.iWidth, array.bNet, vdValues.data());
+         }
+      }
+   }
+
+   double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+
+   return tTotal / 1048576.0 / dSeconds;
+}
+
+
+int main(int argc, char *argv[])
+{
+   const int iNumPasses = 10;
+   bool bSame = true;
+
+   if (argc < 2)
+   {
+      printf(" Usage:  peak_decode.exe file.mzML|file.mzXML ...\n");
+      return 1;
+   }
+
+   printf(" %-24s %8s %12s %10s\n", "file", "arrays", "scalar", "SIMD");
+
+   for (int iFile=1; iFile<argc; iFile++)
+   {
+      FILE *fp = fopen(argv[iFile], "rb");
+      string strFile;
+      vector<PeakArray> vArrays;
+      char szBuf[65536];
+      size_t tRead;
+
+      if (fp == NULL)
+      {
+         printf(" Error - cannot read %s\n", argv[iFile]);
+         return 1;
+      }
+      while ((tRead = fread(szBuf, 1, sizeof(szBuf), fp)) > 0)
+         strFile.append(szBuf, tRead);
+      fclose(fp);
+
+      if (strFile.find("<mzXML") != string::npos)
+         FindMzXMLArrays(strFile, &vArrays);
+      else
+         FindMzMLArrays(strFile, &vArrays);
+
+      const char *szName = strrchr(argv[iFile], '/');
+      szName = (szName != NULL ? szName + 1 : argv[iFile]);
+
+      if (!CompareArrays(szName, vArrays))
+      {
+         bSame = false;
+         continue;
+      }
+
+      printf(" %-24s %8d %7.0f MB/s %5.0f MB/s\n", szName, (int)vArrays.size(),
+            TimeDecode(vArrays, iNumPasses, false), TimeDecode(vArrays, iNumPasses, true));
+   }
+
+   return (bSame ? 0 : 1);
+}
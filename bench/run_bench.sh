@@ -0,0 +1,193 @@
+#!/bin/bash
+# Benchmarks for comet.exe and kernels of CometSearch.  Run "make bench" from the
+# top directory, or
+#    bench/run_bench.sh path/to/comet.exe [benchmark ...]
+# Each benchmark prints its timings for comparison between builds and fails only
+# when the code paths it times give different results.
+
+COMET=${1:-./comet.exe}
+COMET=$(cd "$(dirname "$COMET")" && pwd)/$(basename "$COMET")
+shift
+BENCH=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d)
+[ -n "$KEEP" ] || trap 'rm -rf "$WORK"' EXIT
+
+# make_data: writes the synthetic $WORK/bench.fasta and bench.ms2 once
+make_data()
+{
+   [ -f "$WORK/bench.fasta" ] || python3 "$BENCH/make_bench_data.py" "$WORK" 5000 1000
+}
+
+# make_params <name> [parameter=value ...]
+# Writes $WORK/<name>.params: the default parameters searching bench.fasta on all
+# cores, plus the given overrides.
+make_params()
+{
+   local name=$1
+   shift
+   local settings=("database_name=$WORK/bench.fasta" "num_threads=0" "$@")
+   local sedargs=()
+   local kv
+
+   [ -f "$WORK/comet.params.new" ] || (cd "$WORK" && "$COMET" -p > /dev/null)
+   for kv in "${settings[@]}"
+   do
+      sedargs+=(-e "s|^${kv%%=*} *=.*|${kv%%=*} = ${kv#*=}|")
+   done
+   sed "${sedargs[@]}" "$WORK/comet.params.new" > "$WORK/$name.params"
+}
+
+# timed <label> <command ...>: runs the command and prints its wall clock time
+timed()
+{
+   local label=$1
+   shift
+   local start=$(date +%s.%N)
+
+   "$@" || return 1
+   awk -v label="$label" -v start=$start -v end=$(date +%s.%N) \
+       'BEGIN { printf "   %-28s %8.2f s\n", label, end - start }'
+}
+
+# timed_best <label> <runs> <command ...>: runs the command <runs> times and prints
+# the fastest wall clock time
+timed_best()
+{
+   local label=$1
+   local runs=$2
+   shift 2
+   local times=()
+   local i
+
+   for ((i = 0; i < runs; i++))
+   do
+      local start=$(date +%s.%N)
+      "$@" || return 1
+      times+=($(awk -v start=$start -v end=$(date +%s.%N) 'BEGIN { print end - start }'))
+   done
+   printf "%s\n" "${times[@]}" | sort -g | head -1 | \
+      awk -v label="$label" -v runs=$runs '{ printf "   %-28s %8.2f s (best of %d)\n", label, $1, runs }'
+}
+
+# search <name> [comet option ...]: runs comet with $WORK/<name>.params on bench.ms2;
+# results are $WORK/<name>.pep.xml
+search()
+{
+   local name=$1
+   shift
+   if ! (cd "$WORK" && "$COMET" -P"$name.params" -N"$name" "$@" bench.ms2 > "$name.log" 2>&1)
+   then
+      echo "   comet failed for $name:"
+      cat "$WORK/$name.log"
+      return 1
+   fi
+}
+
+# create_index <name>: runs "comet -i" with $WORK/<name>.params, creating bench.fasta.idx
+create_index()
+{
+   rm -f "$WORK/bench.fasta.idx"
+   if ! (cd "$WORK" && "$COMET" -P"$1.params" -i > "$1.log" 2>&1)
+   then
+      echo "   comet -i failed for $1:"
+      cat "$WORK/$1.log"
+      return 1
+   fi
+}
+
+# evict <file ...>: drops the files from the page cache so that they are read cold.
+# Needs GNU dd, and TMPDIR on a disk rather than in memory.
+evict()
+{
+   sync
+   local f
+   for f in "$@"
+   do
+      dd if="$f" iflag=nocache count=0 status=none
+   done
+}
+
+# same_results <name> <name>: compares two pep.xml results, ignoring dates and paths
+same_results()
+{
+   if ! diff <(grep -v "date=\|$1\|CometVersion" "$WORK/$1.pep.xml") \
+             <(grep -v "date=\|$2\|CometVersion" "$WORK/$2.pep.xml") > /dev/null
+   then
+      echo "   results of $1 and $2 differ"
+      return 1
+   fi
+}
+
+# Sparse matrix lookups of the xcorr fragment ion sums against the "flat_xcorr" kernels.
+bench_xcorr_kernels()
+{
+   "$BENCH/xcorr_kernels.exe"
+}
+
+# Base64 decoding of the mzML and mzXML peak arrays, scalar against SIMD; the decoded
+# bytes and peak values must be identical.
+bench_peak_decode()
+{
+   make_data
+   "$BENCH/peak_decode.exe" "$WORK/bench.mzML" "$WORK/bench.mzXML"
+}
+
+# Decoding of the packed .idx columns of "index_compress = 1" at load time: a single
+# spectrum search is mostly loading the index, so it is timed with a raw and a packed
+# .idx of the same database with a warm cache.  All spectra must give the same results.
+bench_index_decode()
+{
+   local compress
+
+   make_data
+   for compress in 0 1
+   do
+      make_params index_build_$compress "index_compress=$compress"
+      make_params index_search_$compress "database_name=$WORK/bench.fasta.idx"
+
+      timed "create .idx, index_compress=$compress" create_index index_build_$compress || return 1
+      echo "   .idx size                    $(($(wc -c < "$WORK/bench.fasta.idx") / 1048576)) MB"
+      timed_best "1 spectrum, index_compress=$compress" 3 search index_search_$compress -F1 -L1 || return 1
+      search index_search_$compress || return 1
+   done
+
+   same_results index_search_0 index_search_1
+}
+
+# Searches of a memory mapped .idx index, first with the index and database evicted
+# from the page cache and then with both cached.
+bench_index_search()
+{
+   make_data
+   make_params index_build
+   make_params index_search "database_name=$WORK/bench.fasta.idx"
+
+   timed "create .idx" create_index index_build || return 1
+   evict "$WORK/bench.fasta.idx" "$WORK/bench.fasta"
+   timed "search .idx, cold cache" search index_search || return 1
+   mv "$WORK/index_search.pep.xml" "$WORK/index_cold.pep.xml"
+   timed "search .idx, warm cache" search index_search || return 1
+   mv "$WORK/index_search.pep.xml" "$WORK/index_warm.pep.xml"
+
+   same_results index_cold index_warm
+}
+
+BENCHMARKS=("$@")
+if [ ${#BENCHMARKS[@]} -eq 0 ]
+then
+   BENCHMARKS=($(declare -F | awk '$3 ~ /^bench_/ { print substr($3, 7) }'))
+fi
+
+NUMFAILED=0
+for b in "${BENCHMARKS[@]}"
+do
+   echo "== $b"
+   if ! bench_$b
+   then
+      echo "FAIL $b"
+      NUMFAILED=$((NUMFAILED + 1))
+   fi
+done
+
+echo "${#BENCHMARKS[@]} benchmarks, $NUMFAILED failed"
+[ $NUMFAILED -eq 0 ]
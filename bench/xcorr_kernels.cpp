@@ -0,0 +1,244 @@
+// Times the fragment ion sums of xcorr scoring: the sparse matrix lookups of
+// XcorrScore() against each "flat_xcorr" kernel of CometSearch on the same data, and
+// against the kernel SelectFlatXcorrKernel() picks for the bin width.
+//    xcorr_kernels.exe [number of candidates]
+// A synthetic fast xcorr array is built for bin widths from low to high resolution
+// and the b/y ion bins of random tryptic-sized peptides are summed from it.  The
+// data only depend on a fixed seed so runs are comparable.
+
+#include "Common.h"
+#include "CometDataInternal.h"
+#include "CometSearch.h"
+#include <chrono>
+#include <random>
+
+struct XcorrData
+{
+   int iArraySize;
+   int iSparseSize;
+   float **ppfSparse;
+   float *pfFlat;
+   vector<unsigned int> vuiBins;        // ion bins of all candidates, back to back
+   vector<int> viNumBins;               // number of bins of each candidate
+};
+
+static volatile double g_dSink;        // keeps the timed sums from being optimized away
+
+static const double dAAMass[] = { 57.02146, 71.03711, 87.03203, 97.05276, 99.06841, 101.04768, 160.03065,
+                                  113.08406, 114.04293, 115.02694, 128.05858, 128.09496, 129.04259, 131.04049,
+                                  137.05891, 147.06841, 156.10111, 163.06333, 186.07931 };
+
+// Fill a fast xcorr array of peaks spread over 150 to 2000 m/z, as many nonzero bins as
+// preprocessing leaves around each peak, and peptides of 7 to 25 residues with 1+ and 2+
+// b and y ions.
+static void CreateXcorrData(XcorrData *pData,
+                            double dBinWidth,
+                            int iNumCandidates,
+                            std::mt19937 &rng)
+{
+   std::uniform_real_distribution<double> dMz(150.0, 2000.0);
+   std::uniform_real_distribution<float> dIntensity(-10.0f, 50.0f);
+   std::uniform_int_distribution<int> dResidue(0, (int)(sizeof(dAAMass)/sizeof(dAAMass[0])) - 1);
+   std::uniform_int_distribution<int> dLength(7, 25);
+
+   pData->iArraySize = (int)(2100.0 / dBinWidth);
+   pData->iSparseSize = pData->iArraySize/SPARSE_MATRIX_SIZE + 1;
+   pData->ppfSparse = new float*[pData->iSparseSize]();
+   pData->pfFlat = (float *)comet_aligned_malloc(sizeof(float) * pData->iSparseSize * SPARSE_MATRIX_SIZE);
+   memset(pData->pfFlat, 0, sizeof(float) * pData->iSparseSize * SPARSE_MATRIX_SIZE);
+
+   for (int i=0; i<150; i++)
+   {
+      int iPeakBin = (int)(dMz(rng) / dBinWidth);
+      int iWidth = (int)(1.0 / dBinWidth) + 1;
+
+      for (int bin=iPeakBin-iWidth; bin<=iPeakBin+iWidth; bin++)
+      {
+         int x = bin / SPARSE_MATRIX_SIZE;
+
+         if (bin <= 0 || bin >= pData->iArraySize)
+            continue;
+
+         if (pData->ppfSparse[x] == NULL)
+            pData->ppfSparse[x] = new float[SPARSE_MATRIX_SIZE]();
+
+         pData->ppfSparse[x][bin - x*SPARSE_MATRIX_SIZE] = dIntensity(rng);
+      }
+   }
+
+   for (int x=0; x<pData->iSparseSize; x++)
+   {
+      if (pData->ppfSparse[x] != NULL)
+         memcpy(pData->pfFlat + x*SPARSE_MATRIX_SIZE, pData->ppfSparse[x], sizeof(float) * SPARSE_MATRIX_SIZE);
+   }
+
+   for (int i=0; i<iNumCandidates; i++)
+   {
+      int iLen = dLength(rng);
+      vector<double> vdResidues(iLen);
+      size_t tStart = pData->vuiBins.size();
+
+      for (int ii=0; ii<iLen; ii++)
+         vdResidues[ii] = dAAMass[dResidue(rng)];
+
+      for (int iCharge=1; iCharge<=2; iCharge++)
+      {
+         double dB = 0.0;
+         double dY = 18.010565;
+
+         for (int ii=0; ii<iLen-1; ii++)
+         {
+            dB += vdResidues[ii];
+            dY += vdResidues[iLen-1-ii];
+
+            int iBinB = (int)((dB + iCharge*1.00727646688) / iCharge / dBinWidth);
+            int iBinY = (int)((dY + iCharge*1.00727646688) / iCharge / dBinWidth);
+
+            pData->vuiBins.push_back(iBinB < pData->iArraySize ? iBinB : 0);
+            pData->vuiBins.push_back(iBinY < pData->iArraySize ? iBinY : 0);
+         }
+      }
+
+      pData->viNumBins.push_back((int)(pData->vuiBins.size() - tStart));
+   }
+}
+
+
+static void DeleteXcorrData(XcorrData *pData)
+{
+   for (int x=0; x<pData->iSparseSize; x++)
+      delete[] pData->ppfSparse[x];
+   delete[] pData->ppfSparse;
+   comet_aligned_free(pData->pfFlat);
+}
+
+
+// The fragment ion lookups of the sparse path in XcorrScore().
+static double SparseXcorrSum(float **ppSparseFastXcorrData,
+                             int iMax,
+                             const unsigned int *puiBins,
+                             int iCount)
+{
+   double dXcorr = 0.0;
+
+   for (int i=0; i<iCount; i++)
+   {
+      int bin = (int)puiBins[i];
+      int x = bin / SPARSE_MATRIX_SIZE;
+
+      if (bin <= 0 || x>iMax || ppSparseFastXcorrData[x]==NULL)
+         continue;
+
+      int y = bin - (x*SPARSE_MATRIX_SIZE);
+
+      dXcorr += ppSparseFastXcorrData[x][y];
+   }
+
+   return dXcorr;
+}
+
+
+// Run one kernel over all candidates iNumPasses times; returns ns per candidate and
+// the candidate sums of the last pass in pvdSums.
+template <typename Kernel>
+static double TimeKernel(const XcorrData &data,
+                         int iNumPasses,
+                         vector<double> *pvdSums,
+                         Kernel kernel)
+{
+   auto tStart = std::chrono::steady_clock::now();
+   double dTotal = 0.0;
+
+   for (int iPass=0; iPass<iNumPasses; iPass++)
+   {
+      const unsigned int *puiBins = data.vuiBins.data();
+
+      for (size_t i=0; i<data.viNumBins.size(); i++)
+      {
+         (*pvdSums)[i] = kernel(puiBins, data.viNumBins[i]);
+         dTotal += (*pvdSums)[i];
+         puiBins += data.viNumBins[i];
+      }
+   }
+
+   double dNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - tStart).count();
+
+   g_dSink = dTotal;
+
+   return dNs / ((double)iNumPasses * data.viNumBins.size());
+}
+
+
+int main(int argc, char *argv[])
+{
+   int iNumCandidates = (argc > 1 ? atoi(argv[1]) : 100000);
+   const int iNumPasses = 20;
+   const double pdBinWidths[] = { 1.0005079, 0.5, 0.2, 0.1, 0.05, 0.02, 0.01 };
+   const int piKernels[] = { CometSearch::FLAT_XCORR_SCALAR, CometSearch::FLAT_XCORR_AVX2, CometSearch::FLAT_XCORR_AVX512 };
+   const char *pszKernels[] = { "scalar", "avx2", "avx512" };
+   const int iNumKernels = (int)(sizeof(piKernels)/sizeof(piKernels[0]));
+   std::mt19937 rng(7);
+   bool bSame = true;
+
+   if (iNumCandidates <= 0)
+   {
+      printf(" Usage:  xcorr_kernels.exe [number of candidates]\n");
+      return 1;
+   }
+
+   printf(" %d candidates, %d passes; ns per candidate, - if this CPU lacks the kernel\n", iNumCandidates, iNumPasses);
+   printf(" %-10s %10s", "bin width", "sparse");
+   for (int k=0; k<iNumKernels; k++)
+      printf(" %10s", pszKernels[k]);
+   printf(" %10s\n", "flat_xcorr");
+
+   for (size_t iWidth=0; iWidth<sizeof(pdBinWidths)/sizeof(pdBinWidths[0]); iWidth++)
+   {
+      XcorrData data;
+      vector<double> vdSparse(iNumCandidates);
+      vector<double> vdFlat(iNumCandidates);
+
+      CreateXcorrData(&data, pdBinWidths[iWidth], iNumCandidates, rng);
+
+      int iMax = data.iArraySize/SPARSE_MATRIX_SIZE;
+      float **ppfSparse = data.ppfSparse;
+      const float *pfFlat = data.pfFlat;
+
+      double dSparse = TimeKernel(data, iNumPasses, &vdSparse,
+            [=](const unsigned int *puiBins, int iCount) { return SparseXcorrSum(ppfSparse, iMax, puiBins, iCount); });
+
+      printf(" %-10g %10.1f", pdBinWidths[iWidth], dSparse);
+
+      // bin 0 is never set, so every kernel must find the same sums up to rounding;
+      // the scalar kernel adds in the same order as the sparse path so exactly the same
+      for (int k=0; k<=iNumKernels; k++)
+      {
+         if (k < iNumKernels && !CometSearch::SetFlatXcorrKernel(piKernels[k]))
+         {
+            printf(" %10s", "-");
+            continue;
+         }
+         if (k == iNumKernels)
+            CometSearch::SelectFlatXcorrKernel(pdBinWidths[iWidth]);
+
+         printf(" %10.1f", TimeKernel(data, iNumPasses, &vdFlat,
+               [=](const unsigned int *puiBins, int iCount) { return CometSearch::FlatXcorrSum(pfFlat, puiBins, iCount); }));
+
+         for (int i=0; i<iNumCandidates; i++)
+         {
+            if ((k == 0 && vdFlat[i] != vdSparse[i]) || fabs(vdFlat[i] - vdSparse[i]) > 1e-4 * (1.0 + fabs(vdSparse[i])))
+            {
+               printf("\n Error - candidate %d: sparse %f, %s %f\n", i, vdSparse[i],
+                     (k < iNumKernels ? pszKernels[k] : "flat_xcorr"), vdFlat[i]);
+               bSame = false;
+               break;
+            }
+         }
+      }
+      printf("\n");
+
+      DeleteXcorrData(&data);
+   }
+
+   return (bSame ? 0 : 1);
+}
@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+# Writes the synthetic FASTA database and MS2 spectra used by run_tests.sh:
+# random proteins, and for tryptic peptides of the first proteins a spectrum
+# holding their b/y ions (with a little mass error) plus random noise peaks.
+# test.peff holds the same proteins with VariantSimple annotations, and
+# test_peff.ms2 spectra of tryptic peptides carrying one of those variants.
+# test.mzML and test.mzXML repeat the spectra of test.ms2.
+# The output is deterministic; rerun only to change the test data.
+import base64
+import os
+import random
+import struct
+import zlib
+
+random.seed(7)
+AA = "ACDEFGHIKLMNPQRSTVWY"
+MONO = {'G':57.02146, 'A':71.03711, 'S':87.03203, 'P':97.05276, 'V':99.06841, 'T':101.04768,
+        'C':103.00919+57.021464, 'L':113.08406, 'I':113.08406, 'N':114.04293, 'D':115.02694,
+        'Q':128.05858, 'K':128.09496, 'E':129.04259, 'M':131.04049, 'H':137.05891, 'F':147.06841,
+        'R':156.10111, 'Y':163.06333, 'W':186.07931}
+H2O = 18.010565
+PROTON = 1.00727646688
+NUM_PROTEINS = 400
+NUM_SPECTRA = 120
+NUM_VARIANT_PROTEINS = 40
+NUM_VARIANT_SPECTRA = 60
+
+here = os.path.dirname(os.path.abspath(__file__))
+
+proteins = []
+with open(os.path.join(here, "test.fasta"), "w") as f:
+    for i in range(NUM_PROTEINS):
+        seq = "".join(random.choice(AA) for _ in range(random.randint(50, 400)))
+        proteins.append(seq)
+        f.write(">sp|T%05d|TEST%d_HUMAN test protein %d OS=Homo sapiens\n" % (i, i, i))
+        for j in range(0, len(seq), 60):
+            f.write(seq[j:j+60] + "\n")
+
+peptides = []
+for seq in proteins[:80]:
+    cur = ""
+    for c in seq:
+        cur += c
+        if c in "KR":
+            if 7 <= len(cur) <= 25:
+                peptides.append(cur)
+            cur = ""
+random.shuffle(peptides)
+
+def write_ms2(path, peptides, rng):
+    with open(path, "w") as f:
+        f.write("H\tCreationDate\tsynthetic\n")
+        for scan, pep in enumerate(peptides, 1):
+            mass = sum(MONO[c] for c in pep) + H2O
+            z = rng.choice([2, 3])
+            ions = []
+            b = PROTON
+            for c in pep[:-1]:
+                b += MONO[c]
+                ions.append(b)
+            y = H2O + PROTON
+            for c in reversed(pep[1:]):
+                y += MONO[c]
+                ions.append(y)
+            ions += [rng.uniform(150, mass) for _ in range(40)]
+            f.write("S\t%d\t%d\t%.5f\n" % (scan, scan, (mass + z*PROTON) / z))
+            f.write("Z\t%d\t%.5f\n" % (z, mass + PROTON))
+            for mz in sorted(ions):
+                f.write("%.4f %.1f\n" % (mz + rng.gauss(0, 0.005), rng.uniform(100, 1000)))
+
+write_ms2(os.path.join(here, "test.ms2"), peptides[:NUM_SPECTRA], random)
+
+# PEFF variants use their own generator so the files above do not change.
+rng = random.Random(11)
+variant_peptides = []
+with open(os.path.join(here, "test.peff"), "w") as f:
+    for i, seq in enumerate(proteins):
+        variants = []
+        if i < NUM_VARIANT_PROTEINS:
+            for pos in sorted(rng.sample(range(1, len(seq)), 3)):
+                variants.append((pos, rng.choice([c for c in AA if c != seq[pos]])))
+        f.write(">nxp:T%05d \\PName=test protein %d" % (i, i))
+        if variants:
+            f.write(" \\VariantSimple=" + "".join("(%d|%s)" % (pos + 1, c) for pos, c in variants))
+        f.write("\n")
+        for j in range(0, len(seq), 60):
+            f.write(seq[j:j+60] + "\n")
+
+        # tryptic peptide of the protein with one variant in place, holding the variant
+        for pos, c in variants:
+            var = seq[:pos] + c + seq[pos+1:]
+            start = pos
+            while start > 0 and var[start-1] not in "KR":
+                start -= 1
+            end = pos
+            while end < len(var) - 1 and var[end] not in "KR":
+                end += 1
+            if 7 <= end - start + 1 <= 25:
+                variant_peptides.append(var[start:end+1])
+
+write_ms2(os.path.join(here, "test_peff.ms2"), variant_peptides[:NUM_VARIANT_SPECTRA], rng)
+
+with open(os.path.join(here, "test.obo"), "w") as f:
+    f.write("format-version: 1.2\n\n[Term]\nid: MOD:00719\nname: L-methionine sulfoxide\n")
+    f.write("xref: DiffAvg: \"16.00\"\nxref: DiffMono: \"15.994915\"\n")
+
+# test.mzML and test.mzXML hold the spectra of test.ms2, whose peaks Comet decodes on
+# its preprocessing threads: zlib compressed 64-bit m/z with 32-bit intensities in
+# mzML, uncompressed 32-bit network order pairs in mzXML.
+spectra = []
+with open(os.path.join(here, "test.ms2")) as f:
+    for line in f:
+        fields = line.split()
+        if fields[0] == "S":
+            spectra.append([int(fields[1]), float(fields[3]), 0, []])
+        elif fields[0] == "Z":
+            spectra[-1][2] = int(fields[1])
+        elif fields[0] != "H":
+            spectra[-1][3].append((float(fields[0]), float(fields[1])))
+
+def b64(data):
+    return base64.b64encode(data).decode()
+
+# MSToolkit reads mzML and mzXML through their index of byte offsets
+mzml = ['<?xml version="1.0" encoding="utf-8"?>\n',
+        '<indexedmzML xmlns="http://psi.hupo.org/ms/mzml">\n',
+        '<mzML xmlns="http://psi.hupo.org/ms/mzml" version="1.1.0">\n',
+        ' <run id="test">\n  <spectrumList count="%d">\n' % len(spectra)]
+offsets = []
+for i, (scan, mz, z, peaks) in enumerate(spectra):
+    offsets.append((scan, len("".join(mzml)) + 3))
+    mzs = zlib.compress(struct.pack("<%dd" % len(peaks), *[p[0] for p in peaks]))
+    intens = zlib.compress(struct.pack("<%df" % len(peaks), *[p[1] for p in peaks]))
+    mzml.append('   <spectrum index="%d" id="scan=%d" defaultArrayLength="%d">\n' % (i, scan, len(peaks)))
+    mzml.append('    <cvParam cvRef="MS" accession="MS:1000511" name="ms level" value="2"/>\n')
+    mzml.append('    <cvParam cvRef="MS" accession="MS:1000127" name="centroid spectrum" value=""/>\n')
+    mzml.append('    <precursorList count="1">\n     <precursor>\n')
+    mzml.append('      <selectedIonList count="1">\n       <selectedIon>\n')
+    mzml.append('        <cvParam cvRef="MS" accession="MS:1000744" name="selected ion m/z" value="%.5f"/>\n' % mz)
+    mzml.append('        <cvParam cvRef="MS" accession="MS:1000041" name="charge state" value="%d"/>\n' % z)
+    mzml.append('       </selectedIon>\n      </selectedIonList>\n')
+    mzml.append('      <activation>\n')
+    mzml.append('       <cvParam cvRef="MS" accession="MS:1000133" name="collision-induced dissociation" value=""/>\n')
+    mzml.append('      </activation>\n     </precursor>\n    </precursorList>\n')
+    mzml.append('    <binaryDataArrayList count="2">\n')
+    for data, precision, array in ((mzs, ("MS:1000523", "64-bit float"), ("MS:1000514", "m/z array")),
+                                   (intens, ("MS:1000521", "32-bit float"), ("MS:1000515", "intensity array"))):
+        mzml.append('     <binaryDataArray encodedLength="%d">\n' % len(b64(data)))
+        mzml.append('      <cvParam cvRef="MS" accession="%s" name="%s" value=""/>\n' % precision)
+        mzml.append('      <cvParam cvRef="MS" accession="MS:1000574" name="zlib compression" value=""/>\n')
+        mzml.append('      <cvParam cvRef="MS" accession="%s" name="%s" value=""/>\n' % array)
+        mzml.append('      <binary>%s</binary>\n     </binaryDataArray>\n' % b64(data))
+    mzml.append('    </binaryDataArrayList>\n   </spectrum>\n')
+mzml.append('  </spectrumList>\n </run>\n</mzML>\n')
+index_offset = len("".join(mzml))
+mzml.append('<indexList count="1">\n <index name="spectrum">\n')
+mzml += ['  <offset idRef="scan=%d">%d</offset>\n' % o for o in offsets]
+mzml.append(' </index>\n</indexList>\n<indexListOffset>%d</indexListOffset>\n</indexedmzML>\n' % index_offset)
+with open(os.path.join(here, "test.mzML"), "w") as f:
+    f.write("".join(mzml))
+
+mzxml = ['<?xml version="1.0" encoding="ISO-8859-1"?>\n',
+         '<mzXML xmlns="http://sashimi.sourceforge.net/schema_revision/mzXML_3.2">\n',
+         ' <msRun scanCount="%d">\n' % len(spectra)]
+offsets = []
+for scan, mz, z, peaks in spectra:
+    offsets.append((scan, len("".join(mzxml)) + 2))
+    data = struct.pack(">%df" % (2 * len(peaks)), *[v for p in peaks for v in p])
+    mzxml.append('  <scan num="%d" msLevel="2" peaksCount="%d" centroided="1">\n' % (scan, len(peaks)))
+    mzxml.append('   <precursorMz precursorCharge="%d" activationMethod="CID">%.5f</precursorMz>\n' % (z, mz))
+    mzxml.append('   <peaks precision="32" byteOrder="network" contentType="m/z-int" compressionType="none"'
+                 ' compressedLen="0">%s</peaks>\n  </scan>\n' % b64(data))
+mzxml.append(' </msRun>\n')
+index_offset = len("".join(mzxml)) + 1
+mzxml.append(' <index name="scan">\n')
+mzxml += ['  <offset id="%d">%d</offset>\n' % o for o in offsets]
+mzxml.append(' </index>\n <indexOffset>%d</indexOffset>\n</mzXML>\n' % index_offset)
+with open(os.path.join(here, "test.mzXML"), "w") as f:
+    f.write("".join(mzxml))
@@ -0,0 +1,505 @@
+#!/bin/bash
+# Regression tests for comet.exe.  Run "make test" from the top directory, or
+#    tests/run_tests.sh path/to/comet.exe [test ...]
+# Each test searches the synthetic data in tests/data (see make_test_data.py) with
+# parameter files derived from "comet.exe -p" and checks that two configurations
+# which must agree produce the same results, or that results match those recorded
+# in tests/data.
+
+COMET=${1:-./comet.exe}
+COMET=$(cd "$(dirname "$COMET")" && pwd)/$(basename "$COMET")
+shift
+DATA=$(cd "$(dirname "$0")/data" && pwd)
+WORK=$(mktemp -d)
+[ -n "$KEEP" ] || trap 'rm -rf "$WORK"' EXIT
+
+(cd "$WORK" && "$COMET" -p > /dev/null) || { echo "cannot run $COMET"; exit 1; }
+
+# make_params <name> [parameter=value ...]
+# Writes $WORK/<name>.params: the default parameters searching test.fasta with
+# concatenated decoys on 2 threads, plus the given overrides.
+make_params()
+{
+   local name=$1
+   shift
+   local settings=("database_name=$DATA/test.fasta" "decoy_search=1" "num_threads=2" \
+                   "output_txtfile=1" "output_pepxmlfile=1" "$@")
+   local sedargs=()
+   local kv
+
+   for kv in "${settings[@]}"
+   do
+      sedargs+=(-e "s|^${kv%%=*} *=.*|${kv%%=*} = ${kv#*=}|")
+   done
+   sed "${sedargs[@]}" "$WORK/comet.params.new" > "$WORK/$name.params"
+}
+
+# search <name> <input file in tests/data or $WORK>
+# Runs comet with $WORK/<name>.params; results are $WORK/<name>.txt and .pep.xml.
+search()
+{
+   local input="$DATA/$2"
+
+   [ -f "$input" ] || input="$WORK/$2"
+   if ! (cd "$WORK" && "$COMET" -P"$1.params" -N"$1" "$input" > "$1.log" 2>&1)
+   then
+      echo "   comet failed for $1:"
+      cat "$WORK/$1.log"
+      return 1
+   fi
+}
+
+# create_index <name>
+# Runs "comet -i" with $WORK/<name>.params to write the .idx of its database.
+create_index()
+{
+   if ! (cd "$WORK" && "$COMET" -P"$1.params" -i > "$1.log" 2>&1)
+   then
+      echo "   comet -i failed for $1:"
+      cat "$WORK/$1.log"
+      return 1
+   fi
+}
+
+# txt_results <name>: the .txt results without the header line (version, date, paths)
+txt_results()
+{
+   tail -n +2 "$WORK/$1.txt"
+}
+
+# top_hits <name>: "scan.charge peptide e-value" of each spectrum's top hit
+top_hits()
+{
+   awk -F'\t' 'NR > 2 && $2 == 1 { print $1 "." $3, $12, $6 }' "$WORK/$1.txt" | sort
+}
+
+# scored_hits <name>: "scan num charge e-value xcorr sp ions_matched peptide" of
+# each result, the columns that depend on how the spectrum was preprocessed
+scored_hits()
+{
+   awk -F'\t' 'NR > 2 { print $1, $2, $3, $6, $7, $9, $10, $12 }' "$WORK/$1.txt"
+}
+
+# matched_counts <name>: "scan num_matched_peptides" for each spectrum with a hit
+matched_counts()
+{
+   awk -F'"' '/<spectrum_query / { for (i=1; i<NF; i++) if ($i ~ /start_scan=$/) s = $(i+1); h = 1 }
+              /<search_hit / && h { for (i=1; i<NF; i++) if ($i ~ /num_matched_peptides=$/) print s, $(i+1); h = 0 }' \
+        "$WORK/$1.pep.xml" | sort
+}
+
+# The fragment ion index only decides which candidates get an xcorr.  When it lets
+# every candidate through, results including E-values are those of a normal search;
+# when it filters, rejected candidates must still be counted, and the E-values of
+# top hits found by both searches must stay within a factor of 3.
+test_fragindex_evalues()
+{
+   make_params frag_off "fragindex_search=0"
+   make_params frag_all "fragindex_search=1" "fragindex_min_ions_score=0"
+   make_params frag_filter "fragindex_search=1"
+   search frag_off test.ms2 && search frag_all test.ms2 && search frag_filter test.ms2 || return 1
+
+   if ! diff <(txt_results frag_off) <(txt_results frag_all) > /dev/null
+   then
+      echo "   results with every candidate passing the fragment index differ from fragindex_search=0"
+      return 1
+   fi
+   # Spectra whose candidates are all rejected have no hit to report a count with.
+   join <(matched_counts frag_off) <(matched_counts frag_filter) | awk '$2 != $3' > "$WORK/frag.diff"
+   if [ -s "$WORK/frag.diff" ]
+   then
+      echo "   num_matched_peptides changes when the fragment index filters candidates (scan, expected, found):"
+      head "$WORK/frag.diff"
+      return 1
+   fi
+   join <(top_hits frag_off) <(top_hits frag_filter) \
+        | awk '$2 == $4 { d = log($3 / $5) / log(10); if (d > 0.5 || d < -0.5) print }' > "$WORK/frag.diff"
+   if [ -s "$WORK/frag.diff" ]
+   then
+      echo "   E-values change when the fragment index filters candidates (spectrum, peptide, expected, found):"
+      head "$WORK/frag.diff" | awk '{ print "  ", $1, $2, $3, $5 }'
+      return 1
+   fi
+}
+
+# thread_local_scoring only changes how the threads share the stored results, so
+# results must not change, also when few results are kept and with separate decoys.
+test_thread_local_scoring()
+{
+   local decoy
+
+   for decoy in 1 2
+   do
+      make_params shared_$decoy "thread_local_scoring=0" "decoy_search=$decoy" "num_results=5"
+      make_params local_$decoy "thread_local_scoring=1" "decoy_search=$decoy" "num_results=5"
+      search shared_$decoy test.ms2 && search local_$decoy test.ms2 || return 1
+
+      if ! diff <(txt_results shared_$decoy) <(txt_results local_$decoy) > /dev/null
+      then
+         echo "   results with thread_local_scoring=1 differ from thread_local_scoring=0 (decoy_search=$decoy)"
+         return 1
+      fi
+   done
+}
+
+# PEFF variant peptides are scored with the variant residue put into the protein
+# sequence in place; candidates buffered by thread_local_scoring must keep it.
+test_thread_local_scoring_peff()
+{
+   local peff=("database_name=$DATA/test.peff" "peff_format=1" "peff_obo=$DATA/test.obo" "num_results=5")
+
+   make_params peff_shared "thread_local_scoring=0" "${peff[@]}"
+   make_params peff_local "thread_local_scoring=1" "${peff[@]}"
+   search peff_shared test_peff.ms2 && search peff_local test_peff.ms2 || return 1
+
+   if ! awk -F'\t' 'NR > 2 && $19 ~ /_p_/ { found = 1 } END { exit !found }' "$WORK/peff_shared.txt"
+   then
+      echo "   no PEFF variant peptides were reported"
+      return 1
+   fi
+
+   if ! diff <(txt_results peff_shared) <(txt_results peff_local) > /dev/null
+   then
+      echo "   PEFF variant results with thread_local_scoring=1 differ from thread_local_scoring=0"
+      return 1
+   fi
+}
+
+# flat_xcorr only changes how the fast xcorr data are stored and summed.  Its vector
+# kernels add in a different order than the sparse path, which moves a double sum by
+# a few ulps at most, far below the precision of the float xcorr that is reported.
+test_flat_xcorr()
+{
+   local bins
+
+   for bins in "fragment_bin_tol=1.0005" "fragment_bin_tol=0.02 fragment_bin_offset=0.0"
+   do
+      make_params sparse_xcorr "flat_xcorr=0" $bins
+      make_params flat_xcorr "flat_xcorr=1" $bins
+      search sparse_xcorr test.ms2 && search flat_xcorr test.ms2 || return 1
+
+      if ! diff <(txt_results sparse_xcorr) <(txt_results flat_xcorr) > /dev/null
+      then
+         echo "   results with flat_xcorr=1 differ from flat_xcorr=0 ($bins)"
+         return 1
+      fi
+   done
+}
+
+# An .idx search must find the top hits of a search of the FASTA file it was built
+# from, and an .idx damaged after it was written must be rejected by its checksum.
+test_index_v2()
+{
+   cp "$DATA/test.fasta" "$WORK/index.fasta"
+   make_params index_fasta "database_name=$WORK/index.fasta"
+   make_params index_idx "database_name=$WORK/index.fasta.idx"
+
+   create_index index_fasta || return 1
+   if [ "$(head -c 8 "$WORK/index.fasta.idx")" != "CometIDX" ]
+   then
+      echo "   comet -i did not write a version 2 .idx"
+      return 1
+   fi
+   search index_fasta test.ms2 && search index_idx test.ms2 || return 1
+
+   if ! diff <(top_hits index_fasta) <(top_hits index_idx) > /dev/null
+   then
+      echo "   top hits of the .idx search differ from those of the FASTA search"
+      return 1
+   fi
+
+   cp "$WORK/index.fasta.idx" "$WORK/corrupt.idx"
+   printf 'CORRUPT!' | dd of="$WORK/corrupt.idx" bs=1 seek=$(($(wc -c < "$WORK/corrupt.idx") / 2)) \
+                          conv=notrunc status=none
+   make_params index_corrupt "database_name=$WORK/corrupt.idx"
+   if (cd "$WORK" && "$COMET" -Pindex_corrupt.params -Nindex_corrupt "$DATA/test.ms2" > index_corrupt.log 2>&1) \
+         || ! grep -q "checksum mismatch" "$WORK/index_corrupt.log"
+   then
+      echo "   a corrupted .idx was not rejected by its checksum"
+      return 1
+   fi
+}
+
+# index_build_memory only moves the sorting of the peptides to temporary files, so
+# an .idx built within 1 MB, which takes several runs here, must be the same file as
+# one built in memory.
+test_index_build_memory()
+{
+   cp "$DATA/test.fasta" "$WORK/budget.fasta"
+   make_params budget_none "database_name=$WORK/budget.fasta" "index_build_memory=0"
+   make_params budget_1mb "database_name=$WORK/budget.fasta" "index_build_memory=1"
+
+   create_index budget_none || return 1
+   mv "$WORK/budget.fasta.idx" "$WORK/budget_none.idx"
+   create_index budget_1mb || return 1
+
+   if ! cmp -s "$WORK/budget_none.idx" "$WORK/budget.fasta.idx"
+   then
+      echo "   the .idx built with index_build_memory=1 differs from the one built in memory"
+      return 1
+   fi
+}
+
+# Search threads hand the index builder their peptides in batches, in whatever order
+# the threads finish; the .idx must not depend on it, in memory or within a budget.
+test_index_build_threads()
+{
+   local build
+
+   cp "$DATA/test.fasta" "$WORK/threads.fasta"
+   make_params threads_1 "database_name=$WORK/threads.fasta" "num_threads=1"
+   create_index threads_1 || return 1
+   mv "$WORK/threads.fasta.idx" "$WORK/threads_1.idx"
+
+   for build in "index_build_memory=0" "index_build_memory=1"
+   do
+      make_params threads_4 "database_name=$WORK/threads.fasta" "num_threads=4" "$build"
+      create_index threads_4 || return 1
+
+      if ! cmp -s "$WORK/threads_1.idx" "$WORK/threads.fasta.idx"
+      then
+         echo "   the .idx built on 4 threads differs from the one built on 1 thread ($build)"
+         return 1
+      fi
+   done
+}
+
+# An .idx of half the proteins with the other half appended as a delta segment, and
+# the same file compacted back into one segment, must give the search results of an
+# .idx built from all proteins at once.
+test_index_delta()
+{
+   awk '/^>/ { n++ } n <= 200' "$DATA/test.fasta" > "$WORK/delta_base.fasta"
+   awk '/^>/ { n++ } n > 200' "$DATA/test.fasta" > "$WORK/delta_add.fasta"
+   cp "$DATA/test.fasta" "$WORK/delta_all.fasta"
+
+   make_params delta_all "database_name=$WORK/delta_all.fasta"
+   make_params delta_base "database_name=$WORK/delta_base.fasta"
+   make_params delta_add "database_name=$WORK/delta_add.fasta"
+   create_index delta_all && create_index delta_base || return 1
+
+   if ! (cd "$WORK" && "$COMET" -Pdelta_add.params -a"$WORK/delta_base.fasta.idx" > delta_add.log 2>&1)
+   then
+      echo "   comet -a failed:"
+      cat "$WORK/delta_add.log"
+      return 1
+   fi
+
+   make_params search_all "database_name=$WORK/delta_all.fasta.idx"
+   make_params search_delta "database_name=$WORK/delta_base.fasta.idx"
+   search search_all test.ms2 && search search_delta test.ms2 || return 1
+
+   if ! diff <(txt_results search_all) <(txt_results search_delta) > /dev/null
+   then
+      echo "   results of the base + delta .idx differ from those of the .idx of all proteins"
+      return 1
+   fi
+
+   local size=$(wc -c < "$WORK/delta_base.fasta.idx")
+
+   make_params delta_compact "database_name=$WORK/delta_base.fasta.idx"
+   create_index delta_compact || return 1
+   search search_delta test.ms2 || return 1
+
+   if [ $(wc -c < "$WORK/delta_base.fasta.idx") -ge $size ]
+   then
+      echo "   comet -i did not compact the base + delta .idx"
+      return 1
+   fi
+
+   if ! diff <(txt_results search_all) <(txt_results search_delta) > /dev/null
+   then
+      echo "   results of the compacted .idx differ from those of the .idx of all proteins"
+      return 1
+   fi
+}
+
+# index_compress only changes how the peptide columns are stored in the .idx, which
+# are decoded when it is loaded; searches of packed and raw files must agree, also
+# with a delta segment appended to a packed base.
+test_index_compress()
+{
+   awk '/^>/ { n++ } n <= 200' "$DATA/test.fasta" > "$WORK/packed.fasta"
+   awk '/^>/ { n++ } n > 200' "$DATA/test.fasta" > "$WORK/packed_add.fasta"
+   cp "$DATA/test.fasta" "$WORK/raw.fasta"
+   cp "$DATA/test.fasta" "$WORK/packed_all.fasta"
+
+   make_params raw "database_name=$WORK/raw.fasta" "index_compress=0"
+   make_params packed_all "database_name=$WORK/packed_all.fasta" "index_compress=1"
+   make_params packed "database_name=$WORK/packed.fasta" "index_compress=1"
+   make_params packed_add "database_name=$WORK/packed_add.fasta" "index_compress=1"
+   create_index raw && create_index packed_all && create_index packed || return 1
+
+   if ! (cd "$WORK" && "$COMET" -Ppacked_add.params -a"$WORK/packed.fasta.idx" > packed_add.log 2>&1)
+   then
+      echo "   comet -a failed:"
+      cat "$WORK/packed_add.log"
+      return 1
+   fi
+   if [ $(wc -c < "$WORK/packed_all.fasta.idx") -ge $(wc -c < "$WORK/raw.fasta.idx") ]
+   then
+      echo "   the .idx written with index_compress=1 is not smaller than the raw one"
+      return 1
+   fi
+
+   make_params search_raw "database_name=$WORK/raw.fasta.idx"
+   make_params search_packed_all "database_name=$WORK/packed_all.fasta.idx"
+   make_params search_packed "database_name=$WORK/packed.fasta.idx"
+   search search_raw test.ms2 && search search_packed_all test.ms2 && search search_packed test.ms2 || return 1
+
+   if ! diff <(txt_results search_raw) <(txt_results search_packed_all) > /dev/null
+   then
+      echo "   results of the packed .idx differ from those of the raw .idx"
+      return 1
+   fi
+   if ! diff <(txt_results search_raw) <(txt_results search_packed) > /dev/null
+   then
+      echo "   results of the packed base + delta .idx differ from those of the raw .idx"
+      return 1
+   fi
+}
+
+# A scan's charge states share one preprocessed spectrum when it is the same for all
+# of them, so each charge must score as it does in a scan of its own.  The scans of
+# test.ms2 are given charges 2 to 4, once as one scan with three Z lines and once as
+# three scans; charges below the true one cut the highest peaks and are not shared.
+test_shared_preprocessing()
+{
+   local settings
+
+   awk '/^S/ { print; for (z = 2; z <= 4; z++) printf "Z\t%d\t%.5f\n", z, $4 * z - (z - 1) * 1.007276; next }
+        !/^Z/' "$DATA/test.ms2" > "$WORK/charges_shared.ms2"
+   awk '/^S/ { if (s != "") flush(); s = $0; mz = $4; n = 0; next }
+        /^Z/ { next }
+        /^[0-9]/ { peaks[n++] = $0; next }
+        { print }
+        function flush(   z, i)
+        {
+           for (z = 2; z <= 4; z++)
+           {
+              print s
+              printf "Z\t%d\t%.5f\n", z, mz * z - (z - 1) * 1.007276
+              for (i = 0; i < n; i++)
+                 print peaks[i]
+           }
+        }
+        END { flush() }' "$DATA/test.ms2" > "$WORK/charges_split.ms2"
+
+   for settings in "fragment_bin_tol=1.0005" "fragment_bin_tol=0.02 fragment_bin_offset=0.0 flat_xcorr=1"
+   do
+      make_params charges_shared $settings
+      make_params charges_split $settings
+      search charges_shared charges_shared.ms2 && search charges_split charges_split.ms2 || return 1
+
+      if ! diff <(txt_results charges_shared | sort) <(txt_results charges_split | sort) > /dev/null
+      then
+         echo "   results of a scan's charge states differ from those of separate scans ($settings)"
+         return 1
+      fi
+   done
+}
+
+# Spectra are preprocessed as sparse lists of peaks and runs of nonzero bins.  The
+# preprocess_*.expected files hold the results of the dense per-bin arrays this
+# replaced, at ion trap and high resolution binning (flanking peaks off, neutral
+# losses on, flat xcorr) and with the precursor peak removed; they must not change.
+test_sparse_preprocessing()
+{
+   local name
+
+   make_params preprocess_ion_trap
+   make_params preprocess_high_res fragment_bin_tol=0.02 fragment_bin_offset=0.0 \
+               theoretical_fragment_ions=0 use_NL_ions=1 flat_xcorr=1
+   make_params preprocess_remove_precursor remove_precursor_peak=1
+
+   for name in preprocess_ion_trap preprocess_high_res preprocess_remove_precursor
+   do
+      search $name test.ms2 || return 1
+
+      if ! diff "$DATA/$name.expected" <(scored_hits $name) > /dev/null
+      then
+         echo "   results of $name differ from tests/data/$name.expected"
+         return 1
+      fi
+   done
+}
+
+# spectrum_batch_pipeline reads the next batch while the current one is searched, and
+# database_cache_size keeps the parsed database for later batches; neither may change
+# results.  test.ms2 is searched with spectrum_batch_size=37, which takes several
+# batches, and at once.
+test_spectrum_batch_pipeline()
+{
+   local pipeline cache
+
+   make_params batches_serial spectrum_batch_size=0
+   search batches_serial test.ms2 || return 1
+
+   for pipeline in 0 1
+   do
+      for cache in 0 64
+      do
+         make_params batches_$pipeline.$cache spectrum_batch_size=37 \
+                     spectrum_batch_pipeline=$pipeline database_cache_size=$cache
+         search batches_$pipeline.$cache test.ms2 || return 1
+
+         if ! diff <(txt_results batches_serial) <(txt_results batches_$pipeline.$cache) > /dev/null
+         then
+            echo "   results differ with spectrum_batch_pipeline=$pipeline database_cache_size=$cache"
+            return 1
+         fi
+      done
+   done
+}
+
+# mzML and mzXML peaks are left encoded by the reader and decoded on the preprocessing
+# threads, except with clear_mz_range, which needs the decoded peaks while reading;
+# a range that clears nothing must not change results.  test.mzML and test.mzXML hold
+# the spectra of test.ms2, so their top hits must be those of test.ms2.
+test_deferred_peak_decoding()
+{
+   local format
+
+   make_params decode_ms2
+   search decode_ms2 test.ms2 || return 1
+
+   for format in mzML mzXML
+   do
+      make_params decode_deferred
+      make_params decode_inline "clear_mz_range=0.0 0.1"
+      search decode_deferred test.$format && search decode_inline test.$format || return 1
+
+      if ! diff <(txt_results decode_deferred) <(txt_results decode_inline) > /dev/null
+      then
+         echo "   $format results differ when peaks are decoded while reading"
+         return 1
+      fi
+
+      if ! diff <(top_hits decode_ms2 | cut -d' ' -f1,2) <(top_hits decode_deferred | cut -d' ' -f1,2) > /dev/null
+      then
+         echo "   top hits of test.$format differ from those of test.ms2"
+         return 1
+      fi
+   done
+}
+
+TESTS=("$@")
+if [ ${#TESTS[@]} -eq 0 ]
+then
+   TESTS=($(declare -F | awk '$3 ~ /^test_/ { print substr($3, 6) }'))
+fi
+
+NUMFAILED=0
+for t in "${TESTS[@]}"
+do
+   if test_$t
+   then
+      echo "PASS $t"
+   else
+      echo "FAIL $t"
+      NUMFAILED=$((NUMFAILED + 1))
+   fi
+done
+
+echo "${#TESTS[@]} tests, $NUMFAILED failed"
+[ $NUMFAILED -eq 0 ]